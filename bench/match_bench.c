@@ -0,0 +1,216 @@
+#include "firewall.h"
+
+/*
+ * Packet classifier benchmark (`make match-bench`).
+ *
+ * Fills the rule store with generated rules, or a rules file when one is
+ * given, and times classify_packet() over generated packets. Each answer
+ * is also checked against a plain first-match scan of the rules, so the
+ * run fails if the classifier ever disagrees with linear semantics.
+ * Half of the packets are drawn from inside a random rule, so lookups
+ * hit rules all over the list, and half are random.
+ *
+ * Usage: match_bench [rules-file | -n rules] [-p packets]
+ */
+
+#define BENCH_DEFAULT_RULES 100000
+#define BENCH_DEFAULT_PACKETS 1000000
+
+static unsigned int seed = 12345;
+
+/**
+ * Small LCG so every run sees the same rules and packets
+ */
+static unsigned int next_random(void) {
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 4;
+}
+
+/**
+ * Current monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Add count generated rules mixing every field the classifier looks at
+ */
+static int generate_rules(long count) {
+    static const char *interfaces[] = { "eth0", "eth1", "wlan0", "eth+" };
+    static const int lengths[] = { 32, 32, 32, 24, 24, 16, 12 };
+
+    for (long i = 0; i < count; i++) {
+        unsigned int r = next_random();
+        FirewallRule rule;
+
+        make_empty_rule(&rule);
+        rule.action = (uint8_t)(ACTION_ACCEPT + r % 3);
+        // Nearly every rule names a source, so most packets pass many
+        // tuples before their match, and some match nothing
+        if (r & 0x3F) {
+            rule.source_len = (int8_t)lengths[(r >> 4) % 7];
+            rule.source = (next_random() << 8 | 10) & (0xFFFFFFFFu << (32 - rule.source_len));
+        }
+        if ((r & 0x30) == 0x30 || !(r & 0x3F)) {
+            rule.dest_len = (int8_t)lengths[(r >> 8) % 7];
+            rule.dest = (0xC0A80000u | (next_random() & 0xFFFF)) & (0xFFFFFFFFu << (32 - rule.dest_len));
+        }
+        if (r & 0x40) {
+            rule.protocol = (uint8_t)(PROTO_TCP + (r >> 12) % 2);
+            rule.port_first = (uint16_t)(1 + next_random() % 2000);
+            rule.port_last = (r & 0x80) ? rule.port_first : (uint16_t)(rule.port_first + (r >> 14) % 100);
+        } else if (r & 0x80) {
+            rule.protocol = (uint8_t)(PROTO_TCP + (r >> 12) % 4);
+        }
+        if ((r & 0x300) == 0x300) {
+            rule.interface = intern_string(interfaces[(r >> 16) % 4]);
+        }
+        if (rule_store_add(&rule, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reference answer: the first active rule that matches, by linear scan
+ */
+static const FirewallRule *linear_match(const MatchPacket *p) {
+    FirewallRule **rules = ordered_rules();
+
+    for (int i = 0; i < rule_count; i++) {
+        const FirewallRule *r = rules[i];
+        uint32_t smask = r->source_len > 0 ? 0xFFFFFFFFu << (32 - r->source_len) : 0;
+        uint32_t dmask = r->dest_len > 0 ? 0xFFFFFFFFu << (32 - r->dest_len) : 0;
+
+        if (!r->active || ((p->source ^ r->source) & smask) || ((p->dest ^ r->dest) & dmask)) {
+            continue;
+        }
+        if (r->protocol != PROTO_NONE && r->protocol != PROTO_ALL && r->protocol != p->protocol) {
+            continue;
+        }
+        if (r->port_first && (r->protocol == PROTO_TCP || r->protocol == PROTO_UDP) &&
+            (p->port < r->port_first || p->port > r->port_last)) {
+            continue;
+        }
+        if (r->interface && r->interface != p->interface) {
+            const char *name = pool_string(r->interface);
+            size_t len = strlen(name);
+            if (name[len - 1] != '+' || strncmp(name, pool_string(p->interface), len - 1) != 0) {
+                continue;
+            }
+        }
+        return r;
+    }
+    return NULL;
+}
+
+/**
+ * Generate a packet, from inside a random rule for even i
+ */
+static void generate_packet(long i, MatchPacket *p) {
+    static uint32_t interfaces[4];
+    FirewallRule **rules = ordered_rules();
+
+    if (!interfaces[0]) {
+        interfaces[0] = intern_string("eth0");
+        interfaces[1] = intern_string("eth1");
+        interfaces[2] = intern_string("wlan0");
+        interfaces[3] = intern_string("eth7");
+    }
+
+    p->source = next_random() << 8 | (next_random() & 0xFF);
+    p->dest = 0xC0A80000u | (next_random() & 0xFFFF);
+    p->protocol = (uint8_t)(PROTO_TCP + next_random() % 3);
+    p->port = (uint16_t)(next_random() % 2200);
+    p->interface = interfaces[next_random() % 4];
+
+    if (i % 2 == 0 && rule_count > 0) {
+        const FirewallRule *r = rules[next_random() % rule_count];
+        if (r->source_len >= 0) {
+            uint32_t mask = r->source_len ? 0xFFFFFFFFu << (32 - r->source_len) : 0;
+            p->source = r->source | (p->source & ~mask);
+        }
+        if (r->dest_len >= 0) {
+            uint32_t mask = r->dest_len ? 0xFFFFFFFFu << (32 - r->dest_len) : 0;
+            p->dest = r->dest | (p->dest & ~mask);
+        }
+        if (r->protocol >= PROTO_TCP && r->protocol <= PROTO_ICMP) {
+            p->protocol = r->protocol;
+        }
+        if (r->port_first) {
+            p->port = (uint16_t)(r->port_first + next_random() % (r->port_last - r->port_first + 1));
+        }
+        if (r->interface) {
+            p->interface = r->interface;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    long count = BENCH_DEFAULT_RULES;
+    long packets = BENCH_DEFAULT_PACKETS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            packets = atol(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (count <= 0 || packets <= 0) {
+        fprintf(stderr, "Usage: %s [rules-file | -n rules] [-p packets]\n", argv[0]);
+        return 1;
+    }
+
+    if (filename ? load_rules_from_file(filename) < 0 : generate_rules(count) != 0) {
+        return 1;
+    }
+
+    MatchPacket *queries = malloc(sizeof(MatchPacket) * packets);
+    const FirewallRule **answers = malloc(sizeof(*answers) * packets);
+    if (!queries || !answers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    for (long i = 0; i < packets; i++) {
+        generate_packet(i, &queries[i]);
+    }
+
+    double start = now_seconds();
+    if (build_classifier() != 0) {
+        return 1;
+    }
+    double built = now_seconds();
+    for (long i = 0; i < packets; i++) {
+        answers[i] = classify_packet(&queries[i]);
+    }
+    double elapsed = now_seconds() - built;
+
+    printf("Classifier over %d rules: built in %.1f ms, %.0f ns per packet (%ld packets)\n",
+           rule_count, (built - start) * 1000, elapsed * 1e9 / packets, packets);
+
+    // The reference scan is slow, so a sample is enough at large sizes
+    long step = packets > 20000 ? packets / 20000 : 1;
+    long checked = 0, wrong = 0, hits = 0;
+    for (long i = 0; i < packets; i += step) {
+        const FirewallRule *expected = linear_match(&queries[i]);
+        if ((expected ? expected->id : 0) != (answers[i] ? answers[i]->id : 0)) {
+            wrong++;
+        }
+        hits += expected != NULL;
+        checked++;
+    }
+    printf("  %ld packets checked against a linear scan (%ld matched a rule): %ld disagree\n",
+           checked, hits, wrong);
+
+    free(queries);
+    free(answers);
+    return wrong ? 1 : 0;
+}
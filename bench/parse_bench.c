@@ -0,0 +1,184 @@
+#include "firewall.h"
+
+/*
+ * Rule parser benchmark (`make bench`).
+ *
+ * Times parse_rule_string() over a large rule list held in memory, so
+ * the figure is parse throughput alone, without file I/O or the rule
+ * store. The list is read from a rules file when one is given, else
+ * generated: BENCH_DEFAULT_LINES lines mixing every field the parser
+ * knows, from a fixed seed so runs compare.
+ *
+ * Usage: parse_bench [rules-file | -n lines] [-r rounds]
+ */
+
+#define BENCH_DEFAULT_LINES 2000000
+#define BENCH_DEFAULT_ROUNDS 3
+
+/**
+ * Current monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Generate count rule lines, NUL-separated, into one buffer
+ */
+static char *generate_rules(long count, size_t *size) {
+    static const char *actions[] = { "ACCEPT", "DROP", "REJECT" };
+    static const char *protocols[] = { "TCP", "UDP", "ICMP", "ALL" };
+    static const char *interfaces[] = { "eth0", "eth1", "wlan0", "lo" };
+    size_t capacity = (size_t)count * 128 + 1;
+    char *buf = malloc(capacity);
+    size_t used = 0;
+    unsigned int seed = 12345;
+
+    if (!buf) {
+        return NULL;
+    }
+
+    for (long i = 0; i < count; i++) {
+        // Small LCG so every run sees the same lines
+        seed = seed * 1103515245u + 12345u;
+        unsigned int r = seed >> 8;
+        char *line = buf + used;
+        int len = snprintf(line, 128, "action=%s", actions[r % 3]);
+
+        if (r & 0x10) {
+            len += snprintf(line + len, 128 - len, ", source=%u.%u.%u.0/24",
+                            10 + (r >> 4) % 200, (r >> 12) & 255, (r >> 20) & 255);
+        }
+        if (r & 0x20) {
+            len += snprintf(line + len, 128 - len, ", dest=192.168.%u.%u", (r >> 6) & 255, (r >> 14) & 255);
+        }
+        if (r & 0x40) {
+            len += snprintf(line + len, 128 - len, ", port=%u, protocol=%s",
+                            1 + (r >> 9) % 65000, protocols[(r >> 3) & 1]);
+        } else if (r & 0x80) {
+            len += snprintf(line + len, 128 - len, ", protocol=%s", protocols[(r >> 3) & 3]);
+        }
+        if ((r & 0x300) == 0x300) {
+            len += snprintf(line + len, 128 - len, ", interface=%s", interfaces[(r >> 5) & 3]);
+        }
+        if ((r & 0xC00) == 0xC00) {
+            len += snprintf(line + len, 128 - len, ", comment=\"rule %u\"", (r >> 16) & 1023);
+        }
+        used += (size_t)len + 1;
+    }
+
+    *size = used;
+    return buf;
+}
+
+/**
+ * Read a rules file into one buffer of NUL-separated rule strings,
+ * dropping comments, blank lines and "N. " prefixes
+ */
+static char *read_rules(const char *filename, size_t *size, long *count) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return NULL;
+    }
+
+    char *buf = NULL;
+    size_t used = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+
+    *count = 0;
+    while ((len = getline(&line, &line_capacity, fp)) > 0) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        char *rule = strstr(line, ". ");
+        rule = rule ? rule + 2 : line;
+
+        size_t rule_len = strlen(rule) + 1;
+        if (used + rule_len > capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 20;
+            while (capacity < used + rule_len) {
+                capacity *= 2;
+            }
+            char *grown = realloc(buf, capacity);
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory\n");
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+        }
+        memcpy(buf + used, rule, rule_len);
+        used += rule_len;
+        (*count)++;
+    }
+
+    free(line);
+    fclose(fp);
+    *size = used;
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    long count = BENCH_DEFAULT_LINES;
+    int rounds = BENCH_DEFAULT_ROUNDS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (count <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [rules-file | -n lines] [-r rounds]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = 0;
+    char *rules = filename ? read_rules(filename, &size, &count) : generate_rules(count, &size);
+    if (!rules) {
+        return 1;
+    }
+
+    printf("Parsing %ld rules (%.1f MB), best of %d rounds\n", count, size / 1e6, rounds);
+
+    double best = 0;
+    long failed = 0;
+    for (int round = 0; round < rounds; round++) {
+        FirewallRule rule;
+        const char *pos = rules;
+        failed = 0;
+
+        double start = now_seconds();
+        for (long i = 0; i < count; i++) {
+            if (parse_rule_string(pos, &rule) != 0) {
+                failed++;
+            }
+            pos += strlen(pos) + 1;
+        }
+        double elapsed = now_seconds() - start;
+
+        if (round == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("  %.1f ms, %.0f rules/s, %.1f MB/s", best * 1000, count / best, size / 1e6 / best);
+    if (failed) {
+        printf(", %ld rejected", failed);
+    }
+    printf("\n");
+
+    free(rules);
+    return 0;
+}
@@ -105,6 +105,7 @@ chain=INPUT
 policy=ACCEPT
 logging=enabled
 log_file=/var/log/personal-firewall.log
+backend=iptables
 
 [rules]
 # Add your rules here
@@ -0,0 +1,508 @@
+#include "firewall.h"
+
+/*
+ * Chain partitioning.
+ *
+ * Splits the compiled INPUT chain into a dispatch tree: first by
+ * protocol, then by input interface, then by the /8 block of the source
+ * address. Each dispatch entry jumps with -g (goto) into a sub-chain
+ * holding, in their original order, the rules with that value plus the
+ * rules that do not match on the field at all. Rules that do not match
+ * on the field also stay inline after the dispatch entries, for packets
+ * no dispatch entry takes. An interface wildcard such as "eth+" counts
+ * as no match on the interface, as it can take packets of many of them.
+ * Since a goto never returns into the chain that took it, a packet walks
+ * exactly one path and sees every rule that could match it in flat
+ * order, so the first match is unchanged.
+ */
+
+#define LEVEL_PROTOCOL  0
+#define LEVEL_INTERFACE 1
+#define LEVEL_SOURCE    2
+#define LEVEL_LEAF      3
+
+/**
+ * Copy a string into a fixed-size field, truncating if needed
+ */
+static void copy_field(char *dst, size_t size, const char *src) {
+    size_t len = strlen(src);
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/**
+ * Add an empty chain, returning its index or -1
+ */
+static int add_chain(PartitionedRuleset *pr, const char *name) {
+    if (pr->chain_count >= MAX_PARTITION_CHAINS) {
+        return -1;
+    }
+    if (pr->chain_count % 16 == 0) {
+        PartitionChain *grown = realloc(pr->chains, sizeof(PartitionChain) * (pr->chain_count + 16));
+        if (!grown) {
+            return -1;
+        }
+        pr->chains = grown;
+    }
+
+    PartitionChain *chain = &pr->chains[pr->chain_count];
+    memset(chain, 0, sizeof(*chain));
+    copy_field(chain->name, sizeof(chain->name), name);
+    return pr->chain_count++;
+}
+
+/**
+ * Append an entry to a chain; origin is its flat index or -1
+ */
+static int chain_append(PartitionedRuleset *pr, int index, const CompiledEntry *entry, int origin) {
+    PartitionChain *chain = &pr->chains[index];
+
+    if (chain->entry_count == chain->capacity) {
+        int capacity = chain->capacity ? chain->capacity * 2 : 8;
+        CompiledEntry *entries = realloc(chain->entries, sizeof(CompiledEntry) * capacity);
+        if (!entries) {
+            return -1;
+        }
+        chain->entries = entries;
+        int *origins = realloc(chain->origin, sizeof(int) * capacity);
+        if (!origins) {
+            return -1;
+        }
+        chain->origin = origins;
+        chain->capacity = capacity;
+    }
+
+    chain->entries[chain->entry_count] = *entry;
+    chain->origin[chain->entry_count] = origin;
+    chain->entry_count++;
+    return 0;
+}
+
+/**
+ * Key of an entry at a partition level ("" when it does not match on
+ * that field, so it belongs in every branch)
+ */
+static void level_key(const CompiledEntry *entry, int level, char *key, size_t size) {
+    key[0] = '\0';
+
+    if (level == LEVEL_PROTOCOL) {
+        // "ALL" is no protocol match at all
+        if (entry->rule.protocol != PROTO_NONE && entry->rule.protocol != PROTO_ALL) {
+            snprintf(key, size, "%s", protocol_name(entry->rule.protocol));
+        }
+    } else if (level == LEVEL_INTERFACE) {
+        const char *name = pool_string(entry->rule.interface);
+        size_t len = strlen(name);
+        if (len > 0 && name[len - 1] != '+') {
+            copy_field(key, size, name);
+        }
+    } else if (level == LEVEL_SOURCE && entry->set_field != SET_MATCH_SOURCE) {
+        if (entry->rule.source_len >= 8) {
+            snprintf(key, size, "%u", entry->rule.source >> 24);
+        }
+    }
+}
+
+/**
+ * Dispatch entry sending packets with one level value to a sub-chain
+ */
+static void make_dispatch(CompiledEntry *entry, int level, const char *key, const char *target) {
+    make_empty_entry(entry);
+
+    if (level == LEVEL_PROTOCOL) {
+        entry->rule.protocol = parse_protocol(key);
+    } else if (level == LEVEL_INTERFACE) {
+        entry->rule.interface = intern_string(key);
+    } else {
+        entry->rule.source = (uint32_t)atoi(key) << 24;
+        entry->rule.source_len = 8;
+    }
+    copy_field(entry->jump, sizeof(entry->jump), target);
+}
+
+/**
+ * Chain name segment for a level value
+ */
+static void segment_name(int level, const char *key, int ordinal, char *out, size_t size) {
+    if (level == LEVEL_PROTOCOL) {
+        size_t i = 0;
+        for (; key[i] && i < size - 1; i++) {
+            out[i] = tolower((unsigned char)key[i]);
+        }
+        out[i] = '\0';
+    } else if (level == LEVEL_INTERFACE) {
+        // Interface names can be 15 characters, too long to nest
+        snprintf(out, size, "i%d", ordinal);
+    } else {
+        snprintf(out, size, "s%d", atoi(key));
+    }
+}
+
+/**
+ * Place the given flat entries into a chain, splitting from the given
+ * level down wherever the chain is large enough
+ */
+static int build_chain(PartitionedRuleset *pr, const CompiledRuleset *rs, int chain,
+                       const int *items, int count, int level, const char *path) {
+    if (level == LEVEL_LEAF || count < firewall_config.partition_threshold) {
+        for (int i = 0; i < count; i++) {
+            if (chain_append(pr, chain, &rs->entries[items[i]], items[i]) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    int *keyed = malloc(sizeof(int) * (count + 1));
+    int *group = malloc(sizeof(int) * (count + 1));
+    int *child = malloc(sizeof(int) * (count + 1));
+    int *wild = malloc(sizeof(int) * (count + 1));
+    int keyed_count = 0, wild_count = 0, largest = 0, ret = 0;
+    char key[64], other[64];
+
+    if (!keyed || !group || !child || !wild) {
+        free(keyed);
+        free(group);
+        free(child);
+        free(wild);
+        return -1;
+    }
+
+    // Group the entries with a value; group[k] is the first of k's value
+    for (int i = 0; i < count; i++) {
+        level_key(&rs->entries[items[i]], level, key, sizeof(key));
+        if (!key[0]) {
+            wild[wild_count++] = items[i];
+            continue;
+        }
+
+        int k = keyed_count++, size = 1;
+        keyed[k] = i;
+        group[k] = k;
+        for (int p = 0; p < k; p++) {
+            level_key(&rs->entries[items[keyed[p]]], level, other, sizeof(other));
+            if (strcmp(key, other) == 0) {
+                group[k] = group[p];
+                size++;
+            }
+        }
+        if (size > largest) {
+            largest = size;
+        }
+    }
+
+    // Rules without a value are copied into every sub-chain, so only
+    // split when that still leaves each sub-chain clearly smaller
+    int split = keyed_count > 0 && (largest + wild_count) * 4 <= count * 3;
+    if (!split) {
+        ret = build_chain(pr, rs, chain, items, count, level + 1, path);
+    }
+
+    // One sub-chain per distinct value, in order of first appearance
+    for (int k = 0, ordinal = 0; split && k < keyed_count && ret == 0; k++) {
+        if (group[k] != k) {
+            continue;
+        }
+        level_key(&rs->entries[items[keyed[k]]], level, key, sizeof(key));
+
+        int child_count = 0;
+        for (int i = 0; i < count; i++) {
+            level_key(&rs->entries[items[i]], level, other, sizeof(other));
+            if (!other[0] || strcmp(key, other) == 0) {
+                child[child_count++] = items[i];
+            }
+        }
+
+        char segment[16], name[64];
+        segment_name(level, key, ordinal++, segment, sizeof(segment));
+        snprintf(name, sizeof(name), "%s-%s", path, segment);
+        if (strlen(name) >= PARTITION_CHAIN_LENGTH) {
+            ret = -1;
+            break;
+        }
+
+        CompiledEntry dispatch;
+        int index = add_chain(pr, name);
+        make_dispatch(&dispatch, level, key, name);
+        if (index < 0 || chain_append(pr, chain, &dispatch, -1) != 0) {
+            ret = -1;
+            break;
+        }
+
+        ret = build_chain(pr, rs, index, child, child_count, level + 1, name);
+    }
+
+    // Packets no dispatch entry took see only the rules without a value
+    if (split && ret == 0) {
+        ret = build_chain(pr, rs, chain, wild, wild_count, level + 1, path);
+    }
+
+    free(keyed);
+    free(group);
+    free(child);
+    free(wild);
+    return ret;
+}
+
+/**
+ * Partition a compiled ruleset into a dispatch tree rooted at INPUT
+ */
+int partition_ruleset(const CompiledRuleset *rs, PartitionedRuleset *pr) {
+    memset(pr, 0, sizeof(*pr));
+
+    int *items = malloc(sizeof(int) * (rs->entry_count + 1));
+    if (!items || add_chain(pr, "INPUT") != 0) {
+        free(items);
+        free_partitioned_ruleset(pr);
+        return -1;
+    }
+    // The conntrack fast path stays at the head of INPUT, ahead of dispatch
+    int head = 0;
+    while (head < rs->entry_count && rs->entries[head].ctstate[0]) {
+        if (chain_append(pr, 0, &rs->entries[head], head) != 0) {
+            free(items);
+            free_partitioned_ruleset(pr);
+            return -1;
+        }
+        head++;
+    }
+    for (int i = head; i < rs->entry_count; i++) {
+        items[i - head] = i;
+    }
+
+    int ret = build_chain(pr, rs, 0, items, rs->entry_count - head, LEVEL_PROTOCOL, PARTITION_PREFIX);
+    free(items);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Cannot partition INPUT chain\n");
+        free_partitioned_ruleset(pr);
+    }
+    return ret;
+}
+
+/**
+ * Release a partitioned ruleset
+ */
+void free_partitioned_ruleset(PartitionedRuleset *pr) {
+    for (int i = 0; i < pr->chain_count; i++) {
+        free(pr->chains[i].entries);
+        free(pr->chains[i].origin);
+    }
+    free(pr->chains);
+    memset(pr, 0, sizeof(*pr));
+}
+
+/**
+ * Find a chain by name, returning its index or -1
+ */
+int find_partition_chain(const PartitionedRuleset *pr, const char *name) {
+    for (int i = 0; i < pr->chain_count; i++) {
+        if (strcmp(pr->chains[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Verification works on packet classes: a protocol, an input interface
+ * and a source /8 block. Every value the ruleset dispatches on is tried,
+ * plus "none of them" for protocol and interface, and all 256 blocks.
+ * Each interface wildcard a rule names is a class too: an interface it
+ * matches that no rule names exactly.
+ */
+typedef struct {
+    int protocol;           // PROTO_NONE for a protocol no rule names
+    uint32_t interface;     // 0 for an interface no rule names or matches
+    uint32_t block;         // First octet of the source address
+} PacketClass;
+
+/**
+ * Check whether a dispatch entry takes packets of a class
+ */
+static int dispatch_takes(const CompiledEntry *entry, const PacketClass *pc) {
+    if (entry->rule.protocol != PROTO_NONE) {
+        return entry->rule.protocol == pc->protocol;
+    }
+    if (entry->rule.interface) {
+        return entry->rule.interface == pc->interface;
+    }
+    return entry->rule.source_len >= 0 && (entry->rule.source >> 24) == pc->block;
+}
+
+/**
+ * Check whether a rule's interface match could take some interface of
+ * a class
+ */
+static int interface_may_match(uint32_t rule_name, uint32_t class_name) {
+    if (!rule_name || rule_name == class_name) {
+        return 1;
+    }
+    if (!class_name) {
+        return 0;
+    }
+
+    const char *rule = pool_string(rule_name);
+    const char *pc = pool_string(class_name);
+    size_t rule_len = strlen(rule), pc_len = strlen(pc);
+    if (rule_len == 0 || rule[rule_len - 1] != '+') {
+        // A wildcard class stands for the interfaces no rule names exactly
+        return 0;
+    }
+    // Two wildcards overlap when one prefix extends the other
+    size_t common = rule_len - 1;
+    if (pc_len > 0 && pc[pc_len - 1] == '+' && pc_len - 1 < common) {
+        common = pc_len - 1;
+    }
+    return strncmp(rule, pc, common) == 0;
+}
+
+/**
+ * Check whether a flat entry could match some packet of a class
+ */
+static int entry_may_match(const CompiledEntry *entry, const PacketClass *pc) {
+    const FirewallRule *rule = &entry->rule;
+
+    if (rule->protocol != PROTO_NONE && rule->protocol != PROTO_ALL && rule->protocol != pc->protocol) {
+        return 0;
+    }
+    if (!interface_may_match(rule->interface, pc->interface)) {
+        return 0;
+    }
+    if (rule->source_len >= 0) {
+        int block_len = rule->source_len < 8 ? rule->source_len : 8;
+        uint32_t mask = block_len ? 0xFFFFFFFFu << (32 - block_len) : 0;
+        return ((rule->source ^ (pc->block << 24)) & mask) == 0;
+    }
+    return 1;
+}
+
+/**
+ * Walk the partitioned tree for a class and check that the rules it
+ * visits come in flat order and include every rule that could match
+ */
+static int verify_class(const CompiledRuleset *rs, const PartitionedRuleset *pr, const PacketClass *pc) {
+    int chain = 0, pos = 0, expected = 0, hops = 0;
+
+    while (pos < pr->chains[chain].entry_count) {
+        const PartitionChain *current = &pr->chains[chain];
+        const CompiledEntry *entry = &current->entries[pos];
+
+        if (entry->jump[0]) {
+            if (dispatch_takes(entry, pc)) {
+                chain = find_partition_chain(pr, entry->jump);
+                if (chain < 0 || ++hops > pr->chain_count) {
+                    return -1;
+                }
+                pos = 0;
+                continue;
+            }
+            pos++;
+            continue;
+        }
+
+        // Every rule skipped over in flat order must be unable to match
+        int origin = current->origin[pos];
+        if (origin < expected) {
+            return -1;
+        }
+        for (; expected < origin; expected++) {
+            if (entry_may_match(&rs->entries[expected], pc)) {
+                return -1;
+            }
+        }
+        expected = origin + 1;
+        pos++;
+    }
+
+    for (; expected < rs->entry_count; expected++) {
+        if (entry_may_match(&rs->entries[expected], pc)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check that the partitioned ruleset gives every packet the same verdict
+ * as the flat one
+ * Returns 0 when equivalent, -1 (after describing a failing class) if not
+ */
+int verify_partition(const CompiledRuleset *rs, const PartitionedRuleset *pr) {
+    int protocols[] = { PROTO_TCP, PROTO_UDP, PROTO_ICMP, PROTO_NONE };
+    uint32_t *interfaces = malloc(sizeof(uint32_t) * (rs->entry_count + 1));
+    int interface_count = 0;
+
+    if (!interfaces) {
+        return -1;
+    }
+
+    interfaces[interface_count++] = 0;
+    for (int i = 0; i < rs->entry_count; i++) {
+        uint32_t name = rs->entries[i].rule.interface;
+        int seen = !name;
+        for (int k = 0; k < interface_count && !seen; k++) {
+            seen = interfaces[k] == name;
+        }
+        if (!seen) {
+            interfaces[interface_count++] = name;
+        }
+    }
+
+    int ret = 0;
+    for (int p = 0; p < 4 && ret == 0; p++) {
+        for (int f = 0; f < interface_count && ret == 0; f++) {
+            for (uint32_t block = 0; block < 256 && ret == 0; block++) {
+                PacketClass pc = { protocols[p], interfaces[f], block };
+                if (verify_class(rs, pr, &pc) != 0) {
+                    fprintf(stderr, "Error: Partitioned chains differ for protocol=%s interface=%s source=%u.0.0.0/8\n",
+                            pc.protocol != PROTO_NONE ? protocol_name(pc.protocol) : "other",
+                            pc.interface ? pool_string(pc.interface) : "other", block);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    free(interfaces);
+    return ret;
+}
+
+/**
+ * Partition the current ruleset and report whether it is equivalent
+ * (uses a threshold of 1 when partitioning is disabled)
+ */
+int check_partition(void) {
+    CompiledRuleset rs;
+    PartitionedRuleset pr;
+    int threshold = firewall_config.partition_threshold;
+
+    if (compile_ruleset(&rs) != 0) {
+        return -1;
+    }
+    if (threshold <= 0) {
+        firewall_config.partition_threshold = 1;
+    }
+    int ret = partition_ruleset(&rs, &pr);
+    firewall_config.partition_threshold = threshold;
+    if (ret != 0) {
+        free_compiled_ruleset(&rs);
+        return -1;
+    }
+
+    printf("\nINPUT: %d entries in %d chains\n", rs.entry_count, pr.chain_count);
+    for (int c = 0; c < pr.chain_count; c++) {
+        printf("  %-28s %d entries\n", pr.chains[c].name, pr.chains[c].entry_count);
+    }
+
+    ret = verify_partition(&rs, &pr);
+    if (ret == 0) {
+        printf("Partitioned chains give the same verdict as the flat chain\n");
+    }
+
+    free_partitioned_ruleset(&pr);
+    free_compiled_ruleset(&rs);
+    return ret;
+}
@@ -1,20 +1,68 @@
 #include "firewall.h"
+#include <fcntl.h>
 
-// External references
-extern FirewallRule rules[1000];
-extern int rule_count;
+// General settings, defaults used when the config file is missing
+FirewallConfig firewall_config = {
+    "INPUT", "ACCEPT", 1, "/var/log/personal-firewall.log", LOG_LEVEL_INFO, 10L << 20,
+    BACKEND_IPTABLES, 8, 0, 0, XDP_MODE_OFF
+};
 
 /**
- * Save rules to configuration file
+ * Format a rule as a rules file line ("ID. action=...", newline included)
+ * Returns the length of the line
  */
-int save_rules_to_file(const char *filename) {
+int format_rule_line(const FirewallRule *rule, char *line, size_t size) {
+    char text[MAX_IP_LENGTH];
+    int len = snprintf(line, size, "%d. action=%s", rule->id, action_name(rule->action));
+
+    if (rule->source_len >= 0) {
+        format_address(rule->source, rule->source_len, text, sizeof(text));
+        len += snprintf(line + len, size - len, ", source=%s", text);
+    }
+    if (rule->dest_len >= 0) {
+        format_address(rule->dest, rule->dest_len, text, sizeof(text));
+        len += snprintf(line + len, size - len, ", dest=%s", text);
+    }
+    if (rule->port_first) {
+        format_port_range(rule->port_first, rule->port_last, text, sizeof(text));
+        len += snprintf(line + len, size - len, ", port=%s", text);
+    }
+    if (rule->protocol) {
+        len += snprintf(line + len, size - len, ", protocol=%s", protocol_name(rule->protocol));
+    }
+    if (rule->interface) {
+        len += snprintf(line + len, size - len, ", interface=%s", pool_string(rule->interface));
+    }
+    if (rule->comment) {
+        len += snprintf(line + len, size - len, ", comment=\"%s\"", pool_string(rule->comment));
+    }
+    if (rule->expires) {
+        len += snprintf(line + len, size - len, ", expires=%u", rule->expires);
+    }
+    len += snprintf(line + len, size - len, "\n");
+    return len;
+}
+
+/**
+ * Write the rules to a file, synced and renamed into place
+ */
+static int write_rules_file(const char *filename) {
     FILE *fp;
-    
+    char temp[512];
+    char line[MAX_CONFIG_LINE];
+
     if (!filename) {
         filename = RULES_FILE;
     }
+    int default_file = strcmp(filename, RULES_FILE) == 0;
+
+    // A background compaction must not rename an older file over this one
+    if (default_file) {
+        journal_wait();
+    }
 
-    fp = fopen(filename, "w");
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    fp = fopen(temp, "w");
     if (!fp) {
         fprintf(stderr, "Error: Cannot open file for writing: %s\n", filename);
         return -1;
@@ -25,92 +73,278 @@ int save_rules_to_file(const char *filename) {
     fprintf(fp, "# Auto-generated - Do not edit manually\n");
     fprintf(fp, "# Total rules: %d\n\n", rule_count);
 
-    // Write each rule
+    // Write each rule under its ID
+    FirewallRule **rules = ordered_rules();
     for (int i = 0; i < rule_count; i++) {
-        fprintf(fp, "%d. action=%s", i + 1, rules[i].action);
-        
-        if (rules[i].source[0]) {
-            fprintf(fp, ", source=%s", rules[i].source);
-        }
-        if (rules[i].dest[0]) {
-            fprintf(fp, ", dest=%s", rules[i].dest);
-        }
-        if (rules[i].port[0]) {
-            fprintf(fp, ", port=%s", rules[i].port);
+        format_rule_line(rules[i], line, sizeof(line));
+        fputs(line, fp);
+    }
+
+    int failed = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0 || failed || rename(temp, filename) != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", filename);
+        unlink(temp);
+        return -1;
+    }
+    printf("Configuration saved to %s\n", filename);
+
+    // The default rules file now holds every journal record, and gets a
+    // snapshot for the next startup
+    if (default_file) {
+        journal_reset();
+        save_snapshot();
+    }
+    return 0;
+}
+
+/**
+ * Save rules to configuration file
+ * The file is written aside, synced and renamed over the old one, so a
+ * crash leaves either the old rules or the new ones
+ */
+int save_rules_to_file(const char *filename) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = write_rules_file(filename);
+    PROFILE_END(PROFILE_SAVE, started);
+    return ret;
+}
+
+/**
+ * Parse one line of a rules file
+ * Returns 1 for a rule (its ID in rule_id, 0 when the line has none),
+ * 0 for a comment or blank line, -1 for a line that does not parse
+ */
+static int parse_rules_file_line(char *line, FirewallRule *rule, int *rule_id) {
+    // Skip comments and empty lines
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+        return 0;
+    }
+
+    // Remove trailing newline
+    line[strcspn(line, "\n\r")] = '\0';
+
+    // Find the rule part (after "ID. "); the rule keeps that ID
+    *rule_id = 0;
+    char *rule_start = strstr(line, ". ");
+    if (rule_start) {
+        *rule_id = atoi(line);
+        rule_start += 2;
+    } else {
+        // No ID format, use entire line
+        rule_start = line;
+    }
+
+    if (parse_rule_string(rule_start, rule) != 0) {
+        return -1;
+    }
+    rule->id = *rule_id;
+    return 1;
+}
+
+/**
+ * Read a rules file into the rule store
+ */
+static int read_rules_file(const char *filename) {
+    FILE *fp;
+    char line[MAX_CONFIG_LINE];
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        // File doesn't exist - not an error
+        printf("No existing configuration found\n");
+        return 0;
+    }
+
+    // Reset rule store
+    rule_store_clear();
+
+    // Read line by line
+    while (fgets(line, sizeof(line), fp)) {
+        // Parse and add rule
+        FirewallRule rule;
+        int rule_id;
+        if (parse_rules_file_line(line, &rule, &rule_id) == 1 && rule_store_add(&rule, rule_id) < 0) {
+            break;
         }
-        if (rules[i].protocol[0]) {
-            fprintf(fp, ", protocol=%s", rules[i].protocol);
+    }
+
+    fclose(fp);
+    printf("Loaded %d rules from %s\n", rule_count, filename);
+    return rule_count;
+}
+
+/**
+ * Read the rules of a rules file into a list, leaving the rule store
+ * alone; rules without an ID get their line position
+ * Returns the number of rules (*list to be freed by the caller), or -1
+ */
+int read_rule_list(const char *filename, FirewallRule **list) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    char line[MAX_CONFIG_LINE];
+    int count = 0, capacity = 0;
+    *list = NULL;
+
+    while (fgets(line, sizeof(line), fp)) {
+        FirewallRule rule;
+        int rule_id;
+        if (parse_rules_file_line(line, &rule, &rule_id) != 1) {
+            continue;
         }
-        if (rules[i].interface[0]) {
-            fprintf(fp, ", interface=%s", rules[i].interface);
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            FirewallRule *grown = realloc(*list, sizeof(FirewallRule) * capacity);
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory\n");
+                free(*list);
+                *list = NULL;
+                fclose(fp);
+                return -1;
+            }
+            *list = grown;
         }
-        if (rules[i].comment[0]) {
-            fprintf(fp, ", comment=\"%s\"", rules[i].comment);
+        if (rule.id <= 0) {
+            rule.id = count + 1;
         }
-        
-        fprintf(fp, "\n");
+        (*list)[count++] = rule;
     }
 
     fclose(fp);
-    printf("Configuration saved to %s\n", filename);
-    return 0;
+    return count;
 }
 
 /**
  * Load rules from configuration file
+ * The default rules file is read from its snapshot when that is current,
+ * and the journal is replayed on top
  */
 int load_rules_from_file(const char *filename) {
+    uint64_t started = PROFILE_BEGIN();
+    if (filename) {
+        int loaded = read_rules_file(filename);
+        PROFILE_END(PROFILE_LOAD, started);
+        return loaded;
+    }
+
+    journal_wait();
+    int loaded = load_snapshot();
+    if (loaded >= 0) {
+        printf("Loaded %d rules from %s (snapshot)\n", loaded, RULES_SNAPSHOT);
+    } else {
+        rule_store_clear();
+        read_rules_file(RULES_FILE);
+    }
+
+    int replayed = journal_replay();
+    if (replayed > 0) {
+        printf("Replayed %d changes from %s (%d rules)\n", replayed, RULES_JOURNAL, rule_count);
+    }
+    PROFILE_END(PROFILE_LOAD, started);
+    return rule_count;
+}
+
+/**
+ * Load the [general] section of the configuration file
+ */
+int load_general_config(const char *filename) {
     FILE *fp;
     char line[MAX_CONFIG_LINE];
+    int in_general = 0;
 
     if (!filename) {
-        filename = RULES_FILE;
+        filename = CONFIG_FILE;
     }
 
     fp = fopen(filename, "r");
     if (!fp) {
-        // File doesn't exist - not an error
-        printf("No existing configuration found\n");
+        // Keep defaults
         return 0;
     }
 
-    // Reset rule count
-    rule_count = 0;
-
-    // Read line by line
     while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+
         // Skip comments and empty lines
-        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+        if (line[0] == '#' || line[0] == '\0') {
             continue;
         }
 
-        // Remove trailing newline
-        line[strcspn(line, "\n\r")] = '\0';
-
-        // Find the rule part (after "ID. ")
-        char *rule_start = strstr(line, ". ");
-        if (rule_start) {
-            rule_start += 2;
-        } else {
-            // No ID format, use entire line
-            rule_start = line;
+        if (line[0] == '[') {
+            in_general = strncmp(line, "[general]", 9) == 0;
+            continue;
         }
 
-        // Parse and add rule
-        if (parse_rule_string(rule_start, &rules[rule_count]) == 0) {
-            rules[rule_count].id = rule_count + 1;
-            rule_count++;
+        char *equals = strchr(line, '=');
+        if (!in_general || !equals) {
+            continue;
+        }
+        *equals = '\0';
+        const char *key = line;
+        const char *value = equals + 1;
 
-            if (rule_count >= 1000) {
-                fprintf(stderr, "Warning: Maximum rules reached\n");
-                break;
+        if (strcmp(key, "chain") == 0) {
+            strncpy(firewall_config.chain, value, sizeof(firewall_config.chain) - 1);
+        } else if (strcmp(key, "policy") == 0) {
+            strncpy(firewall_config.policy, value, sizeof(firewall_config.policy) - 1);
+        } else if (strcmp(key, "logging") == 0) {
+            firewall_config.logging = strcmp(value, "enabled") == 0;
+        } else if (strcmp(key, "log_file") == 0) {
+            strncpy(firewall_config.log_file, value, sizeof(firewall_config.log_file) - 1);
+        } else if (strcmp(key, "log_level") == 0) {
+            if (strcmp(value, "error") == 0) {
+                firewall_config.log_level = LOG_LEVEL_ERROR;
+            } else if (strcmp(value, "warning") == 0) {
+                firewall_config.log_level = LOG_LEVEL_WARNING;
+            } else if (strcmp(value, "info") == 0) {
+                firewall_config.log_level = LOG_LEVEL_INFO;
+            } else if (strcmp(value, "debug") == 0) {
+                firewall_config.log_level = LOG_LEVEL_DEBUG;
+            } else {
+                fprintf(stderr, "Warning: Unknown log level '%s', using info\n", value);
+            }
+        } else if (strcmp(key, "log_max_size") == 0) {
+            // Bytes, or with a K or M suffix
+            char *unit;
+            long size = strtol(value, &unit, 10);
+            if (*unit == 'K' || *unit == 'k') {
+                size <<= 10;
+            } else if (*unit == 'M' || *unit == 'm') {
+                size <<= 20;
+            }
+            firewall_config.log_max_size = size > 0 ? size : 0;
+        } else if (strcmp(key, "backend") == 0) {
+            if (strcmp(value, "nftables") == 0) {
+                firewall_config.backend = BACKEND_NFTABLES;
+            } else if (strcmp(value, "iptables") == 0) {
+                firewall_config.backend = BACKEND_IPTABLES;
+            } else {
+                fprintf(stderr, "Warning: Unknown backend '%s', using iptables\n", value);
+            }
+        } else if (strcmp(key, "ipset_threshold") == 0) {
+            firewall_config.ipset_threshold = atoi(value);
+        } else if (strcmp(key, "partition_threshold") == 0) {
+            firewall_config.partition_threshold = atoi(value);
+        } else if (strcmp(key, "fast_path") == 0) {
+            firewall_config.fast_path = strcmp(value, "enabled") == 0;
+        } else if (strcmp(key, "xdp") == 0) {
+            if (strcmp(value, "generic") == 0) {
+                firewall_config.xdp = XDP_MODE_GENERIC;
+            } else if (strcmp(value, "native") == 0) {
+                firewall_config.xdp = XDP_MODE_NATIVE;
+            } else if (strcmp(value, "off") == 0) {
+                firewall_config.xdp = XDP_MODE_OFF;
+            } else {
+                fprintf(stderr, "Warning: Unknown xdp mode '%s', leaving it off\n", value);
             }
         }
     }
 
     fclose(fp);
-    printf("Loaded %d rules from %s\n", rule_count, filename);
-    return rule_count;
+    return 0;
 }
 
 /**
@@ -149,10 +383,7 @@ int create_config_directory(void) {
 
     if (stat(config_dir, &st) != 0) {
         // Directory doesn't exist, create it
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "mkdir -p %s", config_dir);
-        
-        if (system(cmd) != 0) {
+        if (mkdir(config_dir, 0755) != 0) {
             fprintf(stderr, "Error: Failed to create config directory\n");
             return -1;
         }
@@ -161,3 +392,17 @@ int create_config_directory(void) {
     return 0;
 }
 
+
+/**
+ * Flush the configuration directory's entries (new, renamed and deleted
+ * files) to disk
+ */
+int sync_config_directory(void) {
+    int fd = open("/etc/personal-firewall", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,374 @@
+#include "firewall.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*
+ * Rule daemon (`firewall daemon`).
+ *
+ * Keeps the rule store in memory and serves CLI commands over a Unix
+ * socket, so a client skips the startup work, the rules file parse and
+ * the rules file rewrite. A request is one line of tab-separated
+ * arguments ("add\t<rule>\n"). A reply is "<exit status> <length>\n"
+ * followed by the command's output. One connection may carry any number
+ * of requests. Rule changes are journaled before the reply is sent, and
+ * the journal is compacted into the rules file in the background.
+ */
+
+// A client that sends nothing for this many seconds is dropped
+#define DAEMON_CLIENT_TIMEOUT 5
+
+static volatile sig_atomic_t daemon_stop;
+
+// Command output is collected here and sent back as the reply body
+static int capture_fd = -1;
+static int saved_stdout = -1;
+static int saved_stderr = -1;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+/**
+ * Fill in the address of DAEMON_SOCKET
+ */
+static socklen_t daemon_address(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, DAEMON_SOCKET, sizeof(addr->sun_path) - 1);
+    return sizeof(*addr);
+}
+
+/**
+ * Write a whole buffer to a descriptor
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Send a command to a running daemon and print its reply
+ * Returns the command's exit status, or -1 when no daemon is listening
+ */
+int forward_to_daemon(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = daemon_address(&addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    char request[DAEMON_REQUEST_LENGTH];
+    size_t used = 0;
+    for (int i = 1; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        if (strpbrk(argv[i], "\t\n") || used + len + 1 >= sizeof(request)) {
+            fprintf(stderr, "Error: Argument cannot be sent to the daemon: %s\n", argv[i]);
+            close(fd);
+            return 1;
+        }
+        memcpy(request + used, argv[i], len);
+        used += len;
+        request[used++] = i + 1 < argc ? '\t' : '\n';
+    }
+
+    FILE *in = NULL;
+    int status = -1;
+    long long remaining = 0;
+    if (write_all(fd, request, used) == 0 && (in = fdopen(fd, "r")) != NULL &&
+        fscanf(in, "%d %lld", &status, &remaining) == 2 && fgetc(in) == '\n') {
+        char buf[4096];
+        while (remaining > 0) {
+            size_t want = remaining < (long long)sizeof(buf) ? (size_t)remaining : sizeof(buf);
+            size_t got = fread(buf, 1, want, in);
+            if (got == 0) {
+                break;
+            }
+            fwrite(buf, 1, got, stdout);
+            remaining -= (long long)got;
+        }
+    } else {
+        remaining = 1;
+    }
+
+    if (in) {
+        fclose(in);
+    } else {
+        close(fd);
+    }
+    if (remaining > 0 || status < 0) {
+        fprintf(stderr, "Error: Incomplete reply from daemon\n");
+        return 1;
+    }
+    return status;
+}
+
+/**
+ * Check whether a daemon accepts connections on DAEMON_SOCKET
+ */
+int daemon_listening(void) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = daemon_address(&addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    int listening = connect(fd, (struct sockaddr *)&addr, addr_len) == 0;
+    close(fd);
+    return listening;
+}
+
+/**
+ * Point stdout and stderr at the capture file
+ */
+static int begin_capture(void) {
+    fflush(stdout);
+    fflush(stderr);
+    if (ftruncate(capture_fd, 0) != 0 || lseek(capture_fd, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+    dup2(capture_fd, STDOUT_FILENO);
+    dup2(capture_fd, STDERR_FILENO);
+    return 0;
+}
+
+/**
+ * Restore the daemon's own stdout and stderr
+ */
+static void end_capture(void) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+}
+
+/**
+ * Send the exit status and the captured output to a client
+ */
+static int send_reply(int fd, int status) {
+    off_t length = lseek(capture_fd, 0, SEEK_END);
+    if (length < 0) {
+        length = 0;
+    }
+
+    char header[64];
+    int len = snprintf(header, sizeof(header), "%d %lld\n", status, (long long)length);
+    if (write_all(fd, header, (size_t)len) != 0) {
+        return -1;
+    }
+
+    char buf[4096];
+    off_t offset = 0;
+    while (offset < length) {
+        ssize_t n = pread(capture_fd, buf, sizeof(buf), offset);
+        if (n <= 0 || write_all(fd, buf, (size_t)n) != 0) {
+            return -1;
+        }
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Split a request line into an argument vector (argv[0] is the program)
+ * Returns argc, or -1 when there are too many arguments
+ */
+static int split_request(char *line, char *argv[]) {
+    static char program[] = "firewall";
+    int argc = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    argv[argc++] = program;
+
+    char *pos = line;
+    while (argc < DAEMON_MAX_ARGS) {
+        argv[argc++] = pos;
+        char *tab = strchr(pos, '\t');
+        if (!tab) {
+            argv[argc] = NULL;
+            return argc;
+        }
+        *tab = '\0';
+        pos = tab + 1;
+    }
+    return -1;
+}
+
+/**
+ * Run one request against the in-memory rule store
+ * Returns the command's exit status
+ */
+static int serve_request(int argc, char *argv[]) {
+    const char *command = argv[1];
+
+    if (strcmp(command, "daemon") == 0) {
+        fprintf(stderr, "Error: Daemon already running on %s\n", DAEMON_SOCKET);
+        return 1;
+    }
+
+    int status = run_command(argc, argv);
+
+    if (strcmp(command, "add") == 0 || strcmp(command, "remove") == 0) {
+        compact_journal_if_due(1);
+    } else if (strcmp(command, "flush") == 0) {
+        // flush clears the kernel only; the rules file and journal still hold the rules
+        load_rules_from_file(NULL);
+    }
+    return status;
+}
+
+/**
+ * Serve requests from one client until it disconnects or goes idle
+ */
+static void serve_client(int fd) {
+    struct timeval timeout = { DAEMON_CLIENT_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while (!daemon_stop && (len = getline(&line, &capacity, in)) > 0) {
+        char *args[DAEMON_MAX_ARGS + 1];
+        int argc = len < DAEMON_REQUEST_LENGTH ? split_request(line, args) : -1;
+        int status = 1;
+
+        if (begin_capture() != 0) {
+            break;
+        }
+        if (argc < 0) {
+            fprintf(stderr, "Error: Malformed request\n");
+        } else {
+            status = serve_request(argc, args);
+        }
+        end_capture();
+
+        if (send_reply(fd, status) != 0) {
+            break;
+        }
+    }
+
+    free(line);
+    fclose(in);
+}
+
+/**
+ * Run the rule daemon in the foreground until SIGTERM or SIGINT
+ */
+int run_daemon(void) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = daemon_address(&addr);
+
+    // A socket that still accepts connections belongs to a live daemon
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, addr_len) == 0) {
+        close(probe);
+        fprintf(stderr, "Error: Daemon already running on %s\n", DAEMON_SOCKET);
+        return -1;
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+    // Only root may talk to the daemon
+    unlink(DAEMON_SOCKET);
+    mode_t old_mask = umask(077);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, addr_len);
+    umask(old_mask);
+    if (bound != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", DAEMON_SOCKET);
+        close(listen_fd);
+        return -1;
+    }
+
+    FILE *capture = tmpfile();
+    saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (!capture || saved_stdout < 0 || saved_stderr < 0) {
+        fprintf(stderr, "Error: Cannot set up output capture\n");
+        close(listen_fd);
+        unlink(DAEMON_SOCKET);
+        return -1;
+    }
+    capture_fd = fileno(capture);
+    fcntl(capture_fd, F_SETFD, FD_CLOEXEC);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    printf("Daemon listening on %s (%d rules loaded)\n", DAEMON_SOCKET, rule_count);
+    fflush(stdout);
+    log_message("Daemon started");
+
+    while (!daemon_stop) {
+        // Rules with a deadline are checked once a second
+        if (expire_rules() > 0) {
+            compact_journal_if_due(1);
+        }
+        fflush(stdout);
+
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, expiry_pending() ? 1000 : -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready > 0) {
+            int client = accept(listen_fd, NULL, NULL);
+            if (client >= 0) {
+                serve_client(client);
+            }
+        }
+    }
+
+    journal_wait();
+    close(listen_fd);
+    unlink(DAEMON_SOCKET);
+    fclose(capture);
+    close(saved_stdout);
+    close(saved_stderr);
+    log_message("Daemon stopped");
+    printf("Daemon stopped\n");
+    return 0;
+}
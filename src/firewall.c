@@ -1,27 +1,99 @@
+#define _DEFAULT_SOURCE     // realpath()
 #include "firewall.h"
+#include <limits.h>
+
+/**
+ * Resolve a file argument against this process's working directory, so
+ * the daemon opens the file the user named rather than one next to its
+ * own working directory. A file that does not exist yet (an export
+ * target) is resolved through its directory.
+ * Returns resolved (PATH_MAX bytes), or NULL with a message printed
+ */
+static const char *client_path(const char *path, char *resolved) {
+    char dir[PATH_MAX], dir_resolved[PATH_MAX];
+
+    if (realpath(path, resolved)) {
+        return resolved;
+    }
+
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+
+    if (*base && realpath(dir, dir_resolved)) {
+        const char *sep = strcmp(dir_resolved, "/") == 0 ? "" : "/";
+        if (snprintf(resolved, PATH_MAX, "%s%s%s", dir_resolved, sep, base) < PATH_MAX) {
+            return resolved;
+        }
+    }
+    fprintf(stderr, "Error: Cannot open %s\n", path);
+    return NULL;
+}
 
 /**
  * Main entry point for the firewall CLI tool
  */
 int main(int argc, char *argv[]) {
+    // --profile[=json] anywhere times the stages of the command
+    argc = profile_options(argc, argv);
+
+    // A running daemon serves the command from its in-memory rule store
+    // (batch matching reads this process's stdin, replay reads a local
+    // capture for a long time, and watch and metrics run until stopped, so
+    // they stay local)
+    int batch_match = argc >= 3 && strcmp(argv[1], "match") == 0 && strcmp(argv[2], "-") == 0;
+    int replay = argc >= 2 && strcmp(argv[1], "replay") == 0;
+    int watch = argc >= 2 && strcmp(argv[1], "watch") == 0;
+    int metrics = argc >= 2 && strcmp(argv[1], "metrics") == 0;
+    char path[PATH_MAX];
+    if (argc >= 2 && strcmp(argv[1], "daemon") != 0 && !batch_match && !replay && !watch && !metrics) {
+        // The daemon opens files from its own working directory
+        if (argc >= 3 && (strcmp(argv[1], "import") == 0 || strcmp(argv[1], "export") == 0)) {
+            if (!client_path(argv[2], path)) {
+                return 1;
+            }
+            argv[2] = path;
+        }
+        uint64_t started = PROFILE_BEGIN();
+        int status = forward_to_daemon(argc, argv);
+        if (status >= 0) {
+            PROFILE_END(PROFILE_DAEMON, started);
+            return status;
+        }
+    }
+
     print_banner();
 
-    // Check for root privileges
-    if (!check_root_privileges()) {
+    // Check for root privileges (replay only reads the rules)
+    if (!replay && !check_root_privileges()) {
         fprintf(stderr, "Error: This program requires root privileges\n");
         fprintf(stderr, "Please run with sudo\n");
         return 1;
     }
 
     // Create config directory if it doesn't exist
-    create_config_directory();
+    if (!replay) {
+        create_config_directory();
+    }
 
-    // Load existing rules
+    // Load general settings
+    load_general_config(NULL);
+
+    // Load existing rules, dropping those that lapsed in the meantime
     load_rules_from_file(NULL);
+    if (!replay) {
+        expire_rules();
+    }
 
     // Parse command-line arguments
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <command> [options]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <command> [options] [--profile[=json]]\n", argv[0]);
         fprintf(stderr, "Commands:\n");
         fprintf(stderr, "  add <rule>     - Add a new firewall rule\n");
         fprintf(stderr, "  remove <id>    - Remove rule by ID\n");
@@ -30,9 +102,49 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "  flush          - Flush all rules\n");
         fprintf(stderr, "  save           - Save rules to file\n");
         fprintf(stderr, "  load           - Load rules from file\n");
+        fprintf(stderr, "  apply          - Apply all rules in one atomic commit\n");
+        fprintf(stderr, "  export [file]  - Write the backend ruleset payload\n");
+        fprintf(stderr, "  optimize [--dry-run] - Drop shadowed/redundant rules, merge prefixes\n");
+        fprintf(stderr, "  verify         - Check partitioned chains against the flat ruleset\n");
+        fprintf(stderr, "  reorder [--dry-run] - Move hot rules up using kernel counters\n");
+        fprintf(stderr, "  sync [--dry-run]    - Bring the kernel in line with the rules file\n");
+        fprintf(stderr, "  import <file>  - Append the rules or addresses of a file\n");
+        fprintf(stderr, "  match <packet> - Show the rule a packet hits (- [file]: batch from stdin)\n");
+        fprintf(stderr, "  replay <pcap> [--baseline <rules file>] [--interface <name>]\n");
+        fprintf(stderr, "                 - Count the packets of a capture each rule would take\n");
+        fprintf(stderr, "  xdp            - Show the XDP early drop program and its counters\n");
+        fprintf(stderr, "  watch [--once] [--dry-run] [log...]\n");
+        fprintf(stderr, "                 - Ban addresses that keep failing in the logs\n");
+        fprintf(stderr, "  metrics [--interval <s>] [--output <file>] [--dump <file>] [--once]\n");
+        fprintf(stderr, "                 - Export per-rule counters and rates for Prometheus\n");
+        fprintf(stderr, "  daemon         - Serve commands from memory on %s\n", DAEMON_SOCKET);
         return 1;
     }
 
+    if (strcmp(argv[1], "daemon") == 0) {
+        return run_daemon() == 0 ? 0 : 1;
+    }
+    if (watch) {
+        return watch_logs(argc, argv) == 0 ? 0 : 1;
+    }
+    if (metrics) {
+        return export_rule_metrics(argc, argv) == 0 ? 0 : 1;
+    }
+
+    int status = run_command(argc, argv);
+
+    // add and remove are journaled; fold the journal in once it is large
+    if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "remove") == 0) {
+        compact_journal_if_due(0);
+    }
+
+    return status;
+}
+
+/**
+ * Carry out one command
+ */
+static int dispatch_command(int argc, char *argv[]) {
     const char *command = argv[1];
 
     if (strcmp(command, "add") == 0) {
@@ -40,6 +152,10 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error: Rule string required\n");
             return 1;
         }
+        // Several rules are added as one change
+        if (argc > 3) {
+            return add_firewall_rule_strings(argv + 2, argc - 2) == 0 ? 0 : 1;
+        }
         add_firewall_rule(argv[2]);
     }
     else if (strcmp(command, "remove") == 0) {
@@ -57,8 +173,19 @@ int main(int argc, char *argv[]) {
         get_firewall_status();
     }
     else if (strcmp(command, "flush") == 0) {
-        flush_rules();
-        rule_count = 0;
+        if (firewall_config.backend == BACKEND_NFTABLES) {
+            nft_flush_ruleset();
+        } else {
+            flush_rules();
+            purge_stale_sets(NULL);
+        }
+        rule_store_clear();
+        xdp_sync();
+    }
+    else if (strcmp(command, "xdp") == 0) {
+        if (xdp_print_status() != 0) {
+            return 1;
+        }
     }
     else if (strcmp(command, "save") == 0) {
         save_rules_to_file(NULL);
@@ -66,16 +193,139 @@ int main(int argc, char *argv[]) {
     else if (strcmp(command, "load") == 0) {
         load_rules_from_file(NULL);
     }
+    else if (strcmp(command, "apply") == 0) {
+        if (apply_all_rules() != 0) {
+            return 1;
+        }
+    }
+    else if (strcmp(command, "export") == 0) {
+        FILE *out = stdout;
+        if (argc >= 3 && !(out = fopen(argv[2], "w"))) {
+            fprintf(stderr, "Error: Cannot open file for writing: %s\n", argv[2]);
+            return 1;
+        }
+        // A snapshot loaded for these rules already holds the payload
+        if (write_snapshot_payload(out) != 0) {
+            if (firewall_config.backend == BACKEND_NFTABLES) {
+                render_nft_ruleset(out);
+            } else {
+                render_iptables_payload(out);
+            }
+        }
+        if (out != stdout) {
+            fclose(out);
+        }
+    }
+    else if (strcmp(command, "optimize") == 0) {
+        int dry_run = argc >= 3 && strcmp(argv[2], "--dry-run") == 0;
+        int removed = optimize_ruleset(dry_run);
+        if (removed < 0) {
+            return 1;
+        }
+        if (!dry_run && removed > 0) {
+            if (apply_all_rules() != 0) {
+                return 1;
+            }
+            save_rules_to_file(NULL);
+        }
+    }
+    else if (strcmp(command, "verify") == 0) {
+        if (check_partition() != 0) {
+            return 1;
+        }
+    }
+    else if (strcmp(command, "reorder") == 0) {
+        int dry_run = argc >= 3 && strcmp(argv[2], "--dry-run") == 0;
+        int moved = reorder_rules(dry_run);
+        if (moved < 0) {
+            return 1;
+        }
+        if (!dry_run && moved > 0) {
+            if (apply_all_rules() != 0) {
+                return 1;
+            }
+            save_rules_to_file(NULL);
+        }
+    }
+    else if (strcmp(command, "sync") == 0) {
+        int dry_run = argc >= 3 && strcmp(argv[2], "--dry-run") == 0;
+        if (sync_ruleset(dry_run) < 0) {
+            return 1;
+        }
+    }
+    else if (strcmp(command, "import") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Error: File name required\n");
+            return 1;
+        }
+        int imported = import_rules(argv[2]);
+        if (imported < 0) {
+            return 1;
+        }
+        if (imported > 0) {
+            if (apply_all_rules() != 0) {
+                return 1;
+            }
+            save_rules_to_file(NULL);
+        }
+    }
+    else if (strcmp(command, "match") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Error: Packet description required\n");
+            return 1;
+        }
+        if (strcmp(argv[2], "-") != 0) {
+            return explain_match(argv[2]) == 0 ? 0 : 1;
+        }
+        FILE *out = stdout;
+        if (argc >= 4 && !(out = fopen(argv[3], "w"))) {
+            fprintf(stderr, "Error: Cannot open file for writing: %s\n", argv[3]);
+            return 1;
+        }
+        int ret = match_stream(stdin, out);
+        if (out != stdout) {
+            fclose(out);
+        }
+        if (ret != 0) {
+            return 1;
+        }
+    }
+    else if (strcmp(command, "replay") == 0) {
+        const char *baseline = NULL, *interface = NULL;
+        if (argc < 3) {
+            fprintf(stderr, "Error: Capture file required\n");
+            return 1;
+        }
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+                baseline = argv[++i];
+            } else if (strcmp(argv[i], "--interface") == 0 && i + 1 < argc) {
+                interface = argv[++i];
+            } else {
+                fprintf(stderr, "Error: Unknown replay option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (replay_capture(argv[2], baseline, interface) != 0) {
+            return 1;
+        }
+    }
     else {
         fprintf(stderr, "Error: Unknown command: %s\n", command);
         return 1;
     }
 
-    // Save rules after any changes
-    if (strcmp(command, "add") == 0 || strcmp(command, "remove") == 0) {
-        save_rules_to_file(NULL);
-    }
-
     return 0;
 }
 
+/**
+ * Run one command against the loaded rules (argv[1] is the command)
+ * Returns the process exit status
+ */
+int run_command(int argc, char *argv[]) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = dispatch_command(argc, argv);
+    PROFILE_END(PROFILE_COMMAND, started);
+    return ret;
+}
+
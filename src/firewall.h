@@ -1,20 +1,19 @@
 #ifndef FIREWALL_H
 #define FIREWALL_H
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 
-// External declarations
-extern FirewallRule rules[1000];
-extern int rule_count;
-
 // Maximum lengths
 #define MAX_RULE_LENGTH 1024
 #define MAX_IP_LENGTH 46
@@ -22,27 +21,182 @@ extern int rule_count;
 #define MAX_ACTION_LENGTH 10
 #define MAX_PROTOCOL_LENGTH 10
 #define MAX_COMMENT_LENGTH 256
+#define PARSE_ERROR_LENGTH 160
 #define MAX_CONFIG_LINE 1024
 #define CONFIG_FILE "/etc/personal-firewall/firewall.conf"
 #define RULES_FILE "/etc/personal-firewall/rules.txt"
+#define RULES_SNAPSHOT "/etc/personal-firewall/rules.snap"
+#define RULES_JOURNAL "/etc/personal-firewall/rules.journal"
+
+// Rule IDs: slot number + 1 in the low bits, slot generation above
+#define RULE_SLOT_BITS 24
+#define RULE_GENERATION_MASK 0x7f
+#define RULE_ID(slot, generation) \
+    ((((generation) & RULE_GENERATION_MASK) << RULE_SLOT_BITS) | ((slot) + 1))
+
+// Rule actions
+#define ACTION_NONE   0
+#define ACTION_ACCEPT 1
+#define ACTION_DROP   2
+#define ACTION_REJECT 3
+
+// Rule protocols (PROTO_NONE: no protocol given)
+#define PROTO_NONE 0
+#define PROTO_TCP  1
+#define PROTO_UDP  2
+#define PROTO_ICMP 3
+#define PROTO_ALL  4
 
-// Rule structure
+// Rule structure, parsed once at ingest: addresses are host-order
+// network prefixes, interface and comment are string pool handles
+// (0 is the empty string). Text is rendered only at the edges.
 typedef struct {
     int id;
-    char action[MAX_ACTION_LENGTH];
-    char source[MAX_IP_LENGTH];
-    char dest[MAX_IP_LENGTH];
-    char port[MAX_PORT_LENGTH];
-    char protocol[MAX_PROTOCOL_LENGTH];
-    char interface[64];
-    char comment[MAX_COMMENT_LENGTH];
-    int active;
+    uint32_t source;        // Masked to source_len
+    uint32_t dest;          // Masked to dest_len
+    uint32_t interface;
+    uint32_t comment;
+    uint32_t expires;       // Unix time the rule lapses, 0 for never
+    uint16_t port_first;    // 0 when no port is given
+    uint16_t port_last;
+    int8_t source_len;      // Prefix length, -1 when no source is given
+    int8_t dest_len;        // Prefix length, -1 when no destination is given
+    uint8_t action;         // ACTION_*
+    uint8_t protocol;       // PROTO_*
+    uint8_t active;
 } FirewallRule;
 
+// Rule backends
+#define BACKEND_IPTABLES 0
+#define BACKEND_NFTABLES 1
+
+// ipset match direction of a compiled entry
+#define SET_MATCH_SOURCE 1
+#define SET_MATCH_DEST   2
+#define IPSET_NAME_LENGTH 32
+
+// multiport limits (a port range takes two of the kernel's 15 slots)
+#define MULTIPORT_MAX_SLOTS 15
+#define MULTIPORT_LOOKAHEAD 64
+#define MULTIPORT_LENGTH 128
+
+// Conntrack fast path entries at the head of INPUT
+#define CTSTATE_LENGTH 24
+#define FAST_PATH_COMMENT "fast-path"
+
+// Sub-chains of a partitioned INPUT chain (iptables allows 28 characters)
+#define PARTITION_CHAIN_LENGTH 29
+#define PARTITION_PREFIX "pfw"
+#define MAX_PARTITION_CHAINS 1024
+
+// XDP early drop modes
+#define XDP_MODE_OFF     0
+#define XDP_MODE_GENERIC 1
+#define XDP_MODE_NATIVE  2
+
+// Log levels (log_level= in CONFIG_FILE)
+#define LOG_LEVEL_ERROR   0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO    2
+#define LOG_LEVEL_DEBUG   3
+
+// Control socket of the rule daemon
+#define DAEMON_SOCKET "/run/personal-firewall.sock"
+// Arguments and bytes of one request, enough for a few hundred rules to one add
+#define DAEMON_MAX_ARGS 256
+#define DAEMON_REQUEST_LENGTH (MAX_RULE_LENGTH * 16)
+
+// Settings from the [general] section of CONFIG_FILE
+typedef struct {
+    char chain[32];
+    char policy[MAX_ACTION_LENGTH];
+    int logging;
+    char log_file[256];
+    int log_level;          // LOG_LEVEL_*: messages above it are skipped
+    long log_max_size;      // Bytes before the log is rotated (0: never)
+    int backend;
+    int ipset_threshold;
+    int partition_threshold;
+    int fast_path;
+    int xdp;                // XDP_MODE_*
+} FirewallConfig;
+
+// One INPUT chain entry produced by the rule compiler
+typedef struct {
+    FirewallRule rule;                  // Match fields and action
+    char set_name[IPSET_NAME_LENGTH];   // ipset of the varying address, "" if plain
+    uint32_t set_hash;                  // Hash the set name was derived from
+    int set_field;                      // SET_MATCH_SOURCE or SET_MATCH_DEST
+    int first_member;                   // First address in CompiledRuleset.members
+    int member_count;
+    char multiport[MULTIPORT_LENGTH];   // Destination ports of a multiport group, "" if single
+    char jump[PARTITION_CHAIN_LENGTH];  // Sub-chain a dispatch entry goes to, "" for a rule
+    char ctstate[CTSTATE_LENGTH];       // Conntrack states of a fast-path entry, "" for a rule
+    char comment[MAX_COMMENT_LENGTH];   // Comment replacing the rule's own, "" if none
+} CompiledEntry;
+
+// Compiled INPUT chain
+typedef struct {
+    CompiledEntry *entries;
+    int entry_count;
+    char (*members)[MAX_IP_LENGTH];
+    int member_count;
+} CompiledRuleset;
+
+// One chain of a partitioned ruleset
+typedef struct {
+    char name[PARTITION_CHAIN_LENGTH];
+    CompiledEntry *entries;
+    int *origin;                        // Flat entry index per entry, -1 for dispatch
+    int entry_count;
+    int capacity;
+} PartitionChain;
+
+// INPUT split into a dispatch tree of sub-chains (chains[0] is INPUT)
+typedef struct {
+    PartitionChain *chains;
+    int chain_count;
+} PartitionedRuleset;
+
+// A packet for the classifier: host-order addresses, destination port
+// (0 for none), PROTO_* protocol (PROTO_NONE when unknown) and input
+// interface as a string pool handle (0 when unknown)
+typedef struct {
+    uint32_t source;
+    uint32_t dest;
+    uint32_t interface;
+    uint16_t port;
+    uint8_t protocol;
+} MatchPacket;
+
+// Packet classifier compiled from a list of rules
+typedef struct {
+    FirewallRule *rules;                // Active rules in evaluation order
+    struct MatchCandidate *candidates;  // Rules bucket by bucket
+    struct MatchTuple *tuples;
+    int rule_count;
+    int tuple_count;
+} PacketClassifier;
+
+// External declarations
+extern int rule_count;
+extern FirewallConfig firewall_config;
+
 // Function declarations
 
+// Rule store
+int rule_store_add(const FirewallRule *rule, int rule_id);
+int rule_store_remove(int rule_id);
+void rule_store_clear(void);
+int rule_store_replace(const FirewallRule *list, int count);
+unsigned long rule_store_version(void);
+FirewallRule **ordered_rules(void);
+int rule_position(int rule_id);
+
 // Rule management
 int add_firewall_rule(const char *rule_string);
+int add_firewall_rules(FirewallRule *rules, int count);
+int add_firewall_rule_strings(char *const *rule_strings, int count);
 int remove_firewall_rule(int rule_id);
 int list_firewall_rules(void);
 int enable_firewall_rule(int rule_id);
@@ -51,16 +205,16 @@ int disable_firewall_rule(int rule_id);
 // Configuration management
 int save_rules_to_file(const char *filename);
 int load_rules_from_file(const char *filename);
+int read_rule_list(const char *filename, FirewallRule **list);
+int format_rule_line(const FirewallRule *rule, char *line, size_t size);
+int sync_config_directory(void);
 int backup_configuration(const char *backup_file);
 int restore_configuration(const char *backup_file);
+int load_general_config(const char *filename);
 
-// Validation functions
-int validate_ip(const char *ip);
-int validate_port(const char *port);
-int validate_cidr(const char *cidr);
-int validate_action(const char *action);
-int validate_protocol(const char *protocol);
-int validate_rule_string(const char *rule_string);
+// Address and port parsing
+int parse_ipv4_prefix(const char *text, uint32_t *addr, int *prefix_len);
+int parse_port_range(const char *port, int *first, int *last);
 
 // iptables integration
 int execute_iptables_cmd(const char *cmd);
@@ -68,15 +222,180 @@ int flush_rules(void);
 int get_firewall_status(void);
 int apply_rule_to_iptables(const FirewallRule *rule);
 int remove_rule_from_iptables(const FirewallRule *rule);
+int begin_iptables_batch(int flush);
+int commit_iptables_batch(void);
+int apply_all_rules(void);
+int probe_iptables(void);
+int print_input_chain(void);
+int render_iptables_payload(FILE *out);
+int build_entry_spec(const CompiledEntry *entry, char *spec, size_t size);
+int append_entry_to_iptables(const CompiledEntry *entry);
+int append_entry_to_chain(const char *chain, const CompiledEntry *entry);
+int reset_chain(const char *chain);
+int delete_chain(const char *chain);
+int list_managed_chains(char (*names)[PARTITION_CHAIN_LENGTH], int max);
+int drop_partition_chains(const PartitionedRuleset *keep);
+int read_entry_counters(void (*visit)(const char *comment, unsigned long long packets,
+                                      unsigned long long bytes, void *arg), void *arg);
+int read_input_specs(char (**specs)[MAX_RULE_LENGTH]);
+int delete_entry_at(int position);
+int refresh_ipsets(const CompiledRuleset *rs);
+int insert_entry_to_iptables(const CompiledEntry *entry, int position);
+int delete_entry_from_iptables(const CompiledEntry *entry);
+int commit_ruleset_change(CompiledRuleset *before);
+int destroy_stale_sets(const CompiledRuleset *rs);
+int purge_stale_sets(const CompiledRuleset *rs);
+FILE *open_command_pipe(char *const argv[], pid_t *pid_out);
+int close_command_pipe(FILE *fp, pid_t pid);
+
+// Rule compiler
+int compile_ruleset(CompiledRuleset *rs);
+void free_compiled_ruleset(CompiledRuleset *rs);
+void make_plain_entry(const FirewallRule *rule, CompiledEntry *entry);
+void make_empty_entry(CompiledEntry *entry);
+const CompiledEntry *find_compiled_set(const CompiledRuleset *rs, const char *name);
+int interfaces_overlap(uint32_t a, uint32_t b);
+int rules_overlap(const FirewallRule *a, const FirewallRule *b);
+
+// Chain partitioning
+int partition_ruleset(const CompiledRuleset *rs, PartitionedRuleset *pr);
+void free_partitioned_ruleset(PartitionedRuleset *pr);
+int verify_partition(const CompiledRuleset *rs, const PartitionedRuleset *pr);
+int find_partition_chain(const PartitionedRuleset *pr, const char *name);
+int check_partition(void);
+
+// Ruleset optimizer
+int optimize_ruleset(int dry_run);
+
+// Kernel reconciliation
+int sync_ruleset(int dry_run);
+
+// Bulk import (rule_import.c)
+int import_rules(const char *filename);
+
+// Binary ruleset snapshot (snapshot.c)
+int save_snapshot(void);
+int load_snapshot(void);
+const char *snapshot_payload(size_t *size);
+const char *snapshot_saved_payload(size_t *size);
+int write_snapshot_payload(FILE *out);
+
+// Packet classifier (rule_match.c)
+int compile_classifier(FirewallRule **rules, int count, PacketClassifier *pc);
+void free_compiled_classifier(PacketClassifier *pc);
+const FirewallRule *classifier_lookup(const PacketClassifier *pc, const MatchPacket *packet);
+int build_classifier(void);
+void free_classifier(void);
+const FirewallRule *classify_packet(const MatchPacket *packet);
+int parse_packet_string(const char *text, MatchPacket *packet, char *error, size_t error_size);
+int explain_match(const char *text);
+int match_stream(FILE *in, FILE *out);
+
+// Capture replay (pcap_replay.c)
+int replay_capture(const char *filename, const char *baseline_file, const char *interface);
+
+// XDP early drop (xdp_backend.c)
+int xdp_sync(void);
+int xdp_print_status(void);
+
+// Rule counter telemetry (rule_metrics.c)
+int export_rule_metrics(int argc, char *argv[]);
+
+// Log watcher (log_watch.c)
+int watch_logs(int argc, char *argv[]);
+
+// Rule expiry (rule_expiry.c)
+int expiry_reserve(int slots);
+void expiry_schedule(int slot, int rule_id, uint32_t expires);
+void expiry_cancel(int slot);
+int expiry_pending(void);
+int expire_rules(void);
+
+// Rule journal (rule_journal.c)
+int journal_add(const FirewallRule *rule);
+int journal_add_rules(const FirewallRule *rules, int count);
+int journal_remove(int rule_id);
+int journal_remove_rules(const int *rule_ids, int count);
+int journal_replay(void);
+void journal_reset(void);
+void journal_wait(void);
+int compact_journal_if_due(int background);
+uint64_t rules_files_stamp(void);
+
+// Counter-driven reordering
+uint32_t comment_hash(const char *text);
+int comment_equals(const char *stored, const char *kernel);
+int read_rule_counters(unsigned long long *packets, unsigned long long *bytes);
+void credit_rule_counter(const char *comment, unsigned long long packets, unsigned long long bytes,
+                         unsigned long long *packet_counts, unsigned long long *byte_counts);
+int reorder_rules(int dry_run);
+
+// Rule daemon
+int run_command(int argc, char *argv[]);
+int run_daemon(void);
+int forward_to_daemon(int argc, char *argv[]);
+int daemon_listening(void);
+
+// nftables backend
+int render_nft_ruleset(FILE *out);
+int nft_apply_ruleset(void);
+int nft_flush_ruleset(void);
+int nft_print_ruleset(void);
+
+// Profiled stages (--profile)
+#define PROFILE_COMMAND 0       // A whole command
+#define PROFILE_DAEMON  1       // A command served by the daemon, round trip
+#define PROFILE_LOAD    2       // Loading the rules (snapshot or file, and journal)
+#define PROFILE_PARSE   3       // Parsing and validating one rule string
+#define PROFILE_JOURNAL 4       // One journal write and fsync
+#define PROFILE_COMPILE 5       // Compiling the ruleset into chain entries
+#define PROFILE_BUILD   6       // Building the iptables arguments of one entry
+#define PROFILE_SPAWN   7       // Forking and starting a backend command
+#define PROFILE_WAIT    8       // Waiting for a backend command to finish
+#define PROFILE_SAVE    9       // Writing the rules file
+#define PROFILE_XDP     10      // Syncing the XDP program
+#define PROFILE_STAGES  11
+
+// Profiling (profiler.c)
+extern int profile_enabled;
+uint64_t profile_clock(void);
+void profile_record(int stage, uint64_t started);
+int profile_options(int argc, char *argv[]);
+// Start and end a span of a stage; without --profile only a flag is tested
+#define PROFILE_BEGIN() (profile_enabled ? profile_clock() : 0)
+#define PROFILE_END(stage, started) do { if (started) profile_record((stage), (started)); } while (0)
+
+// Logging (logger.c)
+void log_event(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_message(const char *message);
+void log_flush(void);
 
 // Utility functions
 void print_banner(void);
-void log_message(const char *message);
 int check_root_privileges(void);
 int create_config_directory(void);
 
+// String pool
+uint32_t intern_string(const char *text);
+uint32_t intern_span(const char *text, size_t len);
+const char *pool_string(uint32_t handle);
+const char *pool_data(size_t *size);
+int pool_restore(const char *data, size_t size);
+
+// Rule text (parsed at ingest, rendered at the edges)
+int parse_action(const char *text);
+int parse_protocol(const char *text);
+const char *action_name(int action);
+const char *protocol_name(int protocol);
+void format_address(uint32_t addr, int prefix_len, char *out, size_t size);
+void format_port_range(int first, int last, char *out, size_t size);
+
 // Additional functions
 int parse_rule_string(const char *rule_string, FirewallRule *rule);
+int parse_rule_span(const char *line, const char *start, const char *end,
+                    FirewallRule *rule, char *error, size_t error_size);
+const char *parse_address_span(const char *p, const char *end, uint32_t *addr, int8_t *prefix_len);
+void make_empty_rule(FirewallRule *rule);
 int get_rule_count(void);
 FirewallRule* get_rule_by_id(int rule_id);
 
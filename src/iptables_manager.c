@@ -1,5 +1,6 @@
 #include "firewall.h"
 #include <sys/wait.h>
+#include <signal.h>
 
 /**
  * Execute an iptables command
@@ -12,6 +13,7 @@ int execute_iptables_cmd(const char *cmd) {
     printf("Executing: iptables %s\n", cmd);
 
     // Fork and execute
+    uint64_t started = PROFILE_BEGIN();
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
@@ -19,8 +21,20 @@ int execute_iptables_cmd(const char *cmd) {
     }
 
     if (pid == 0) {
-        // Child process
-        char *args[] = {"iptables", (char *)cmd, NULL};
+        // Child process: split the command into separate arguments
+        char buf[MAX_RULE_LENGTH];
+        char *args[64];
+        int argc = 0;
+
+        strncpy(buf, cmd, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+
+        args[argc++] = "iptables";
+        for (char *tok = strtok(buf, " "); tok && argc < 63; tok = strtok(NULL, " ")) {
+            args[argc++] = tok;
+        }
+        args[argc] = NULL;
+
         if (execvp("iptables", args) < 0) {
             perror("execvp");
             exit(1);
@@ -28,8 +42,11 @@ int execute_iptables_cmd(const char *cmd) {
     } else {
         // Parent process
         int status;
+        PROFILE_END(PROFILE_SPAWN, started);
+        started = PROFILE_BEGIN();
         waitpid(pid, &status, 0);
-        
+        PROFILE_END(PROFILE_WAIT, started);
+
         if (WIFEXITED(status)) {
             return WEXITSTATUS(status);
         }
@@ -40,65 +57,676 @@ int execute_iptables_cmd(const char *cmd) {
 }
 
 /**
- * Apply a rule to iptables
+ * Start a command that reads its input from the returned stream
+ * Used to feed iptables-restore, nft and ipset payloads in one go
  */
-int apply_rule_to_iptables(const FirewallRule *rule) {
-    if (!rule) {
+FILE *open_command_pipe(char *const argv[], pid_t *pid_out) {
+    // A failed child must not kill us through SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    uint64_t started = PROFILE_BEGIN();
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    if (pid == 0) {
+        // Child process reads the payload from the pipe
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        perror("execvp");
+        _exit(1);
+    }
+
+    close(fds[0]);
+    FILE *fp = fdopen(fds[1], "w");
+    if (!fp) {
+        perror("fdopen");
+        close(fds[1]);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+
+    *pid_out = pid;
+    PROFILE_END(PROFILE_SPAWN, started);
+    return fp;
+}
+
+/**
+ * Close the payload stream and wait for the command to finish
+ */
+int close_command_pipe(FILE *fp, pid_t pid) {
+    int status;
+    uint64_t started = PROFILE_BEGIN();
+
+    fclose(fp);
+    pid_t waited = waitpid(pid, &status, 0);
+    PROFILE_END(PROFILE_WAIT, started);
+    if (waited < 0) {
         return -1;
     }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return -1;
+}
 
-    char cmd[MAX_RULE_LENGTH] = "";
-    char temp[256];
+/**
+ * Format the match and target part of a chain entry
+ */
+static int format_entry_spec(const CompiledEntry *entry, char *spec, size_t size) {
+    const FirewallRule *rule = &entry->rule;
+    char temp[MAX_COMMENT_LENGTH + 64];
+    char text[MAX_IP_LENGTH];
 
-    // Build iptables command
-    strcat(cmd, "-A INPUT");
+    spec[0] = '\0';
 
     // Add source IP
-    if (rule->source[0]) {
-        snprintf(temp, sizeof(temp), " -s %s", rule->source);
-        strcat(cmd, temp);
+    if (rule->source_len >= 0) {
+        format_address(rule->source, rule->source_len, text, sizeof(text));
+        snprintf(temp, sizeof(temp), " -s %s", text);
+        strncat(spec, temp, size - strlen(spec) - 1);
     }
 
     // Add destination IP
-    if (rule->dest[0]) {
-        snprintf(temp, sizeof(temp), " -d %s", rule->dest);
-        strcat(cmd, temp);
+    if (rule->dest_len >= 0) {
+        format_address(rule->dest, rule->dest_len, text, sizeof(text));
+        snprintf(temp, sizeof(temp), " -d %s", text);
+        strncat(spec, temp, size - strlen(spec) - 1);
     }
 
     // Add protocol
-    if (rule->protocol[0]) {
-        snprintf(temp, sizeof(temp), " -p %s", rule->protocol);
-        strcat(cmd, temp);
+    if (rule->protocol) {
+        snprintf(temp, sizeof(temp), " -p %s", protocol_name(rule->protocol));
+        strncat(spec, temp, size - strlen(spec) - 1);
     }
 
-    // Add port
-    if (rule->port[0]) {
-        if (strcmp(rule->protocol, "TCP") == 0 || strcmp(rule->protocol, "UDP") == 0) {
-            snprintf(temp, sizeof(temp), " --dport %s", rule->port);
-            strcat(cmd, temp);
+    // Add port (a multiport group carries its ports separately)
+    if (entry->multiport[0]) {
+        snprintf(temp, sizeof(temp), " -m multiport --dports %s", entry->multiport);
+        strncat(spec, temp, size - strlen(spec) - 1);
+    } else if (rule->port_first) {
+        if (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP) {
+            format_port_range(rule->port_first, rule->port_last, text, sizeof(text));
+            snprintf(temp, sizeof(temp), " --dport %s", text);
+            strncat(spec, temp, size - strlen(spec) - 1);
         }
     }
 
     // Add interface
-    if (rule->interface[0]) {
-        snprintf(temp, sizeof(temp), " -i %s", rule->interface);
-        strcat(cmd, temp);
+    if (rule->interface) {
+        snprintf(temp, sizeof(temp), " -i %s", pool_string(rule->interface));
+        strncat(spec, temp, size - strlen(spec) - 1);
     }
 
-    // Add comment
-    if (rule->comment[0]) {
-        snprintf(temp, sizeof(temp), " -m comment --comment \"%s\"", rule->comment);
-        strcat(cmd, temp);
+    // Add set match
+    if (entry->set_name[0]) {
+        snprintf(temp, sizeof(temp), " -m set --match-set %s %s", entry->set_name,
+                 entry->set_field == SET_MATCH_SOURCE ? "src" : "dst");
+        strncat(spec, temp, size - strlen(spec) - 1);
+    }
+
+    // Add conntrack state match
+    if (entry->ctstate[0]) {
+        snprintf(temp, sizeof(temp), " -m conntrack --ctstate %s", entry->ctstate);
+        strncat(spec, temp, size - strlen(spec) - 1);
+    }
+
+    // Dispatch entries of a partitioned chain carry no comment
+    if (entry->jump[0]) {
+        snprintf(temp, sizeof(temp), " -g %s", entry->jump);
+        strncat(spec, temp, size - strlen(spec) - 1);
+        return 0;
+    }
+
+    // Add comment (double quotes would terminate the argument early)
+    if (entry->set_name[0]) {
+        snprintf(temp, sizeof(temp), " -m comment --comment \"%s\"", entry->set_name);
+    } else if (entry->comment[0] || rule->comment) {
+        char comment[MAX_COMMENT_LENGTH];
+        strncpy(comment, entry->comment[0] ? entry->comment : pool_string(rule->comment), sizeof(comment) - 1);
+        comment[sizeof(comment) - 1] = '\0';
+        for (char *c = comment; *c; c++) {
+            if (*c == '"') {
+                *c = '\'';
+            }
+        }
+        snprintf(temp, sizeof(temp), " -m comment --comment \"%s\"", comment);
     } else {
         snprintf(temp, sizeof(temp), " -m comment --comment \"Rule-ID-%d\"", rule->id);
-        strcat(cmd, temp);
     }
+    strncat(spec, temp, size - strlen(spec) - 1);
 
     // Add action
-    snprintf(temp, sizeof(temp), " -j %s", rule->action);
-    strcat(cmd, temp);
+    snprintf(temp, sizeof(temp), " -j %s", action_name(rule->action));
+    strncat(spec, temp, size - strlen(spec) - 1);
+
+    return 0;
+}
+
+/**
+ * Build the match and target part of a chain entry
+ * (everything after "-A INPUT" / "-D INPUT")
+ */
+int build_entry_spec(const CompiledEntry *entry, char *spec, size_t size) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = format_entry_spec(entry, spec, size);
+    PROFILE_END(PROFILE_BUILD, started);
+    return ret;
+}
+
+/*
+ * ipset batch, fed to "ipset restore" and opened on first use so that
+ * changes without set updates do not spawn it at all
+ */
+static FILE *ipset_fp = NULL;
+static pid_t ipset_pid = -1;
+
+/**
+ * Get the ipset batch stream, starting "ipset restore" if needed
+ */
+static FILE *ipset_stream(void) {
+    if (!ipset_fp) {
+        char *args[] = {"ipset", "restore", NULL};
+        ipset_fp = open_command_pipe(args, &ipset_pid);
+    }
+    return ipset_fp;
+}
+
+/**
+ * Write one line to the ipset batch
+ */
+static int ipset_write(const char *fmt, const char *name, const char *arg) {
+    FILE *fp = ipset_stream();
+    if (!fp) {
+        return -1;
+    }
+    fprintf(fp, fmt, name, arg);
+    return 0;
+}
+
+/**
+ * Run the ipset batch, if one was started
+ */
+static int ipset_commit(void) {
+    if (!ipset_fp) {
+        return 0;
+    }
+
+    printf("Executing: ipset restore\n");
+
+    int ret = close_command_pipe(ipset_fp, ipset_pid);
+    ipset_fp = NULL;
+    ipset_pid = -1;
+    if (ret != 0) {
+        fprintf(stderr, "Error: ipset restore failed\n");
+    }
+    return ret;
+}
+
+#define IPSET_CREATE "create %s hash:net family inet maxelem 1048576 -exist%s\n"
+
+/**
+ * Write the ipset payload that (re)builds every set of a compiled ruleset
+ * Each set is filled under a temporary name and swapped in atomically
+ */
+static void write_full_sets(const CompiledRuleset *rs, FILE *out) {
+    char temp[IPSET_NAME_LENGTH + 4];
+
+    for (int i = 0; i < rs->entry_count; i++) {
+        const CompiledEntry *entry = &rs->entries[i];
+        if (!entry->set_name[0]) {
+            continue;
+        }
+
+        // Without an explicit stream the sets go to "ipset restore"
+        if (!out && !(out = ipset_stream())) {
+            return;
+        }
+
+        snprintf(temp, sizeof(temp), "%s-t", entry->set_name);
+        fprintf(out, IPSET_CREATE, entry->set_name, "");
+        fprintf(out, IPSET_CREATE, temp, "");
+        fprintf(out, "flush %s\n", temp);
+        for (int m = entry->first_member; m < entry->first_member + entry->member_count; m++) {
+            fprintf(out, "add %s %s -exist\n", temp, rs->members[m]);
+        }
+        fprintf(out, "swap %s %s\n", temp, entry->set_name);
+        fprintf(out, "destroy %s\n", temp);
+    }
+}
+
+/**
+ * Partition a compiled ruleset when partition_threshold asks for it
+ * Returns 1 with pr filled when the verified tree should be used, else 0
+ */
+static int prepare_partition(const CompiledRuleset *rs, PartitionedRuleset *pr) {
+    if (firewall_config.partition_threshold <= 0 || partition_ruleset(rs, pr) != 0) {
+        return 0;
+    }
+    if (verify_partition(rs, pr) != 0) {
+        fprintf(stderr, "Warning: Partitioned chains failed verification, using one flat chain\n");
+        free_partitioned_ruleset(pr);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Write the whole ruleset as ipset and iptables-restore payloads
+ */
+int render_iptables_payload(FILE *out) {
+    CompiledRuleset rs;
+    PartitionedRuleset pr;
+    char spec[MAX_RULE_LENGTH];
+
+    if (compile_ruleset(&rs) != 0) {
+        return -1;
+    }
+    int partitioned = prepare_partition(&rs, &pr);
+
+    write_full_sets(&rs, out);
+
+    fprintf(out, "*filter\n");
+    if (partitioned) {
+        for (int c = 1; c < pr.chain_count; c++) {
+            fprintf(out, ":%s - [0:0]\n", pr.chains[c].name);
+        }
+    }
+    fprintf(out, "-F INPUT\n");
+    if (partitioned) {
+        for (int c = 0; c < pr.chain_count; c++) {
+            for (int i = 0; i < pr.chains[c].entry_count; i++) {
+                build_entry_spec(&pr.chains[c].entries[i], spec, sizeof(spec));
+                fprintf(out, "-A %s%s\n", pr.chains[c].name, spec);
+            }
+        }
+        free_partitioned_ruleset(&pr);
+    } else {
+        for (int i = 0; i < rs.entry_count; i++) {
+            build_entry_spec(&rs.entries[i], spec, sizeof(spec));
+            fprintf(out, "-A INPUT%s\n", spec);
+        }
+    }
+    fprintf(out, "COMMIT\n");
+
+    free_compiled_ruleset(&rs);
+    return 0;
+}
+
+/**
+ * Empty and delete, inside the open batch, every partition sub-chain
+ * in the kernel that keep does not use (all of them when keep is NULL)
+ */
+int drop_partition_chains(const PartitionedRuleset *keep) {
+    char (*names)[PARTITION_CHAIN_LENGTH] = malloc(sizeof(*names) * MAX_PARTITION_CHAINS);
+    if (!names) {
+        return -1;
+    }
+
+    int count = list_managed_chains(names, MAX_PARTITION_CHAINS);
+    int stale = 0;
+    for (int i = 0; i < count; i++) {
+        if (!keep || find_partition_chain(keep, names[i]) < 0) {
+            strcpy(names[stale++], names[i]);
+        }
+    }
+
+    // Stale chains may jump to each other, so empty them all first
+    for (int i = 0; i < stale; i++) {
+        reset_chain(names[i]);
+    }
+    for (int i = 0; i < stale; i++) {
+        delete_chain(names[i]);
+    }
+
+    free(names);
+    return count < 0 ? -1 : 0;
+}
+
+/**
+ * Rebuild every set a compiled ruleset references, each swapped in
+ * atomically
+ */
+int refresh_ipsets(const CompiledRuleset *rs) {
+    write_full_sets(rs, NULL);
+    return ipset_commit();
+}
+
+/*
+ * ipsets the last applied ruleset created, so that stale ones can be
+ * destroyed without listing the kernel's sets on every apply. Until this
+ * process applies a ruleset they are read from the payload of the loaded
+ * snapshot; applied_set_count is -1 while they are unknown, and leftovers
+ * of an unknown earlier ruleset wait for purge_stale_sets() (sync, flush).
+ */
+static char (*applied_sets)[IPSET_NAME_LENGTH];
+static int applied_set_count = -1;
+
+/**
+ * Record the sets of the ruleset just applied (none when rs is NULL)
+ */
+static void remember_applied_sets(const CompiledRuleset *rs) {
+    free(applied_sets);
+    applied_sets = NULL;
+    applied_set_count = 0;
+    if (!rs) {
+        return;
+    }
+
+    applied_sets = malloc(sizeof(*applied_sets) * (rs->entry_count + 1));
+    if (!applied_sets) {
+        applied_set_count = -1;
+        return;
+    }
+    for (int i = 0; i < rs->entry_count; i++) {
+        if (rs->entries[i].set_name[0]) {
+            strcpy(applied_sets[applied_set_count++], rs->entries[i].set_name);
+        }
+    }
+}
+
+/**
+ * Collect the names of the sets an iptables payload creates into the
+ * entries of sets, which must have room for MAX_PARTITION_CHAINS
+ */
+static void collect_payload_sets(const char *data, const char *end, CompiledRuleset *sets) {
+    for (const char *line = data; line < end && strncmp(line, "*filter\n", 8) != 0; ) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        char name[IPSET_NAME_LENGTH];
+        size_t len;
+
+        // Temporary "-t" sets are destroyed by the payload itself
+        if (sscanf(line, "create %31s ", name) == 1 && (len = strlen(name)) > 2 &&
+            strcmp(name + len - 2, "-t") != 0 && !find_compiled_set(sets, name) &&
+            sets->entry_count < MAX_PARTITION_CHAINS) {
+            strcpy(sets->entries[sets->entry_count++].set_name, name);
+        }
+        line = newline ? newline + 1 : end;
+    }
+}
+
+/**
+ * Learn the sets of the ruleset the loaded snapshot was saved with,
+ * unless this process already applied one
+ */
+static void load_applied_sets(void) {
+    size_t size;
+    const char *data;
+
+    if (applied_set_count >= 0 || !(data = snapshot_saved_payload(&size))) {
+        return;
+    }
+
+    CompiledRuleset sets = { 0 };
+    sets.entries = calloc(MAX_PARTITION_CHAINS, sizeof(CompiledEntry));
+    if (!sets.entries) {
+        return;
+    }
+    collect_payload_sets(data, data + size, &sets);
+    remember_applied_sets(&sets);
+    free(sets.entries);
+}
+
+/**
+ * Destroy the ipsets the last applied ruleset created that rs, the
+ * ruleset just applied, no longer references
+ */
+int destroy_stale_sets(const CompiledRuleset *rs) {
+    load_applied_sets();
+    for (int i = 0; i < applied_set_count; i++) {
+        if (!find_compiled_set(rs, applied_sets[i])) {
+            ipset_write("destroy %s%s\n", applied_sets[i], "");
+        }
+    }
+    remember_applied_sets(rs);
+
+    return ipset_commit();
+}
+
+/**
+ * Destroy every ipset in the kernel created by an earlier ruleset that
+ * rs no longer references (all of them when rs is NULL)
+ * Lists the kernel's sets, so only sync and flush use it
+ */
+int purge_stale_sets(const CompiledRuleset *rs) {
+    char name[256];
+
+    FILE *list = popen("ipset list -n 2>/dev/null", "r");
+    if (!list) {
+        return -1;
+    }
+
+    while (fgets(name, sizeof(name), list)) {
+        name[strcspn(name, "\n")] = '\0';
+        if (strncmp(name, "pfw-", 4) == 0 && (!rs || !find_compiled_set(rs, name))) {
+            ipset_write("destroy %s%s\n", name, "");
+        }
+    }
+    pclose(list);
+    remember_applied_sets(rs);
+
+    return ipset_commit();
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * Drop repeated entries from a sorted list
+ * Returns the new length
+ */
+static int unique_strings(const char **list, int count) {
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (kept == 0 || strcmp(list[kept - 1], list[i]) != 0) {
+            list[kept++] = list[i];
+        }
+    }
+    return kept;
+}
+
+/**
+ * Compare member lists of a set and queue the additions and removals
+ */
+static void diff_set_members(const CompiledRuleset *before, const CompiledEntry *old_set,
+                             const CompiledRuleset *after, const CompiledEntry *new_set) {
+    int old_count = old_set ? old_set->member_count : 0;
+    int new_count = new_set ? new_set->member_count : 0;
+    const char **old_members = malloc(sizeof(char *) * (old_count + 1));
+    const char **new_members = malloc(sizeof(char *) * (new_count + 1));
+
+    if (!old_members || !new_members) {
+        free(old_members);
+        free(new_members);
+        return;
+    }
+
+    for (int i = 0; i < old_count; i++) {
+        old_members[i] = before->members[old_set->first_member + i];
+    }
+    for (int i = 0; i < new_count; i++) {
+        new_members[i] = after->members[new_set->first_member + i];
+    }
+    qsort(old_members, old_count, sizeof(char *), compare_strings);
+    qsort(new_members, new_count, sizeof(char *), compare_strings);
+
+    // Several rules can put the same address in a set, which holds it
+    // once: it may only be deleted when no rule is left that wants it
+    old_count = unique_strings(old_members, old_count);
+    new_count = unique_strings(new_members, new_count);
+
+    // Merge the sorted lists
+    const char *name = new_set ? new_set->set_name : old_set->set_name;
+    int i = 0, j = 0;
+    while (i < old_count || j < new_count) {
+        int cmp = i == old_count ? 1 : j == new_count ? -1 : strcmp(old_members[i], new_members[j]);
+        if (cmp < 0) {
+            ipset_write("del %s %s -exist\n", name, old_members[i++]);
+        } else if (cmp > 0) {
+            ipset_write("add %s %s -exist\n", name, new_members[j++]);
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    free(old_members);
+    free(new_members);
+}
+
+/**
+ * Commit the difference between the ruleset compiled before a change
+ * and the current one: set member updates go to ipset, and only the
+ * chain entries that actually differ are deleted and inserted, in one
+ * iptables transaction. When that transaction fails the set updates are
+ * reverted. Frees the "before" ruleset.
+ */
+int commit_ruleset_change(CompiledRuleset *before) {
+    CompiledRuleset after;
+    int ret = 0;
+
+    // A change can reshape the whole dispatch tree, so rebuild it
+    if (firewall_config.partition_threshold > 0) {
+        free_compiled_ruleset(before);
+        return apply_all_rules();
+    }
+
+    if (compile_ruleset(&after) != 0) {
+        free_compiled_ruleset(before);
+        return -1;
+    }
+
+    // New sets and member changes must be in place before the chain uses them
+    for (int i = 0; i < after.entry_count; i++) {
+        const CompiledEntry *entry = &after.entries[i];
+        if (entry->set_name[0]) {
+            const CompiledEntry *old_set = find_compiled_set(before, entry->set_name);
+            if (!old_set) {
+                ipset_write(IPSET_CREATE, entry->set_name, "");
+            }
+            diff_set_members(before, old_set, &after, entry);
+        }
+    }
+    if (ipset_commit() != 0) {
+        ret = -1;
+        goto out;
+    }
+
+    // Chain entries: keep the common prefix and suffix, replace the middle
+    char **old_specs = malloc(sizeof(char *) * (before->entry_count + 1));
+    char **new_specs = malloc(sizeof(char *) * (after.entry_count + 1));
+    if (!old_specs || !new_specs) {
+        free(old_specs);
+        free(new_specs);
+        ret = -1;
+        goto restore_sets;
+    }
+    for (int i = 0; i < before->entry_count; i++) {
+        old_specs[i] = malloc(MAX_RULE_LENGTH);
+        build_entry_spec(&before->entries[i], old_specs[i], MAX_RULE_LENGTH);
+    }
+    for (int i = 0; i < after.entry_count; i++) {
+        new_specs[i] = malloc(MAX_RULE_LENGTH);
+        build_entry_spec(&after.entries[i], new_specs[i], MAX_RULE_LENGTH);
+    }
+
+    int prefix = 0;
+    while (prefix < before->entry_count && prefix < after.entry_count &&
+           strcmp(old_specs[prefix], new_specs[prefix]) == 0) {
+        prefix++;
+    }
+    int suffix = 0;
+    while (suffix < before->entry_count - prefix && suffix < after.entry_count - prefix &&
+           strcmp(old_specs[before->entry_count - 1 - suffix], new_specs[after.entry_count - 1 - suffix]) == 0) {
+        suffix++;
+    }
+
+    if (prefix + suffix < before->entry_count || prefix + suffix < after.entry_count) {
+        ret = begin_iptables_batch(0);
+        if (ret == 0) {
+            for (int i = prefix; i < before->entry_count - suffix; i++) {
+                delete_entry_from_iptables(&before->entries[i]);
+            }
+            for (int i = prefix; i < after.entry_count - suffix; i++) {
+                if (suffix == 0) {
+                    append_entry_to_iptables(&after.entries[i]);
+                } else {
+                    insert_entry_to_iptables(&after.entries[i], i + 1);
+                }
+            }
+            ret = commit_iptables_batch();
+        }
+    }
+
+    for (int i = 0; i < before->entry_count; i++) {
+        free(old_specs[i]);
+    }
+    for (int i = 0; i < after.entry_count; i++) {
+        free(new_specs[i]);
+    }
+    free(old_specs);
+    free(new_specs);
+
+restore_sets:
+    // The chain was left as it was, so give its sets back their members
+    if (ret != 0) {
+        for (int i = 0; i < after.entry_count; i++) {
+            const CompiledEntry *entry = &after.entries[i];
+            if (entry->set_name[0]) {
+                const CompiledEntry *old_set = find_compiled_set(before, entry->set_name);
+                if (!old_set) {
+                    ipset_write("destroy %s%s\n", entry->set_name, "");
+                } else {
+                    diff_set_members(&after, entry, before, old_set);
+                }
+            }
+        }
+        ipset_commit();
+        goto out;
+    }
+
+    // Sets the chain no longer references can go now
+    for (int i = 0; i < before->entry_count; i++) {
+        const CompiledEntry *entry = &before->entries[i];
+        if (entry->set_name[0] && !find_compiled_set(&after, entry->set_name)) {
+            ipset_write("destroy %s%s\n", entry->set_name, "");
+        }
+    }
+    ret = ipset_commit();
+    if (ret == 0) {
+        remember_applied_sets(&after);
+    }
 
-    return execute_iptables_cmd(cmd);
+out:
+    free_compiled_ruleset(before);
+    free_compiled_ruleset(&after);
+    return ret;
+}
+
+/**
+ * Apply a rule to iptables
+ */
+int apply_rule_to_iptables(const FirewallRule *rule) {
+    if (!rule) {
+        return -1;
+    }
+
+    CompiledEntry entry;
+    make_plain_entry(rule, &entry);
+    return append_entry_to_iptables(&entry);
 }
 
 /**
@@ -109,58 +737,271 @@ int remove_rule_from_iptables(const FirewallRule *rule) {
         return -1;
     }
 
-    char cmd[MAX_RULE_LENGTH] = "";
-    char temp[256];
+    CompiledEntry entry;
+    make_plain_entry(rule, &entry);
+    return delete_entry_from_iptables(&entry);
+}
 
-    // Build iptables delete command
-    strcat(cmd, "-D INPUT");
+#ifndef USE_LIBIPTC
 
-    // Add source IP
-    if (rule->source[0]) {
-        snprintf(temp, sizeof(temp), " -s %s", rule->source);
-        strcat(cmd, temp);
+/*
+ * Open iptables-restore batch. While a batch is open, rule changes are
+ * written to the restore payload and only hit the kernel on commit,
+ * as one atomic table replacement.
+ */
+static FILE *batch_fp = NULL;
+static pid_t batch_pid = -1;
+static int batch_ops = 0;
+
+/**
+ * Start an iptables-restore batch
+ * With flush set, the INPUT chain is emptied inside the same transaction
+ */
+int begin_iptables_batch(int flush) {
+    if (batch_fp) {
+        fprintf(stderr, "Error: iptables batch already open\n");
+        return -1;
     }
 
-    // Add destination IP
-    if (rule->dest[0]) {
-        snprintf(temp, sizeof(temp), " -d %s", rule->dest);
-        strcat(cmd, temp);
+    // --noflush keeps the chains this tool does not manage
+    char *args[] = {"iptables-restore", "--noflush", NULL};
+    pid_t pid;
+
+    batch_fp = open_command_pipe(args, &pid);
+    if (!batch_fp) {
+        return -1;
     }
 
-    // Add protocol
-    if (rule->protocol[0]) {
-        snprintf(temp, sizeof(temp), " -p %s", rule->protocol);
-        strcat(cmd, temp);
+    batch_pid = pid;
+    batch_ops = 0;
+
+    fprintf(batch_fp, "*filter\n");
+    if (flush) {
+        fprintf(batch_fp, "-F INPUT\n");
+    }
+    return 0;
+}
+
+/**
+ * Write a raw command line into the open batch
+ */
+static int batch_write(const char *cmd) {
+    if (!batch_fp) {
+        return -1;
+    }
+    fprintf(batch_fp, "%s\n", cmd);
+    batch_ops++;
+    return 0;
+}
+
+/**
+ * Commit the open batch in a single iptables-restore transaction
+ */
+int commit_iptables_batch(void) {
+    if (!batch_fp) {
+        return -1;
+    }
+
+    printf("Executing: iptables-restore --noflush (%d operations)\n", batch_ops);
+
+    fprintf(batch_fp, "COMMIT\n");
+    int ret = close_command_pipe(batch_fp, batch_pid);
+    batch_fp = NULL;
+    batch_pid = -1;
+    return ret;
+}
+
+/**
+ * Run a single command through iptables-restore --noflush
+ * (joins the open batch if there is one)
+ */
+static int execute_restore_cmd(const char *cmd) {
+    if (batch_fp) {
+        return batch_write(cmd);
+    }
+
+    if (begin_iptables_batch(0) != 0) {
+        return -1;
+    }
+    batch_write(cmd);
+    return commit_iptables_batch();
+}
+
+/**
+ * Run one entry command ("-A INPUT", "-I INPUT 3", ...) through the batch
+ */
+static int run_entry_cmd(const char *prefix, const CompiledEntry *entry) {
+    char spec[MAX_RULE_LENGTH];
+    char cmd[MAX_RULE_LENGTH + 32];
+
+    build_entry_spec(entry, spec, sizeof(spec));
+    snprintf(cmd, sizeof(cmd), "%s%s", prefix, spec);
+
+    return execute_restore_cmd(cmd);
+}
+
+/**
+ * Append an entry to the INPUT chain
+ */
+int append_entry_to_iptables(const CompiledEntry *entry) {
+    return run_entry_cmd("-A INPUT", entry);
+}
+
+/**
+ * Append an entry to a named chain
+ */
+int append_entry_to_chain(const char *chain, const CompiledEntry *entry) {
+    char prefix[PARTITION_CHAIN_LENGTH + 8];
+
+    snprintf(prefix, sizeof(prefix), "-A %s", chain);
+    return run_entry_cmd(prefix, entry);
+}
+
+/**
+ * Insert an entry at a 1-based INPUT chain position
+ */
+int insert_entry_to_iptables(const CompiledEntry *entry, int position) {
+    char prefix[32];
+
+    snprintf(prefix, sizeof(prefix), "-I INPUT %d", position);
+    return run_entry_cmd(prefix, entry);
+}
+
+/**
+ * Delete an entry from the INPUT chain by its specification
+ */
+int delete_entry_from_iptables(const CompiledEntry *entry) {
+    return run_entry_cmd("-D INPUT", entry);
+}
+
+/**
+ * Create a user chain, or empty it if it already exists
+ */
+int reset_chain(const char *chain) {
+    char cmd[PARTITION_CHAIN_LENGTH + 16];
+
+    // A chain line in a --noflush restore creates or flushes the chain
+    snprintf(cmd, sizeof(cmd), ":%s - [0:0]", chain);
+    return execute_restore_cmd(cmd);
+}
+
+/**
+ * Delete an empty, unreferenced user chain
+ */
+int delete_chain(const char *chain) {
+    char cmd[PARTITION_CHAIN_LENGTH + 8];
+
+    snprintf(cmd, sizeof(cmd), "-X %s", chain);
+    return execute_restore_cmd(cmd);
+}
+
+/**
+ * List the partition sub-chains currently in the filter table
+ * Returns the number of names stored, or -1 on error
+ */
+int list_managed_chains(char (*names)[PARTITION_CHAIN_LENGTH], int max) {
+    char line[256];
+    const char *prefix = "-N " PARTITION_PREFIX "-";
+
+    FILE *list = popen("iptables -S 2>/dev/null", "r");
+    if (!list) {
+        return -1;
     }
 
-    // Add port
-    if (rule->port[0]) {
-        if (strcmp(rule->protocol, "TCP") == 0 || strcmp(rule->protocol, "UDP") == 0) {
-            snprintf(temp, sizeof(temp), " --dport %s", rule->port);
-            strcat(cmd, temp);
+    int count = 0;
+    while (fgets(line, sizeof(line), list) && count < max) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            line[3 + PARTITION_CHAIN_LENGTH - 1] = '\0';
+            strcpy(names[count++], line + 3);
         }
     }
+    pclose(list);
+    return count;
+}
 
-    // Add interface
-    if (rule->interface[0]) {
-        snprintf(temp, sizeof(temp), " -i %s", rule->interface);
-        strcat(cmd, temp);
+/**
+ * Pass the comment and the packet and byte counters of every commented
+ * entry in the filter table to visit, from one listing of the table
+ */
+int read_entry_counters(void (*visit)(const char *comment, unsigned long long packets,
+                                      unsigned long long bytes, void *arg), void *arg) {
+    char line[MAX_RULE_LENGTH];
+
+    // -x prints exact counters instead of 1K/1M abbreviations
+    FILE *list = popen("iptables -L -n -v -x 2>/dev/null", "r");
+    if (!list) {
+        return -1;
     }
 
-    // Add comment
-    if (rule->comment[0]) {
-        snprintf(temp, sizeof(temp), " -m comment --comment \"%s\"", rule->comment);
-        strcat(cmd, temp);
-    } else {
-        snprintf(temp, sizeof(temp), " -m comment --comment \"Rule-ID-%d\"", rule->id);
-        strcat(cmd, temp);
+    while (fgets(line, sizeof(line), list)) {
+        unsigned long long entry_packets, entry_bytes;
+        char *start = strstr(line, "/* ");
+        char *end = start ? strstr(start + 3, " */") : NULL;
+
+        if (!end || sscanf(line, " %llu %llu", &entry_packets, &entry_bytes) != 2) {
+            continue;
+        }
+        *end = '\0';
+        visit(start + 3, entry_packets, entry_bytes, arg);
     }
 
-    // Add action
-    snprintf(temp, sizeof(temp), " -j %s", rule->action);
-    strcat(cmd, temp);
+    return pclose(list) == 0 ? 0 : -1;
+}
 
-    return execute_iptables_cmd(cmd);
+/**
+ * Delete the entry at a 1-based INPUT chain position
+ */
+int delete_entry_at(int position) {
+    char cmd[32];
+
+    snprintf(cmd, sizeof(cmd), "-D INPUT %d", position);
+    return execute_restore_cmd(cmd);
+}
+
+/**
+ * Read the live INPUT chain as "-A INPUT ..." specifications
+ * Returns the number of entries (*specs is malloc'd), or -1 on error
+ */
+int read_input_specs(char (**specs)[MAX_RULE_LENGTH]) {
+    char line[MAX_RULE_LENGTH];
+    int count = 0, capacity = 64;
+
+    *specs = malloc(sizeof(**specs) * capacity);
+    FILE *list = *specs ? popen("iptables -S INPUT 2>/dev/null", "r") : NULL;
+    if (!list) {
+        free(*specs);
+        *specs = NULL;
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "-A INPUT ", 9) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            char (*grown)[MAX_RULE_LENGTH] = realloc(*specs, sizeof(**specs) * capacity * 2);
+            // A partial listing would make sync add or delete entries wrongly
+            if (!grown) {
+                fprintf(stderr, "Error: Out of memory\n");
+                pclose(list);
+                free(*specs);
+                *specs = NULL;
+                return -1;
+            }
+            *specs = grown;
+            capacity *= 2;
+        }
+        strcpy((*specs)[count++], line);
+    }
+
+    if (pclose(list) != 0) {
+        free(*specs);
+        *specs = NULL;
+        return -1;
+    }
+    return count;
 }
 
 /**
@@ -169,19 +1010,199 @@ int remove_rule_from_iptables(const FirewallRule *rule) {
 int flush_rules(void) {
     printf("Flushing iptables rules...\n");
     
-    // Flush INPUT chain
-    int ret = execute_iptables_cmd("-F INPUT");
+    // Flush INPUT chain and reset default policy in one transaction
+    int ret = begin_iptables_batch(0);
+    if (ret == 0) {
+        batch_write(":INPUT ACCEPT [0:0]");
+        batch_write("-F INPUT");
+        drop_partition_chains(NULL);
+        ret = commit_iptables_batch();
+    }
     if (ret != 0) {
         fprintf(stderr, "Warning: Failed to flush INPUT chain\n");
     }
 
-    // Reset default policy
-    execute_iptables_cmd("-P INPUT ACCEPT");
-    
     printf("Rules flushed successfully\n");
     return 0;
 }
 
+/**
+ * Check that iptables can read the filter table
+ */
+int probe_iptables(void) {
+    return execute_iptables_cmd("-L -n");
+}
+
+/**
+ * Print the INPUT chain with counters
+ */
+int print_input_chain(void) {
+    return execute_iptables_cmd("-L INPUT -n -v --line-numbers");
+}
+
+/**
+ * Apply the payload stored in a loaded snapshot instead of compiling the
+ * rules again: the transactions of apply_all_rules(), fed from
+ * render_iptables_payload() output
+ */
+static int apply_snapshot_payload(const char *data, size_t size) {
+    const char *end = data + size;
+    const char *filter = data;
+
+    // The ipset lines come before "*filter"
+    while (filter < end && strncmp(filter, "*filter\n", 8) != 0) {
+        const char *newline = memchr(filter, '\n', (size_t)(end - filter));
+        filter = newline ? newline + 1 : end;
+    }
+
+    // Sets and chains the payload uses, so stale ones can be dropped
+    CompiledRuleset sets = { 0 };
+    PartitionedRuleset keep = { 0 };
+    sets.entries = calloc(MAX_PARTITION_CHAINS, sizeof(CompiledEntry));
+    keep.chains = calloc(MAX_PARTITION_CHAINS, sizeof(PartitionChain));
+    if (!sets.entries || !keep.chains) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(sets.entries);
+        free(keep.chains);
+        return -1;
+    }
+
+    collect_payload_sets(data, filter, &sets);
+
+    int ret = 0;
+    if (filter > data) {
+        FILE *fp = ipset_stream();
+        if (!fp || fwrite(data, 1, (size_t)(filter - data), fp) != (size_t)(filter - data)) {
+            ret = -1;
+        }
+        if (ipset_commit() != 0) {
+            ret = -1;
+        }
+    }
+    if (ret != 0 || begin_iptables_batch(1) != 0) {
+        free(sets.entries);
+        free(keep.chains);
+        return -1;
+    }
+
+    // The batch opens with "*filter" and "-F INPUT" and closes with "COMMIT"
+    for (const char *line = filter; line < end; ) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        int len = (int)((newline ? newline : end) - line);
+
+        if (line[0] == ':' && keep.chain_count < MAX_PARTITION_CHAINS) {
+            snprintf(keep.chains[keep.chain_count++].name, PARTITION_CHAIN_LENGTH, "%.*s",
+                     (int)strcspn(line + 1, " \n"), line + 1);
+            fprintf(batch_fp, "%.*s\n", len, line);
+            batch_ops++;
+        } else if (strncmp(line, "-F INPUT\n", 9) == 0) {
+            // Every sub-chain is declared by now
+            if (keep.chain_count) {
+                printf("Partitioned INPUT into %d sub-chains\n", keep.chain_count);
+            }
+            drop_partition_chains(keep.chain_count ? &keep : NULL);
+        } else if (strncmp(line, "-A ", 3) == 0) {
+            fprintf(batch_fp, "%.*s\n", len, line);
+            batch_ops++;
+        }
+        line = newline ? newline + 1 : end;
+    }
+    free(keep.chains);
+
+    ret = commit_iptables_batch();
+    if (ret != 0) {
+        fprintf(stderr, "Error: iptables-restore failed, %s\n",
+                filter > data ? "chains unchanged but ipsets already rebuilt" : "ruleset unchanged");
+        free(sets.entries);
+        return ret;
+    }
+
+    destroy_stale_sets(&sets);
+    free(sets.entries);
+
+    printf("Ruleset applied successfully\n");
+    return 0;
+}
+
+#endif // USE_LIBIPTC
+
+/**
+ * Apply the whole in-memory ruleset in one atomic transaction
+ * The INPUT chain is flushed and repopulated in the same commit,
+ * so it is never seen half-populated. The ipsets are rebuilt in their
+ * own transaction just before it and stay rebuilt if it fails: their
+ * old members are gone by then, so the next apply puts them right
+ */
+int apply_all_rules(void) {
+    // The XDP early drop maps follow the same rules (nothing when it is off)
+    xdp_sync();
+
+    if (firewall_config.backend == BACKEND_NFTABLES) {
+        return nft_apply_ruleset();
+    }
+
+    printf("Applying %d rules...\n", rule_count);
+
+#ifndef USE_LIBIPTC
+    // A snapshot loaded for these rules already holds the payload
+    size_t cached;
+    const char *payload = snapshot_payload(&cached);
+    if (payload) {
+        return apply_snapshot_payload(payload, cached);
+    }
+#endif
+
+    CompiledRuleset rs;
+    PartitionedRuleset pr;
+    if (compile_ruleset(&rs) != 0) {
+        return -1;
+    }
+    int partitioned = prepare_partition(&rs, &pr);
+
+    // Sets first, so the new chain can reference them
+    write_full_sets(&rs, NULL);
+    if (ipset_commit() != 0 || begin_iptables_batch(1) != 0) {
+        if (partitioned) {
+            free_partitioned_ruleset(&pr);
+        }
+        free_compiled_ruleset(&rs);
+        return -1;
+    }
+
+    if (partitioned) {
+        printf("Partitioned INPUT into %d sub-chains\n", pr.chain_count - 1);
+        for (int c = 1; c < pr.chain_count; c++) {
+            reset_chain(pr.chains[c].name);
+        }
+        drop_partition_chains(&pr);
+        for (int c = 0; c < pr.chain_count; c++) {
+            for (int i = 0; i < pr.chains[c].entry_count; i++) {
+                append_entry_to_chain(pr.chains[c].name, &pr.chains[c].entries[i]);
+            }
+        }
+        free_partitioned_ruleset(&pr);
+    } else {
+        drop_partition_chains(NULL);
+        for (int i = 0; i < rs.entry_count; i++) {
+            append_entry_to_iptables(&rs.entries[i]);
+        }
+    }
+
+    int ret = commit_iptables_batch();
+    if (ret != 0) {
+        fprintf(stderr, "Error: iptables-restore failed, %s\n",
+                rs.member_count ? "chains unchanged but ipsets already rebuilt" : "ruleset unchanged");
+        free_compiled_ruleset(&rs);
+        return ret;
+    }
+
+    destroy_stale_sets(&rs);
+    free_compiled_ruleset(&rs);
+
+    printf("Ruleset applied successfully\n");
+    return 0;
+}
+
 /**
  * Get firewall status
  */
@@ -190,8 +1211,18 @@ int get_firewall_status(void) {
     printf("║                    FIREWALL STATUS                               ║\n");
     printf("╠══════════════════════════════════════════════════════════════════╣\n");
 
+    printf("║  Fast path:  %-52s║\n", firewall_config.fast_path ? "ENABLED" : "DISABLED");
+    printf("║  XDP:        %-52s║\n", firewall_config.xdp == XDP_MODE_NATIVE ? "NATIVE" :
+                                      firewall_config.xdp == XDP_MODE_GENERIC ? "GENERIC" : "OFF");
+
+    if (firewall_config.backend == BACKEND_NFTABLES) {
+        printf("║  Backend:    nftables                                            ║\n");
+        printf("╚══════════════════════════════════════════════════════════════════╝\n");
+        return nft_print_ruleset();
+    }
+
     // Check if iptables is available
-    int ret = execute_iptables_cmd("-L -n");
+    int ret = probe_iptables();
     if (ret == 0) {
         printf("║  Status:     RUNNING                                             ║\n");
     } else {
@@ -203,7 +1234,7 @@ int get_firewall_status(void) {
     printf("║  INPUT Chain Rules:                                              ║\n");
     printf("╚══════════════════════════════════════════════════════════════════╝\n");
     
-    execute_iptables_cmd("-L INPUT -n -v --line-numbers");
+    print_input_chain();
 
     return ret;
 }
@@ -0,0 +1,769 @@
+#include "firewall.h"
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <libiptc/libiptc.h>
+#include <linux/netfilter/xt_tcpudp.h>
+#include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_multiport.h>
+#include <linux/netfilter/xt_conntrack.h>
+#include <linux/netfilter_ipv4/ipt_REJECT.h>
+#include <linux/netfilter/xt_set.h>
+
+/*
+ * In-process iptables backend built on libiptc (make BACKEND=libiptc).
+ * The filter table is fetched once per batch, every change is made on
+ * the in-memory copy and the whole table is committed once, so no
+ * child process is ever spawned.
+ */
+
+static struct xtc_handle *batch_handle = NULL;
+static int batch_ops = 0;
+
+/**
+ * Fill an address/mask pair from a rule prefix
+ */
+static void set_ipv4_net(uint32_t net, int len, struct in_addr *addr, struct in_addr *mask) {
+    addr->s_addr = htonl(net);
+    mask->s_addr = htonl(len ? 0xFFFFFFFFu << (32 - len) : 0);
+}
+
+/**
+ * Fill a kernel port range from a rule
+ */
+static void set_port_range(const FirewallRule *rule, __u16 range[2]) {
+    range[0] = rule->port_first;
+    range[1] = rule->port_last;
+}
+
+/**
+ * Fill a multiport match from a comma-separated port list
+ */
+static void set_multiport(const char *list, struct xt_multiport_v1 *mp) {
+    char ports[MULTIPORT_LENGTH];
+    char *saveptr;
+
+    mp->flags = XT_MULTIPORT_DESTINATION;
+    strncpy(ports, list, sizeof(ports) - 1);
+    ports[sizeof(ports) - 1] = '\0';
+
+    for (char *port = strtok_r(ports, ",", &saveptr); port && mp->count < XT_MULTI_PORTS;
+         port = strtok_r(NULL, ",", &saveptr)) {
+        int first, last;
+        parse_port_range(port, &first, &last);
+        mp->ports[mp->count] = (__u16)first;
+        if (first != last && mp->count + 1 < XT_MULTI_PORTS) {
+            // A range is a flagged start slot followed by its end
+            mp->pflags[mp->count++] = 1;
+            mp->ports[mp->count] = (__u16)last;
+        }
+        mp->count++;
+    }
+}
+
+/**
+ * Look up the kernel index of an ipset by name
+ */
+static int get_set_index(const char *name, ip_set_id_t *index) {
+    struct ip_set_req_get_set req;
+    socklen_t size = sizeof(req);
+
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (sock < 0) {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op = IP_SET_OP_GET_BYNAME;
+    req.version = IPSET_PROTOCOL;
+    strncpy(req.set.name, name, IPSET_MAXNAMELEN - 1);
+
+    int ret = getsockopt(sock, SOL_IP, SO_IP_SET, &req, &size);
+    close(sock);
+
+    if (ret != 0 || req.set.index == IPSET_INVALID_ID) {
+        return -1;
+    }
+    *index = req.set.index;
+    return 0;
+}
+
+/**
+ * Look up the name of an ipset by its kernel index
+ */
+static int get_set_name(ip_set_id_t index, char *name, size_t size) {
+    struct ip_set_req_get_set req;
+    socklen_t len = sizeof(req);
+
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (sock < 0) {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op = IP_SET_OP_GET_BYINDEX;
+    req.version = IPSET_PROTOCOL;
+    req.set.index = index;
+
+    int ret = getsockopt(sock, SOL_IP, SO_IP_SET, &req, &len);
+    close(sock);
+
+    if (ret != 0 || !req.set.name[0]) {
+        return -1;
+    }
+    snprintf(name, size, "%.*s", IPSET_MAXNAMELEN - 1, req.set.name);
+    return 0;
+}
+
+/**
+ * Build a kernel ipt_entry for a compiled chain entry
+ * Returns a malloc'd entry, or NULL on error
+ */
+static struct ipt_entry *build_entry(const CompiledEntry *entry) {
+    const FirewallRule *rule = &entry->rule;
+    int is_tcp = rule->protocol == PROTO_TCP;
+    int is_udp = rule->protocol == PROTO_UDP;
+    int has_port = rule->port_first && (is_tcp || is_udp);
+    int is_reject = rule->action == ACTION_REJECT;
+
+    size_t port_size = 0;
+    if (has_port) {
+        port_size = XT_ALIGN(sizeof(struct xt_entry_match)) +
+                    (is_tcp ? XT_ALIGN(sizeof(struct xt_tcp)) : XT_ALIGN(sizeof(struct xt_udp)));
+    }
+    size_t multiport_size = 0;
+    if (entry->multiport[0]) {
+        multiport_size = XT_ALIGN(sizeof(struct xt_entry_match)) +
+                         XT_ALIGN(sizeof(struct xt_multiport_v1));
+    }
+    size_t ctstate_size = 0;
+    if (entry->ctstate[0]) {
+        ctstate_size = XT_ALIGN(sizeof(struct xt_entry_match)) +
+                       XT_ALIGN(sizeof(struct xt_conntrack_mtinfo1));
+    }
+    size_t set_size = 0;
+    ip_set_id_t set_index = 0;
+    if (entry->set_name[0]) {
+        if (get_set_index(entry->set_name, &set_index) != 0) {
+            fprintf(stderr, "Error: Unknown ipset %s\n", entry->set_name);
+            return NULL;
+        }
+        set_size = XT_ALIGN(sizeof(struct xt_entry_match)) +
+                   XT_ALIGN(sizeof(struct xt_set_info_match_v1));
+    }
+    // Dispatch entries of a partitioned chain carry no comment
+    size_t comment_size = entry->jump[0] ? 0 : XT_ALIGN(sizeof(struct xt_entry_match)) +
+                                                XT_ALIGN(sizeof(struct xt_comment_info));
+    size_t target_size = is_reject
+        ? XT_ALIGN(sizeof(struct xt_entry_target)) + XT_ALIGN(sizeof(struct ipt_reject_info))
+        : XT_ALIGN(sizeof(struct xt_standard_target));
+    size_t entry_size = XT_ALIGN(sizeof(struct ipt_entry));
+    size_t total = entry_size + port_size + multiport_size + ctstate_size + set_size + comment_size + target_size;
+
+    struct ipt_entry *e = calloc(1, total);
+    if (!e) {
+        return NULL;
+    }
+
+    // Addresses
+    if (rule->source_len >= 0) {
+        set_ipv4_net(rule->source, rule->source_len, &e->ip.src, &e->ip.smsk);
+    }
+    if (rule->dest_len >= 0) {
+        set_ipv4_net(rule->dest, rule->dest_len, &e->ip.dst, &e->ip.dmsk);
+    }
+
+    // Protocol
+    if (is_tcp) {
+        e->ip.proto = IPPROTO_TCP;
+    } else if (is_udp) {
+        e->ip.proto = IPPROTO_UDP;
+    } else if (rule->protocol == PROTO_ICMP) {
+        e->ip.proto = IPPROTO_ICMP;
+    }
+
+    // Interface: the mask covers the NUL too unless the name ends in '+',
+    // in which case only the prefix before it must match
+    if (rule->interface) {
+        strncpy(e->ip.iniface, pool_string(rule->interface), IFNAMSIZ - 1);
+        size_t len = strlen(e->ip.iniface);
+        if (len > 0 && e->ip.iniface[len - 1] == '+') {
+            e->ip.iniface[--len] = '\0';
+            memset(e->ip.iniface_mask, 0xFF, len);
+        } else {
+            memset(e->ip.iniface_mask, 0xFF, len + 1);
+        }
+    }
+
+    unsigned char *pos = e->elems;
+
+    // Port match
+    if (has_port) {
+        struct xt_entry_match *m = (struct xt_entry_match *)pos;
+        m->u.match_size = port_size;
+        if (is_tcp) {
+            struct xt_tcp *tcp = (struct xt_tcp *)m->data;
+            strcpy(m->u.user.name, "tcp");
+            tcp->spts[1] = 0xFFFF;
+            set_port_range(rule, tcp->dpts);
+        } else {
+            struct xt_udp *udp = (struct xt_udp *)m->data;
+            strcpy(m->u.user.name, "udp");
+            udp->spts[1] = 0xFFFF;
+            set_port_range(rule, udp->dpts);
+        }
+        pos += port_size;
+    }
+
+    // Multiport match
+    if (multiport_size) {
+        struct xt_entry_match *mm = (struct xt_entry_match *)pos;
+        mm->u.match_size = multiport_size;
+        mm->u.user.revision = 1;
+        strcpy(mm->u.user.name, "multiport");
+        set_multiport(entry->multiport, (struct xt_multiport_v1 *)mm->data);
+        pos += multiport_size;
+    }
+
+    // Conntrack state match
+    if (ctstate_size) {
+        struct xt_entry_match *ctm = (struct xt_entry_match *)pos;
+        struct xt_conntrack_mtinfo1 *ct = (struct xt_conntrack_mtinfo1 *)ctm->data;
+        ctm->u.match_size = ctstate_size;
+        ctm->u.user.revision = 1;
+        strcpy(ctm->u.user.name, "conntrack");
+        ct->match_flags = XT_CONNTRACK_STATE;
+        if (strstr(entry->ctstate, "INVALID")) {
+            ct->state_mask |= XT_CONNTRACK_STATE_INVALID;
+        }
+        if (strstr(entry->ctstate, "ESTABLISHED")) {
+            ct->state_mask |= XT_CONNTRACK_STATE_BIT(IP_CT_ESTABLISHED);
+        }
+        if (strstr(entry->ctstate, "RELATED")) {
+            ct->state_mask |= XT_CONNTRACK_STATE_BIT(IP_CT_RELATED);
+        }
+        pos += ctstate_size;
+    }
+
+    // Set match
+    if (set_size) {
+        struct xt_entry_match *sm = (struct xt_entry_match *)pos;
+        struct xt_set_info_match_v1 *set = (struct xt_set_info_match_v1 *)sm->data;
+        sm->u.match_size = set_size;
+        sm->u.user.revision = 1;
+        strcpy(sm->u.user.name, "set");
+        set->match_set.index = set_index;
+        set->match_set.dim = 1;
+        set->match_set.flags = entry->set_field == SET_MATCH_SOURCE ? IPSET_DIM_ONE_SRC : 0;
+        pos += set_size;
+    }
+
+    // Comment match
+    if (comment_size) {
+        struct xt_entry_match *cm = (struct xt_entry_match *)pos;
+        struct xt_comment_info *info = (struct xt_comment_info *)cm->data;
+        cm->u.match_size = comment_size;
+        strcpy(cm->u.user.name, "comment");
+        if (entry->set_name[0]) {
+            strncpy(info->comment, entry->set_name, XT_MAX_COMMENT_LEN - 1);
+        } else if (entry->comment[0]) {
+            strncpy(info->comment, entry->comment, XT_MAX_COMMENT_LEN - 1);
+        } else if (rule->comment) {
+            strncpy(info->comment, pool_string(rule->comment), XT_MAX_COMMENT_LEN - 1);
+        } else {
+            snprintf(info->comment, XT_MAX_COMMENT_LEN, "Rule-ID-%d", rule->id);
+        }
+        pos += comment_size;
+    }
+
+    // Target
+    e->target_offset = pos - (unsigned char *)e;
+    e->next_offset = total;
+
+    struct xt_entry_target *t = (struct xt_entry_target *)pos;
+    t->u.target_size = target_size;
+    if (entry->jump[0]) {
+        // libiptc resolves a chain name target into a jump
+        strncpy(t->u.user.name, entry->jump, sizeof(t->u.user.name) - 1);
+        e->ip.flags |= IPT_F_GOTO;
+    } else if (is_reject) {
+        struct ipt_reject_info *reject = (struct ipt_reject_info *)t->data;
+        strcpy(t->u.user.name, "REJECT");
+        reject->with = IPT_ICMP_PORT_UNREACHABLE;
+    } else {
+        // libiptc maps ACCEPT/DROP to standard verdicts on append
+        strncpy(t->u.user.name, action_name(rule->action), sizeof(t->u.user.name) - 1);
+    }
+
+    return e;
+}
+
+/**
+ * Start a batch: fetch the filter table once
+ */
+int begin_iptables_batch(int flush) {
+    if (batch_handle) {
+        fprintf(stderr, "Error: iptables batch already open\n");
+        return -1;
+    }
+
+    batch_handle = iptc_init("filter");
+    if (!batch_handle) {
+        fprintf(stderr, "Error: Cannot read filter table: %s\n", iptc_strerror(errno));
+        return -1;
+    }
+    batch_ops = 0;
+
+    if (flush && !iptc_flush_entries("INPUT", batch_handle)) {
+        fprintf(stderr, "Error: Cannot flush INPUT: %s\n", iptc_strerror(errno));
+        iptc_free(batch_handle);
+        batch_handle = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Commit every change made in the batch in one table replacement
+ */
+int commit_iptables_batch(void) {
+    if (!batch_handle) {
+        return -1;
+    }
+
+    printf("Committing filter table (%d operations)\n", batch_ops);
+
+    int ret = 0;
+    if (!iptc_commit(batch_handle)) {
+        fprintf(stderr, "Error: Commit failed: %s\n", iptc_strerror(errno));
+        ret = -1;
+    }
+
+    iptc_free(batch_handle);
+    batch_handle = NULL;
+    return ret;
+}
+
+#define ENTRY_APPEND 0
+#define ENTRY_INSERT 1
+#define ENTRY_DELETE 2
+
+/**
+ * Run one entry operation, joining the open batch if there is one
+ */
+static int run_entry_op(const char *chain, const CompiledEntry *entry, int op, int position) {
+    int own_batch = 0;
+
+    if (!batch_handle) {
+        if (begin_iptables_batch(0) != 0) {
+            return -1;
+        }
+        own_batch = 1;
+    }
+
+    struct ipt_entry *e = build_entry(entry);
+    if (!e) {
+        fprintf(stderr, "Error: Cannot build entry for rule %d\n", entry->rule.id);
+        if (own_batch) {
+            iptc_free(batch_handle);
+            batch_handle = NULL;
+        }
+        return -1;
+    }
+
+    int ok;
+    if (op == ENTRY_DELETE) {
+        // Every byte we set is significant, so compare the whole entry
+        unsigned char *mask = malloc(e->next_offset);
+        ok = mask != NULL;
+        if (ok) {
+            memset(mask, 0xFF, e->next_offset);
+            ok = iptc_delete_entry(chain, e, mask, batch_handle);
+            free(mask);
+        }
+    } else if (op == ENTRY_INSERT) {
+        ok = iptc_insert_entry(chain, e, position - 1, batch_handle);
+    } else {
+        ok = iptc_append_entry(chain, e, batch_handle);
+    }
+    free(e);
+
+    if (!ok) {
+        fprintf(stderr, "Error: %s\n", iptc_strerror(errno));
+        if (own_batch) {
+            iptc_free(batch_handle);
+            batch_handle = NULL;
+        }
+        return -1;
+    }
+    batch_ops++;
+
+    return own_batch ? commit_iptables_batch() : 0;
+}
+
+/**
+ * Append an entry to the INPUT chain
+ */
+int append_entry_to_iptables(const CompiledEntry *entry) {
+    return run_entry_op("INPUT", entry, ENTRY_APPEND, 0);
+}
+
+/**
+ * Append an entry to a named chain
+ */
+int append_entry_to_chain(const char *chain, const CompiledEntry *entry) {
+    return run_entry_op(chain, entry, ENTRY_APPEND, 0);
+}
+
+/**
+ * Insert an entry at a 1-based INPUT chain position
+ */
+int insert_entry_to_iptables(const CompiledEntry *entry, int position) {
+    return run_entry_op("INPUT", entry, ENTRY_INSERT, position);
+}
+
+/**
+ * Delete an entry from the INPUT chain by its contents
+ */
+int delete_entry_from_iptables(const CompiledEntry *entry) {
+    return run_entry_op("INPUT", entry, ENTRY_DELETE, 0);
+}
+
+/**
+ * Run one chain operation in the open batch (one-shot without a batch)
+ */
+static int run_chain_op(const char *chain, int remove) {
+    int own_batch = 0;
+
+    if (!batch_handle) {
+        if (begin_iptables_batch(0) != 0) {
+            return -1;
+        }
+        own_batch = 1;
+    }
+
+    int ok;
+    if (remove) {
+        ok = iptc_delete_chain(chain, batch_handle);
+    } else if (iptc_is_chain(chain, batch_handle)) {
+        ok = iptc_flush_entries(chain, batch_handle);
+    } else {
+        ok = iptc_create_chain(chain, batch_handle);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: Chain %s: %s\n", chain, iptc_strerror(errno));
+        if (own_batch) {
+            iptc_free(batch_handle);
+            batch_handle = NULL;
+        }
+        return -1;
+    }
+    batch_ops++;
+
+    return own_batch ? commit_iptables_batch() : 0;
+}
+
+/**
+ * Create a user chain, or empty it if it already exists
+ */
+int reset_chain(const char *chain) {
+    return run_chain_op(chain, 0);
+}
+
+/**
+ * Delete an empty, unreferenced user chain
+ */
+int delete_chain(const char *chain) {
+    return run_chain_op(chain, 1);
+}
+
+/**
+ * List the partition sub-chains currently in the filter table
+ * Returns the number of names stored, or -1 on error
+ */
+int list_managed_chains(char (*names)[PARTITION_CHAIN_LENGTH], int max) {
+    struct xtc_handle *h = iptc_init("filter");
+    if (!h) {
+        return -1;
+    }
+
+    int count = 0;
+    for (const char *chain = iptc_first_chain(h); chain && count < max; chain = iptc_next_chain(h)) {
+        if (strncmp(chain, PARTITION_PREFIX "-", strlen(PARTITION_PREFIX) + 1) == 0) {
+            snprintf(names[count++], PARTITION_CHAIN_LENGTH, "%s", chain);
+        }
+    }
+
+    iptc_free(h);
+    return count;
+}
+
+/**
+ * Flush all rules from iptables
+ */
+int flush_rules(void) {
+    printf("Flushing iptables rules...\n");
+
+    // Flush INPUT chain and reset default policy in one transaction
+    int ret = begin_iptables_batch(1);
+    if (ret == 0) {
+        if (!iptc_set_policy("INPUT", "ACCEPT", NULL, batch_handle)) {
+            fprintf(stderr, "Warning: Failed to reset INPUT policy\n");
+        }
+        drop_partition_chains(NULL);
+        ret = commit_iptables_batch();
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Warning: Failed to flush INPUT chain\n");
+    }
+
+    printf("Rules flushed successfully\n");
+    return 0;
+}
+
+/**
+ * Check that the filter table can be read
+ */
+int probe_iptables(void) {
+    struct xtc_handle *h = iptc_init("filter");
+    if (!h) {
+        return -1;
+    }
+    iptc_free(h);
+    return 0;
+}
+
+/**
+ * Find the comment attached to an entry, if any
+ */
+static const char *entry_comment(const struct ipt_entry *e) {
+    for (unsigned int off = sizeof(struct ipt_entry); off < e->target_offset; ) {
+        const struct xt_entry_match *m = (const struct xt_entry_match *)((const unsigned char *)e + off);
+        if (strcmp(m->u.user.name, "comment") == 0) {
+            return ((const struct xt_comment_info *)m->data)->comment;
+        }
+        off += m->u.match_size;
+    }
+    return "";
+}
+
+/**
+ * Pass the comment and the packet and byte counters of every commented
+ * entry in the filter table to visit, from one read of the table
+ */
+int read_entry_counters(void (*visit)(const char *comment, unsigned long long packets,
+                                      unsigned long long bytes, void *arg), void *arg) {
+    struct xtc_handle *h = iptc_init("filter");
+    if (!h) {
+        fprintf(stderr, "Error: Cannot read filter table: %s\n", iptc_strerror(errno));
+        return -1;
+    }
+
+    for (const char *chain = iptc_first_chain(h); chain; chain = iptc_next_chain(h)) {
+        for (const struct ipt_entry *e = iptc_first_rule(chain, h); e; e = iptc_next_rule(e, h)) {
+            const char *comment = entry_comment(e);
+            if (comment[0]) {
+                visit(comment, e->counters.pcnt, e->counters.bcnt, arg);
+            }
+        }
+    }
+
+    iptc_free(h);
+    return 0;
+}
+
+/**
+ * Append formatted text to a spec being built
+ */
+static void spec_append(char *spec, size_t size, const char *fmt, const char *arg) {
+    size_t used = strlen(spec);
+    snprintf(spec + used, size - used, fmt, arg);
+}
+
+/**
+ * Describe a kernel entry in iptables -S syntax, covering the matches
+ * this tool generates
+ */
+static void describe_entry(const struct ipt_entry *e, struct xtc_handle *h, char *spec, size_t size) {
+    char text[MAX_COMMENT_LENGTH];
+
+    snprintf(spec, size, "-A INPUT");
+
+    if (e->ip.smsk.s_addr) {
+        inet_ntop(AF_INET, &e->ip.src, text, INET_ADDRSTRLEN);
+        snprintf(text + strlen(text), 4, "/%d", __builtin_popcount(e->ip.smsk.s_addr));
+        spec_append(spec, size, " -s %s", text);
+    }
+    if (e->ip.dmsk.s_addr) {
+        inet_ntop(AF_INET, &e->ip.dst, text, INET_ADDRSTRLEN);
+        snprintf(text + strlen(text), 4, "/%d", __builtin_popcount(e->ip.dmsk.s_addr));
+        spec_append(spec, size, " -d %s", text);
+    }
+    if (e->ip.iniface[0]) {
+        // A mask that stops short of the NUL is a wildcard: "eth" -> "eth+"
+        size_t len = strlen(e->ip.iniface);
+        int wildcard = len < IFNAMSIZ && !e->ip.iniface_mask[len] && e->ip.iniface[len - 1] != '+';
+        spec_append(spec, size, " -i %s%s", e->ip.iniface, wildcard ? "+" : "");
+    }
+    if (e->ip.proto == IPPROTO_TCP) {
+        spec_append(spec, size, " -p %s", "tcp");
+    } else if (e->ip.proto == IPPROTO_UDP) {
+        spec_append(spec, size, " -p %s", "udp");
+    } else if (e->ip.proto == IPPROTO_ICMP) {
+        spec_append(spec, size, " -p %s", "icmp");
+    }
+
+    for (unsigned int off = sizeof(struct ipt_entry); off < e->target_offset; ) {
+        const struct xt_entry_match *m = (const struct xt_entry_match *)((const unsigned char *)e + off);
+        const char *name = m->u.user.name;
+
+        if (strcmp(name, "tcp") == 0 || strcmp(name, "udp") == 0) {
+            const __u16 *dpts = strcmp(name, "tcp") == 0 ? ((const struct xt_tcp *)m->data)->dpts
+                                                          : ((const struct xt_udp *)m->data)->dpts;
+            if (dpts[0] == dpts[1]) {
+                snprintf(text, sizeof(text), "%u", dpts[0]);
+            } else {
+                snprintf(text, sizeof(text), "%u:%u", dpts[0], dpts[1]);
+            }
+            if (dpts[0] != 0 || dpts[1] != 0xFFFF) {
+                spec_append(spec, size, " --dport %s", text);
+            }
+        } else if (strcmp(name, "multiport") == 0) {
+            const struct xt_multiport_v1 *mp = (const struct xt_multiport_v1 *)m->data;
+            text[0] = '\0';
+            for (int i = 0; i < mp->count; i++) {
+                size_t used = strlen(text);
+                if (mp->pflags[i] && i + 1 < mp->count) {
+                    snprintf(text + used, sizeof(text) - used, "%s%u:%u", i ? "," : "", mp->ports[i], mp->ports[i + 1]);
+                    i++;
+                } else {
+                    snprintf(text + used, sizeof(text) - used, "%s%u", i ? "," : "", mp->ports[i]);
+                }
+            }
+            spec_append(spec, size, " --dports %s", text);
+        } else if (strcmp(name, "set") == 0) {
+            const struct xt_set_info_match_v1 *set = (const struct xt_set_info_match_v1 *)m->data;
+            if (get_set_name(set->match_set.index, text, sizeof(text)) == 0) {
+                spec_append(spec, size, " --match-set %s", text);
+                spec_append(spec, size, " %s", set->match_set.flags & IPSET_DIM_ONE_SRC ? "src" : "dst");
+            }
+        } else if (strcmp(name, "conntrack") == 0) {
+            const struct xt_conntrack_mtinfo1 *ct = (const struct xt_conntrack_mtinfo1 *)m->data;
+            text[0] = '\0';
+            if (ct->state_mask & XT_CONNTRACK_STATE_INVALID) {
+                strcat(text, "INVALID,");
+            }
+            if (ct->state_mask & XT_CONNTRACK_STATE_BIT(IP_CT_ESTABLISHED)) {
+                strcat(text, "ESTABLISHED,");
+            }
+            if (ct->state_mask & XT_CONNTRACK_STATE_BIT(IP_CT_RELATED)) {
+                strcat(text, "RELATED,");
+            }
+            size_t len = strlen(text);
+            if (len) {
+                text[len - 1] = '\0';
+            }
+            spec_append(spec, size, " --ctstate %s", text);
+        } else if (strcmp(name, "comment") == 0) {
+            spec_append(spec, size, " --comment \"%s\"", ((const struct xt_comment_info *)m->data)->comment);
+        } else {
+            spec_append(spec, size, " -m %s", name);
+        }
+        off += m->u.match_size;
+    }
+
+    spec_append(spec, size, (e->ip.flags & IPT_F_GOTO) ? " -g %s" : " -j %s", iptc_get_target(e, h));
+}
+
+/**
+ * Read the live INPUT chain as "-A INPUT ..." specifications
+ * Returns the number of entries (*specs is malloc'd), or -1 on error
+ */
+int read_input_specs(char (**specs)[MAX_RULE_LENGTH]) {
+    struct xtc_handle *h = iptc_init("filter");
+    if (!h) {
+        fprintf(stderr, "Error: Cannot read filter table: %s\n", iptc_strerror(errno));
+        return -1;
+    }
+
+    int count = 0;
+    for (const struct ipt_entry *e = iptc_first_rule("INPUT", h); e; e = iptc_next_rule(e, h)) {
+        count++;
+    }
+
+    *specs = malloc(sizeof(**specs) * (count + 1));
+    if (!*specs) {
+        iptc_free(h);
+        return -1;
+    }
+
+    int i = 0;
+    for (const struct ipt_entry *e = iptc_first_rule("INPUT", h); e; e = iptc_next_rule(e, h)) {
+        describe_entry(e, h, (*specs)[i++], MAX_RULE_LENGTH);
+    }
+
+    iptc_free(h);
+    return count;
+}
+
+/**
+ * Delete the entry at a 1-based INPUT chain position
+ */
+int delete_entry_at(int position) {
+    int own_batch = 0;
+
+    if (!batch_handle) {
+        if (begin_iptables_batch(0) != 0) {
+            return -1;
+        }
+        own_batch = 1;
+    }
+
+    if (!iptc_delete_num_entry("INPUT", position - 1, batch_handle)) {
+        fprintf(stderr, "Error: %s\n", iptc_strerror(errno));
+        if (own_batch) {
+            iptc_free(batch_handle);
+            batch_handle = NULL;
+        }
+        return -1;
+    }
+    batch_ops++;
+
+    return own_batch ? commit_iptables_batch() : 0;
+}
+
+/**
+ * Print the INPUT chain with counters, read straight from the kernel
+ */
+int print_input_chain(void) {
+    struct xtc_handle *h = iptc_init("filter");
+    if (!h) {
+        fprintf(stderr, "Error: Cannot read filter table: %s\n", iptc_strerror(errno));
+        return -1;
+    }
+
+    struct xt_counters policy_counters;
+    const char *policy = iptc_get_policy("INPUT", &policy_counters, h);
+    printf("Chain INPUT (policy %s %llu packets, %llu bytes)\n", policy ? policy : "-",
+           (unsigned long long)policy_counters.pcnt, (unsigned long long)policy_counters.bcnt);
+    printf("num  %10s %10s  %-8s %-18s %-18s %s\n", "pkts", "bytes", "target", "source", "destination", "comment");
+
+    int num = 1;
+    for (const struct ipt_entry *e = iptc_first_rule("INPUT", h); e; e = iptc_next_rule(e, h)) {
+        char src[INET_ADDRSTRLEN + 4], dst[INET_ADDRSTRLEN + 4];
+
+        inet_ntop(AF_INET, &e->ip.src, src, INET_ADDRSTRLEN);
+        snprintf(src + strlen(src), 4, "/%d", __builtin_popcount(e->ip.smsk.s_addr));
+        inet_ntop(AF_INET, &e->ip.dst, dst, INET_ADDRSTRLEN);
+        snprintf(dst + strlen(dst), 4, "/%d", __builtin_popcount(e->ip.dmsk.s_addr));
+
+        printf("%-4d %10llu %10llu  %-8s %-18s %-18s %s\n", num++,
+               (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt,
+               iptc_get_target(e, h), src, dst, entry_comment(e));
+    }
+
+    iptc_free(h);
+    return 0;
+}
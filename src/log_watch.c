@@ -0,0 +1,744 @@
+#define _GNU_SOURCE         // memmem()
+#include "firewall.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+/*
+ * Log watcher (`firewall watch`).
+ *
+ * Tails the log files named in the [watch] section of CONFIG_FILE with
+ * inotify, following rotation (a new file created or moved in under the
+ * same name) and truncation. Each line is tried against precompiled
+ * patterns: literal text with `*` for anything and `<HOST>` for the IPv4
+ * source address, located with memmem() rather than a regex engine.
+ *
+ * Failures are counted per address in a count-min sketch of
+ * SKETCH_DEPTH rows of SKETCH_WIDTH counters, a fixed 1 MB however
+ * many addresses appear. Counts decay exponentially with time constant
+ * findtime: a failure adds exp((now - base) / findtime) (forward decay),
+ * so only the estimate is scaled back and no counter is ever aged one
+ * by one; the counters are rescaled when the weights grow large. Updates
+ * are conservative (only the smallest counters rise), which keeps the
+ * overestimate of a rare address small. An address whose decayed count
+ * reaches maxretry is banned.
+ *
+ * Bans are collected while a burst of lines is read and added as one
+ * batch of `action=DROP, source=<address>` rules with ttl=bantime: one
+ * journal write and one ruleset commit. With a daemon running, the batch
+ * goes to it as `add` requests of up to DAEMON_MAX_ARGS - 2 rules each,
+ * which it adds the same way, so there is one owner of the rules.
+ * Otherwise the rules are reloaded before a batch whenever another
+ * command changed them, and the watcher expires lapsed bans itself;
+ * while a daemon listens, expiry is left to it.
+ *
+ * Usage: firewall watch [--once] [--dry-run] [log...]
+ *   --once     read the logs from the start to their end and exit
+ *              (for testing with synthetic logs)
+ *   --dry-run  report the bans without adding rules
+ */
+
+#define WATCH_MAX_LOGS 16
+#define WATCH_MAX_PATTERNS 32
+#define WATCH_MAX_LITERALS 8
+#define WATCH_MAX_IGNORE 32
+#define WATCH_READ_SIZE 65536
+#define WATCH_COMMENT "auto-ban"
+#define WATCH_DEFAULT_LOG "/var/log/auth.log"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_BITS 16
+#define SKETCH_WIDTH (1 << SKETCH_BITS)
+// Weight at which the counters are scaled back down
+#define SKETCH_RESCALE 1e15
+
+// Addresses banned recently (power of two)
+#define BANNED_SIZE (1 << 14)
+
+// What comes before a pattern literal
+#define GAP_ANY  0
+#define GAP_HOST 1
+
+typedef struct {
+    char text[MAX_CONFIG_LINE];             // Literals, NUL-separated
+    const char *literal[WATCH_MAX_LITERALS];
+    size_t literal_len[WATCH_MAX_LITERALS];
+    int gap[WATCH_MAX_LITERALS];            // GAP_* before each literal
+    int count;
+} WatchPattern;
+
+typedef struct {
+    char path[256];
+    int fd;
+    int wd;                 // inotify watch on the file, -1 when none
+    int dir_wd;             // inotify watch on its directory
+    char *pending;          // Start of a line not ended yet
+    size_t pending_len;
+} WatchedLog;
+
+typedef struct {
+    uint32_t addr;          // 0 for an empty entry
+    uint32_t until;         // 0 for a ban without end
+} BannedEntry;
+
+static WatchPattern patterns[WATCH_MAX_PATTERNS];
+static int pattern_count;
+static WatchedLog logs[WATCH_MAX_LOGS];
+static int log_count;
+static uint32_t ignore_addr[WATCH_MAX_IGNORE];
+static int8_t ignore_len[WATCH_MAX_IGNORE];
+static int ignore_count;
+static int maxretry = 5;
+static int findtime = 600;
+static int bantime = 3600;
+
+static float sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+static double sketch_base;
+
+static BannedEntry banned[BANNED_SIZE];
+static int banned_count;
+
+// Bans waiting for the next batch
+static uint32_t *ban_queue;
+static int ban_queue_count;
+static int ban_queue_capacity;
+
+static unsigned long long lines_read, lines_matched, bans_made;
+static volatile sig_atomic_t watch_stop;
+// rules_files_stamp() as this process last left the rules
+static uint64_t seen_stamp;
+
+static const char *default_patterns[] = {
+    "Failed password for * from <HOST>",
+    "Invalid user * from <HOST>",
+    "authentication failure;*rhost=<HOST>",
+    "Did not receive identification string from <HOST>",
+};
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+/**
+ * Compile a pattern: literal text, `*` for anything, `<HOST>` once for
+ * the address
+ * Returns 0 on success, -1 if it is malformed
+ */
+static int compile_pattern(const char *source, WatchPattern *p) {
+    size_t len = strlen(source);
+    int hosts = 0;
+
+    if (len >= sizeof(p->text)) {
+        return -1;
+    }
+    memcpy(p->text, source, len + 1);
+    p->count = 0;
+
+    char *pos = p->text;
+    int gap = GAP_ANY;
+    for (;;) {
+        char *star = strchr(pos, '*');
+        char *host = strstr(pos, "<HOST>");
+        char *cut = star && (!host || star < host) ? star : host;
+
+        if (p->count == WATCH_MAX_LITERALS) {
+            return -1;
+        }
+        p->literal[p->count] = pos;
+        p->literal_len[p->count] = cut ? (size_t)(cut - pos) : strlen(pos);
+        p->gap[p->count++] = gap;
+        if (!cut) {
+            break;
+        }
+
+        // `*` next to <HOST> adds nothing; <HOST> wins the gap
+        if (cut == host) {
+            hosts++;
+            gap = GAP_HOST;
+            pos = host + 6;
+        } else {
+            gap = gap == GAP_HOST && star == pos ? GAP_HOST : GAP_ANY;
+            pos = star + 1;
+        }
+        *cut = '\0';
+    }
+    return hosts == 1 ? 0 : -1;
+}
+
+/**
+ * Match a line against a pattern
+ * Returns 1 and the address on a match, 0 otherwise
+ */
+static int match_pattern(const WatchPattern *p, const char *line, const char *end, uint32_t *addr) {
+    const char *pos = line;
+    int found = 0;
+
+    for (int i = 0; i < p->count; i++) {
+        const char *literal = p->literal[i];
+        size_t len = p->literal_len[i];
+
+        if (p->gap[i] == GAP_HOST) {
+            const char *host_end = pos;
+            while (host_end < end && host_end - pos < 16 &&
+                   ((*host_end >= '0' && *host_end <= '9') || *host_end == '.')) {
+                host_end++;
+            }
+            // "from 192.0.2.1." ends a sentence, not the address
+            if (host_end > pos && host_end[-1] == '.' && (len == 0 || literal[0] != '.')) {
+                host_end--;
+            }
+            int8_t prefix_len;
+            if (parse_address_span(pos, host_end, addr, &prefix_len) != NULL || prefix_len != 32) {
+                return 0;
+            }
+            found = 1;
+            pos = host_end;
+            if (len > (size_t)(end - pos) || memcmp(pos, literal, len) != 0) {
+                return 0;
+            }
+            pos += len;
+        } else if (len > 0) {
+            const char *at = memmem(pos, (size_t)(end - pos), literal, len);
+            if (!at) {
+                return 0;
+            }
+            pos = at + len;
+        }
+    }
+    return found;
+}
+
+/**
+ * Load the [watch] section of CONFIG_FILE
+ */
+static int load_watch_config(void) {
+    FILE *fp = fopen(CONFIG_FILE, "r");
+    char line[MAX_CONFIG_LINE];
+    int in_watch = 0;
+
+    while (fp && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n\r")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (line[0] == '[') {
+            in_watch = strncmp(line, "[watch]", 7) == 0;
+            continue;
+        }
+        char *equals = strchr(line, '=');
+        if (!in_watch || !equals) {
+            continue;
+        }
+        *equals = '\0';
+        const char *key = line;
+        const char *value = equals + 1;
+
+        if (strcmp(key, "log") == 0) {
+            if (log_count < WATCH_MAX_LOGS) {
+                strncpy(logs[log_count++].path, value, sizeof(logs[0].path) - 1);
+            }
+        } else if (strcmp(key, "pattern") == 0) {
+            if (pattern_count < WATCH_MAX_PATTERNS && compile_pattern(value, &patterns[pattern_count]) == 0) {
+                pattern_count++;
+            } else {
+                fprintf(stderr, "Warning: Skipping pattern (it needs exactly one <HOST>): %s\n", value);
+            }
+        } else if (strcmp(key, "ignore") == 0) {
+            if (ignore_count < WATCH_MAX_IGNORE &&
+                parse_address_span(value, value + strlen(value), &ignore_addr[ignore_count],
+                                   &ignore_len[ignore_count]) == NULL) {
+                ignore_count++;
+            } else {
+                fprintf(stderr, "Warning: Skipping ignore address: %s\n", value);
+            }
+        } else if (strcmp(key, "maxretry") == 0) {
+            maxretry = atoi(value);
+        } else if (strcmp(key, "findtime") == 0) {
+            findtime = atoi(value);
+        } else if (strcmp(key, "bantime") == 0) {
+            bantime = atoi(value);
+        }
+    }
+    if (fp) {
+        fclose(fp);
+    }
+
+    if (maxretry < 1 || findtime < 1 || bantime < 0) {
+        fprintf(stderr, "Error: [watch] needs maxretry >= 1, findtime >= 1 and bantime >= 0\n");
+        return -1;
+    }
+    if (pattern_count == 0) {
+        for (size_t i = 0; i < sizeof(default_patterns) / sizeof(default_patterns[0]); i++) {
+            compile_pattern(default_patterns[i], &patterns[pattern_count++]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add one failure of an address at time now
+ * Returns the address's decayed failure count
+ */
+static double sketch_add(uint32_t addr, double now) {
+    double weight = exp((now - sketch_base) / findtime);
+    if (weight > SKETCH_RESCALE) {
+        float scale = (float)(1.0 / weight);
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            for (int i = 0; i < SKETCH_WIDTH; i++) {
+                sketch[row][i] *= scale;
+            }
+        }
+        sketch_base = now;
+        weight = 1.0;
+    }
+
+    // One 64-bit mix gives each row its own SKETCH_BITS bits
+    uint64_t hash = (addr + 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 31;
+    hash *= 0x94D049BB133111EBull;
+    hash ^= hash >> 29;
+
+    float *cells[SKETCH_DEPTH];
+    float low = 0;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        cells[row] = &sketch[row][(hash >> (row * SKETCH_BITS)) & (SKETCH_WIDTH - 1)];
+        if (row == 0 || *cells[row] < low) {
+            low = *cells[row];
+        }
+    }
+    // Conservative update: raise only the counters below the new estimate
+    float updated = low + (float)weight;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        if (*cells[row] < updated) {
+            *cells[row] = updated;
+        }
+    }
+    return updated / weight;
+}
+
+static BannedEntry *banned_entry(uint32_t addr) {
+    uint32_t i = (addr * 2654435761u) >> (32 - 14);
+    while (banned[i].addr && banned[i].addr != addr) {
+        i = (i + 1) & (BANNED_SIZE - 1);
+    }
+    return &banned[i];
+}
+
+/**
+ * Whether an address is banned at time now
+ */
+static int is_banned(uint32_t addr, uint32_t now) {
+    const BannedEntry *e = banned_entry(addr);
+    return e->addr == addr && (e->until == 0 || e->until > now);
+}
+
+/**
+ * Order bans latest lapse first, permanent ones ahead of all
+ */
+static int compare_bans(const void *a, const void *b) {
+    uint32_t x = ((const BannedEntry *)a)->until - 1, y = ((const BannedEntry *)b)->until - 1;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Remember a ban; once the table is three quarters full, lapsed bans
+ * are dropped, and if more than half are still live only the half that
+ * lapses last is kept
+ */
+static void remember_ban(uint32_t addr, uint32_t until, uint32_t now) {
+    if (banned_count >= BANNED_SIZE / 4 * 3) {
+        static BannedEntry kept[BANNED_SIZE];
+        int count = 0;
+        for (int i = 0; i < BANNED_SIZE; i++) {
+            if (banned[i].addr && (banned[i].until == 0 || banned[i].until > now)) {
+                kept[count++] = banned[i];
+            }
+        }
+        if (count > BANNED_SIZE / 2) {
+            qsort(kept, count, sizeof(BannedEntry), compare_bans);
+            count = BANNED_SIZE / 2;
+        }
+        memset(banned, 0, sizeof(banned));
+        banned_count = 0;
+        for (int i = 0; i < count; i++) {
+            *banned_entry(kept[i].addr) = kept[i];
+            banned_count++;
+        }
+    }
+    BannedEntry *e = banned_entry(addr);
+    if (!e->addr) {
+        banned_count++;
+    }
+    e->addr = addr;
+    e->until = until;
+}
+
+/**
+ * Mark the addresses existing single-address DROP rules already block
+ */
+static void seed_banned(uint32_t now) {
+    FirewallRule **rules = ordered_rules();
+    for (int i = 0; i < rule_count; i++) {
+        const FirewallRule *r = rules[i];
+        if (r->active && r->action == ACTION_DROP && r->source_len == 32 && r->dest_len < 0 &&
+            !r->port_first && !r->interface && (r->protocol == PROTO_NONE || r->protocol == PROTO_ALL)) {
+            remember_ban(r->source, r->expires, now);
+        }
+    }
+}
+
+static int is_ignored(uint32_t addr) {
+    for (int i = 0; i < ignore_count; i++) {
+        uint32_t mask = ignore_len[i] ? 0xFFFFFFFFu << (32 - ignore_len[i]) : 0;
+        if ((addr & mask) == ignore_addr[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Count one log line
+ */
+static void process_line(const char *line, const char *end, double now) {
+    uint32_t addr;
+
+    lines_read++;
+    for (int i = 0; i < pattern_count; i++) {
+        if (!match_pattern(&patterns[i], line, end, &addr)) {
+            continue;
+        }
+        lines_matched++;
+        if (is_ignored(addr) || is_banned(addr, (uint32_t)now)) {
+            return;
+        }
+        if (sketch_add(addr, now) >= maxretry) {
+            if (ban_queue_count == ban_queue_capacity) {
+                int capacity = ban_queue_capacity ? ban_queue_capacity * 2 : 256;
+                uint32_t *grown = realloc(ban_queue, sizeof(uint32_t) * capacity);
+                if (!grown) {
+                    return;
+                }
+                ban_queue = grown;
+                ban_queue_capacity = capacity;
+            }
+            ban_queue[ban_queue_count++] = addr;
+            // Queued counts as banned, so later lines do not queue it again
+            remember_ban(addr, bantime ? (uint32_t)now + (uint32_t)bantime : 0, (uint32_t)now);
+        }
+        return;
+    }
+}
+
+/**
+ * Read what a log has gained and count its complete lines
+ */
+static void read_log(WatchedLog *log, double now) {
+    static char buffer[WATCH_READ_SIZE];
+
+    if (log->fd < 0) {
+        return;
+    }
+    // A log cut short by truncation is read again from the start
+    struct stat st;
+    off_t offset = lseek(log->fd, 0, SEEK_CUR);
+    if (fstat(log->fd, &st) == 0 && st.st_size < offset) {
+        lseek(log->fd, 0, SEEK_SET);
+        log->pending_len = 0;
+    }
+
+    for (;;) {
+        // The held-over line start goes first
+        size_t held = log->pending_len;
+        if (held) {
+            memcpy(buffer, log->pending, held);
+        }
+        ssize_t n = read(log->fd, buffer + held, sizeof(buffer) - held);
+        if (n <= 0) {
+            return;
+        }
+
+        char *pos = buffer, *end = buffer + held + n;
+        char *newline;
+        while ((newline = memchr(pos, '\n', (size_t)(end - pos))) != NULL) {
+            process_line(pos, newline, now);
+            pos = newline + 1;
+        }
+
+        // A line longer than the buffer is counted in pieces
+        if (pos == buffer && end == buffer + sizeof(buffer)) {
+            process_line(pos, end, now);
+            pos = end;
+        }
+        log->pending_len = (size_t)(end - pos);
+        memcpy(log->pending, pos, log->pending_len);
+    }
+}
+
+/**
+ * Open a log (from the start, or from its end when tail is set) and
+ * watch it
+ */
+static void open_log(WatchedLog *log, int inotify_fd, int tail) {
+    log->fd = open(log->path, O_RDONLY | O_CLOEXEC);
+    log->pending_len = 0;
+    if (log->fd < 0) {
+        return;
+    }
+    if (tail) {
+        lseek(log->fd, 0, SEEK_END);
+    }
+    if (inotify_fd >= 0) {
+        log->wd = inotify_add_watch(inotify_fd, log->path, IN_MODIFY);
+    }
+}
+
+/**
+ * Add the queued bans
+ * Returns 1 when a daemon took any of them, else 0
+ */
+static int flush_bans(int dry_run) {
+    char text[MAX_IP_LENGTH];
+    uint32_t now = (uint32_t)time(NULL);
+    int count = ban_queue_count;
+
+    if (count == 0) {
+        return 0;
+    }
+    ban_queue_count = 0;
+
+    if (dry_run) {
+        for (int i = 0; i < count; i++) {
+            format_address(ban_queue[i], 32, text, sizeof(text));
+            printf("Would ban %s\n", text);
+        }
+        bans_made += (unsigned long long)count;
+        return 0;
+    }
+
+    // A running daemon owns the rules: the bans go to it as adds of as
+    // many rules as a request carries, each added as one change
+    static char rule_text[DAEMON_MAX_ARGS][128];
+    char *argv[DAEMON_MAX_ARGS + 1] = { "firewall", "add" };
+    int sent = 0;
+    while (sent < count) {
+        int argc = 2;
+        size_t used = strlen("add") + 1;
+        while (sent + argc - 2 < count && argc < DAEMON_MAX_ARGS) {
+            format_address(ban_queue[sent + argc - 2], 32, text, sizeof(text));
+            if (bantime) {
+                snprintf(rule_text[argc], sizeof(rule_text[argc]), "action=DROP, source=%s, ttl=%d, comment=%s",
+                         text, bantime, WATCH_COMMENT);
+            } else {
+                snprintf(rule_text[argc], sizeof(rule_text[argc]), "action=DROP, source=%s, comment=%s",
+                         text, WATCH_COMMENT);
+            }
+            size_t len = strlen(rule_text[argc]);
+            if (used + len + 1 >= DAEMON_REQUEST_LENGTH) {
+                break;
+            }
+            used += len + 1;
+            argv[argc] = rule_text[argc];
+            argc++;
+        }
+        argv[argc] = NULL;
+        if (forward_to_daemon(argc, argv) < 0) {
+            break;
+        }
+        sent += argc - 2;
+    }
+    if (sent > 0) {
+        seen_stamp = rules_files_stamp();
+    }
+
+    int left = count - sent;
+    if (left > 0) {
+        if (rules_files_stamp() != seen_stamp) {
+            load_rules_from_file(NULL);
+        }
+        FirewallRule *rules = malloc(sizeof(FirewallRule) * left);
+        if (!rules) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return sent > 0;
+        }
+        for (int i = 0; i < left; i++) {
+            make_empty_rule(&rules[i]);
+            rules[i].action = ACTION_DROP;
+            rules[i].source = ban_queue[sent + i];
+            rules[i].source_len = 32;
+            rules[i].comment = intern_string(WATCH_COMMENT);
+            rules[i].expires = bantime ? now + (uint32_t)bantime : 0;
+        }
+        if (add_firewall_rules(rules, left) == 0) {
+            format_address(ban_queue[sent], 32, text, sizeof(text));
+            printf("Banned %d address%s (first %s)\n", left, left == 1 ? "" : "es", text);
+        } else {
+            left = 0;
+        }
+        free(rules);
+        compact_journal_if_due(0);
+        seen_stamp = rules_files_stamp();
+    }
+
+    bans_made += (unsigned long long)(sent + left);
+    log_event(LOG_LEVEL_INFO, "watch: banned %d addresses", sent + left);
+    return sent > 0;
+}
+
+/**
+ * Watch the logs and ban offenders
+ * Returns 0 on success, -1 on error
+ */
+int watch_logs(int argc, char *argv[]) {
+    int once = 0, dry_run = 0, named = 0;
+
+    if (load_watch_config() != 0) {
+        return -1;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--once") == 0) {
+            once = 1;
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        } else {
+            // Logs on the command line replace the configured ones
+            if (!named++) {
+                log_count = 0;
+            }
+            if (log_count < WATCH_MAX_LOGS) {
+                strncpy(logs[log_count++].path, argv[i], sizeof(logs[0].path) - 1);
+            }
+        }
+    }
+    if (log_count == 0) {
+        strncpy(logs[log_count++].path, WATCH_DEFAULT_LOG, sizeof(logs[0].path) - 1);
+    }
+
+    int inotify_fd = once ? -1 : inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (!once && inotify_fd < 0) {
+        fprintf(stderr, "Error: Cannot start inotify: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < log_count; i++) {
+        WatchedLog *log = &logs[i];
+        log->wd = -1;
+        log->dir_wd = -1;
+        log->pending = malloc(WATCH_READ_SIZE);
+        if (!log->pending) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        open_log(log, inotify_fd, !once);
+        if (log->fd < 0) {
+            fprintf(stderr, "Warning: Cannot open %s yet: %s\n", log->path, strerror(errno));
+        }
+        // Rotation shows up in the directory as a new file under the name
+        if (inotify_fd >= 0) {
+            char dir[sizeof(log->path)];
+            strcpy(dir, log->path);
+            log->dir_wd = inotify_add_watch(inotify_fd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+        }
+    }
+
+    double start_time = (double)time(NULL);
+    sketch_base = start_time;
+    seed_banned((uint32_t)start_time);
+    seen_stamp = rules_files_stamp();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    if (once) {
+        for (int i = 0; i < log_count; i++) {
+            read_log(&logs[i], start_time);
+        }
+        flush_bans(dry_run);
+    } else {
+        printf("Watching %d log%s with %d patterns (maxretry=%d, findtime=%ds, bantime=%ds)\n",
+               log_count, log_count == 1 ? "" : "s", pattern_count, maxretry, findtime, bantime);
+        fflush(stdout);
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!once && !watch_stop) {
+        struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        double now = (double)time(NULL);
+        ssize_t n;
+        while ((n = read(inotify_fd, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + n; ) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                for (int i = 0; i < log_count; i++) {
+                    WatchedLog *log = &logs[i];
+                    char path[sizeof(log->path)];
+                    strcpy(path, log->path);
+                    if (ev->wd == log->wd) {
+                        read_log(log, now);
+                    } else if (ev->wd == log->dir_wd && ev->len && strcmp(ev->name, basename(path)) == 0) {
+                        // Rotated: finish the old file, then read the new one whole
+                        read_log(log, now);
+                        if (log->pending_len) {
+                            process_line(log->pending, log->pending + log->pending_len, now);
+                        }
+                        if (log->fd >= 0) {
+                            close(log->fd);
+                            if (log->wd >= 0) {
+                                inotify_rm_watch(inotify_fd, log->wd);
+                            }
+                        }
+                        open_log(log, inotify_fd, 0);
+                        read_log(log, now);
+                    }
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        int forwarded = flush_bans(dry_run);
+
+        // Bans with a bantime lapse here too, unless a daemon owns the
+        // rules and expires them itself
+        if (!dry_run && expiry_pending() && !forwarded && !daemon_listening()) {
+            if (rules_files_stamp() != seen_stamp) {
+                load_rules_from_file(NULL);
+            }
+            if (expire_rules() > 0) {
+                seen_stamp = rules_files_stamp();
+            }
+        }
+        fflush(stdout);
+    }
+
+    struct timespec ended;
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    double elapsed = (double)(ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+    printf("Read %llu lines (%.0f lines/s), %llu matched, %llu addresses banned\n", lines_read,
+           elapsed > 0 ? lines_read / elapsed : 0.0, lines_matched, bans_made);
+
+    for (int i = 0; i < log_count; i++) {
+        if (logs[i].fd >= 0) {
+            close(logs[i].fd);
+        }
+        free(logs[i].pending);
+    }
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+    free(ban_queue);
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "firewall.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+/*
+ * Logging.
+ *
+ * log_event() formats the message straight into a slot of a bounded
+ * ring (LOG_RING_SLOTS entries of LOG_ENTRY_SIZE bytes) and returns: no
+ * lock, no allocation and, while the writer is busy, no system call.
+ * Producers claim slots with a compare-and-swap on the tail and publish
+ * them through a per-slot sequence number (a Vyukov bounded queue); when
+ * the ring is full the message is dropped and counted rather than
+ * waiting, and the writer reports the count.
+ *
+ * One writer thread, started by the first message, drains the ring in
+ * batches of up to LOG_BATCH entries with a single writev() on a log
+ * file kept open. It renders each entry's timestamp, reusing it for the
+ * entries of the same second, and sleeps on an eventfd that producers
+ * only signal when it said it was idle. When the file reaches
+ * log_max_size it is renamed to <log_file>.1 and a new one started; a
+ * file moved away by an outside logrotate is reopened within a second.
+ * The ring is drained on exit.
+ */
+
+#define LOG_RING_SLOTS 4096
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+#define LOG_ENTRY_SIZE 256
+// Entries per writev() (three iovecs each, within IOV_MAX)
+#define LOG_BATCH 256
+#define LOG_STAMP_SIZE 32
+
+typedef struct {
+    uint64_t sequence;      // Slot position when free, position + 1 when filled
+    time_t when;
+    int level;
+    int length;             // Text length, newline included
+    char text[LOG_ENTRY_SIZE];
+} LogEntry;
+
+static LogEntry ring[LOG_RING_SLOTS];
+static uint64_t ring_tail;                  // Next slot producers claim
+static uint64_t ring_head;                  // Next slot the writer takes
+static unsigned long dropped;
+static int writer_idle;
+static int writer_stop;
+static int wake_fd = -1;
+static int log_fd = -1;
+static off_t log_size;
+static pthread_t writer_thread;
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static int logger_started;
+
+static const char *level_prefix[] = { "ERROR: ", "WARNING: ", "", "DEBUG: " };
+
+/**
+ * Open (or create) the log file for appending
+ */
+static void open_log_file(void) {
+    struct stat st;
+
+    log_fd = open(firewall_config.log_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    log_size = log_fd >= 0 && fstat(log_fd, &st) == 0 ? st.st_size : 0;
+}
+
+/**
+ * Start a new log file once the current one is full, or when it was
+ * moved away
+ */
+static void check_log_file(time_t now) {
+    static time_t last_check;
+    struct stat open_st, path_st;
+
+    if (now != last_check) {
+        last_check = now;
+        if (log_fd < 0 || fstat(log_fd, &open_st) != 0 || stat(firewall_config.log_file, &path_st) != 0 ||
+            open_st.st_ino != path_st.st_ino || open_st.st_dev != path_st.st_dev) {
+            if (log_fd >= 0) {
+                close(log_fd);
+            }
+            open_log_file();
+        }
+    }
+    if (log_fd >= 0 && firewall_config.log_max_size > 0 && log_size >= firewall_config.log_max_size) {
+        char rotated[sizeof(firewall_config.log_file) + 2];
+        snprintf(rotated, sizeof(rotated), "%s.1", firewall_config.log_file);
+        close(log_fd);
+        rename(firewall_config.log_file, rotated);
+        open_log_file();
+    }
+}
+
+/**
+ * Write out the published entries from the head of the ring
+ * Returns the number of entries written
+ */
+static int drain_ring(void) {
+    static struct iovec iov[LOG_BATCH * 3 + 1];
+    static char stamps[LOG_BATCH][LOG_STAMP_SIZE];
+    char notice[64];
+    int entries = 0, iovs = 0;
+    time_t stamp_time = (time_t)-1;
+    int stamp = -1;
+
+    unsigned long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost) {
+        int len = snprintf(notice, sizeof(notice), "WARNING: %lu log messages dropped\n", lost);
+        iov[iovs].iov_base = notice;
+        iov[iovs++].iov_len = (size_t)len;
+    }
+
+    while (entries < LOG_BATCH) {
+        LogEntry *e = &ring[(ring_head + entries) & LOG_RING_MASK];
+        if (__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) != ring_head + entries + 1) {
+            break;
+        }
+        // Entries of the same second share one rendered timestamp
+        if (e->when != stamp_time) {
+            struct tm tm;
+            stamp_time = e->when;
+            localtime_r(&stamp_time, &tm);
+            strftime(stamps[++stamp], LOG_STAMP_SIZE, "[%a %b %e %H:%M:%S %Y] ", &tm);
+        }
+        iov[iovs].iov_base = stamps[stamp];
+        iov[iovs++].iov_len = strlen(stamps[stamp]);
+        iov[iovs].iov_base = (void *)level_prefix[e->level];
+        iov[iovs++].iov_len = strlen(level_prefix[e->level]);
+        iov[iovs].iov_base = e->text;
+        iov[iovs++].iov_len = (size_t)e->length;
+        entries++;
+    }
+    if (iovs == 0) {
+        return 0;
+    }
+
+    check_log_file(stamp_time == (time_t)-1 ? time(NULL) : stamp_time);
+    if (log_fd >= 0) {
+        ssize_t written = writev(log_fd, iov, iovs);
+        if (written > 0) {
+            log_size += written;
+        }
+    }
+
+    // Hand the slots back to the producers, one lap on
+    for (int i = 0; i < entries; i++) {
+        __atomic_store_n(&ring[(ring_head + i) & LOG_RING_MASK].sequence,
+                         ring_head + i + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    }
+    ring_head += (uint64_t)entries;
+    return entries;
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (drain_ring() > 0) {
+            continue;
+        }
+        if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // Say so before sleeping, then look once more: a producer that
+        // published before seeing the flag left its entry for this check
+        __atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+        const LogEntry *e = &ring[ring_head & LOG_RING_MASK];
+        if (__atomic_load_n(&e->sequence, __ATOMIC_SEQ_CST) != ring_head + 1 &&
+            !__atomic_load_n(&writer_stop, __ATOMIC_SEQ_CST)) {
+            struct pollfd pfd = { wake_fd, POLLIN, 0 };
+            poll(&pfd, 1, 1000);
+        }
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) < 0) {
+            // Nothing signalled (woken by the timeout)
+        }
+        __atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+    }
+
+    if (log_fd >= 0) {
+        close(log_fd);
+        log_fd = -1;
+    }
+    return NULL;
+}
+
+static void wake_writer(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already pending, which wakes the writer anyway
+    }
+}
+
+/**
+ * Drain the ring and stop the writer (run at exit)
+ */
+void log_flush(void) {
+    if (!logger_started) {
+        return;
+    }
+    logger_started = 0;
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+    pthread_join(writer_thread, NULL);
+}
+
+static void start_logger(void) {
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+        ring[i].sequence = i;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return;
+    }
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0) {
+        close(wake_fd);
+        wake_fd = -1;
+        return;
+    }
+    logger_started = 1;
+    atexit(log_flush);
+}
+
+/**
+ * Log a message at a LOG_LEVEL_* level (printf-style)
+ * Never blocks: when the ring is full the message is dropped
+ */
+void log_event(int level, const char *format, ...) {
+    if (!firewall_config.logging || level > firewall_config.log_level) {
+        return;
+    }
+    pthread_once(&logger_once, start_logger);
+    if (!logger_started) {
+        return;
+    }
+
+    // Claim a slot: it is free when its sequence equals the position
+    uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    LogEntry *e;
+    for (;;) {
+        e = &ring[pos & LOG_RING_MASK];
+        int64_t diff = (int64_t)(__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(e->text, LOG_ENTRY_SIZE - 1, format, args);
+    va_end(args);
+    if (len < 0) {
+        len = 0;
+    } else if (len > LOG_ENTRY_SIZE - 2) {
+        len = LOG_ENTRY_SIZE - 2;
+    }
+    e->text[len++] = '\n';
+    e->length = len;
+    e->level = level;
+    e->when = time(NULL);
+
+    __atomic_store_n(&e->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST)) {
+        wake_writer();
+    }
+}
+
+/**
+ * Log a message at LOG_LEVEL_INFO
+ */
+void log_message(const char *message) {
+    log_event(LOG_LEVEL_INFO, "%s", message);
+}
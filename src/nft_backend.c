@@ -0,0 +1,489 @@
+#include "firewall.h"
+
+/*
+ * nftables backend (backend=nftables in [general]).
+ *
+ * Consecutive rules that match on the same set of fields are compiled
+ * into one named set (single verdict) or verdict map (mixed verdicts)
+ * keyed on the concatenation of those fields, so the kernel does one
+ * hash or interval lookup per group instead of walking every rule.
+ * An interface wildcard ("eth+") cannot be a set element, so a rule
+ * naming one is written on its own as nft's iifname "eth*".
+ * The whole table is replaced in a single nft transaction.
+ */
+
+#define NFT_TABLE "personal_firewall"
+
+// Match fields, in concatenation order
+#define NFT_IFACE  0x01
+#define NFT_SRC    0x02
+#define NFT_DST    0x04
+#define NFT_PROTO  0x08
+#define NFT_PORT   0x10
+
+static const struct {
+    int field;
+    const char *expr;
+    const char *type;
+} nft_fields[] = {
+    { NFT_IFACE, "iifname",      "ifname" },
+    { NFT_SRC,   "ip saddr",     "ipv4_addr" },
+    { NFT_DST,   "ip daddr",     "ipv4_addr" },
+    { NFT_PROTO, "meta l4proto", "inet_proto" },
+    { NFT_PORT,  "th dport",     "inet_service" },
+};
+
+#define NFT_FIELD_COUNT ((int)(sizeof(nft_fields) / sizeof(nft_fields[0])))
+
+// Elements whose first address is at least this specific are bucketed by /16
+#define NFT_BUCKET_BITS 16
+
+typedef struct {
+    const FirewallRule *rule;
+    int shape;
+    uint32_t src, dst;
+    int src_len, dst_len;
+    int port_first, port_last;
+    int wildcard;               // Interface name ends in '+'
+    int bucket_next;
+} NftKey;
+
+/**
+ * Work out which fields a rule matches on and parse them
+ */
+static void build_key(const FirewallRule *rule, NftKey *key) {
+    memset(key, 0, sizeof(*key));
+    key->rule = rule;
+    key->bucket_next = -1;
+
+    if (rule->interface) {
+        const char *name = pool_string(rule->interface);
+        size_t len = strlen(name);
+        key->wildcard = len > 0 && name[len - 1] == '+';
+        key->shape |= NFT_IFACE;
+    }
+    if (rule->source_len >= 0) {
+        key->src = rule->source;
+        key->src_len = rule->source_len;
+        key->shape |= NFT_SRC;
+    }
+    if (rule->dest_len >= 0) {
+        key->dst = rule->dest;
+        key->dst_len = rule->dest_len;
+        key->shape |= NFT_DST;
+    }
+    if (rule->protocol != PROTO_NONE && rule->protocol != PROTO_ALL) {
+        key->shape |= NFT_PROTO;
+    }
+    if (rule->port_first && (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP)) {
+        key->port_first = rule->port_first;
+        key->port_last = rule->port_last;
+        key->shape |= NFT_PORT;
+    }
+}
+
+/**
+ * Check whether two prefixes share any address
+ */
+static int prefixes_overlap(uint32_t a, int a_len, uint32_t b, int b_len) {
+    int len = a_len < b_len ? a_len : b_len;
+    uint32_t mask = len ? 0xFFFFFFFFu << (32 - len) : 0;
+    return ((a ^ b) & mask) == 0;
+}
+
+/**
+ * Check whether two keys of the same shape can match the same packet
+ * Such keys cannot live in one set: nft rejects overlapping elements,
+ * and first-match order between them would be lost
+ */
+static int keys_overlap(const NftKey *a, const NftKey *b) {
+    if ((a->shape & NFT_IFACE) && !interfaces_overlap(a->rule->interface, b->rule->interface)) {
+        return 0;
+    }
+    if ((a->shape & NFT_SRC) && !prefixes_overlap(a->src, a->src_len, b->src, b->src_len)) {
+        return 0;
+    }
+    if ((a->shape & NFT_DST) && !prefixes_overlap(a->dst, a->dst_len, b->dst, b->dst_len)) {
+        return 0;
+    }
+    if ((a->shape & NFT_PROTO) && a->rule->protocol != b->rule->protocol) {
+        return 0;
+    }
+    if ((a->shape & NFT_PORT) && (a->port_last < b->port_first || b->port_last < a->port_first)) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * First address field of a key, used to bucket overlap checks
+ */
+static int key_bucket(const NftKey *key) {
+    if ((key->shape & NFT_SRC) && key->src_len >= NFT_BUCKET_BITS) {
+        return key->src >> (32 - NFT_BUCKET_BITS);
+    }
+    if (!(key->shape & NFT_SRC) && (key->shape & NFT_DST) && key->dst_len >= NFT_BUCKET_BITS) {
+        return key->dst >> (32 - NFT_BUCKET_BITS);
+    }
+    return -1;
+}
+
+/**
+ * Lower-case nft verdict for a rule action
+ */
+static const char *nft_verdict(const FirewallRule *rule) {
+    if (rule->action == ACTION_ACCEPT) {
+        return "accept";
+    }
+    if (rule->action == ACTION_DROP) {
+        return "drop";
+    }
+    return "jump reject_input";
+}
+
+/**
+ * Write one field value of a key
+ */
+static void write_field(FILE *out, const NftKey *key, int field) {
+    struct in_addr in;
+    char ip[INET_ADDRSTRLEN];
+
+    switch (field) {
+    case NFT_IFACE:
+        if (key->wildcard) {
+            // iptables' "eth+" is nft's "eth*"
+            const char *name = pool_string(key->rule->interface);
+            fprintf(out, "\"%.*s*\"", (int)strlen(name) - 1, name);
+        } else {
+            fprintf(out, "\"%s\"", pool_string(key->rule->interface));
+        }
+        break;
+    case NFT_SRC:
+    case NFT_DST:
+        in.s_addr = htonl(field == NFT_SRC ? key->src : key->dst);
+        inet_ntop(AF_INET, &in, ip, sizeof(ip));
+        fprintf(out, "%s/%d", ip, field == NFT_SRC ? key->src_len : key->dst_len);
+        break;
+    case NFT_PROTO:
+        fprintf(out, "%s", key->rule->protocol == PROTO_TCP ? "tcp" :
+                           key->rule->protocol == PROTO_UDP ? "udp" : "icmp");
+        break;
+    case NFT_PORT:
+        if (key->port_first == key->port_last) {
+            fprintf(out, "%d", key->port_first);
+        } else {
+            fprintf(out, "%d-%d", key->port_first, key->port_last);
+        }
+        break;
+    }
+}
+
+/**
+ * Write "a . b . c" for the fields in a shape (types or expressions)
+ */
+static void write_concat(FILE *out, int shape, int types) {
+    int first = 1;
+
+    for (int f = 0; f < NFT_FIELD_COUNT; f++) {
+        if (shape & nft_fields[f].field) {
+            fprintf(out, "%s%s", first ? "" : " . ", types ? nft_fields[f].type : nft_fields[f].expr);
+            first = 0;
+        }
+    }
+}
+
+/**
+ * Write a key's element value
+ */
+static void write_element(FILE *out, const NftKey *key) {
+    int first = 1;
+
+    for (int f = 0; f < NFT_FIELD_COUNT; f++) {
+        if (key->shape & nft_fields[f].field) {
+            fprintf(out, "%s", first ? "" : " . ");
+            write_field(out, key, nft_fields[f].field);
+            first = 0;
+        }
+    }
+}
+
+/**
+ * Check whether a key needs interval flags (CIDR or port range)
+ */
+static int key_is_interval(const NftKey *key) {
+    return ((key->shape & NFT_SRC) && key->src_len < 32) ||
+           ((key->shape & NFT_DST) && key->dst_len < 32) ||
+           ((key->shape & NFT_PORT) && key->port_first != key->port_last);
+}
+
+/**
+ * Write a group of keys as a set or verdict map declaration
+ */
+static void write_group_decl(FILE *out, const NftKey *keys, int first, int count, int index) {
+    int mixed = 0, interval = 0;
+
+    for (int i = first; i < first + count; i++) {
+        if (keys[i].rule->action != keys[first].rule->action) {
+            mixed = 1;
+        }
+        if (key_is_interval(&keys[i])) {
+            interval = 1;
+        }
+    }
+
+    fprintf(out, "    %s g%d {\n", mixed ? "map" : "set", index);
+    fprintf(out, "        type ");
+    write_concat(out, keys[first].shape, 1);
+    fprintf(out, "%s\n", mixed ? " : verdict" : "");
+    if (interval) {
+        fprintf(out, "        flags interval\n");
+    }
+    fprintf(out, "        elements = {");
+    for (int i = first; i < first + count; i++) {
+        fprintf(out, "%s\n            ", i == first ? "" : ",");
+        write_element(out, &keys[i]);
+        if (mixed) {
+            fprintf(out, " : %s", nft_verdict(keys[i].rule));
+        }
+    }
+    fprintf(out, "\n        }\n");
+    fprintf(out, "    }\n");
+}
+
+/**
+ * Write the chain rule that looks up a group (or matches a lone rule)
+ */
+static void write_group_rule(FILE *out, const NftKey *keys, int first, int count, int index) {
+    const NftKey *key = &keys[first];
+
+    fprintf(out, "        ");
+    if (count == 1) {
+        for (int f = 0; f < NFT_FIELD_COUNT; f++) {
+            if (key->shape & nft_fields[f].field) {
+                fprintf(out, "%s ", nft_fields[f].expr);
+                write_field(out, key, nft_fields[f].field);
+                fprintf(out, " ");
+            }
+        }
+        fprintf(out, "%s comment \"Rule-ID-%d\"\n", nft_verdict(key->rule), key->rule->id);
+        return;
+    }
+
+    int mixed = 0;
+    for (int i = first; i < first + count; i++) {
+        if (keys[i].rule->action != key->rule->action) {
+            mixed = 1;
+        }
+    }
+
+    write_concat(out, key->shape, 0);
+    if (mixed) {
+        fprintf(out, " vmap @g%d", index);
+    } else {
+        fprintf(out, " @g%d %s", index, nft_verdict(key->rule));
+    }
+    fprintf(out, " comment \"Rule-ID-%d..%d\"\n", key->rule->id, keys[first + count - 1].rule->id);
+}
+
+/**
+ * Split keys into groups of consecutive, same-shape, non-overlapping keys
+ * group_start receives the first index of each group; returns group count
+ */
+static int build_groups(NftKey *keys, int count, int *group_start) {
+    static int buckets[1 << NFT_BUCKET_BITS];
+    int *touched = malloc(sizeof(int) * (count + 1));
+    int touched_count = 0;
+    int wide = -1;
+    int groups = 0;
+    int start = 0;
+
+    if (!touched) {
+        return -1;
+    }
+    memset(buckets, -1, sizeof(buckets));
+
+    for (int i = 0; i < count; i++) {
+        int split = (i == 0) || keys[i].shape != keys[start].shape || keys[i].shape == 0 ||
+                    keys[i].wildcard || keys[start].wildcard;
+        int bucket = key_bucket(&keys[i]);
+
+        // Look for an overlapping key in the current group
+        if (!split) {
+            if (bucket < 0) {
+                for (int j = start; j < i && !split; j++) {
+                    split = keys_overlap(&keys[i], &keys[j]);
+                }
+            } else {
+                for (int j = buckets[bucket]; j >= 0 && !split; j = keys[j].bucket_next) {
+                    split = keys_overlap(&keys[i], &keys[j]);
+                }
+                for (int j = wide; j >= 0 && !split; j = keys[j].bucket_next) {
+                    split = keys_overlap(&keys[i], &keys[j]);
+                }
+            }
+        }
+
+        if (split) {
+            for (int t = 0; t < touched_count; t++) {
+                buckets[touched[t]] = -1;
+            }
+            touched_count = 0;
+            wide = -1;
+            start = i;
+            group_start[groups++] = i;
+        }
+
+        if (bucket < 0) {
+            keys[i].bucket_next = wide;
+            wide = i;
+        } else {
+            if (buckets[bucket] < 0) {
+                touched[touched_count++] = bucket;
+            }
+            keys[i].bucket_next = buckets[bucket];
+            buckets[bucket] = i;
+        }
+    }
+
+    free(touched);
+    group_start[groups] = count;
+    return groups;
+}
+
+/**
+ * Write the complete nft script for the in-memory ruleset
+ * The table is created, deleted and re-declared so the script
+ * replaces any previous version in one transaction
+ */
+int render_nft_ruleset(FILE *out) {
+    NftKey *keys = malloc(sizeof(NftKey) * (rule_count + 1));
+    int *group_start = malloc(sizeof(int) * (rule_count + 1));
+    int count = 0;
+
+    if (!keys || !group_start) {
+        free(keys);
+        free(group_start);
+        return -1;
+    }
+
+    FirewallRule **rules = ordered_rules();
+    for (int i = 0; i < rule_count; i++) {
+        if (rules[i]->active) {
+            build_key(rules[i], &keys[count++]);
+        }
+    }
+
+    int groups = build_groups(keys, count, group_start);
+    if (groups < 0) {
+        free(keys);
+        free(group_start);
+        return -1;
+    }
+
+    fprintf(out, "table ip %s\n", NFT_TABLE);
+    fprintf(out, "delete table ip %s\n", NFT_TABLE);
+    fprintf(out, "table ip %s {\n", NFT_TABLE);
+    fprintf(out, "    chain reject_input {\n");
+    fprintf(out, "        reject\n");
+    fprintf(out, "    }\n");
+
+    for (int g = 0; g < groups; g++) {
+        int size = group_start[g + 1] - group_start[g];
+        if (size > 1) {
+            write_group_decl(out, keys, group_start[g], size, g + 1);
+        }
+    }
+
+    fprintf(out, "    chain input {\n");
+    fprintf(out, "        type filter hook input priority filter; policy accept;\n");
+    if (firewall_config.fast_path) {
+        fprintf(out, "        ct state established,related accept comment \"%s\"\n", FAST_PATH_COMMENT);
+        fprintf(out, "        ct state invalid drop comment \"%s\"\n", FAST_PATH_COMMENT);
+    }
+    for (int g = 0; g < groups; g++) {
+        write_group_rule(out, keys, group_start[g], group_start[g + 1] - group_start[g], g + 1);
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "}\n");
+
+    free(keys);
+    free(group_start);
+    return 0;
+}
+
+/**
+ * Run an nft script through "nft -f -"
+ */
+static int run_nft_script(int (*render)(FILE *out)) {
+    char *args[] = {"nft", "-f", "-", NULL};
+    pid_t pid;
+
+    FILE *fp = open_command_pipe(args, &pid);
+    if (!fp) {
+        return -1;
+    }
+
+    render(fp);
+    return close_command_pipe(fp, pid);
+}
+
+/**
+ * Replace the nftables table with the compiled ruleset
+ */
+int nft_apply_ruleset(void) {
+    printf("Executing: nft -f - (%d rules)\n", rule_count);
+
+    // A snapshot loaded for these rules already holds the script
+    size_t cached;
+    int ret = run_nft_script(snapshot_payload(&cached) ? write_snapshot_payload : render_nft_ruleset);
+    if (ret != 0) {
+        fprintf(stderr, "Error: nft transaction failed, ruleset unchanged\n");
+    }
+    return ret;
+}
+
+/**
+ * Script that removes the table if it exists
+ */
+static int render_nft_flush(FILE *out) {
+    fprintf(out, "table ip %s\n", NFT_TABLE);
+    fprintf(out, "delete table ip %s\n", NFT_TABLE);
+    return 0;
+}
+
+/**
+ * Remove every rule installed by the nftables backend
+ */
+int nft_flush_ruleset(void) {
+    printf("Flushing nftables rules...\n");
+
+    if (run_nft_script(render_nft_flush) != 0) {
+        fprintf(stderr, "Warning: Failed to delete table %s\n", NFT_TABLE);
+        return -1;
+    }
+
+    printf("Rules flushed successfully\n");
+    return 0;
+}
+
+/**
+ * Print the installed table with counters
+ */
+int nft_print_ruleset(void) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        char *args[] = {"nft", "list", "table", "ip", NFT_TABLE, NULL};
+        execvp("nft", args);
+        perror("execvp");
+        _exit(1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
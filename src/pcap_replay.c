@@ -0,0 +1,527 @@
+#include "firewall.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * Capture replay (`firewall replay <file.pcap>`).
+ *
+ * Runs every IPv4 packet of a pcap capture through a classifier compiled
+ * from the rules, as the first packet of its connection, and counts the
+ * packets and bytes each rule would take. Given a baseline rules file,
+ * it also reports the packets the rules now drop that the baseline let
+ * through. No traffic is sent and no root is needed.
+ *
+ * The file is memory-mapped and read in place. Packets are sharded
+ * across worker threads by a hash of their 5-tuple, so a flow always
+ * lands on the same worker: every worker walks the record headers and
+ * classifies only the packets of its own flows, into its own counters.
+ * The counters are merged once the workers are done. Walking a record
+ * header costs little next to classifying the packet, and no queue or
+ * lock sits between the workers.
+ *
+ * Classic pcap files in either byte order, with microsecond or
+ * nanosecond timestamps, are read. Link types: Ethernet (with VLAN
+ * tags), raw IPv4, BSD loopback and Linux cooked captures (v1 and v2).
+ * Captures carry no input interface, so one can be given for all
+ * packets; otherwise rules naming an interface match nothing.
+ */
+
+#define PCAP_MAGIC_MICRO 0xA1B2C3D4u
+#define PCAP_MAGIC_NANO  0xA1B23C4Du
+#define PCAPNG_MAGIC     0x0A0D0D0Au
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+
+// Link-layer header types
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+
+#define REPLAY_MAX_WORKERS 16
+// Newly dropped packets listed; later ones are only counted
+#define REPLAY_MAX_SAMPLES 10
+
+// A packet the rules drop that the baseline let through
+typedef struct {
+    long index;                 // Packet number in the capture, from 1
+    MatchPacket packet;
+    int rule_id;                // Rule that drops it, 0 for the policy
+    int baseline_id;            // Rule that accepted it, 0 for the policy
+} ReplaySample;
+
+typedef struct {
+    int worker;
+    int workers;
+    const unsigned char *records;
+    const unsigned char *end;
+    int swapped;
+    uint32_t linktype;
+    uint32_t interface;
+    const PacketClassifier *rules;
+    const PacketClassifier *baseline;   // NULL without a baseline
+    int policy;                         // ACTION_* of the chain policy
+
+    unsigned long long *packets;        // Per rule position, policy last
+    unsigned long long *bytes;
+    // Every worker walks all records, so these come out the same in each
+    unsigned long long records_seen;
+    unsigned long long records_bytes;   // Wire length of all records
+    unsigned long long skipped;         // Not IPv4
+    int truncated;
+    unsigned long long newly_dropped;
+    unsigned long long newly_dropped_bytes;
+    unsigned long long newly_accepted;
+    ReplaySample samples[REPLAY_MAX_SAMPLES];
+    int sample_count;
+} ReplayWorker;
+
+static uint32_t swap_u32(uint32_t v) {
+    return v >> 24 | (v >> 8 & 0xFF00) | (v << 8 & 0xFF0000) | v << 24;
+}
+
+/**
+ * Read a 32-bit field of the capture's byte order
+ */
+static uint32_t read_u32(const unsigned char *p, int swapped) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swapped ? swap_u32(v) : v;
+}
+
+/**
+ * Read a big-endian (network order) field
+ */
+static uint16_t read_be16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t read_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * Decode the IPv4 header of a captured packet
+ * Fills in the packet and a hash of its 5-tuple
+ * Returns 1 for an IPv4 packet, 0 for anything else
+ */
+static int decode_packet(const unsigned char *data, uint32_t caplen, uint32_t linktype,
+                         MatchPacket *packet, uint32_t *flow) {
+    uint32_t off;
+
+    switch (linktype) {
+    case LINKTYPE_ETHERNET: {
+        if (caplen < 14) {
+            return 0;
+        }
+        uint16_t type = read_be16(data + 12);
+        off = 14;
+        while ((type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) && caplen >= off + 4) {
+            type = read_be16(data + off + 2);
+            off += 4;
+        }
+        if (type != ETHERTYPE_IPV4) {
+            return 0;
+        }
+        break;
+    }
+    case LINKTYPE_NULL:
+        // Address family in the capturing host's byte order; AF_INET is 2
+        if (caplen < 4 || (data[0] != 2 && data[3] != 2)) {
+            return 0;
+        }
+        off = 4;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (caplen < 16 || read_be16(data + 14) != ETHERTYPE_IPV4) {
+            return 0;
+        }
+        off = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (caplen < 20 || read_be16(data) != ETHERTYPE_IPV4) {
+            return 0;
+        }
+        off = 20;
+        break;
+    default:
+        off = 0;
+        break;
+    }
+
+    const unsigned char *ip = data + off;
+    if (caplen < off + 20 || ip[0] >> 4 != 4) {
+        return 0;
+    }
+    uint32_t header_len = (uint32_t)(ip[0] & 0x0F) * 4;
+    int ip_proto = ip[9];
+
+    packet->source = read_be32(ip + 12);
+    packet->dest = read_be32(ip + 16);
+    packet->interface = 0;
+    packet->port = 0;
+    packet->protocol = ip_proto == 6 ? PROTO_TCP : ip_proto == 17 ? PROTO_UDP :
+                       ip_proto == 1 ? PROTO_ICMP : PROTO_NONE;
+
+    // Ports are in the first fragment only
+    uint16_t source_port = 0;
+    if ((packet->protocol == PROTO_TCP || packet->protocol == PROTO_UDP) &&
+        (read_be16(ip + 6) & 0x1FFF) == 0 && header_len >= 20 && caplen >= off + header_len + 4) {
+        source_port = read_be16(ip + header_len);
+        packet->port = read_be16(ip + header_len + 2);
+    }
+
+    uint32_t h = packet->source * 0x9E3779B1u ^ packet->dest * 0x85EBCA77u ^
+                 ((uint32_t)source_port << 16 | packet->port) * 0xC2B2AE3Du ^ (uint32_t)ip_proto;
+    *flow = h ^ (h >> 16);
+    return 1;
+}
+
+/**
+ * Verdict for a matched rule, or the policy when none matched
+ */
+static int verdict_of(const FirewallRule *rule, int policy) {
+    return rule ? rule->action : policy;
+}
+
+static int is_dropped(int action) {
+    return action == ACTION_DROP || action == ACTION_REJECT;
+}
+
+/**
+ * Classify the packets of one worker's flows
+ */
+static void *replay_worker(void *arg) {
+    ReplayWorker *w = arg;
+    const unsigned char *pos = w->records;
+    int policy_slot = w->rules->rule_count;
+    long index = 0;
+
+    while (w->end - pos >= PCAP_RECORD_SIZE) {
+        uint32_t caplen = read_u32(pos + 8, w->swapped);
+        uint32_t wire_len = read_u32(pos + 12, w->swapped);
+        const unsigned char *data = pos + PCAP_RECORD_SIZE;
+        if (caplen > (size_t)(w->end - data)) {
+            break;
+        }
+        pos = data + caplen;
+        index++;
+        w->records_bytes += wire_len;
+
+        MatchPacket packet;
+        uint32_t flow;
+        if (!decode_packet(data, caplen, w->linktype, &packet, &flow)) {
+            w->skipped++;
+            continue;
+        }
+        if ((int)(flow % (uint32_t)w->workers) != w->worker) {
+            continue;
+        }
+        packet.interface = w->interface;
+
+        const FirewallRule *rule = classifier_lookup(w->rules, &packet);
+        int slot = rule ? (int)(rule - w->rules->rules) : policy_slot;
+        w->packets[slot]++;
+        w->bytes[slot] += wire_len;
+
+        if (!w->baseline) {
+            continue;
+        }
+        const FirewallRule *before = classifier_lookup(w->baseline, &packet);
+        int now_dropped = is_dropped(verdict_of(rule, w->policy));
+        int was_dropped = is_dropped(verdict_of(before, w->policy));
+        if (now_dropped && !was_dropped) {
+            w->newly_dropped++;
+            w->newly_dropped_bytes += wire_len;
+            if (w->sample_count < REPLAY_MAX_SAMPLES) {
+                ReplaySample *s = &w->samples[w->sample_count++];
+                s->index = index;
+                s->packet = packet;
+                s->rule_id = rule ? rule->id : 0;
+                s->baseline_id = before ? before->id : 0;
+            }
+        } else if (was_dropped && !now_dropped) {
+            w->newly_accepted++;
+        }
+    }
+
+    w->records_seen = (unsigned long long)index;
+    w->truncated = pos < w->end;
+    return NULL;
+}
+
+/**
+ * Number of worker threads to use
+ */
+static int replay_worker_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > REPLAY_MAX_WORKERS ? REPLAY_MAX_WORKERS : (int)cpus;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    long x = ((const ReplaySample *)a)->index, y = ((const ReplaySample *)b)->index;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Compile the classifier of a baseline rules file
+ */
+static int compile_baseline(const char *filename, PacketClassifier *pc) {
+    FirewallRule *list;
+    int count = read_rule_list(filename, &list);
+    if (count < 0) {
+        return -1;
+    }
+
+    FirewallRule **order = malloc(sizeof(FirewallRule *) * (count + 1));
+    if (!order) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(list);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        order[i] = &list[i];
+    }
+    int ret = compile_classifier(order, count, pc);
+    free(order);
+    free(list);
+    return ret;
+}
+
+/**
+ * Print the rules that took packets, in evaluation order
+ */
+static void print_rule_hits(const PacketClassifier *pc, const unsigned long long *packets,
+                            const unsigned long long *bytes) {
+    char line[MAX_CONFIG_LINE];
+    int unused = 0;
+
+    printf("\n%10s %14s %16s  %s\n", "Rule", "Packets", "Bytes", "Match");
+    for (int i = 0; i < pc->rule_count; i++) {
+        if (!packets[i]) {
+            unused++;
+            continue;
+        }
+        format_rule_line(&pc->rules[i], line, sizeof(line));
+        printf("%10d %14llu %16llu  %s", pc->rules[i].id, packets[i], bytes[i], strchr(line, ' ') + 1);
+    }
+    printf("%10s %14llu %16llu  %s\n", "policy", packets[pc->rule_count], bytes[pc->rule_count],
+           firewall_config.policy);
+    if (unused) {
+        printf("%d active rules took no packets\n", unused);
+    }
+}
+
+/**
+ * Print a sample of the packets the rules drop that the baseline passed
+ */
+static void print_samples(ReplaySample *samples, int count) {
+    qsort(samples, count, sizeof(ReplaySample), compare_samples);
+    if (count > REPLAY_MAX_SAMPLES) {
+        count = REPLAY_MAX_SAMPLES;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const ReplaySample *s = &samples[i];
+        char src[MAX_IP_LENGTH], dst[MAX_IP_LENGTH], now[24], before[24];
+
+        format_address(s->packet.source, 32, src, sizeof(src));
+        format_address(s->packet.dest, 32, dst, sizeof(dst));
+        if (s->rule_id) {
+            snprintf(now, sizeof(now), "rule %d", s->rule_id);
+        } else {
+            snprintf(now, sizeof(now), "policy");
+        }
+        if (s->baseline_id) {
+            snprintf(before, sizeof(before), "rule %d", s->baseline_id);
+        } else {
+            snprintf(before, sizeof(before), "policy");
+        }
+        printf("  packet %ld: %s -> %s %s", s->index, src, dst,
+               s->packet.protocol ? protocol_name(s->packet.protocol) : "other");
+        if (s->packet.port) {
+            printf(" port %u", s->packet.port);
+        }
+        printf(": dropped by %s, passed by %s\n", now, before);
+    }
+}
+
+/**
+ * Replay a pcap capture against the rules
+ * With a baseline rules file, also report packets that the rules drop
+ * and the baseline passed. interface (may be NULL) is the input
+ * interface of every packet.
+ * Returns 0 on success, -1 on error
+ */
+int replay_capture(const char *filename, const char *baseline_file, const char *interface) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: Not a regular file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < PCAP_HEADER_SIZE) {
+        fprintf(stderr, "Error: Not a pcap file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s\n", filename);
+        return -1;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    uint32_t magic = read_u32(map, 0);
+    int swapped = magic == swap_u32(PCAP_MAGIC_MICRO) || magic == swap_u32(PCAP_MAGIC_NANO);
+    if (magic == PCAPNG_MAGIC) {
+        fprintf(stderr, "Error: %s is pcapng; convert it with \"editcap -F pcap\"\n", filename);
+        munmap(map, size);
+        return -1;
+    }
+    if (!swapped && magic != PCAP_MAGIC_MICRO && magic != PCAP_MAGIC_NANO) {
+        fprintf(stderr, "Error: Not a pcap file: %s\n", filename);
+        munmap(map, size);
+        return -1;
+    }
+    uint32_t linktype = read_u32(map + 20, swapped) & 0x0FFFFFFF;
+    if (linktype != LINKTYPE_ETHERNET && linktype != LINKTYPE_RAW && linktype != LINKTYPE_IPV4 &&
+        linktype != LINKTYPE_NULL && linktype != LINKTYPE_LINUX_SLL && linktype != LINKTYPE_LINUX_SLL2) {
+        fprintf(stderr, "Error: Unsupported link type %u in %s\n", linktype, filename);
+        munmap(map, size);
+        return -1;
+    }
+
+    PacketClassifier rules, baseline;
+    memset(&baseline, 0, sizeof(baseline));
+    if (compile_classifier(ordered_rules(), rule_count, &rules) != 0) {
+        munmap(map, size);
+        return -1;
+    }
+    if (baseline_file && compile_baseline(baseline_file, &baseline) != 0) {
+        free_compiled_classifier(&rules);
+        munmap(map, size);
+        return -1;
+    }
+
+    int workers = replay_worker_count();
+    int slots = rules.rule_count + 1;
+    ReplayWorker *shards = calloc(workers, sizeof(ReplayWorker));
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+    int ret = shards && threads ? 0 : -1;
+    for (int w = 0; w < workers && ret == 0; w++) {
+        ReplayWorker *shard = &shards[w];
+        shard->worker = w;
+        shard->workers = workers;
+        shard->records = map + PCAP_HEADER_SIZE;
+        shard->end = map + size;
+        shard->swapped = swapped;
+        shard->linktype = linktype;
+        shard->interface = interface ? intern_string(interface) : 0;
+        shard->rules = &rules;
+        shard->baseline = baseline_file ? &baseline : NULL;
+        shard->policy = parse_action(firewall_config.policy);
+        shard->packets = calloc(slots, sizeof(unsigned long long));
+        shard->bytes = calloc(slots, sizeof(unsigned long long));
+        if (!shard->packets || !shard->bytes) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        struct timespec started, finished;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        // The calling thread takes the first shard itself
+        int started_workers = 1;
+        for (; started_workers < workers; started_workers++) {
+            if (pthread_create(&threads[started_workers], NULL, replay_worker, &shards[started_workers]) != 0) {
+                break;
+            }
+        }
+        replay_worker(&shards[0]);
+        for (int w = started_workers; w < workers; w++) {
+            replay_worker(&shards[w]);
+        }
+        for (int w = 1; w < started_workers; w++) {
+            pthread_join(threads[w], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+        // Merge into the first shard
+        ReplayWorker *total = &shards[0];
+        ReplaySample samples[REPLAY_MAX_WORKERS * REPLAY_MAX_SAMPLES];
+        int sample_count = total->sample_count;
+        memcpy(samples, total->samples, sizeof(ReplaySample) * total->sample_count);
+        for (int w = 1; w < workers; w++) {
+            ReplayWorker *shard = &shards[w];
+            for (int i = 0; i < slots; i++) {
+                total->packets[i] += shard->packets[i];
+                total->bytes[i] += shard->bytes[i];
+            }
+            total->newly_dropped += shard->newly_dropped;
+            total->newly_dropped_bytes += shard->newly_dropped_bytes;
+            total->newly_accepted += shard->newly_accepted;
+            memcpy(samples + sample_count, shard->samples, sizeof(ReplaySample) * shard->sample_count);
+            sample_count += shard->sample_count;
+        }
+        unsigned long long classified = total->records_seen - total->skipped;
+
+        printf("Replayed %llu packets (%.1f MB) from %s against %d rules in %.2f s using %d workers\n",
+               total->records_seen, total->records_bytes / 1e6, filename, rules.rule_count, seconds, workers);
+        printf("Rate: %.2f M packets/s, %.0f MB/s\n",
+               seconds > 0 ? total->records_seen / seconds / 1e6 : 0.0,
+               seconds > 0 ? size / seconds / 1e6 : 0.0);
+        if (total->skipped) {
+            printf("Skipped %llu packets that are not IPv4\n", total->skipped);
+        }
+        if (total->truncated) {
+            fprintf(stderr, "Warning: %s is truncated; replayed up to the last whole packet\n", filename);
+        }
+
+        if (classified) {
+            print_rule_hits(&rules, total->packets, total->bytes);
+        }
+
+        if (baseline_file) {
+            printf("\nAgainst %s: %llu packets (%llu bytes) now dropped that passed before, "
+                   "%llu now passed that were dropped\n", baseline_file,
+                   total->newly_dropped, total->newly_dropped_bytes, total->newly_accepted);
+            print_samples(samples, sample_count);
+        }
+    } else {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+
+    for (int w = 0; shards && w < workers; w++) {
+        free(shards[w].packets);
+        free(shards[w].bytes);
+    }
+    free(shards);
+    free(threads);
+    free_compiled_classifier(&rules);
+    free_compiled_classifier(&baseline);
+    munmap(map, size);
+    return ret;
+}
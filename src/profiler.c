@@ -0,0 +1,188 @@
+#include "firewall.h"
+
+/*
+ * Stage profiling (--profile).
+ *
+ * The slow steps of a command are wrapped in PROFILE_BEGIN() and
+ * PROFILE_END(stage, started): CLOCK_MONOTONIC spans recorded into one
+ * fixed histogram per stage. Without --profile, PROFILE_BEGIN() is a
+ * test of profile_enabled and PROFILE_END() a test of the zero it
+ * returned, so the spans stay in production builds.
+ *
+ * Histograms are log-linear: exact below 16 ns, then eight buckets per
+ * power of two, so a percentile is off by at most 12.5% while a stage
+ * takes PROFILE_BUCKETS counters however many spans it records. Counts,
+ * totals and maxima are exact. Recording uses relaxed atomic adds, as
+ * import parses on worker threads.
+ *
+ * The report goes to stderr when the process exits: a table of count,
+ * total, p50, p90, p99 and max per stage, or one JSON object with
+ * --profile=json. A daemon started with --profile reports when it stops.
+ */
+
+#define PROFILE_SUB_BITS 3
+#define PROFILE_LINEAR 16
+// Up to 2^48 ns (three days) in one bucket per eighth of a power of two
+#define PROFILE_BUCKETS (PROFILE_LINEAR + (48 - 4) * (1 << PROFILE_SUB_BITS))
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;             // Nanoseconds
+    uint64_t max;
+    uint64_t buckets[PROFILE_BUCKETS];
+} StageHistogram;
+
+int profile_enabled;
+static int profile_json;
+static StageHistogram histograms[PROFILE_STAGES];
+
+static const char *stage_names[PROFILE_STAGES] = {
+    "command", "daemon", "load", "parse", "journal", "compile",
+    "build", "spawn", "wait", "save", "xdp",
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < PROFILE_LINEAR) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (exponent - PROFILE_SUB_BITS)) & ((1 << PROFILE_SUB_BITS) - 1);
+    int bucket = PROFILE_LINEAR + (exponent - 4) * (1 << PROFILE_SUB_BITS) + sub;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+/**
+ * Largest value a bucket holds
+ */
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < PROFILE_LINEAR) {
+        return (uint64_t)bucket;
+    }
+    int exponent = (bucket - PROFILE_LINEAR) / (1 << PROFILE_SUB_BITS) + 4;
+    int sub = (bucket - PROFILE_LINEAR) % (1 << PROFILE_SUB_BITS);
+    uint64_t width = 1ull << (exponent - PROFILE_SUB_BITS);
+    return (1ull << exponent) + (uint64_t)(sub + 1) * width - 1;
+}
+
+/**
+ * Record a span of a stage that started at the given profile_clock()
+ */
+void profile_record(int stage, uint64_t started) {
+    uint64_t ns = profile_clock() - started;
+    StageHistogram *h = &histograms[stage];
+
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Value below which the given share of a stage's spans fall
+ */
+static uint64_t percentile(const StageHistogram *h, double share) {
+    uint64_t rank = (uint64_t)(share * h->count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t limit = bucket_limit(b);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Format nanoseconds with a unit that keeps three significant digits
+ */
+static const char *format_duration(uint64_t ns, char *out, size_t size) {
+    if (ns < 1000) {
+        snprintf(out, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(out, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(out, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(out, size, "%.2fs", ns / 1e9);
+    }
+    return out;
+}
+
+/**
+ * Print the stages that recorded spans
+ */
+static void profile_report(void) {
+    char a[16], b[16], c[16], d[16], e[16];
+
+    if (profile_json) {
+        fprintf(stderr, "{\"stages\":[");
+        int first = 1;
+        for (int s = 0; s < PROFILE_STAGES; s++) {
+            const StageHistogram *h = &histograms[s];
+            if (!h->count) {
+                continue;
+            }
+            fprintf(stderr, "%s{\"stage\":\"%s\",\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,"
+                            "\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}",
+                    first ? "" : ",", stage_names[s], (unsigned long long)h->count,
+                    (unsigned long long)h->total, (unsigned long long)percentile(h, 0.50),
+                    (unsigned long long)percentile(h, 0.90), (unsigned long long)percentile(h, 0.99),
+                    (unsigned long long)h->max);
+            first = 0;
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    fprintf(stderr, "\n%-10s %9s %10s %10s %10s %10s %10s\n", "Stage", "Count", "Total", "p50", "p90", "p99", "Max");
+    for (int s = 0; s < PROFILE_STAGES; s++) {
+        const StageHistogram *h = &histograms[s];
+        if (!h->count) {
+            continue;
+        }
+        fprintf(stderr, "%-10s %9llu %10s %10s %10s %10s %10s\n", stage_names[s], (unsigned long long)h->count,
+                format_duration(h->total, a, sizeof(a)), format_duration(percentile(h, 0.50), b, sizeof(b)),
+                format_duration(percentile(h, 0.90), c, sizeof(c)), format_duration(percentile(h, 0.99), d, sizeof(d)),
+                format_duration(h->max, e, sizeof(e)));
+    }
+}
+
+/**
+ * Take --profile or --profile=json out of the arguments and, if given,
+ * start profiling with a report at exit
+ * Returns the remaining argument count
+ */
+int profile_options(int argc, char *argv[]) {
+    int kept = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && (strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "--profile=json") == 0)) {
+            profile_json = argv[i][9] == '=';
+            profile_enabled = 1;
+            continue;
+        }
+        argv[kept++] = argv[i];
+    }
+    argv[kept] = NULL;
+
+    if (profile_enabled) {
+        atexit(profile_report);
+    }
+    return kept;
+}
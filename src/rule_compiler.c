@@ -0,0 +1,386 @@
+#include "firewall.h"
+
+/*
+ * iptables rule compiler.
+ *
+ * Turns the in-memory rules into the list of entries the INPUT chain
+ * should hold. Runs of consecutive rules that differ only in their
+ * source (or destination) address are folded into a single entry that
+ * matches a hash:net ipset, so a long blocklist costs one hash lookup
+ * per packet instead of one rule per address. Rules that differ only in
+ * their destination port are gathered into multiport entries; a later
+ * rule is only pulled forward into a group when no rule it would jump
+ * over could give an overlapping packet a different verdict.
+ */
+
+/**
+ * FNV-1a hash, used to derive stable ipset names
+ */
+static uint32_t hash_string(const char *text, uint32_t hash) {
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Check whether an address can be stored in a hash:net set
+ * (hash:net does not accept a /0 prefix)
+ */
+static int set_member_ok(int prefix_len) {
+    return prefix_len > 0;
+}
+
+/**
+ * Check whether two rules are identical apart from one address field
+ */
+static int same_except(const FirewallRule *a, const FirewallRule *b, int field) {
+    if (a->action != b->action ||
+        a->protocol != b->protocol ||
+        a->port_first != b->port_first || a->port_last != b->port_last ||
+        a->interface != b->interface) {
+        return 0;
+    }
+
+    if (field == SET_MATCH_SOURCE) {
+        return a->dest == b->dest && a->dest_len == b->dest_len &&
+               set_member_ok(a->source_len) && set_member_ok(b->source_len);
+    }
+    return a->source == b->source && a->source_len == b->source_len &&
+           set_member_ok(a->dest_len) && set_member_ok(b->dest_len);
+}
+
+/**
+ * Check whether a rule can join a multiport group
+ */
+static int multiport_ok(const FirewallRule *rule) {
+    return rule->port_first && (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP);
+}
+
+/**
+ * Kernel multiport slots taken by a port (ranges take two)
+ */
+static int port_slots(const FirewallRule *rule) {
+    return rule->port_first != rule->port_last ? 2 : 1;
+}
+
+/**
+ * Check whether two rules are identical apart from the destination port
+ */
+static int same_but_port(const FirewallRule *a, const FirewallRule *b) {
+    return multiport_ok(a) && multiport_ok(b) &&
+           a->action == b->action &&
+           a->source == b->source && a->source_len == b->source_len &&
+           a->dest == b->dest && a->dest_len == b->dest_len &&
+           a->protocol == b->protocol &&
+           a->interface == b->interface;
+}
+
+/**
+ * Check whether an address field of two rules can match the same packet
+ * (a field that is not given matches everything)
+ */
+static int addresses_overlap(uint32_t addr_a, int len_a, uint32_t addr_b, int len_b) {
+    if (len_a < 0 || len_b < 0) {
+        return 1;
+    }
+    int len = len_a < len_b ? len_a : len_b;
+    uint32_t mask = len ? 0xFFFFFFFFu << (32 - len) : 0;
+    return ((addr_a ^ addr_b) & mask) == 0;
+}
+
+/**
+ * Check whether two interface matches can take the same packet
+ * (0 matches every interface, a name ending in '+' every interface
+ * that starts with the rest of it)
+ */
+int interfaces_overlap(uint32_t a, uint32_t b) {
+    if (!a || !b || a == b) {
+        return 1;
+    }
+    const char *name_a = pool_string(a), *name_b = pool_string(b);
+    size_t len_a = strlen(name_a), len_b = strlen(name_b);
+    int wild_a = len_a > 0 && name_a[len_a - 1] == '+';
+    int wild_b = len_b > 0 && name_b[len_b - 1] == '+';
+    if (wild_a) {
+        len_a--;
+    }
+    if (wild_b) {
+        len_b--;
+    }
+    // A wildcard overlaps anything its prefix is a prefix of
+    if (wild_a && wild_b) {
+        return strncmp(name_a, name_b, len_a < len_b ? len_a : len_b) == 0;
+    }
+    if (wild_a) {
+        return len_a <= len_b && strncmp(name_a, name_b, len_a) == 0;
+    }
+    if (wild_b) {
+        return len_b <= len_a && strncmp(name_a, name_b, len_b) == 0;
+    }
+    return 0;
+}
+
+/**
+ * Check whether some packet could match both rules
+ */
+int rules_overlap(const FirewallRule *a, const FirewallRule *b) {
+    if (!addresses_overlap(a->source, a->source_len, b->source, b->source_len) ||
+        !addresses_overlap(a->dest, a->dest_len, b->dest, b->dest_len)) {
+        return 0;
+    }
+    // "ALL" matches any protocol, like no protocol at all
+    if (a->protocol != PROTO_NONE && a->protocol != PROTO_ALL &&
+        b->protocol != PROTO_NONE && b->protocol != PROTO_ALL &&
+        a->protocol != b->protocol) {
+        return 0;
+    }
+    if (!interfaces_overlap(a->interface, b->interface)) {
+        return 0;
+    }
+    if (multiport_ok(a) && multiport_ok(b)) {
+        return a->port_first <= b->port_last && b->port_first <= a->port_last;
+    }
+    return 1;
+}
+
+/**
+ * Check whether rule from can move up to just after rule to without
+ * changing any verdict: every rule it jumps over must either share its
+ * action or be unable to match the same packets
+ */
+static int can_hoist(int from, int to, const char *taken) {
+    FirewallRule **rules = ordered_rules();
+    for (int k = to + 1; k < from; k++) {
+        if (taken[k] || !rules[k]->active) {
+            continue;
+        }
+        if (rules[k]->action != rules[from]->action && rules_overlap(rules[k], rules[from])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Gather rules that differ from rule first only in their port into a
+ * multiport entry, marking the ones pulled in as taken
+ */
+static void gather_multiport(CompiledEntry *entry, int first, char *taken) {
+    FirewallRule **rules = ordered_rules();
+    char ports[MULTIPORT_LENGTH], ids[MAX_COMMENT_LENGTH];
+    int slots = port_slots(rules[first]);
+    int members = 1;
+
+    format_port_range(rules[first]->port_first, rules[first]->port_last, ports, sizeof(ports));
+    snprintf(ids, sizeof(ids), "Rule-ID-%d", rules[first]->id);
+
+    for (int j = first + 1; j < rule_count && j <= first + MULTIPORT_LOOKAHEAD && slots < MULTIPORT_MAX_SLOTS; j++) {
+        if (taken[j] || !rules[j]->active || !same_but_port(rules[first], rules[j]) ||
+            slots + port_slots(rules[j]) > MULTIPORT_MAX_SLOTS || !can_hoist(j, first, taken)) {
+            continue;
+        }
+
+        char port[MAX_PORT_LENGTH];
+        size_t used = strlen(ports), id_used = strlen(ids);
+        format_port_range(rules[j]->port_first, rules[j]->port_last, port, sizeof(port));
+        snprintf(ports + used, sizeof(ports) - used, ",%s", port);
+        snprintf(ids + id_used, sizeof(ids) - id_used, ",%d", rules[j]->id);
+        slots += port_slots(rules[j]);
+        taken[j] = 1;
+        members++;
+    }
+
+    if (members > 1) {
+        // Ports live in the multiport match, member IDs in the comment
+        strcpy(entry->multiport, ports);
+        entry->rule.port_first = 0;
+        entry->rule.port_last = 0;
+        strcpy(entry->comment, ids);
+    }
+}
+
+/**
+ * Name a set after everything its members have in common, so adding
+ * or removing a member keeps the name (and the chain entry) unchanged
+ */
+static void name_set(CompiledRuleset *rs, CompiledEntry *entry) {
+    const FirewallRule *r = &entry->rule;
+    char source[MAX_IP_LENGTH], dest[MAX_IP_LENGTH], port[MAX_PORT_LENGTH];
+    uint32_t hash = 2166136261u;
+
+    // Hashed as text so names do not depend on the in-memory layout
+    format_address(r->source, r->source_len, source, sizeof(source));
+    format_address(r->dest, r->dest_len, dest, sizeof(dest));
+    format_port_range(r->port_first, r->port_last, port, sizeof(port));
+    hash = hash_string(entry->set_field == SET_MATCH_SOURCE ? "src" : "dst", hash);
+    hash = hash_string(action_name(r->action), hash);
+    hash = hash_string(source, hash);
+    hash = hash_string(dest, hash);
+    hash = hash_string(port, hash);
+    hash = hash_string(protocol_name(r->protocol), hash);
+    hash = hash_string(pool_string(r->interface), hash);
+
+    // Groups with the same shape later in the chain get their own set
+    int occurrence = 0;
+    for (int i = 0; i < rs->entry_count; i++) {
+        if (rs->entries[i].set_name[0] && rs->entries[i].set_hash == hash) {
+            occurrence++;
+        }
+    }
+
+    entry->set_hash = hash;
+    snprintf(entry->set_name, sizeof(entry->set_name), "pfw-%08x-%d", hash, occurrence);
+}
+
+/**
+ * Add the conntrack fast path: packets of known connections are accepted
+ * and invalid ones dropped before any rule, so the rules only ever see
+ * packets that open a new connection
+ */
+static void add_fast_path(CompiledRuleset *rs) {
+    const char *states[] = { "ESTABLISHED,RELATED", "INVALID" };
+    const int actions[] = { ACTION_ACCEPT, ACTION_DROP };
+
+    for (int i = 0; i < 2; i++) {
+        CompiledEntry *entry = &rs->entries[rs->entry_count++];
+        make_empty_entry(entry);
+        strcpy(entry->ctstate, states[i]);
+        strcpy(entry->comment, FAST_PATH_COMMENT);
+        entry->rule.action = actions[i];
+    }
+}
+
+/**
+ * Compile the active rules into chain entries
+ */
+static int compile_entries(CompiledRuleset *rs) {
+    FirewallRule **rules = ordered_rules();
+    memset(rs, 0, sizeof(*rs));
+
+    rs->entries = malloc(sizeof(CompiledEntry) * (rule_count + 3));
+    rs->members = malloc(sizeof(*rs->members) * (rule_count + 1));
+    char *taken = calloc(rule_count + 1, 1);
+    if (!rs->entries || !rs->members || !taken) {
+        free_compiled_ruleset(rs);
+        free(taken);
+        return -1;
+    }
+
+    if (firewall_config.fast_path) {
+        add_fast_path(rs);
+    }
+
+    int threshold = firewall_config.ipset_threshold;
+    int i = 0;
+
+    while (i < rule_count) {
+        if (!rules[i]->active || taken[i]) {
+            i++;
+            continue;
+        }
+
+        // Find the longest run of rules that differ in one address only
+        int run = 1, field = 0;
+        if (threshold > 0) {
+            int fields[] = { SET_MATCH_SOURCE, SET_MATCH_DEST };
+            for (int f = 0; f < 2; f++) {
+                int j = i + 1;
+                while (j < rule_count && rules[j]->active && !taken[j] && same_except(rules[i], rules[j], fields[f])) {
+                    j++;
+                }
+                if (j - i > run) {
+                    run = j - i;
+                    field = fields[f];
+                }
+            }
+        }
+
+        CompiledEntry *entry = &rs->entries[rs->entry_count];
+        memset(entry, 0, sizeof(*entry));
+        entry->rule = *rules[i];
+
+        if (threshold > 0 && run >= threshold) {
+            entry->set_field = field;
+            entry->first_member = rs->member_count;
+            entry->member_count = run;
+            for (int j = i; j < i + run; j++) {
+                if (field == SET_MATCH_SOURCE) {
+                    format_address(rules[j]->source, rules[j]->source_len,
+                                   rs->members[rs->member_count++], MAX_IP_LENGTH);
+                } else {
+                    format_address(rules[j]->dest, rules[j]->dest_len,
+                                   rs->members[rs->member_count++], MAX_IP_LENGTH);
+                }
+            }
+
+            // The varying address lives in the set, not the entry
+            if (field == SET_MATCH_SOURCE) {
+                entry->rule.source_len = -1;
+            } else {
+                entry->rule.dest_len = -1;
+            }
+            entry->rule.comment = 0;
+            name_set(rs, entry);
+        } else {
+            run = 1;
+            if (multiport_ok(rules[i])) {
+                gather_multiport(entry, i, taken);
+            }
+        }
+
+        rs->entry_count++;
+        i += run;
+    }
+
+    free(taken);
+    return 0;
+}
+
+/**
+ * Compile the active rules into chain entries
+ */
+int compile_ruleset(CompiledRuleset *rs) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = compile_entries(rs);
+    PROFILE_END(PROFILE_COMPILE, started);
+    return ret;
+}
+
+/**
+ * Release a compiled ruleset
+ */
+void free_compiled_ruleset(CompiledRuleset *rs) {
+    free(rs->entries);
+    free(rs->members);
+    memset(rs, 0, sizeof(*rs));
+}
+
+/**
+ * Start an entry that matches everything and has no action yet
+ */
+void make_empty_entry(CompiledEntry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    make_empty_rule(&entry->rule);
+}
+
+/**
+ * Wrap a single rule as a plain chain entry
+ */
+void make_plain_entry(const FirewallRule *rule, CompiledEntry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->rule = *rule;
+}
+
+/**
+ * Find a set by name in a compiled ruleset
+ */
+const CompiledEntry *find_compiled_set(const CompiledRuleset *rs, const char *name) {
+    for (int i = 0; i < rs->entry_count; i++) {
+        if (rs->entries[i].set_name[0] && strcmp(rs->entries[i].set_name, name) == 0) {
+            return &rs->entries[i];
+        }
+    }
+    return NULL;
+}
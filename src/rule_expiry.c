@@ -0,0 +1,268 @@
+#include "firewall.h"
+
+/*
+ * Rule expiry.
+ *
+ * A rule given ttl= or expires= carries the Unix time it lapses, kept as
+ * expires= in the rules file and journal. Rules with a deadline sit in a
+ * hierarchical timing wheel: EXPIRY_LEVELS wheels of EXPIRY_SLOTS
+ * buckets, where level l holds deadlines less than EXPIRY_SLOTS^(l+1)
+ * seconds ahead in buckets EXPIRY_SLOTS^l seconds wide. Scheduling and
+ * cancelling link or unlink one node. Advancing the clock empties the
+ * level 0 bucket of each second passed into the due list, and each time
+ * a level wraps, the next bucket of the level above is spread over the
+ * levels below, so a rule is moved at most once per level before it
+ * lapses.
+ *
+ * Nodes are indexed by rule store slot and kept up to date by
+ * rule_store_add() and rule_store_remove(), so loading the rules after a
+ * restart (file, snapshot or journal) schedules every deadline again;
+ * deadlines already past land in the current bucket and lapse on the
+ * first advance. expire_rules() then removes the lapsed rules as one
+ * change: one journal write and one ruleset diff committed to the kernel.
+ */
+
+#define EXPIRY_BITS 6
+#define EXPIRY_SLOTS (1 << EXPIRY_BITS)
+#define EXPIRY_MASK (EXPIRY_SLOTS - 1)
+// Five levels reach 2^30 seconds ahead; later deadlines wait in the top level
+#define EXPIRY_LEVELS 5
+#define EXPIRY_BUCKETS (EXPIRY_LEVELS * EXPIRY_SLOTS)
+// Bucket of the lapsed rules not removed yet
+#define EXPIRY_DUE EXPIRY_BUCKETS
+
+typedef struct {
+    int rule_id;
+    uint32_t expires;
+    int prev;               // Neighbours in the bucket list (slots), -1 at the ends
+    int next;
+    int bucket;             // -1 when not scheduled
+} ExpiryNode;
+
+static ExpiryNode *nodes;
+static int node_capacity;
+static int buckets[EXPIRY_BUCKETS + 1];     // First slot of each bucket
+static int bucket_sizes[EXPIRY_BUCKETS + 1];
+static int scheduled;
+// Next second the wheel processes
+static uint32_t wheel_time;
+
+/**
+ * Make room for nodes of slots below the given count
+ * Called by the rule store before it schedules a rule, so scheduling
+ * itself never fails
+ */
+int expiry_reserve(int slots) {
+    if (slots <= node_capacity) {
+        return 0;
+    }
+    if (!nodes) {
+        for (int b = 0; b <= EXPIRY_BUCKETS; b++) {
+            buckets[b] = -1;
+        }
+        wheel_time = (uint32_t)time(NULL);
+    }
+
+    int capacity = node_capacity ? node_capacity : 1024;
+    while (capacity < slots) {
+        capacity *= 2;
+    }
+    ExpiryNode *grown = realloc(nodes, sizeof(ExpiryNode) * capacity);
+    if (!grown) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    for (int slot = node_capacity; slot < capacity; slot++) {
+        grown[slot].bucket = -1;
+    }
+    nodes = grown;
+    node_capacity = capacity;
+    return 0;
+}
+
+static void link_node(int slot, int bucket) {
+    ExpiryNode *n = &nodes[slot];
+    n->bucket = bucket;
+    n->prev = -1;
+    n->next = buckets[bucket];
+    if (n->next >= 0) {
+        nodes[n->next].prev = slot;
+    }
+    buckets[bucket] = slot;
+    bucket_sizes[bucket]++;
+}
+
+static void unlink_node(int slot) {
+    ExpiryNode *n = &nodes[slot];
+    if (n->prev >= 0) {
+        nodes[n->prev].next = n->next;
+    } else {
+        buckets[n->bucket] = n->next;
+    }
+    if (n->next >= 0) {
+        nodes[n->next].prev = n->prev;
+    }
+    bucket_sizes[n->bucket]--;
+    n->bucket = -1;
+}
+
+/**
+ * Bucket for a deadline, relative to wheel_time
+ */
+static int bucket_for(uint32_t expires) {
+    if (expires < wheel_time) {
+        expires = wheel_time;
+    }
+    uint32_t delta = expires - wheel_time;
+
+    for (int level = 0; level < EXPIRY_LEVELS; level++) {
+        if (delta < 1u << (EXPIRY_BITS * (level + 1))) {
+            return level * EXPIRY_SLOTS + (int)((expires >> (EXPIRY_BITS * level)) & EXPIRY_MASK);
+        }
+    }
+    // Past the top level: park at its far end, the cascade looks again
+    expires = wheel_time + (1u << (EXPIRY_BITS * EXPIRY_LEVELS)) - 1;
+    return (EXPIRY_LEVELS - 1) * EXPIRY_SLOTS +
+           (int)((expires >> (EXPIRY_BITS * (EXPIRY_LEVELS - 1))) & EXPIRY_MASK);
+}
+
+/**
+ * Schedule a stored rule to lapse at expires (replacing any earlier deadline)
+ */
+void expiry_schedule(int slot, int rule_id, uint32_t expires) {
+    if (nodes[slot].bucket >= 0) {
+        unlink_node(slot);
+        scheduled--;
+    }
+    // A wheel holding nothing restarts at the current second
+    if (scheduled == bucket_sizes[EXPIRY_DUE]) {
+        uint32_t now = (uint32_t)time(NULL);
+        if (wheel_time < now) {
+            wheel_time = now;
+        }
+    }
+    nodes[slot].rule_id = rule_id;
+    nodes[slot].expires = expires;
+    link_node(slot, bucket_for(expires));
+    scheduled++;
+}
+
+/**
+ * Forget the deadline of a slot, if it has one
+ */
+void expiry_cancel(int slot) {
+    if (slot < node_capacity && nodes[slot].bucket >= 0) {
+        unlink_node(slot);
+        scheduled--;
+    }
+}
+
+/**
+ * Whether any rule is waiting to lapse
+ */
+int expiry_pending(void) {
+    return scheduled > 0;
+}
+
+/**
+ * Spread one bucket over the levels below
+ * Returns the bucket's index within its level
+ */
+static int cascade(int level) {
+    int index = (int)((wheel_time >> (EXPIRY_BITS * level)) & EXPIRY_MASK);
+    int bucket = level * EXPIRY_SLOTS + index;
+
+    int slot = buckets[bucket];
+    while (slot >= 0) {
+        int next = nodes[slot].next;
+        unlink_node(slot);
+        link_node(slot, bucket_for(nodes[slot].expires));
+        slot = next;
+    }
+    return index;
+}
+
+/**
+ * Run the wheel up to now, moving lapsed rules to the due list
+ */
+static void advance_wheel(uint32_t now) {
+    // An idle wheel has nothing to catch up on
+    if (scheduled == bucket_sizes[EXPIRY_DUE]) {
+        if (wheel_time <= now) {
+            wheel_time = now + 1;
+        }
+        return;
+    }
+
+    while (wheel_time <= now) {
+        int index = (int)(wheel_time & EXPIRY_MASK);
+        for (int level = 1; index == 0 && level < EXPIRY_LEVELS; level++) {
+            index = cascade(level);
+        }
+
+        int bucket = (int)(wheel_time & EXPIRY_MASK);
+        while (buckets[bucket] >= 0) {
+            int slot = buckets[bucket];
+            unlink_node(slot);
+            link_node(slot, EXPIRY_DUE);
+        }
+        wheel_time++;
+    }
+}
+
+/**
+ * Remove the rules whose deadline has passed, as one change
+ * Returns the number of rules removed, or -1 on error
+ */
+int expire_rules(void) {
+    if (!nodes) {
+        return 0;
+    }
+    advance_wheel((uint32_t)time(NULL));
+
+    int count = bucket_sizes[EXPIRY_DUE];
+    if (count == 0) {
+        return 0;
+    }
+    int *ids = malloc(sizeof(int) * count);
+    if (!ids) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    int n = 0;
+    for (int slot = buckets[EXPIRY_DUE]; slot >= 0; slot = nodes[slot].next) {
+        ids[n++] = nodes[slot].rule_id;
+    }
+
+    // On failure the rules stay on the due list for the next attempt
+    if (journal_remove_rules(ids, n) != 0) {
+        free(ids);
+        return -1;
+    }
+
+    // Snapshot the compiled chain so the batch is one committed diff
+    CompiledRuleset before;
+    int root = check_root_privileges();
+    int sync_iptables = root && firewall_config.backend == BACKEND_IPTABLES &&
+                        compile_ruleset(&before) == 0;
+
+    for (int i = 0; i < n; i++) {
+        rule_store_remove(ids[i]);
+    }
+
+    if (sync_iptables) {
+        commit_ruleset_change(&before);
+    } else if (root && firewall_config.backend == BACKEND_NFTABLES) {
+        nft_apply_ruleset();
+    }
+    if (root) {
+        xdp_sync();
+    }
+
+    char message[64];
+    snprintf(message, sizeof(message), "Expired %d rule%s", n, n == 1 ? "" : "s");
+    printf("%s\n", message);
+    log_message(message);
+    free(ids);
+    return n;
+}
@@ -0,0 +1,308 @@
+#include "firewall.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * Bulk import (`firewall import <file>`).
+ *
+ * The file is memory-mapped and handled one window at a time. A window
+ * is split at line boundaries into one chunk per worker thread; each
+ * worker parses and validates its chunk into its own result buffer.
+ * The main thread then adds the rules and reports the errors chunk by
+ * chunk, so both come out in file order. Buffers are reused from window
+ * to window and pages already read are unmapped, so memory stays bounded
+ * by the window size plus the rules kept, whatever the file size.
+ *
+ * A line is either a rule string or, as in blocklist feeds, a bare
+ * address or CIDR (anything after it is ignored), which becomes a DROP
+ * rule for that source. Blank lines and lines starting with '#' are
+ * skipped. A rules file "N. " prefix is ignored: imported rules always
+ * get new IDs.
+ */
+
+// Bytes of the file parsed per round of workers
+#define IMPORT_WINDOW_BYTES (64 * 1024 * 1024)
+#define IMPORT_MAX_WORKERS 16
+// Errors printed; later ones are only counted
+#define IMPORT_MAX_ERRORS 100
+
+typedef struct {
+    long line;                          // Line within the chunk, from 0
+    char message[PARSE_ERROR_LENGTH];
+} ImportError;
+
+typedef struct {
+    const char *start;
+    const char *end;
+    long lines;
+    FirewallRule *rules;
+    long rule_count;
+    long rule_capacity;
+    ImportError errors[IMPORT_MAX_ERRORS];  // The chunk's first errors
+    long error_count;                       // All errors, printed or not
+    int out_of_memory;
+} ImportChunk;
+
+/**
+ * Parse one line of an import file
+ * Returns 1 for a rule, 0 for a line without one, -1 on error
+ */
+static int parse_import_line(const char *line, const char *end, FirewallRule *rule,
+                             char *error, size_t error_size) {
+    const char *p = line;
+
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    while (end > p && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (p == end || *p == '#') {
+        return 0;
+    }
+
+    // Rules file "N. " prefix
+    const char *digits = p;
+    while (digits < end && isdigit((unsigned char)*digits)) {
+        digits++;
+    }
+    if (digits > p && end - digits >= 2 && digits[0] == '.' && digits[1] == ' ') {
+        p = digits + 2;
+    }
+
+    if (memchr(p, '=', (size_t)(end - p))) {
+        if (parse_rule_span(line, p, end, rule, error, error_size) != 0) {
+            return -1;
+        }
+        if (rule->action == ACTION_NONE) {
+            snprintf(error, error_size, "Action is required");
+            return -1;
+        }
+        return 1;
+    }
+
+    // Bare blocklist entry
+    const char *addr_end = p;
+    while (addr_end < end && !isspace((unsigned char)*addr_end) && *addr_end != ';' && *addr_end != '#') {
+        addr_end++;
+    }
+    make_empty_rule(rule);
+    rule->action = ACTION_DROP;
+    const char *bad = parse_address_span(p, addr_end, &rule->source, &rule->source_len);
+    if (bad) {
+        int len = (int)(addr_end - p);
+        snprintf(error, error_size, "Invalid address at column %d: %.*s",
+                 (int)(bad - line) + 1, len > 64 ? 64 : len, p);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Worker: parse every line of a chunk into its result buffer
+ */
+static void *import_worker(void *arg) {
+    ImportChunk *chunk = arg;
+    const char *pos = chunk->start;
+
+    chunk->lines = 0;
+    chunk->rule_count = 0;
+    chunk->error_count = 0;
+    chunk->out_of_memory = 0;
+
+    while (pos < chunk->end) {
+        const char *newline = memchr(pos, '\n', (size_t)(chunk->end - pos));
+        const char *line_end = newline ? newline : chunk->end;
+        char error[PARSE_ERROR_LENGTH];
+        FirewallRule rule;
+
+        int ret = parse_import_line(pos, line_end, &rule, error, sizeof(error));
+        if (ret > 0) {
+            if (chunk->rule_count == chunk->rule_capacity) {
+                long capacity = chunk->rule_capacity ? chunk->rule_capacity * 2 : 4096;
+                FirewallRule *grown = realloc(chunk->rules, sizeof(FirewallRule) * capacity);
+                if (!grown) {
+                    chunk->out_of_memory = 1;
+                    return NULL;
+                }
+                chunk->rules = grown;
+                chunk->rule_capacity = capacity;
+            }
+            chunk->rules[chunk->rule_count++] = rule;
+        } else if (ret < 0) {
+            if (chunk->error_count < IMPORT_MAX_ERRORS) {
+                ImportError *e = &chunk->errors[chunk->error_count];
+                e->line = chunk->lines;
+                memcpy(e->message, error, sizeof(e->message));
+            }
+            chunk->error_count++;
+        }
+
+        chunk->lines++;
+        pos = newline ? newline + 1 : chunk->end;
+    }
+    return NULL;
+}
+
+/**
+ * Number of worker threads to use
+ */
+static int import_worker_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > IMPORT_MAX_WORKERS ? IMPORT_MAX_WORKERS : (int)cpus;
+}
+
+/**
+ * Import the rules of a file, appending them to the rule store
+ * Lines that fail to parse are reported and skipped
+ * Returns the number of rules imported, or -1 on error
+ */
+int import_rules(const char *filename) {
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: Not a regular file: %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        printf("Imported 0 rules from %s\n", filename);
+        return 0;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %s\n", filename);
+        return -1;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t unmapped = 0;
+
+    int workers = import_worker_count();
+    ImportChunk *chunks = calloc(workers, sizeof(ImportChunk));
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+    if (!chunks || !threads) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(chunks);
+        free(threads);
+        munmap(map, size);
+        return -1;
+    }
+
+    const char *end = map + size;
+    const char *window = map;
+    long line_base = 0, imported = 0, rejected = 0;
+    int ret = 0;
+
+    while (window < end && ret == 0) {
+        // Window and chunk bounds fall just after a newline
+        const char *window_end = end - window > IMPORT_WINDOW_BYTES ? window + IMPORT_WINDOW_BYTES : end;
+        if (window_end < end) {
+            const char *newline = memchr(window_end, '\n', (size_t)(end - window_end));
+            window_end = newline ? newline + 1 : end;
+        }
+
+        const char *pos = window;
+        for (int w = 0; w < workers; w++) {
+            const char *chunk_end = w + 1 < workers ? pos + (window_end - window) / workers : window_end;
+            if (chunk_end > window_end) {
+                chunk_end = window_end;
+            }
+            if (chunk_end < window_end) {
+                const char *newline = memchr(chunk_end, '\n', (size_t)(window_end - chunk_end));
+                chunk_end = newline ? newline + 1 : window_end;
+            }
+            chunks[w].start = pos;
+            chunks[w].end = chunk_end;
+            pos = chunk_end;
+        }
+
+        // The calling thread takes the first chunk itself
+        int started_workers = 1;
+        for (; started_workers < workers; started_workers++) {
+            if (pthread_create(&threads[started_workers], NULL, import_worker, &chunks[started_workers]) != 0) {
+                break;
+            }
+        }
+        import_worker(&chunks[0]);
+        for (int w = started_workers; w < workers; w++) {
+            import_worker(&chunks[w]);
+        }
+        for (int w = 1; w < started_workers; w++) {
+            pthread_join(threads[w], NULL);
+        }
+
+        // Merge in file order
+        for (int w = 0; w < workers && ret == 0; w++) {
+            ImportChunk *chunk = &chunks[w];
+            if (chunk->out_of_memory) {
+                fprintf(stderr, "Error: Out of memory\n");
+                ret = -1;
+                break;
+            }
+            for (long e = 0; e < chunk->error_count && e < IMPORT_MAX_ERRORS; e++) {
+                if (rejected + e < IMPORT_MAX_ERRORS) {
+                    fprintf(stderr, "Error: %s:%ld: %s\n", filename,
+                            line_base + chunk->errors[e].line + 1, chunk->errors[e].message);
+                }
+            }
+            rejected += chunk->error_count;
+            for (long r = 0; r < chunk->rule_count; r++) {
+                if (rule_store_add(&chunk->rules[r], 0) < 0) {
+                    ret = -1;
+                    break;
+                }
+                imported++;
+            }
+            line_base += chunk->lines;
+        }
+
+        // Pages behind us are not needed again
+        size_t done = (size_t)(window_end - map) & ~(page - 1);
+        if (done > unmapped) {
+            munmap(map + unmapped, done - unmapped);
+            unmapped = done;
+        }
+        window = window_end;
+    }
+
+    for (int w = 0; w < workers; w++) {
+        free(chunks[w].rules);
+    }
+    free(chunks);
+    free(threads);
+    if (unmapped < size) {
+        munmap(map + unmapped, size - unmapped);
+    }
+
+    if (rejected > IMPORT_MAX_ERRORS) {
+        fprintf(stderr, "Error: %ld more invalid lines not shown\n", rejected - IMPORT_MAX_ERRORS);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Imported %ld rules from %s (%ld lines, %ld rejected) in %.2f s using %d workers\n",
+           imported, filename, line_base, rejected, seconds, workers);
+
+    if (ret != 0) {
+        return -1;
+    }
+    return imported > INT_MAX ? INT_MAX : (int)imported;
+}
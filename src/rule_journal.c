@@ -0,0 +1,349 @@
+#include "firewall.h"
+#include <errno.h>
+#include <fcntl.h>
+
+/*
+ * Rule journal.
+ *
+ * `add` and `remove` append one fsync'd record to RULES_JOURNAL instead
+ * of rewriting RULES_FILE, so a change costs one small write whatever the
+ * ruleset size. Loading the rules replays the journal on top of
+ * RULES_FILE (or its snapshot). Once the journal passes
+ * JOURNAL_COMPACT_BYTES it is compacted: the rules are saved whole,
+ * through a temporary file and a rename, and the journal is emptied.
+ *
+ * Records are text lines: "+ <rules file line>" for an added rule and
+ * "- <id>" for a removed one. A last line without its newline is a record
+ * torn by a crash; it is dropped on replay.
+ *
+ * Replay is idempotent, so a crash between saving RULES_FILE and emptying
+ * the journal only replays records the file already holds: a rule that is
+ * already stored is not added again, and neither is one whose slot has
+ * moved on to a later rule.
+ *
+ * The daemon compacts in a forked child, which saves its copy-on-write
+ * view of the store while the daemon keeps serving. The journal is first
+ * renamed to JOURNAL_COMPACTING, so records appended in the meantime go
+ * to a fresh journal; the child deletes the renamed one once the rules
+ * file holds it. Replay reads JOURNAL_COMPACTING, then RULES_JOURNAL.
+ */
+
+// Journal size that triggers compaction
+#define JOURNAL_COMPACT_BYTES (1024 * 1024)
+#define JOURNAL_COMPACTING RULES_JOURNAL ".old"
+
+static int journal_fd = -1;
+static pid_t compact_pid = -1;
+// Set in the compaction child, whose save must not empty the new journal
+static int compacting_child;
+
+/**
+ * Open the journal for appending, creating it if needed
+ */
+static int open_journal(void) {
+    if (journal_fd >= 0) {
+        return 0;
+    }
+
+    int created = access(RULES_JOURNAL, F_OK) != 0;
+    journal_fd = open(RULES_JOURNAL, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s\n", RULES_JOURNAL);
+        return -1;
+    }
+    fcntl(journal_fd, F_SETFD, FD_CLOEXEC);
+
+    // A new file is only durable once its directory entry is
+    if (created) {
+        sync_config_directory();
+    }
+    return 0;
+}
+
+/**
+ * Write one record and sync it
+ */
+static int write_record(const char *record, size_t len) {
+    if (open_journal() != 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        ssize_t n = write(journal_fd, record, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Cannot write %s\n", RULES_JOURNAL);
+            return -1;
+        }
+        record += n;
+        len -= (size_t)n;
+    }
+
+    if (fdatasync(journal_fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync %s\n", RULES_JOURNAL);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append one record and wait until it is on disk
+ */
+static int append_record(const char *record, size_t len) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = write_record(record, len);
+    PROFILE_END(PROFILE_JOURNAL, started);
+    return ret;
+}
+
+/**
+ * Record an added rule (rule->id must be set)
+ */
+int journal_add(const FirewallRule *rule) {
+    char record[MAX_CONFIG_LINE + 2];
+
+    record[0] = '+';
+    record[1] = ' ';
+    int len = format_rule_line(rule, record + 2, sizeof(record) - 2);
+    return append_record(record, (size_t)len + 2);
+}
+
+/**
+ * Record several added rules with a single write and sync
+ */
+int journal_add_rules(const FirewallRule *rules, int count) {
+    size_t size = (size_t)count * (MAX_CONFIG_LINE + 2);
+    char *records = malloc(size);
+    size_t len = 0;
+
+    if (!records) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        records[len++] = '+';
+        records[len++] = ' ';
+        len += (size_t)format_rule_line(&rules[i], records + len, size - len);
+    }
+    int ret = append_record(records, len);
+    free(records);
+    return ret;
+}
+
+/**
+ * Record a removed rule
+ */
+int journal_remove(int rule_id) {
+    return journal_remove_rules(&rule_id, 1);
+}
+
+/**
+ * Record several removed rules with a single write and sync
+ */
+int journal_remove_rules(const int *rule_ids, int count) {
+    // "- <id>\n" takes at most 14 bytes
+    size_t size = (size_t)count * 16 + 1;
+    char *records = malloc(size);
+    size_t len = 0;
+
+    if (!records) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        len += (size_t)snprintf(records + len, size - len, "- %d\n", rule_ids[i]);
+    }
+    int ret = append_record(records, len);
+    free(records);
+    return ret;
+}
+
+/**
+ * Apply the records of one journal file to the rule store
+ * Returns the number of records applied, or -1 on error
+ */
+static int replay_file(const char *filename) {
+    // A reader without write access (replay as a normal user) still
+    // replays the records; it just cannot cut a torn one
+    int writable = 1;
+    FILE *fp = fopen(filename, "r+");
+    if (!fp && errno == EACCES) {
+        writable = 0;
+        fp = fopen(filename, "r");
+    }
+    if (!fp) {
+        return 0;
+    }
+
+    char line[MAX_CONFIG_LINE + 2];
+    long good_end = 0;
+    int applied = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            // Torn by a crash mid-append; cut it so the next append
+            // starts on a line of its own
+            fflush(fp);
+            if (writable && ftruncate(fileno(fp), good_end) == 0) {
+                fprintf(stderr, "Warning: Dropped a torn record at the end of %s\n", filename);
+            }
+            break;
+        }
+        good_end = ftell(fp);
+        line[len - 1] = '\0';
+
+        if (line[0] == '-' && line[1] == ' ') {
+            rule_store_remove(atoi(line + 2));
+            applied++;
+        } else if (line[0] == '+' && line[1] == ' ') {
+            int rule_id = atoi(line + 2);
+            char *rule_start = strstr(line + 2, ". ");
+            FirewallRule rule;
+
+            if (rule_id <= 0 || !rule_start || parse_rule_string(rule_start + 2, &rule) != 0) {
+                fprintf(stderr, "Warning: Skipping malformed record in %s\n", filename);
+                continue;
+            }
+            if (!get_rule_by_id(rule_id)) {
+                int stored = rule_store_add(&rule, rule_id);
+                if (stored < 0) {
+                    fclose(fp);
+                    return -1;
+                }
+                // The slot already holds a later rule: this one was removed
+                if (stored != rule_id) {
+                    rule_store_remove(stored);
+                }
+            }
+            applied++;
+        }
+    }
+
+    fclose(fp);
+    return applied;
+}
+
+/**
+ * Replay the journal on top of the rules just loaded
+ * Returns the number of records applied, or -1 on error
+ */
+int journal_replay(void) {
+    int old = replay_file(JOURNAL_COMPACTING);
+    if (old < 0) {
+        return -1;
+    }
+    int current = replay_file(RULES_JOURNAL);
+    if (current < 0) {
+        return -1;
+    }
+    return old + current;
+}
+
+/**
+ * Forget the journal records the rules file now holds
+ * Called after RULES_FILE was saved whole
+ */
+void journal_reset(void) {
+    unlink(JOURNAL_COMPACTING);
+    if (compacting_child) {
+        return;
+    }
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    unlink(RULES_JOURNAL);
+    sync_config_directory();
+}
+
+/**
+ * Wait for a running background compaction to finish
+ * Its rules file must be in place before the rules are read or saved
+ */
+void journal_wait(void) {
+    if (compact_pid > 0) {
+        waitpid(compact_pid, NULL, 0);
+        compact_pid = -1;
+    }
+}
+
+/**
+ * Fingerprint of RULES_FILE and RULES_JOURNAL (identity, size and
+ * modification time); it changes whenever any process saves or journals
+ * a change, so long-running commands know when to reload the rules
+ */
+uint64_t rules_files_stamp(void) {
+    const char *paths[] = { RULES_FILE, RULES_JOURNAL };
+    uint64_t stamp = 1469598103934665603ull;
+
+    for (int i = 0; i < 2; i++) {
+        struct stat st;
+        uint64_t parts[4] = { 0, 0, 0, 0 };
+        if (stat(paths[i], &st) == 0) {
+            parts[0] = (uint64_t)st.st_ino;
+            parts[1] = (uint64_t)st.st_size;
+            parts[2] = (uint64_t)st.st_mtim.tv_sec;
+            parts[3] = (uint64_t)st.st_mtim.tv_nsec;
+        }
+        for (int j = 0; j < 4; j++) {
+            stamp = (stamp ^ parts[j]) * 1099511628211ull;
+        }
+    }
+    return stamp;
+}
+
+/**
+ * Compact the journal once it has grown past JOURNAL_COMPACT_BYTES
+ * In the background, a child process saves the rules and the caller
+ * goes on at once
+ * Returns 0 on success or when there is nothing to do, -1 on error
+ */
+int compact_journal_if_due(int background) {
+    struct stat st;
+
+    // Reap a background compaction that has finished
+    if (compact_pid > 0 && waitpid(compact_pid, NULL, WNOHANG) == compact_pid) {
+        compact_pid = -1;
+    }
+    if (compact_pid > 0 || stat(RULES_JOURNAL, &st) != 0 || st.st_size < JOURNAL_COMPACT_BYTES) {
+        return 0;
+    }
+
+    if (!background) {
+        return save_rules_to_file(NULL);
+    }
+
+    // Later records go to a fresh journal while the child saves. A file
+    // left by a crashed compaction is kept: the child still deletes it
+    if (access(JOURNAL_COMPACTING, F_OK) != 0) {
+        if (journal_fd >= 0) {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+        if (rename(RULES_JOURNAL, JOURNAL_COMPACTING) != 0) {
+            fprintf(stderr, "Error: Cannot rotate %s\n", RULES_JOURNAL);
+            return -1;
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        compacting_child = 1;
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(1);
+        }
+        _exit(save_rules_to_file(NULL) == 0 ? 0 : 1);
+    }
+
+    compact_pid = pid;
+    return 0;
+}
@@ -0,0 +1,508 @@
+#include "firewall.h"
+#include <limits.h>
+
+/*
+ * Packet classifier (`firewall match`).
+ *
+ * Answers which rule a packet hits, without generating traffic, by
+ * tuple-space search. Each active rule falls in the tuple of its source
+ * and destination prefix lengths (no address counts as length 0) and of
+ * whether it matches one exact TCP/UDP port. Within a tuple, rules are
+ * hashed on their masked addresses (plus protocol and port for
+ * exact-port tuples), so a lookup costs one hash probe per tuple however
+ * many rules share it. Rules that land in the same bucket are stored
+ * next to each other in evaluation order, with just the fields left to
+ * check: protocol, port range and interface.
+ *
+ * Most probes find nothing. Each tuple has a Bloom filter of its keys,
+ * both bits of a key in one 64-bit word, so those probes are answered
+ * from a few cached bits instead of a miss into a large hash table.
+ *
+ * Tuples are visited in order of their first rule, and a lookup stops as
+ * soon as no remaining tuple or bucket can hold an earlier rule than the
+ * best match so far. The result is always the first matching rule in
+ * evaluation order, the same as a linear scan.
+ *
+ * A classifier can be compiled from any list of rules and is read-only
+ * once built, so threads may share it. The one for the rule store is
+ * built on first use and rebuilt whenever the store changes. Like the
+ * kernel rules, it ignores the conntrack fast path: it answers for the
+ * first packet of a connection.
+ */
+
+// Tuple index: source length, destination length, exact port
+#define TUPLE_INDEX(src_len, dst_len, exact) ((((src_len) * 33) + (dst_len)) * 2 + (exact))
+// Bloom filter bits per key (two bits set per key: about 2% false hits)
+#define FILTER_BITS_PER_KEY 16
+
+typedef struct {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t proto_port;        // protocol << 16 | port in exact-port tuples
+    int start;                  // First candidate of the bucket
+    int count;                  // 0 for an empty slot
+} MatchBucket;
+
+typedef struct MatchTuple {
+    uint32_t src_mask;
+    uint32_t dst_mask;
+    int exact_port;
+    int first;                  // Earliest rule of the tuple
+    MatchBucket *slots;
+    uint32_t slot_mask;
+    uint64_t *filter;
+    uint32_t filter_mask;       // Filter size in words, minus one
+} MatchTuple;
+
+// A rule as stored in its bucket
+typedef struct MatchCandidate {
+    int position;               // Index in PacketClassifier.rules
+    uint32_t interface;         // 0 for any
+    uint16_t port_first;        // 0-65535 when the port does not apply
+    uint16_t port_last;
+    uint8_t protocol;           // PROTO_NONE for any
+    uint8_t wildcard;           // Interface name ends in '+'
+} MatchCandidate;
+
+typedef struct {
+    int tuple;
+    uint32_t src;
+    uint32_t dst;
+    uint32_t proto_port;
+    int position;
+} MatchItem;
+
+// Classifier of the rule store
+static PacketClassifier classifier;
+static int built;
+static unsigned long built_version;
+
+/**
+ * Prefix mask for a length
+ */
+static uint32_t prefix_mask(int len) {
+    return len > 0 ? 0xFFFFFFFFu << (32 - len) : 0;
+}
+
+/**
+ * Hash of a bucket key
+ */
+static uint32_t bucket_hash(uint32_t src, uint32_t dst, uint32_t proto_port) {
+    uint32_t h = src * 0x9E3779B1u ^ dst * 0x85EBCA77u ^ proto_port * 0xC2B2AE3Du;
+    return h ^ (h >> 15);
+}
+
+/**
+ * The two filter bits of a key hash, both within one filter word
+ */
+static uint64_t filter_bits(uint32_t hash) {
+    return 1ull << (hash >> 20 & 63) | 1ull << (hash >> 26);
+}
+
+/**
+ * Whether a rule matches one exact TCP/UDP port
+ */
+static int exact_port(const FirewallRule *rule) {
+    return (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP) &&
+           rule->port_first && rule->port_first == rule->port_last;
+}
+
+static int compare_items(const void *a, const void *b) {
+    const MatchItem *x = a, *y = b;
+    if (x->tuple != y->tuple) {
+        return x->tuple < y->tuple ? -1 : 1;
+    }
+    if (x->src != y->src) {
+        return x->src < y->src ? -1 : 1;
+    }
+    if (x->dst != y->dst) {
+        return x->dst < y->dst ? -1 : 1;
+    }
+    if (x->proto_port != y->proto_port) {
+        return x->proto_port < y->proto_port ? -1 : 1;
+    }
+    return x->position - y->position;
+}
+
+static int compare_tuples(const void *a, const void *b) {
+    return ((const MatchTuple *)a)->first - ((const MatchTuple *)b)->first;
+}
+
+/**
+ * Fill in the fields a bucket key leaves open
+ */
+static void make_candidate(const FirewallRule *rule, int position, MatchCandidate *c) {
+    const char *name = pool_string(rule->interface);
+    size_t len = strlen(name);
+
+    c->position = position;
+    c->interface = rule->interface;
+    c->wildcard = len > 0 && name[len - 1] == '+';
+    // "ALL" matches any protocol, like no protocol at all
+    c->protocol = rule->protocol == PROTO_ALL ? PROTO_NONE : rule->protocol;
+    // A port only applies to TCP and UDP rules
+    if (rule->port_first && (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP)) {
+        c->port_first = rule->port_first;
+        c->port_last = rule->port_last;
+    } else {
+        c->port_first = 0;
+        c->port_last = 65535;
+    }
+}
+
+/**
+ * Free a compiled classifier
+ */
+void free_compiled_classifier(PacketClassifier *pc) {
+    for (int t = 0; t < pc->tuple_count; t++) {
+        free(pc->tuples[t].slots);
+        free(pc->tuples[t].filter);
+    }
+    free(pc->tuples);
+    free(pc->rules);
+    free(pc->candidates);
+    memset(pc, 0, sizeof(*pc));
+}
+
+/**
+ * Build one tuple from its run of sorted items
+ * Returns 0 on success, -1 when out of memory
+ */
+static int build_tuple(PacketClassifier *pc, MatchTuple *tuple, const MatchItem *items, int start, int end) {
+    int keys = 0;
+    for (int i = start; i < end; i++) {
+        if (i == start || items[i].src != items[i - 1].src || items[i].dst != items[i - 1].dst ||
+            items[i].proto_port != items[i - 1].proto_port) {
+            keys++;
+        }
+    }
+
+    // Hash table at most half full, filter of FILTER_BITS_PER_KEY
+    uint32_t size = 2, words = 1;
+    while (size < (uint32_t)keys * 2) {
+        size *= 2;
+    }
+    while (words * 64 < (uint32_t)keys * FILTER_BITS_PER_KEY) {
+        words *= 2;
+    }
+
+    int index = items[start].tuple;
+    tuple->src_mask = prefix_mask(index / 2 / 33);
+    tuple->dst_mask = prefix_mask(index / 2 % 33);
+    tuple->exact_port = index % 2;
+    tuple->first = INT_MAX;
+    tuple->slot_mask = size - 1;
+    tuple->filter_mask = words - 1;
+    tuple->slots = calloc(size, sizeof(MatchBucket));
+    tuple->filter = calloc(words, sizeof(uint64_t));
+    if (!tuple->slots || !tuple->filter) {
+        return -1;
+    }
+
+    for (int k = start; k < end; ) {
+        int run = k;
+        while (run < end && items[run].src == items[k].src && items[run].dst == items[k].dst &&
+               items[run].proto_port == items[k].proto_port) {
+            make_candidate(&pc->rules[items[run].position], items[run].position, &pc->candidates[run]);
+            run++;
+        }
+
+        uint32_t hash = bucket_hash(items[k].src, items[k].dst, items[k].proto_port);
+        uint32_t slot = hash & tuple->slot_mask;
+        while (tuple->slots[slot].count) {
+            slot = (slot + 1) & tuple->slot_mask;
+        }
+        MatchBucket *bucket = &tuple->slots[slot];
+        bucket->src = items[k].src;
+        bucket->dst = items[k].dst;
+        bucket->proto_port = items[k].proto_port;
+        bucket->start = k;
+        bucket->count = run - k;
+        tuple->filter[hash & tuple->filter_mask] |= filter_bits(hash);
+        if (items[k].position < tuple->first) {
+            tuple->first = items[k].position;
+        }
+        k = run;
+    }
+    return 0;
+}
+
+/**
+ * Compile a classifier from the active rules of a list, in order
+ * Returns 0 on success, -1 on error
+ */
+int compile_classifier(FirewallRule **rules, int count, PacketClassifier *pc) {
+    memset(pc, 0, sizeof(*pc));
+    pc->rules = malloc(sizeof(FirewallRule) * (count + 1));
+    pc->candidates = malloc(sizeof(MatchCandidate) * (count + 1));
+    MatchItem *items = malloc(sizeof(MatchItem) * (count + 1));
+    if (!pc->rules || !pc->candidates || !items) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(items);
+        free_compiled_classifier(pc);
+        return -1;
+    }
+
+    int active = 0;
+    for (int i = 0; i < count; i++) {
+        const FirewallRule *rule = rules[i];
+        if (!rule->active) {
+            continue;
+        }
+        int src_len = rule->source_len > 0 ? rule->source_len : 0;
+        int dst_len = rule->dest_len > 0 ? rule->dest_len : 0;
+        int exact = exact_port(rule);
+
+        pc->rules[active] = *rule;
+        items[active].tuple = TUPLE_INDEX(src_len, dst_len, exact);
+        items[active].src = rule->source & prefix_mask(src_len);
+        items[active].dst = rule->dest & prefix_mask(dst_len);
+        items[active].proto_port = exact ? (uint32_t)rule->protocol << 16 | rule->port_first : 0;
+        items[active].position = active;
+        active++;
+    }
+    pc->rule_count = active;
+
+    // Sorted, each tuple is a run of items and each bucket a run within it
+    qsort(items, active, sizeof(MatchItem), compare_items);
+
+    int distinct = 0;
+    for (int i = 0; i < active; i++) {
+        if (i == 0 || items[i].tuple != items[i - 1].tuple) {
+            distinct++;
+        }
+    }
+    pc->tuples = calloc(distinct + 1, sizeof(MatchTuple));
+    if (!pc->tuples) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(items);
+        free_compiled_classifier(pc);
+        return -1;
+    }
+
+    for (int i = 0; i < active; ) {
+        int end = i;
+        while (end < active && items[end].tuple == items[i].tuple) {
+            end++;
+        }
+        if (build_tuple(pc, &pc->tuples[pc->tuple_count++], items, i, end) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            free(items);
+            free_compiled_classifier(pc);
+            return -1;
+        }
+        i = end;
+    }
+    free(items);
+
+    qsort(pc->tuples, pc->tuple_count, sizeof(MatchTuple), compare_tuples);
+    return 0;
+}
+
+/**
+ * Build the classifier of the rule store
+ * Returns 0 on success, -1 on error
+ */
+int build_classifier(void) {
+    free_classifier();
+    if (compile_classifier(ordered_rules(), rule_count, &classifier) != 0) {
+        return -1;
+    }
+    built = 1;
+    built_version = rule_store_version();
+    return 0;
+}
+
+/**
+ * Release the classifier of the rule store
+ */
+void free_classifier(void) {
+    free_compiled_classifier(&classifier);
+    built = 0;
+}
+
+/**
+ * Check the fields a bucket key leaves open: protocol, port and interface
+ */
+static int candidate_matches(const MatchCandidate *c, const MatchPacket *packet) {
+    if ((c->protocol && c->protocol != packet->protocol) ||
+        packet->port < c->port_first || packet->port > c->port_last) {
+        return 0;
+    }
+    if (c->interface && c->interface != packet->interface) {
+        if (!c->wildcard) {
+            return 0;
+        }
+        const char *name = pool_string(c->interface);
+        if (strncmp(name, pool_string(packet->interface), strlen(name) - 1) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * First active rule, in evaluation order, that a packet matches
+ * Returns NULL when no rule matches (the chain policy applies)
+ */
+const FirewallRule *classifier_lookup(const PacketClassifier *pc, const MatchPacket *packet) {
+    int best = INT_MAX;
+    for (int t = 0; t < pc->tuple_count && pc->tuples[t].first < best; t++) {
+        const MatchTuple *tuple = &pc->tuples[t];
+        uint32_t src = packet->source & tuple->src_mask;
+        uint32_t dst = packet->dest & tuple->dst_mask;
+        uint32_t proto_port = tuple->exact_port ? (uint32_t)packet->protocol << 16 | packet->port : 0;
+        uint32_t hash = bucket_hash(src, dst, proto_port);
+        uint64_t bits = filter_bits(hash);
+
+        if ((tuple->filter[hash & tuple->filter_mask] & bits) != bits) {
+            continue;
+        }
+
+        for (uint32_t slot = hash & tuple->slot_mask; tuple->slots[slot].count;
+             slot = (slot + 1) & tuple->slot_mask) {
+            const MatchBucket *bucket = &tuple->slots[slot];
+            if (bucket->src != src || bucket->dst != dst || bucket->proto_port != proto_port) {
+                continue;
+            }
+            const MatchCandidate *c = &pc->candidates[bucket->start];
+            for (int n = bucket->count; n > 0 && c->position < best; n--, c++) {
+                if (candidate_matches(c, packet)) {
+                    best = c->position;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    return best < INT_MAX ? &pc->rules[best] : NULL;
+}
+
+/**
+ * First active rule of the rule store that a packet matches
+ * Returns NULL when no rule matches (the chain policy applies)
+ */
+const FirewallRule *classify_packet(const MatchPacket *packet) {
+    if ((!built || built_version != rule_store_version()) && build_classifier() != 0) {
+        return NULL;
+    }
+    return classifier_lookup(&classifier, packet);
+}
+
+/**
+ * Parse a packet description, written like a rule:
+ * "source=10.2.3.4, dest=192.168.1.10, port=443, protocol=TCP, interface=eth1"
+ * Fields left out are 0 (addresses, port) or unknown (protocol, interface)
+ * Returns 0 on success, -1 with a message in error
+ */
+int parse_packet_string(const char *text, MatchPacket *packet, char *error, size_t error_size) {
+    FirewallRule rule;
+
+    if (parse_rule_span(text, text, text + strlen(text), &rule, error, error_size) != 0) {
+        return -1;
+    }
+    if (rule.source_len > 0 && rule.source_len < 32) {
+        snprintf(error, error_size, "A packet has one source address, not a network");
+        return -1;
+    }
+    if (rule.dest_len > 0 && rule.dest_len < 32) {
+        snprintf(error, error_size, "A packet has one destination address, not a network");
+        return -1;
+    }
+    if (rule.port_first != rule.port_last) {
+        snprintf(error, error_size, "A packet has one destination port, not a range");
+        return -1;
+    }
+    if (rule.protocol == PROTO_ALL) {
+        snprintf(error, error_size, "A packet has one protocol: TCP, UDP or ICMP");
+        return -1;
+    }
+
+    packet->source = rule.source_len >= 0 ? rule.source : 0;
+    packet->dest = rule.dest_len >= 0 ? rule.dest : 0;
+    packet->port = rule.port_first;
+    packet->protocol = rule.protocol;
+    packet->interface = rule.interface;
+    return 0;
+}
+
+/**
+ * Print which rule a packet described on the command line hits
+ * Returns 0 on success, -1 on error
+ */
+int explain_match(const char *text) {
+    char error[PARSE_ERROR_LENGTH];
+    MatchPacket packet;
+
+    if (parse_packet_string(text, &packet, error, sizeof(error)) != 0) {
+        fprintf(stderr, "Error: %s\n", error);
+        return -1;
+    }
+
+    const FirewallRule *rule = classify_packet(&packet);
+    if (!built) {
+        return -1;
+    }
+    if (!rule) {
+        printf("No rule matches: chain policy %s applies\n", firewall_config.policy);
+        return 0;
+    }
+
+    char line[MAX_CONFIG_LINE];
+    format_rule_line(rule, line, sizeof(line));
+    printf("Verdict: %s\n", action_name(rule->action));
+    printf("Matched rule %d (position %d): %s", rule->id, rule_position(rule->id) + 1,
+           strchr(line, ' ') + 1);
+    return 0;
+}
+
+/**
+ * Classify one packet per line of in, writing "<rule id> <verdict>"
+ * lines to out (rule id 0 when the chain policy applies, "- ERROR" for a
+ * line that does not parse)
+ * Returns 0 on success, -1 on error
+ */
+int match_stream(FILE *in, FILE *out) {
+    char line[MAX_CONFIG_LINE];
+    char error[PARSE_ERROR_LENGTH];
+    long packets = 0, lineno = 0, invalid = 0;
+    double elapsed = 0;
+
+    if ((!built || built_version != rule_store_version()) && build_classifier() != 0) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        MatchPacket packet;
+        struct timespec start, end;
+
+        lineno++;
+        line[strcspn(line, "\n\r")] = '\0';
+        if (parse_packet_string(line, &packet, error, sizeof(error)) != 0) {
+            fprintf(stderr, "Error: line %ld: %s\n", lineno, error);
+            fprintf(out, "- ERROR\n");
+            invalid++;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const FirewallRule *rule = classify_packet(&packet);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        packets++;
+
+        if (rule) {
+            fprintf(out, "%d %s\n", rule->id, action_name(rule->action));
+        } else {
+            fprintf(out, "0 %s\n", firewall_config.policy);
+        }
+    }
+
+    fprintf(stderr, "Classified %ld packets against %d rules in %d tuples, %.0f ns each",
+            packets, rule_count, classifier.tuple_count, packets ? elapsed * 1e9 / packets : 0.0);
+    if (invalid) {
+        fprintf(stderr, ", %ld invalid lines", invalid);
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
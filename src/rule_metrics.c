@@ -0,0 +1,568 @@
+#include "firewall.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+
+/*
+ * Rule counter telemetry (`firewall metrics`).
+ *
+ * Every interval the packet and byte counters of the whole filter table
+ * are read in one pass (read_entry_counters(): one listing, or one
+ * libiptc snapshot, however many rules) and matched to the entries of
+ * the compiled ruleset by their comments, one hash probe per entry.
+ * There is one series per compiled entry rather than per rule, since a
+ * kernel counter cannot be split: a multiport group is one series
+ * labelled with all its rule IDs, and an ipset entry one series marked
+ * as aggregated over its members. Entries that carry the same user
+ * comment in the kernel (auto-ban rules, say) cannot be told apart by
+ * their counters either, so they too make one series labelled with all
+ * their rule IDs. The samples go into a ring of the
+ * last METRICS_HISTORY; rates are taken between its oldest and newest
+ * sample, so they are smoothed over the ring's span, and a counter that
+ * went down (the ruleset was replaced) counts as a rate of 0.
+ *
+ * After each sample the totals and rates are written as a Prometheus
+ * text file (for node_exporter's textfile collector or any scraper) and,
+ * when asked, as a binary dump: a MetricsDumpHeader followed by one
+ * MetricsDumpRecord per entry, in chain order. Both are written to a
+ * temporary file and renamed, so readers never see half a sample.
+ *
+ * When another command changes the rules, they are reloaded and compiled
+ * again and the ring starts over, since entries no longer line up.
+ *
+ * Usage: firewall metrics [--interval <seconds>] [--output <file>]
+ *                         [--dump <file>] [--once]
+ */
+
+#define METRICS_DEFAULT_INTERVAL 5
+#define METRICS_DEFAULT_OUTPUT "/run/personal-firewall.prom"
+// Samples kept for rates
+#define METRICS_HISTORY 8
+#define METRICS_BUFFER (1 << 20)
+
+#define METRICS_DUMP_MAGIC "PFWMETR"
+#define METRICS_DUMP_VERSION 2
+
+// MetricsDumpRecord flags
+#define METRICS_ENTRY_SET 1     // The counters are those of a whole ipset
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t timestamp;         // Unix time of the newest sample
+    double span;                // Seconds the rates are taken over (0: no rates yet)
+} MetricsDumpHeader;
+
+typedef struct {
+    int32_t id;                 // First rule of the entry
+    int32_t action;             // ACTION_*
+    uint32_t rules;             // Rules sharing the counters
+    uint32_t flags;             // METRICS_ENTRY_*
+    uint64_t packets;
+    uint64_t bytes;
+    float packet_rate;          // Per second
+    float byte_rate;
+} MetricsDumpRecord;
+
+typedef struct {
+    double when;                // CLOCK_MONOTONIC seconds
+    unsigned long long *packets;
+    unsigned long long *bytes;
+} MetricsSample;
+
+static MetricsSample history[METRICS_HISTORY];
+static int history_count;
+static int history_next;
+static int history_entries;     // Entries each sample has room for
+static volatile sig_atomic_t metrics_stop;
+
+// Compiled ruleset the series follow, and its entries hashed by comment
+static CompiledRuleset entries;
+static int *entry_index;
+static int entry_index_size;
+// Per entry: the first entry with its comment, which holds the series,
+// and the next entry sharing that comment (-1 at the end)
+static int *entry_owner;
+static int *entry_next;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    metrics_stop = 1;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Comment an entry carries in the kernel, as format_entry_spec() sets it
+ */
+static const char *entry_comment(const CompiledEntry *entry, char *buffer, size_t size) {
+    if (entry->set_name[0]) {
+        return entry->set_name;
+    }
+    if (entry->comment[0]) {
+        return entry->comment;
+    }
+    if (entry->rule.comment) {
+        return pool_string(entry->rule.comment);
+    }
+    snprintf(buffer, size, "Rule-ID-%d", entry->rule.id);
+    return buffer;
+}
+
+/**
+ * Whether an entry holds a series (the fast path entries are not rules,
+ * and entries sharing a comment belong to the first one's series)
+ */
+static int is_series(int i) {
+    return !entries.entries[i].ctstate[0] && entry_owner[i] == i;
+}
+
+/**
+ * Number of exported series
+ */
+static int series_count(void) {
+    int count = 0;
+    for (int i = 0; i < entries.entry_count; i++) {
+        count += is_series(i);
+    }
+    return count;
+}
+
+/**
+ * Compile the current rules and hash their entries by comment
+ * Returns 0 on success, -1 on error
+ */
+static int load_entries(void) {
+    char buffer[32];
+
+    free_compiled_ruleset(&entries);
+    if (compile_ruleset(&entries) != 0) {
+        return -1;
+    }
+
+    int size = 16;
+    while (size < entries.entry_count * 2) {
+        size *= 2;
+    }
+    if (size != entry_index_size) {
+        int *grown = realloc(entry_index, sizeof(int) * size);
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        entry_index = grown;
+        entry_index_size = size;
+    }
+    memset(entry_index, -1, sizeof(int) * size);
+
+    int *owner = realloc(entry_owner, sizeof(int) * (entries.entry_count + 1));
+    if (owner) {
+        entry_owner = owner;
+    }
+    int *next = realloc(entry_next, sizeof(int) * (entries.entry_count + 1));
+    if (next) {
+        entry_next = next;
+    }
+    int *tail = malloc(sizeof(int) * (entries.entry_count + 1));
+    if (!owner || !next || !tail) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(tail);
+        return -1;
+    }
+
+    // The first entry with a comment holds the series of all that share it
+    for (int i = 0; i < entries.entry_count; i++) {
+        entry_owner[i] = i;
+        entry_next[i] = -1;
+        tail[i] = i;
+        if (entries.entries[i].ctstate[0]) {
+            continue;
+        }
+        const char *text = entry_comment(&entries.entries[i], buffer, sizeof(buffer));
+        uint32_t slot = comment_hash(text) & (uint32_t)(size - 1);
+        char other[32];
+        while (entry_index[slot] >= 0 &&
+               !comment_equals(entry_comment(&entries.entries[entry_index[slot]], other, sizeof(other)), text)) {
+            slot = (slot + 1) & (uint32_t)(size - 1);
+        }
+        if (entry_index[slot] < 0) {
+            entry_index[slot] = i;
+        } else {
+            int first = entry_index[slot];
+            entry_owner[i] = first;
+            entry_next[tail[first]] = i;
+            tail[first] = i;
+        }
+    }
+    free(tail);
+    return 0;
+}
+
+/**
+ * Add the counters of a kernel entry to the series of its comment
+ * (a partitioned chain may hold copies of one entry)
+ */
+static void credit_entry(const char *comment, unsigned long long packets, unsigned long long bytes, void *arg) {
+    MetricsSample *s = arg;
+    char buffer[32];
+
+    uint32_t slot = comment_hash(comment) & (uint32_t)(entry_index_size - 1);
+    for (; entry_index[slot] >= 0; slot = (slot + 1) & (uint32_t)(entry_index_size - 1)) {
+        int i = entry_index[slot];
+        if (comment_equals(entry_comment(&entries.entries[i], buffer, sizeof(buffer)), comment)) {
+            s->packets[i] += packets;
+            s->bytes[i] += bytes;
+            return;
+        }
+    }
+}
+
+/**
+ * Empty the ring, sized for the current entries
+ * Returns 0 on success, -1 when out of memory
+ */
+static int reset_history(void) {
+    history_count = 0;
+    history_next = 0;
+    if (entries.entry_count + 1 <= history_entries) {
+        return 0;
+    }
+    for (int i = 0; i < METRICS_HISTORY; i++) {
+        free(history[i].packets);
+        free(history[i].bytes);
+        history[i].packets = malloc(sizeof(unsigned long long) * (entries.entry_count + 1));
+        history[i].bytes = malloc(sizeof(unsigned long long) * (entries.entry_count + 1));
+        if (!history[i].packets || !history[i].bytes) {
+            fprintf(stderr, "Error: Out of memory\n");
+            history_entries = 0;
+            return -1;
+        }
+    }
+    history_entries = entries.entry_count + 1;
+    return 0;
+}
+
+/**
+ * Read the counters into the next ring slot
+ * Returns 0 on success, -1 on error
+ */
+static int take_sample(void) {
+    MetricsSample *s = &history[history_next];
+
+    memset(s->packets, 0, sizeof(unsigned long long) * entries.entry_count);
+    memset(s->bytes, 0, sizeof(unsigned long long) * entries.entry_count);
+    if (read_entry_counters(credit_entry, s) != 0) {
+        fprintf(stderr, "Error: Cannot read rule counters\n");
+        return -1;
+    }
+    s->when = monotonic_seconds();
+
+    history_next = (history_next + 1) % METRICS_HISTORY;
+    if (history_count < METRICS_HISTORY) {
+        history_count++;
+    }
+    return 0;
+}
+
+static const MetricsSample *newest_sample(void) {
+    return &history[(history_next + METRICS_HISTORY - 1) % METRICS_HISTORY];
+}
+
+static const MetricsSample *oldest_sample(void) {
+    return &history[(history_next + METRICS_HISTORY - history_count) % METRICS_HISTORY];
+}
+
+/**
+ * Per-second rate of a counter between two samples
+ */
+static double counter_rate(unsigned long long old_value, unsigned long long new_value, double span) {
+    if (span <= 0 || new_value < old_value) {
+        return 0;
+    }
+    return (double)(new_value - old_value) / span;
+}
+
+/**
+ * Write a label value with \, " and newlines escaped
+ */
+static void write_label(FILE *out, const char *text) {
+    for (; *text; text++) {
+        if (*text == '\\' || *text == '"') {
+            fputc('\\', out);
+            fputc(*text, out);
+        } else if (*text == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*text, out);
+        }
+    }
+}
+
+/**
+ * Number of rules whose packets a series counts
+ */
+static int entry_rules(int i) {
+    const CompiledEntry *entry = &entries.entries[i];
+    if (entry->set_name[0]) {
+        return entry->member_count;
+    }
+    int count = 0;
+    for (int e = i; e >= 0; e = entry_next[e]) {
+        count++;
+        for (const char *c = entries.entries[e].comment; *c; c++) {
+            count += *c == ',';
+        }
+    }
+    return count;
+}
+
+/**
+ * Write the labels of a series: the IDs of its rules ("3" or "3,5,9"),
+ * or for an ipset its name and aggregated="true", then the action and
+ * the rule's own comment
+ */
+static void write_labels(FILE *out, int i) {
+    const CompiledEntry *entry = &entries.entries[i];
+    if (entry->set_name[0]) {
+        fprintf(out, "{set=\"%s\",aggregated=\"true\"", entry->set_name);
+    } else {
+        fputs("{rules=\"", out);
+        for (int e = i; e >= 0; e = entry_next[e]) {
+            const CompiledEntry *member = &entries.entries[e];
+            fputs(e == i ? "" : ",", out);
+            if (member->comment[0]) {
+                // A multiport group names its rules after "Rule-ID-"
+                fputs(member->comment + 8, out);
+            } else {
+                fprintf(out, "%d", member->rule.id);
+            }
+        }
+        fputc('"', out);
+    }
+    fprintf(out, ",action=\"%s\"", action_name(entry->rule.action));
+    if (entry->rule.comment) {
+        fputs(",comment=\"", out);
+        write_label(out, pool_string(entry->rule.comment));
+        fputc('"', out);
+    }
+}
+
+/**
+ * Write one series of every entry
+ */
+static void write_series(FILE *out, const char *name, const char *help, const char *type,
+                         const unsigned long long *counters, const unsigned long long *old_counters,
+                         double span) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < entries.entry_count; i++) {
+        if (!is_series(i)) {
+            continue;
+        }
+        fputs(name, out);
+        write_labels(out, i);
+        if (old_counters) {
+            fprintf(out, "} %.3f\n", counter_rate(old_counters[i], counters[i], span));
+        } else {
+            fprintf(out, "} %llu\n", counters[i]);
+        }
+    }
+}
+
+/**
+ * Open a temporary file next to path, with a large buffer
+ */
+static FILE *open_temporary(const char *path, char *temp, size_t size) {
+    snprintf(temp, size, "%s.tmp", path);
+    FILE *out = fopen(temp, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", temp, strerror(errno));
+        return NULL;
+    }
+    setvbuf(out, NULL, _IOFBF, METRICS_BUFFER);
+    return out;
+}
+
+/**
+ * Finish a temporary file and move it over path
+ */
+static int commit_temporary(FILE *out, const char *temp, const char *path) {
+    if (ferror(out) | (fclose(out) != 0) || rename(temp, path) != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", path);
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write the newest sample in the Prometheus text format
+ */
+static int write_prometheus(const char *path, double read_seconds) {
+    const MetricsSample *now = newest_sample(), *then = oldest_sample();
+    double span = now->when - then->when;
+    char temp[PATH_MAX];
+    FILE *out = open_temporary(path, temp, sizeof(temp));
+    if (!out) {
+        return -1;
+    }
+
+    write_series(out, "firewall_rule_packets_total", "Packets matched by the rules of the entry", "counter",
+                 now->packets, NULL, 0);
+    write_series(out, "firewall_rule_bytes_total", "Bytes matched by the rules of the entry", "counter",
+                 now->bytes, NULL, 0);
+    write_series(out, "firewall_rule_packets_per_second", "Packet rate over the sampling window", "gauge",
+                 now->packets, then->packets, span);
+    write_series(out, "firewall_rule_bytes_per_second", "Byte rate over the sampling window", "gauge",
+                 now->bytes, then->bytes, span);
+    fprintf(out, "# HELP firewall_set_rules Rules aggregated into the ipset\n"
+                 "# TYPE firewall_set_rules gauge\n");
+    for (int i = 0; i < entries.entry_count; i++) {
+        if (entries.entries[i].set_name[0]) {
+            fprintf(out, "firewall_set_rules{set=\"%s\"} %d\n", entries.entries[i].set_name,
+                    entries.entries[i].member_count);
+        }
+    }
+    fprintf(out, "# HELP firewall_rules Rules in the ruleset\n# TYPE firewall_rules gauge\n"
+                 "firewall_rules %d\n", rule_count);
+    fprintf(out, "# HELP firewall_metrics_read_seconds Time taken to read all rule counters\n"
+                 "# TYPE firewall_metrics_read_seconds gauge\nfirewall_metrics_read_seconds %.6f\n",
+            read_seconds);
+    return commit_temporary(out, temp, path);
+}
+
+/**
+ * Write the newest sample as a binary dump
+ */
+static int write_dump(const char *path) {
+    const MetricsSample *now = newest_sample(), *then = oldest_sample();
+    char temp[PATH_MAX];
+    MetricsDumpHeader header;
+
+    FILE *out = open_temporary(path, temp, sizeof(temp));
+    if (!out) {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, METRICS_DUMP_MAGIC, sizeof(header.magic));
+    header.version = METRICS_DUMP_VERSION;
+    header.entry_count = (uint32_t)series_count();
+    header.timestamp = (uint64_t)time(NULL);
+    header.span = now->when - then->when;
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (int i = 0; i < entries.entry_count; i++) {
+        const CompiledEntry *entry = &entries.entries[i];
+        if (!is_series(i)) {
+            continue;
+        }
+        MetricsDumpRecord record;
+        memset(&record, 0, sizeof(record));
+        record.id = entry->rule.id;
+        record.action = entry->rule.action;
+        record.rules = (uint32_t)entry_rules(i);
+        record.flags = entry->set_name[0] ? METRICS_ENTRY_SET : 0;
+        record.packets = now->packets[i];
+        record.bytes = now->bytes[i];
+        record.packet_rate = (float)counter_rate(then->packets[i], now->packets[i], header.span);
+        record.byte_rate = (float)counter_rate(then->bytes[i], now->bytes[i], header.span);
+        fwrite(&record, sizeof(record), 1, out);
+    }
+    return commit_temporary(out, temp, path);
+}
+
+/**
+ * Sample the rule counters on an interval and export them
+ * Returns 0 on success, -1 on error
+ */
+int export_rule_metrics(int argc, char *argv[]) {
+    const char *output = METRICS_DEFAULT_OUTPUT, *dump = NULL;
+    int interval = METRICS_DEFAULT_INTERVAL, once = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dump = argv[++i];
+        } else if (strcmp(argv[i], "--once") == 0) {
+            once = 1;
+        } else {
+            fprintf(stderr, "Error: Unknown metrics option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (interval < 1) {
+        fprintf(stderr, "Error: The interval must be at least one second\n");
+        return -1;
+    }
+    if (firewall_config.backend == BACKEND_NFTABLES) {
+        fprintf(stderr, "Error: metrics needs the iptables backend\n");
+        return -1;
+    }
+    if (load_entries() != 0 || reset_history() != 0) {
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    uint64_t seen_stamp = rules_files_stamp();
+    int status = 0, samples = 0;
+    while (!metrics_stop) {
+        // Changed rules shift every position: reload and start over
+        if (rules_files_stamp() != seen_stamp) {
+            load_rules_from_file(NULL);
+            seen_stamp = rules_files_stamp();
+            if (load_entries() != 0 || reset_history() != 0) {
+                status = -1;
+                break;
+            }
+        }
+
+        double started = monotonic_seconds();
+        if (take_sample() != 0) {
+            status = -1;
+            break;
+        }
+        double read_seconds = monotonic_seconds() - started;
+        if (write_prometheus(output, read_seconds) != 0 || (dump && write_dump(dump) != 0)) {
+            status = -1;
+            break;
+        }
+        if (samples++ == 0) {
+            printf("Sampled %d rules in %d entries in %.1f ms, writing %s%s%s every %ds\n", rule_count,
+                   series_count(), read_seconds * 1000, output, dump ? " and " : "", dump ? dump : "", interval);
+            fflush(stdout);
+        }
+        if (once) {
+            break;
+        }
+
+        // Sleep out the interval, waking early only to stop
+        double wake = started + interval;
+        double left;
+        while (!metrics_stop && (left = wake - monotonic_seconds()) > 0) {
+            poll(NULL, 0, (int)(left * 1000) + 1);
+        }
+    }
+
+    for (int i = 0; i < METRICS_HISTORY; i++) {
+        free(history[i].packets);
+        free(history[i].bytes);
+        history[i].packets = history[i].bytes = NULL;
+    }
+    history_entries = 0;
+    free_compiled_ruleset(&entries);
+    return status;
+}
@@ -0,0 +1,578 @@
+#include "firewall.h"
+
+/*
+ * Ruleset optimizer.
+ *
+ * Removes rules that can never change a verdict and merges address
+ * runs into the fewest prefixes:
+ *   - shadowed:  an earlier rule matches everything this rule matches
+ *   - redundant: a later rule with the same action matches everything
+ *                this rule matches, and no rule in between with another
+ *                action can match any of the same packets
+ *   - merged:    consecutive rules that differ only in source (or only
+ *                in destination) are collapsed to the minimal prefix set
+ *
+ * Candidate lookups go through hash indexes keyed on address prefixes,
+ * so each rule only inspects the handful of rules whose prefixes can
+ * contain or overlap its own instead of the whole list.
+ */
+
+// Longest range of candidates checked before assuming a conflict
+#define OPT_SCAN_LIMIT 64
+
+typedef struct {
+    uint32_t src, dst;
+    int src_len, dst_len;       // 0 when the field is not matched
+    int proto;                  // 0 any, 1 TCP, 2 UDP, 3 ICMP
+    int port_first, port_last;  // 0-65535 when the port is not matched
+    uint32_t iface;             // 0 when the interface is not matched
+    int action;
+    uint32_t expires;           // 0 for never
+} OptMatch;
+
+typedef struct {
+    uint64_t key;
+    int *items;
+    int count;
+    int cap;
+} IndexBucket;
+
+typedef struct {
+    IndexBucket *slots;
+    size_t size;
+} PrefixIndex;
+
+static OptMatch *matches;
+static int src_lengths[33], dst_lengths[33];
+static int src_length_count, dst_length_count;
+
+/**
+ * Prefix mask for a length
+ */
+static uint32_t prefix_mask(int len) {
+    return len ? 0xFFFFFFFFu << (32 - len) : 0;
+}
+
+/**
+ * Parse a rule into numeric match ranges
+ */
+static void build_match(const FirewallRule *rule, OptMatch *m) {
+    memset(m, 0, sizeof(*m));
+
+    if (rule->source_len >= 0) {
+        m->src = rule->source;
+        m->src_len = rule->source_len;
+    }
+    if (rule->dest_len >= 0) {
+        m->dst = rule->dest;
+        m->dst_len = rule->dest_len;
+    }
+
+    if (rule->protocol == PROTO_TCP) {
+        m->proto = 1;
+    } else if (rule->protocol == PROTO_UDP) {
+        m->proto = 2;
+    } else if (rule->protocol == PROTO_ICMP) {
+        m->proto = 3;
+    }
+
+    m->port_last = 65535;
+    if (rule->port_first && (m->proto == 1 || m->proto == 2)) {
+        m->port_first = rule->port_first;
+        m->port_last = rule->port_last;
+    }
+
+    m->iface = rule->interface;
+    m->action = rule->action;
+    m->expires = rule->expires;
+}
+
+/**
+ * Check whether a matches every packet b matches for as long as b lives
+ */
+static int match_covers(const OptMatch *a, const OptMatch *b) {
+    return (a->expires == 0 || (b->expires != 0 && a->expires >= b->expires)) &&
+           a->src_len <= b->src_len && (b->src & prefix_mask(a->src_len)) == a->src &&
+           a->dst_len <= b->dst_len && (b->dst & prefix_mask(a->dst_len)) == a->dst &&
+           (a->proto == 0 || a->proto == b->proto) &&
+           a->port_first <= b->port_first && b->port_last <= a->port_last &&
+           (!a->iface || a->iface == b->iface);
+}
+
+/**
+ * Check whether a and b can match the same packet
+ */
+static int match_intersects(const OptMatch *a, const OptMatch *b) {
+    int src_len = a->src_len < b->src_len ? a->src_len : b->src_len;
+    int dst_len = a->dst_len < b->dst_len ? a->dst_len : b->dst_len;
+
+    return ((a->src ^ b->src) & prefix_mask(src_len)) == 0 &&
+           ((a->dst ^ b->dst) & prefix_mask(dst_len)) == 0 &&
+           (a->proto == 0 || b->proto == 0 || a->proto == b->proto) &&
+           a->port_first <= b->port_last && b->port_first <= a->port_last &&
+           interfaces_overlap(a->iface, b->iface);
+}
+
+/**
+ * 64-bit mixing step for index keys
+ */
+static uint64_t mix(uint64_t hash, uint64_t value) {
+    hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+    return hash * 0xFF51AFD7ED558CCDull;
+}
+
+/**
+ * Key of the cover index: every match field
+ */
+static uint64_t cover_key(uint32_t src, int src_len, uint32_t dst, int dst_len, int proto,
+                          int port_first, int port_last, uint32_t iface) {
+    uint64_t key = mix(1, src);
+    key = mix(key, src_len);
+    key = mix(key, dst);
+    key = mix(key, dst_len);
+    key = mix(key, proto);
+    key = mix(key, ((uint64_t)port_first << 16) | port_last);
+    return mix(key, iface);
+}
+
+/**
+ * Key of the conflict index: source prefix plus action
+ */
+static uint64_t conflict_key(uint32_t src, int src_len, int action, int descendants) {
+    uint64_t key = mix(2 + descendants, src);
+    key = mix(key, src_len);
+    return mix(key, action);
+}
+
+static int index_init(PrefixIndex *index, size_t expected) {
+    index->size = 16;
+    while (index->size < expected * 2) {
+        index->size <<= 1;
+    }
+    index->slots = calloc(index->size, sizeof(IndexBucket));
+    return index->slots ? 0 : -1;
+}
+
+static void index_free(PrefixIndex *index) {
+    for (size_t i = 0; i < index->size; i++) {
+        free(index->slots[i].items);
+    }
+    free(index->slots);
+    index->slots = NULL;
+}
+
+/**
+ * Find the bucket for a key (NULL when absent and not creating)
+ */
+static IndexBucket *index_bucket(PrefixIndex *index, uint64_t key, int create) {
+    size_t slot = key & (index->size - 1);
+
+    while (index->slots[slot].items) {
+        if (index->slots[slot].key == key) {
+            return &index->slots[slot];
+        }
+        slot = (slot + 1) & (index->size - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    IndexBucket *bucket = &index->slots[slot];
+    bucket->key = key;
+    bucket->cap = 4;
+    bucket->items = malloc(sizeof(int) * bucket->cap);
+    return bucket->items ? bucket : NULL;
+}
+
+/**
+ * Append a rule index to a bucket (indexes arrive in ascending order)
+ */
+static int index_add(PrefixIndex *index, uint64_t key, int item) {
+    IndexBucket *bucket = index_bucket(index, key, 1);
+    if (!bucket) {
+        return -1;
+    }
+    if (bucket->count == bucket->cap) {
+        int *grown = realloc(bucket->items, sizeof(int) * bucket->cap * 2);
+        if (!grown) {
+            return -1;
+        }
+        bucket->items = grown;
+        bucket->cap *= 2;
+    }
+    bucket->items[bucket->count++] = item;
+    return 0;
+}
+
+/**
+ * Position of the first item greater than value
+ */
+static int bucket_upper_bound(const IndexBucket *bucket, int value) {
+    int lo = 0, hi = bucket->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (bucket->items[mid] <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Record which prefix lengths occur, so lookups only try those
+ */
+static void collect_lengths(int count) {
+    int seen_src[33] = {0}, seen_dst[33] = {0};
+
+    for (int i = 0; i < count; i++) {
+        seen_src[matches[i].src_len] = 1;
+        seen_dst[matches[i].dst_len] = 1;
+    }
+
+    src_length_count = dst_length_count = 0;
+    for (int len = 0; len <= 32; len++) {
+        if (seen_src[len]) {
+            src_lengths[src_length_count++] = len;
+        }
+        if (seen_dst[len]) {
+            dst_lengths[dst_length_count++] = len;
+        }
+    }
+}
+
+/**
+ * Find a rule covering rule self: any earlier one, or with later set the
+ * nearest later one with the same action. Covering rules are looked up by
+ * every generalisation of self's fields (shorter prefixes in use, any
+ * protocol, any port, any interface); a port range that only partly
+ * generalises self's range is not detected.
+ */
+static int find_cover(PrefixIndex *index, int self, int later) {
+    const OptMatch *m = &matches[self];
+    int protos[2] = { 0, m->proto };
+    int port_firsts[2] = { 0, m->port_first };
+    int port_lasts[2] = { 65535, m->port_last };
+    int port_options = (m->port_first == 0 && m->port_last == 65535) ? 1 : 2;
+    uint32_t ifaces[2] = { 0, m->iface };
+    int best = -1;
+
+    for (int s = 0; s < src_length_count && src_lengths[s] <= m->src_len; s++) {
+        int sl = src_lengths[s];
+        for (int d = 0; d < dst_length_count && dst_lengths[d] <= m->dst_len; d++) {
+            int dl = dst_lengths[d];
+            for (int p = 0; p < (m->proto ? 2 : 1); p++) {
+                for (int f = 0; f < (m->iface ? 2 : 1); f++) {
+                    for (int o = 0; o < port_options; o++) {
+                        uint64_t key = cover_key(m->src & prefix_mask(sl), sl, m->dst & prefix_mask(dl), dl,
+                                                 protos[p], port_firsts[o], port_lasts[o], ifaces[f]);
+                        IndexBucket *bucket = index_bucket(index, key, 0);
+                        if (!bucket) {
+                            continue;
+                        }
+
+                        if (!later) {
+                            // Any earlier rule covering us shadows us
+                            for (int k = 0; k < bucket->count; k++) {
+                                if (match_covers(&matches[bucket->items[k]], m)) {
+                                    return bucket->items[k];
+                                }
+                            }
+                            continue;
+                        }
+
+                        // Nearest later rule with our action that covers us
+                        int scanned = 0;
+                        for (int k = bucket_upper_bound(bucket, self); k < bucket->count; k++) {
+                            int other = bucket->items[k];
+                            if ((best >= 0 && other >= best) || ++scanned > OPT_SCAN_LIMIT) {
+                                break;
+                            }
+                            if (matches[other].action == m->action &&
+                                match_covers(&matches[other], m)) {
+                                best = other;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * Check for a rule strictly between self and last, with an action other
+ * than m's, that can match any packet m matches. Errs on the side of
+ * reporting a conflict.
+ */
+static int has_conflict(PrefixIndex *index, int self, int last) {
+    const OptMatch *m = &matches[self];
+    int actions[] = { ACTION_ACCEPT, ACTION_DROP, ACTION_REJECT };
+
+    for (int a = 0; a < 3; a++) {
+        if (actions[a] == m->action) {
+            continue;
+        }
+
+        // Rules whose source contains ours, then rules inside our source
+        for (int s = 0; s <= src_length_count; s++) {
+            uint64_t key;
+            if (s < src_length_count) {
+                int sl = src_lengths[s];
+                if (sl > m->src_len) {
+                    continue;
+                }
+                key = conflict_key(m->src & prefix_mask(sl), sl, actions[a], 0);
+            } else {
+                key = conflict_key(m->src, m->src_len, actions[a], 1);
+            }
+
+            IndexBucket *bucket = index_bucket(index, key, 0);
+            if (!bucket) {
+                continue;
+            }
+
+            int scanned = 0;
+            for (int k = bucket_upper_bound(bucket, self); k < bucket->count && bucket->items[k] < last; k++) {
+                if (++scanned > OPT_SCAN_LIMIT || match_intersects(&matches[bucket->items[k]], m)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    uint32_t addr;
+    int len;
+} Prefix;
+
+static int compare_prefixes(const void *a, const void *b) {
+    const Prefix *pa = a, *pb = b;
+    if (pa->addr != pb->addr) {
+        return pa->addr < pb->addr ? -1 : 1;
+    }
+    return pa->len - pb->len;
+}
+
+/**
+ * Reduce a prefix list to the minimal equivalent set in place
+ * Returns the new count
+ */
+static int merge_prefixes(Prefix *list, int count) {
+    int top = 0;
+
+    qsort(list, count, sizeof(Prefix), compare_prefixes);
+
+    for (int i = 0; i < count; i++) {
+        Prefix p = list[i];
+
+        // Already inside the previous prefix
+        if (top > 0 && p.len >= list[top - 1].len &&
+            (p.addr & prefix_mask(list[top - 1].len)) == list[top - 1].addr) {
+            continue;
+        }
+        list[top++] = p;
+
+        // Fold sibling pairs into their parent
+        while (top >= 2) {
+            Prefix *a = &list[top - 2], *b = &list[top - 1];
+            if (a->len != b->len || a->len == 0 ||
+                (a->addr & (1u << (32 - a->len))) || (a->addr ^ b->addr) != (1u << (32 - a->len))) {
+                break;
+            }
+            a->len--;
+            top--;
+        }
+    }
+    return top;
+}
+
+/**
+ * Check whether two rules differ only in one address field
+ */
+static int same_but(const FirewallRule *a, const FirewallRule *b, int field) {
+    return a->action == b->action &&
+           a->expires == b->expires &&
+           a->protocol == b->protocol &&
+           a->port_first == b->port_first && a->port_last == b->port_last &&
+           a->interface == b->interface &&
+           (field == SET_MATCH_SOURCE
+                ? a->dest == b->dest && a->dest_len == b->dest_len && a->source_len >= 0 && b->source_len >= 0
+                : a->source == b->source && a->source_len == b->source_len && a->dest_len >= 0 && b->dest_len >= 0);
+}
+
+/**
+ * Optimize the in-memory ruleset
+ * With dry_run set only the report is printed
+ * Returns the number of rules removed, or -1 on error
+ */
+int optimize_ruleset(int dry_run) {
+    FirewallRule **rules = ordered_rules();
+    int count = rule_count;
+    int *removed = calloc(count + 1, sizeof(int));
+    PrefixIndex cover = {0}, conflict = {0};
+
+    matches = malloc(sizeof(OptMatch) * (count + 1));
+    if (!removed || !matches ||
+        index_init(&cover, count) != 0 || index_init(&conflict, count * 2) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(removed);
+        free(matches);
+        index_free(&cover);
+        index_free(&conflict);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        build_match(rules[i], &matches[i]);
+    }
+    collect_lengths(count);
+
+    printf("\nOptimizing %d rules...\n", count);
+
+    // Shadowed rules: scan forward, indexing each rule after checking it
+    for (int i = 0; i < count; i++) {
+        const OptMatch *m = &matches[i];
+        if (!rules[i]->active) {
+            continue;
+        }
+
+        int by = find_cover(&cover, i, 0);
+        if (by >= 0) {
+            removed[i] = 1;
+            printf("  Rule %d removed: shadowed by rule %d\n", rules[i]->id, rules[by]->id);
+        }
+        index_add(&cover, cover_key(m->src, m->src_len, m->dst, m->dst_len, m->proto,
+                                    m->port_first, m->port_last, m->iface), i);
+    }
+
+    // Conflict index: each rule under its own source prefix, and under
+    // every shorter prefix in use that contains it
+    for (int i = 0; i < count; i++) {
+        const OptMatch *m = &matches[i];
+        if (!rules[i]->active) {
+            continue;
+        }
+        index_add(&conflict, conflict_key(m->src, m->src_len, m->action, 0), i);
+        for (int s = 0; s < src_length_count && src_lengths[s] < m->src_len; s++) {
+            int sl = src_lengths[s];
+            index_add(&conflict, conflict_key(m->src & prefix_mask(sl), sl, m->action, 1), i);
+        }
+    }
+
+    // Redundant rules: a later same-action rule takes the same packets
+    for (int i = 0; i < count; i++) {
+        if (removed[i] || !rules[i]->active) {
+            continue;
+        }
+        int by = find_cover(&cover, i, 1);
+        if (by >= 0 && !has_conflict(&conflict, i, by)) {
+            removed[i] = 1;
+            printf("  Rule %d removed: redundant with later rule %d\n", rules[i]->id, rules[by]->id);
+        }
+    }
+
+    index_free(&cover);
+    index_free(&conflict);
+    free(matches);
+    matches = NULL;
+
+    // Rebuild the list, merging address runs as we go
+    FirewallRule *result = malloc(sizeof(FirewallRule) * (count + 1));
+    Prefix *prefixes = malloc(sizeof(Prefix) * (count + 1));
+    int kept = 0;
+
+    if (!result || !prefixes) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(result);
+        free(prefixes);
+        free(removed);
+        return -1;
+    }
+
+    int i = 0;
+    while (i < count) {
+        if (removed[i]) {
+            i++;
+            continue;
+        }
+
+        // Longest run of surviving active rules differing in one address
+        int run_end = i + 1, field = 0;
+        if (rules[i]->active) {
+            int fields[] = { SET_MATCH_SOURCE, SET_MATCH_DEST };
+            for (int f = 0; f < 2; f++) {
+                int j = i + 1;
+                while (j < count && (removed[j] ||
+                       (rules[j]->active && same_but(rules[i], rules[j], fields[f])))) {
+                    j++;
+                }
+                if (j > run_end) {
+                    run_end = j;
+                    field = fields[f];
+                }
+            }
+        }
+
+        int members = 0, run_first = kept;
+        for (int j = i; j < run_end; j++) {
+            if (removed[j]) {
+                continue;
+            }
+            if (field == SET_MATCH_DEST) {
+                prefixes[members].addr = rules[j]->dest;
+                prefixes[members].len = rules[j]->dest_len;
+            } else if (field == SET_MATCH_SOURCE) {
+                prefixes[members].addr = rules[j]->source;
+                prefixes[members].len = rules[j]->source_len;
+            }
+            result[kept + members] = *rules[j];
+            members++;
+        }
+
+        if (members > 1) {
+            int merged = merge_prefixes(prefixes, members);
+            if (merged < members) {
+                printf("  Rules %d..%d merged into %d rule(s):", result[run_first].id,
+                       result[run_first + members - 1].id, merged);
+                for (int p = 0; p < merged; p++) {
+                    FirewallRule *target = &result[run_first + p];
+                    char text[MAX_IP_LENGTH];
+                    if (field == SET_MATCH_DEST) {
+                        target->dest = prefixes[p].addr;
+                        target->dest_len = prefixes[p].len;
+                    } else {
+                        target->source = prefixes[p].addr;
+                        target->source_len = prefixes[p].len;
+                    }
+                    format_address(prefixes[p].addr, prefixes[p].len, text, sizeof(text));
+                    printf(" %s", text);
+                }
+                printf("\n");
+                members = merged;
+            }
+        }
+
+        kept += members;
+        i = run_end;
+    }
+
+    int dropped = count - kept;
+    printf("\n%d rules -> %d rules (%d removed)\n", count, kept, dropped);
+
+    // Surviving rules keep their IDs; a merged rule takes the ID of the
+    // run member whose place it takes
+    if (!dry_run && dropped > 0 && rule_store_replace(result, kept) != 0) {
+        dropped = -1;
+    }
+
+    free(result);
+    free(prefixes);
+    free(removed);
+    return dropped;
+}
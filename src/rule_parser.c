@@ -1,72 +1,333 @@
 #include "firewall.h"
 #include <sys/wait.h>
 
-// Global rules array
-FirewallRule rules[1000];
-int rule_count = 0;
+/*
+ * Rule strings are comma-separated key=value fields. parse_rule_string()
+ * walks the text once without copying it: each field is located in
+ * place, its key is dispatched on length and text, and its value is
+ * converted into the packed rule straight away. Nothing is allocated
+ * apart from interning interface names and comments, and no state is
+ * kept between calls, so import workers parse concurrently.
+ */
+
+#define FIELD_UNKNOWN   0
+#define FIELD_ACTION    1
+#define FIELD_SOURCE    2
+#define FIELD_DEST      3
+#define FIELD_PORT      4
+#define FIELD_PROTOCOL  5
+#define FIELD_INTERFACE 6
+#define FIELD_COMMENT   7
+#define FIELD_TTL       8
+#define FIELD_EXPIRES   9
+
+// Longest interface name kept
+#define INTERFACE_LENGTH 63
 
 /**
- * Parse a rule string into a FirewallRule structure
- * Format: action=ACCEPT,source=192.168.1.1,port=80,protocol=TCP
+ * Check whether a span holds exactly the given word
  */
-int parse_rule_string(const char *rule_string, FirewallRule *rule) {
-    if (!rule_string || !rule) {
-        return -1;
+static int span_is(const char *text, size_t len, const char *word) {
+    return strncmp(text, word, len) == 0 && word[len] == '\0';
+}
+
+/**
+ * Field a key names (switch on length, then compare)
+ */
+static int field_for_key(const char *key, size_t len) {
+    switch (len) {
+    case 3:
+        return span_is(key, len, "ttl") ? FIELD_TTL : FIELD_UNKNOWN;
+    case 1:
+        return key[0] == 'i' ? FIELD_INTERFACE : FIELD_UNKNOWN;
+    case 4:
+        return span_is(key, len, "port") ? FIELD_PORT :
+               span_is(key, len, "dest") ? FIELD_DEST : FIELD_UNKNOWN;
+    case 5:
+        return span_is(key, len, "dport") ? FIELD_PORT : FIELD_UNKNOWN;
+    case 6:
+        return span_is(key, len, "action") ? FIELD_ACTION :
+               span_is(key, len, "source") ? FIELD_SOURCE : FIELD_UNKNOWN;
+    case 7:
+        return span_is(key, len, "comment") ? FIELD_COMMENT :
+               span_is(key, len, "expires") ? FIELD_EXPIRES : FIELD_UNKNOWN;
+    case 8:
+        return span_is(key, len, "protocol") ? FIELD_PROTOCOL : FIELD_UNKNOWN;
+    case 9:
+        return span_is(key, len, "interface") ? FIELD_INTERFACE : FIELD_UNKNOWN;
+    case 11:
+        return span_is(key, len, "destination") ? FIELD_DEST : FIELD_UNKNOWN;
     }
+    return FIELD_UNKNOWN;
+}
 
-    // Initialize rule
-    memset(rule, 0, sizeof(FirewallRule));
-    rule->active = 1;
+/**
+ * Read a decimal number of at most max_digits digits, advancing *pos
+ * Returns 0 on success, -1 if there is no digit or the number is longer
+ */
+static int scan_number(const char **pos, const char *end, int max_digits, int *value) {
+    const char *p = *pos;
+    int n = 0;
 
-    // Copy and sanitize rule string
-    char *rule_copy = strdup(rule_string);
-    if (!rule_copy) {
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - *pos == max_digits) {
+            return -1;
+        }
+        n = n * 10 + (*p++ - '0');
+    }
+    if (p == *pos) {
         return -1;
     }
+    *pos = p;
+    *value = n;
+    return 0;
+}
 
-    // Tokenize by comma
-    char *token = strtok(rule_copy, ",");
-    while (token != NULL) {
-        // Remove leading/trailing whitespace
-        while (isspace(*token)) token++;
-        char *end = token + strlen(token) - 1;
-        while (end > token && isspace(*end)) *end-- = '\0';
-
-        // Parse key=value pairs
-        char *equals = strchr(token, '=');
-        if (equals) {
-            *equals = '\0';
-            char *key = token;
-            char *value = equals + 1;
-
-            // Remove quotes if present
-            if (value[0] == '"' || value[0] == '\'') {
-                value++;
-                value[strlen(value) - 1] = '\0';
+/**
+ * Parse "a.b.c.d" or "a.b.c.d/len" into a masked prefix
+ * Returns NULL on success, or the first offending character
+ */
+const char *parse_address_span(const char *p, const char *end, uint32_t *addr, int8_t *prefix_len) {
+    uint32_t value = 0;
+    int len = 32;
+
+    for (int octet = 0; octet < 4; octet++) {
+        if (octet > 0) {
+            if (p == end || *p != '.') {
+                return p;
             }
+            p++;
+        }
+        // Same octets inet_pton() takes: no leading zeros, at most 255
+        const char *start = p;
+        int n;
+        if (scan_number(&p, end, 3, &n) != 0 || n > 255 || (p - start > 1 && *start == '0')) {
+            return start;
+        }
+        value = (value << 8) | (uint32_t)n;
+    }
 
-            // Assign values based on key
-            if (strcmp(key, "action") == 0) {
-                strncpy(rule->action, value, MAX_ACTION_LENGTH - 1);
-            } else if (strcmp(key, "source") == 0) {
-                strncpy(rule->source, value, MAX_IP_LENGTH - 1);
-            } else if (strcmp(key, "destination") == 0 || strcmp(key, "dest") == 0) {
-                strncpy(rule->dest, value, MAX_IP_LENGTH - 1);
-            } else if (strcmp(key, "port") == 0 || strcmp(key, "dport") == 0) {
-                strncpy(rule->port, value, MAX_PORT_LENGTH - 1);
-            } else if (strcmp(key, "protocol") == 0) {
-                strncpy(rule->protocol, value, MAX_PROTOCOL_LENGTH - 1);
-            } else if (strcmp(key, "interface") == 0 || strcmp(key, "i") == 0) {
-                strncpy(rule->interface, value, 63);
-            } else if (strcmp(key, "comment") == 0) {
-                strncpy(rule->comment, value, MAX_COMMENT_LENGTH - 1);
+    if (p < end && *p == '/') {
+        const char *start = ++p;
+        if (scan_number(&p, end, 2, &len) != 0 || len > 32) {
+            return start;
+        }
+    }
+    if (p != end) {
+        return p;
+    }
+
+    *addr = len ? value & (0xFFFFFFFFu << (32 - len)) : 0;
+    *prefix_len = (int8_t)len;
+    return NULL;
+}
+
+/**
+ * Parse "port" or "first:last" (1-65535, first <= last)
+ * Returns NULL on success, or the first offending character
+ */
+static const char *scan_port(const char *p, const char *end, uint16_t *first, uint16_t *last) {
+    const char *start = p;
+    int low, high;
+
+    if (scan_number(&p, end, 5, &low) != 0 || low < 1 || low > 65535) {
+        return start;
+    }
+    high = low;
+    if (p < end && *p == ':') {
+        start = ++p;
+        if (scan_number(&p, end, 5, &high) != 0 || high < low || high > 65535) {
+            return start;
+        }
+    }
+    if (p != end) {
+        return p;
+    }
+
+    *first = (uint16_t)low;
+    *last = (uint16_t)high;
+    return NULL;
+}
+
+/**
+ * Parse a lifetime ("90", "30s", "15m", "2h", "7d") or, with absolute
+ * set, a Unix time, into the time the rule lapses
+ * Returns NULL on success, or the first offending character
+ */
+static const char *scan_expiry(const char *p, const char *end, int absolute, uint32_t *expires) {
+    const char *start = p;
+    long long value = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (p - start == 10) {
+            return p;
+        }
+        value = value * 10 + (*p++ - '0');
+    }
+    if (p == start || value == 0) {
+        return start;
+    }
+    if (!absolute && p < end) {
+        const char *units = "smhd";
+        static const long long seconds[] = { 1, 60, 3600, 86400 };
+        const char *unit = memchr(units, *p, 4);
+        if (!unit) {
+            return p;
+        }
+        value *= seconds[unit - units];
+        p++;
+        value += (long long)time(NULL);
+    } else if (!absolute) {
+        value += (long long)time(NULL);
+    }
+    if (p != end) {
+        return p;
+    }
+    if (value > UINT32_MAX) {
+        return start;
+    }
+
+    *expires = (uint32_t)value;
+    return NULL;
+}
+
+/**
+ * Convert one field value into the rule
+ * Returns NULL on success, or the first offending character
+ */
+static const char *parse_field(int field, const char *value, size_t len, FirewallRule *rule) {
+    const char *end = value + len;
+
+    switch (field) {
+    case FIELD_ACTION:
+        for (int a = ACTION_ACCEPT; a <= ACTION_REJECT; a++) {
+            if (span_is(value, len, action_name(a))) {
+                rule->action = (uint8_t)a;
+                return NULL;
             }
         }
+        return value;
+    case FIELD_PROTOCOL:
+        for (int p = PROTO_TCP; p <= PROTO_ALL; p++) {
+            if (span_is(value, len, protocol_name(p))) {
+                rule->protocol = (uint8_t)p;
+                return NULL;
+            }
+        }
+        return value;
+    case FIELD_SOURCE:
+        return parse_address_span(value, end, &rule->source, &rule->source_len);
+    case FIELD_DEST:
+        return parse_address_span(value, end, &rule->dest, &rule->dest_len);
+    case FIELD_PORT:
+        return scan_port(value, end, &rule->port_first, &rule->port_last);
+    case FIELD_INTERFACE:
+        rule->interface = intern_span(value, len < INTERFACE_LENGTH ? len : INTERFACE_LENGTH);
+        return rule->interface ? NULL : value;
+    case FIELD_COMMENT:
+        rule->comment = intern_span(value, len < MAX_COMMENT_LENGTH - 1 ? len : MAX_COMMENT_LENGTH - 1);
+        return rule->comment ? NULL : value;
+    case FIELD_TTL:
+        return scan_expiry(value, end, 0, &rule->expires);
+    case FIELD_EXPIRES:
+        return scan_expiry(value, end, 1, &rule->expires);
+    }
+    return NULL;
+}
+
+/**
+ * Start a rule that matches everything and has no action yet
+ */
+void make_empty_rule(FirewallRule *rule) {
+    memset(rule, 0, sizeof(FirewallRule));
+    rule->source_len = -1;
+    rule->dest_len = -1;
+    rule->active = 1;
+}
+
+/**
+ * Parse the rule text between start and end, which lies within line
+ * Every field is validated and converted in the same pass. On error a
+ * description naming the column (counted from line) of the offending
+ * character is written to error and -1 is returned.
+ */
+int parse_rule_span(const char *line, const char *start, const char *end,
+                    FirewallRule *rule, char *error, size_t error_size) {
+    static const char *labels[] = {
+        "", "action", "source IP", "destination IP", "port", "protocol", "interface", "comment",
+        "ttl", "expiry time"
+    };
+
+    make_empty_rule(rule);
+
+    const char *pos = start;
+    while (pos < end) {
+        // One field, trimmed of surrounding whitespace
+        const char *field_start = pos;
+        while (pos < end && *pos != ',') {
+            pos++;
+        }
+        const char *field_end = pos;
+        if (pos < end) {
+            pos++;
+        }
+        while (field_start < field_end && isspace((unsigned char)*field_start)) {
+            field_start++;
+        }
+        while (field_end > field_start + 1 && isspace((unsigned char)field_end[-1])) {
+            field_end--;
+        }
+
+        const char *equals = memchr(field_start, '=', (size_t)(field_end - field_start));
+        if (!equals) {
+            continue;
+        }
+        int field = field_for_key(field_start, (size_t)(equals - field_start));
+        if (field == FIELD_UNKNOWN) {
+            continue;
+        }
+
+        // Remove quotes if present
+        const char *value = equals + 1;
+        size_t len = (size_t)(field_end - value);
+        if (len > 0 && (value[0] == '"' || value[0] == '\'')) {
+            value++;
+            len = len >= 2 ? len - 2 : 0;
+        }
+        // An empty value leaves the field unset
+        if (len == 0) {
+            continue;
+        }
 
-        token = strtok(NULL, ",");
+        const char *bad = parse_field(field, value, len, rule);
+        if (bad) {
+            snprintf(error, error_size, "Invalid %s at column %d: %.*s", labels[field],
+                     (int)(bad - line) + 1, len > 64 ? 64 : (int)len, value);
+            return -1;
+        }
     }
 
-    free(rule_copy);
+    return 0;
+}
+
+/**
+ * Parse a rule string into a FirewallRule structure
+ * Format: action=ACCEPT,source=192.168.1.1,port=80,protocol=TCP
+ */
+int parse_rule_string(const char *rule_string, FirewallRule *rule) {
+    char error[PARSE_ERROR_LENGTH];
+
+    if (!rule_string || !rule) {
+        return -1;
+    }
+    uint64_t started = PROFILE_BEGIN();
+    int ret = parse_rule_span(rule_string, rule_string, rule_string + strlen(rule_string),
+                              rule, error, sizeof(error));
+    PROFILE_END(PROFILE_PARSE, started);
+    if (ret != 0) {
+        fprintf(stderr, "Error: %s\n", error);
+        return -1;
+    }
     return 0;
 }
 
@@ -79,86 +340,166 @@ int add_firewall_rule(const char *rule_string) {
         return -1;
     }
 
-    if (rule_count >= 1000) {
-        fprintf(stderr, "Error: Maximum rule limit reached\n");
-        return -1;
-    }
-
+    // Fields are validated while parsing
     FirewallRule rule;
     if (parse_rule_string(rule_string, &rule) != 0) {
-        fprintf(stderr, "Error: Failed to parse rule\n");
         return -1;
     }
 
-    // Validate the rule
-    if (rule.action[0] == '\0') {
+    if (rule.action == ACTION_NONE) {
         fprintf(stderr, "Error: Action is required\n");
         return -1;
     }
 
-    if (!validate_action(rule.action)) {
-        fprintf(stderr, "Error: Invalid action: %s\n", rule.action);
+    // Snapshot the compiled chain so only the difference is committed
+    CompiledRuleset before;
+    int sync_iptables = check_root_privileges() &&
+                        firewall_config.backend == BACKEND_IPTABLES &&
+                        compile_ruleset(&before) == 0;
+
+    // Assign ID and add rule
+    rule.id = rule_store_add(&rule, 0);
+    if (rule.id < 0) {
+        if (sync_iptables) {
+            free_compiled_ruleset(&before);
+        }
         return -1;
     }
 
-    if (rule.source[0] && !validate_ip(rule.source) && !validate_cidr(rule.source)) {
-        fprintf(stderr, "Error: Invalid source IP: %s\n", rule.source);
+    // The change is on disk before it reaches the kernel
+    if (journal_add(&rule) != 0) {
+        rule_store_remove(rule.id);
+        if (sync_iptables) {
+            free_compiled_ruleset(&before);
+        }
         return -1;
     }
 
-    if (rule.dest[0] && !validate_ip(rule.dest) && !validate_cidr(rule.dest)) {
-        fprintf(stderr, "Error: Invalid destination IP: %s\n", rule.dest);
-        return -1;
+    // Apply to the kernel if we have root
+    if (sync_iptables) {
+        commit_ruleset_change(&before);
+    } else if (check_root_privileges() && firewall_config.backend == BACKEND_NFTABLES) {
+        nft_apply_ruleset();
     }
+    if (check_root_privileges()) {
+        xdp_sync();
+    }
+
+    printf("Rule added successfully with ID: %d\n", rule.id);
+    log_event(LOG_LEVEL_INFO, "Added rule %d: %s", rule.id, rule_string);
+    return rule.id;
+}
 
-    if (rule.port[0] && !validate_port(rule.port)) {
-        fprintf(stderr, "Error: Invalid port: %s\n", rule.port);
+/**
+ * Add several parsed rules as one change: one journal write and one
+ * committed ruleset diff (their IDs are filled in)
+ * Returns 0 on success, -1 on error (none of the rules is added)
+ */
+int add_firewall_rules(FirewallRule *rules, int count) {
+    // Snapshot the compiled chain so only the difference is committed
+    CompiledRuleset before;
+    int sync_iptables = check_root_privileges() &&
+                        firewall_config.backend == BACKEND_IPTABLES &&
+                        compile_ruleset(&before) == 0;
+
+    int added = 0;
+    while (added < count && (rules[added].id = rule_store_add(&rules[added], 0)) >= 0) {
+        added++;
+    }
+    // The changes are on disk before they reach the kernel
+    if (added < count || journal_add_rules(rules, count) != 0) {
+        while (added > 0) {
+            rule_store_remove(rules[--added].id);
+        }
+        if (sync_iptables) {
+            free_compiled_ruleset(&before);
+        }
         return -1;
     }
 
-    if (rule.protocol[0] && !validate_protocol(rule.protocol)) {
-        fprintf(stderr, "Error: Invalid protocol: %s\n", rule.protocol);
-        return -1;
+    if (sync_iptables) {
+        commit_ruleset_change(&before);
+    } else if (check_root_privileges() && firewall_config.backend == BACKEND_NFTABLES) {
+        nft_apply_ruleset();
     }
+    if (check_root_privileges()) {
+        xdp_sync();
+    }
+    return 0;
+}
 
-    // Assign ID and add rule
-    rule.id = rule_count + 1;
-    rules[rule_count] = rule;
-    rule_count++;
+/**
+ * Add several rule strings as one change (see add_firewall_rules())
+ * Returns 0 on success, -1 on error (none of the rules is added)
+ */
+int add_firewall_rule_strings(char *const *rule_strings, int count) {
+    FirewallRule *rules = malloc(sizeof(FirewallRule) * (count + 1));
+    if (!rules) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
 
-    // Apply to iptables if we have root
-    if (check_root_privileges()) {
-        apply_rule_to_iptables(&rule);
+    for (int i = 0; i < count; i++) {
+        if (parse_rule_string(rule_strings[i], &rules[i]) != 0) {
+            free(rules);
+            return -1;
+        }
+        if (rules[i].action == ACTION_NONE) {
+            fprintf(stderr, "Error: Action is required: %s\n", rule_strings[i]);
+            free(rules);
+            return -1;
+        }
     }
 
-    printf("Rule added successfully with ID: %d\n", rule.id);
-    return rule.id;
+    if (add_firewall_rules(rules, count) != 0) {
+        free(rules);
+        return -1;
+    }
+    printf("Rules added successfully with IDs:");
+    for (int i = 0; i < count; i++) {
+        printf("%s %d", i ? "," : "", rules[i].id);
+        log_event(LOG_LEVEL_INFO, "Added rule %d: %s", rules[i].id, rule_strings[i]);
+    }
+    printf("\n");
+    free(rules);
+    return 0;
 }
 
 /**
  * Remove a firewall rule by ID
  */
 int remove_firewall_rule(int rule_id) {
-    if (rule_id < 1 || rule_id > rule_count) {
+    if (!get_rule_by_id(rule_id)) {
         fprintf(stderr, "Error: Invalid rule ID\n");
         return -1;
     }
 
-    int index = rule_id - 1;
-
-    // Apply removal to iptables if we have root
-    if (check_root_privileges() && rules[index].active) {
-        remove_rule_from_iptables(&rules[index]);
+    if (journal_remove(rule_id) != 0) {
+        return -1;
     }
 
-    // Remove from array by shifting
-    for (int i = index; i < rule_count - 1; i++) {
-        rules[i] = rules[i + 1];
-        rules[i].id = i + 1;
+    // Snapshot the compiled chain so only the difference is committed
+    CompiledRuleset before;
+    int sync_iptables = check_root_privileges() &&
+                        firewall_config.backend == BACKEND_IPTABLES &&
+                        compile_ruleset(&before) == 0;
+
+    // Other rules keep their IDs, so their kernel comments stay valid
+    rule_store_remove(rule_id);
+
+    // Apply removal to the kernel if we have root
+    if (sync_iptables) {
+        commit_ruleset_change(&before);
+    } else if (check_root_privileges() && firewall_config.backend == BACKEND_NFTABLES) {
+        // nftables groups are recompiled as a whole
+        nft_apply_ruleset();
+    }
+    if (check_root_privileges()) {
+        xdp_sync();
     }
 
-    rule_count--;
     printf("Rule %d removed successfully\n", rule_id);
+    log_event(LOG_LEVEL_INFO, "Removed rule %d", rule_id);
     return 0;
 }
 
@@ -176,26 +517,40 @@ int list_firewall_rules(void) {
         return 0;
     }
 
+    FirewallRule **rules = ordered_rules();
     for (int i = 0; i < rule_count; i++) {
-        printf("║  ID: %-3d | Status: %s\n", rules[i].id, rules[i].active ? "ACTIVE" : "DISABLED");
-        
-        if (rules[i].action[0]) {
-            printf("║  Action:    %s\n", rules[i].action);
+        const FirewallRule *rule = rules[i];
+        char text[MAX_IP_LENGTH];
+
+        printf("║  ID: %-3d | Status: %s\n", rule->id, rule->active ? "ACTIVE" : "DISABLED");
+
+        if (rule->action) {
+            printf("║  Action:    %s\n", action_name(rule->action));
         }
-        if (rules[i].source[0]) {
-            printf("║  Source:    %s\n", rules[i].source);
+        if (rule->source_len >= 0) {
+            format_address(rule->source, rule->source_len, text, sizeof(text));
+            printf("║  Source:    %s\n", text);
         }
-        if (rules[i].dest[0]) {
-            printf("║  Dest:      %s\n", rules[i].dest);
+        if (rule->dest_len >= 0) {
+            format_address(rule->dest, rule->dest_len, text, sizeof(text));
+            printf("║  Dest:      %s\n", text);
         }
-        if (rules[i].port[0]) {
-            printf("║  Port:      %s\n", rules[i].port);
+        if (rule->port_first) {
+            format_port_range(rule->port_first, rule->port_last, text, sizeof(text));
+            printf("║  Port:      %s\n", text);
         }
-        if (rules[i].protocol[0]) {
-            printf("║  Protocol:  %s\n", rules[i].protocol);
+        if (rule->protocol) {
+            printf("║  Protocol:  %s\n", protocol_name(rule->protocol));
         }
-        if (rules[i].comment[0]) {
-            printf("║  Comment:   %s\n", rules[i].comment);
+        if (rule->comment) {
+            printf("║  Comment:   %s\n", pool_string(rule->comment));
+        }
+        if (rule->expires) {
+            time_t expires = (time_t)rule->expires;
+            long left = (long)(expires - time(NULL));
+            strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&expires));
+            left = left > 0 ? left : 0;
+            printf("║  Expires:   %s (in %ldh %02ldm %02lds)\n", text, left / 3600, left / 60 % 60, left % 60);
         }
         if (i < rule_count - 1) {
             printf("╠══════════════════════════════════════════════════════════════════╣\n");
@@ -206,21 +561,3 @@ int list_firewall_rules(void) {
     printf("\nTotal rules: %d\n", rule_count);
     return 0;
 }
-
-/**
- * Get rule count
- */
-int get_rule_count(void) {
-    return rule_count;
-}
-
-/**
- * Get rule by ID
- */
-FirewallRule* get_rule_by_id(int rule_id) {
-    if (rule_id < 1 || rule_id > rule_count) {
-        return NULL;
-    }
-    return &rules[rule_id - 1];
-}
-
@@ -0,0 +1,317 @@
+#include "firewall.h"
+
+/*
+ * Counter-driven rule reordering.
+ *
+ * Reads the packet counter of every chain entry, credits it to the
+ * rules named in the entry's comment, and moves the hot rules toward the
+ * head of the ruleset. A rule never moves past a rule it overlaps with,
+ * so no packet can change verdict. Cold rules keep their relative order.
+ */
+
+// Share of all matched packets, in percent, that makes a rule hot
+#define REORDER_HOT_PERCENT 1
+
+/*
+ * Ready queue: a binary heap of rule indexes, hottest first and, among
+ * equally hot rules, earliest first
+ */
+static const unsigned long long *heap_heat;
+static int *heap;
+static int heap_size;
+
+/**
+ * Check whether rule a should come out of the heap before rule b
+ */
+static int heap_before(int a, int b) {
+    if (heap_heat[a] != heap_heat[b]) {
+        return heap_heat[a] > heap_heat[b];
+    }
+    return a < b;
+}
+
+/**
+ * Add a rule index to the heap
+ */
+static void heap_push(int item) {
+    int pos = heap_size++;
+    while (pos > 0 && heap_before(item, heap[(pos - 1) / 2])) {
+        heap[pos] = heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    heap[pos] = item;
+}
+
+/**
+ * Remove and return the first rule index in the heap
+ */
+static int heap_pop(void) {
+    int top = heap[0];
+    int item = heap[--heap_size];
+    int pos = 0;
+
+    while (2 * pos + 1 < heap_size) {
+        int child = 2 * pos + 1;
+        if (child + 1 < heap_size && heap_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!heap_before(heap[child], item)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = item;
+    return top;
+}
+
+/*
+ * User comments of the stored rules in kernel form, hashed to the first
+ * rule carrying each, so crediting an entry is one probe however many
+ * rules there are. Rebuilt when the store changes.
+ */
+static int *comment_index;
+static int comment_index_size;
+static unsigned long comment_index_version;
+
+/**
+ * Hash a comment as the kernel shows it (double quotes turned single)
+ */
+uint32_t comment_hash(const char *text) {
+    uint32_t hash = 2166136261u;
+    for (; *text; text++) {
+        hash = (hash ^ (unsigned char)(*text == '"' ? '\'' : *text)) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Check whether a stored comment reads as a kernel comment
+ */
+int comment_equals(const char *stored, const char *kernel) {
+    while (*stored && *kernel && (*stored == *kernel || (*stored == '"' && *kernel == '\''))) {
+        stored++;
+        kernel++;
+    }
+    return !*stored && !*kernel;
+}
+
+static int build_comment_index(void) {
+    FirewallRule **rules = ordered_rules();
+    int size = 16;
+    while (size < rule_count * 2) {
+        size *= 2;
+    }
+    if (size != comment_index_size) {
+        int *grown = realloc(comment_index, sizeof(int) * size);
+        if (!grown) {
+            return -1;
+        }
+        comment_index = grown;
+        comment_index_size = size;
+    }
+    memset(comment_index, -1, sizeof(int) * size);
+
+    for (int i = 0; i < rule_count; i++) {
+        if (!rules[i]->comment) {
+            continue;
+        }
+        const char *text = pool_string(rules[i]->comment);
+        uint32_t slot = comment_hash(text) & (uint32_t)(size - 1);
+        // The first rule with a comment keeps it
+        while (comment_index[slot] >= 0 && !comment_equals(pool_string(rules[comment_index[slot]]->comment), text)) {
+            slot = (slot + 1) & (uint32_t)(size - 1);
+        }
+        if (comment_index[slot] < 0) {
+            comment_index[slot] = i;
+        }
+    }
+    comment_index_version = rule_store_version();
+    return 0;
+}
+
+/**
+ * Credit an entry's packet and byte counters to the rules its comment
+ * names: "Rule-ID-N" or "Rule-ID-N,M,..." for a multiport group,
+ * otherwise the first rule carrying that user comment. Set entries are
+ * not credited, since the counter cannot be split among their members.
+ * Both arrays are indexed by rule position; bytes may be NULL.
+ */
+void credit_rule_counter(const char *comment, unsigned long long packets, unsigned long long bytes,
+                         unsigned long long *packet_counts, unsigned long long *byte_counts) {
+    if (strncmp(comment, "Rule-ID-", 8) == 0) {
+        const char *pos = comment + 8;
+        while (*pos) {
+            char *end;
+            long id = strtol(pos, &end, 10);
+            if (end == pos) {
+                break;
+            }
+            int index = rule_position((int)id);
+            if (index >= 0) {
+                packet_counts[index] += packets;
+                if (byte_counts) {
+                    byte_counts[index] += bytes;
+                }
+            }
+            pos = *end == ',' ? end + 1 : end;
+        }
+        return;
+    }
+
+    if ((!comment_index || comment_index_version != rule_store_version()) && build_comment_index() != 0) {
+        return;
+    }
+    FirewallRule **rules = ordered_rules();
+    uint32_t slot = comment_hash(comment) & (uint32_t)(comment_index_size - 1);
+    for (; comment_index[slot] >= 0; slot = (slot + 1) & (uint32_t)(comment_index_size - 1)) {
+        int i = comment_index[slot];
+        if (comment_equals(pool_string(rules[i]->comment), comment)) {
+            packet_counts[i] += packets;
+            if (byte_counts) {
+                byte_counts[i] += bytes;
+            }
+            return;
+        }
+    }
+}
+
+typedef struct {
+    unsigned long long *packets;
+    unsigned long long *bytes;
+} RuleCounters;
+
+static void credit_entry(const char *comment, unsigned long long packets, unsigned long long bytes, void *arg) {
+    RuleCounters *counters = arg;
+    credit_rule_counter(comment, packets, bytes, counters->packets, counters->bytes);
+}
+
+/**
+ * Credit the packet and byte counters of every entry in the filter table
+ * to the rules named by its comment, from one read of the table
+ * (both arrays are indexed by rule position; bytes may be NULL)
+ */
+int read_rule_counters(unsigned long long *packets, unsigned long long *bytes) {
+    RuleCounters counters = { packets, bytes };
+    return read_entry_counters(credit_entry, &counters);
+}
+
+/**
+ * Reorder rules by their packet counters
+ * With dry_run set only the planned moves are printed
+ * Returns the number of rules that moved, or -1 on error
+ */
+int reorder_rules(int dry_run) {
+    FirewallRule **rules = ordered_rules();
+    if (firewall_config.backend == BACKEND_NFTABLES) {
+        fprintf(stderr, "Error: reorder needs the iptables backend\n");
+        return -1;
+    }
+
+    int count = rule_count;
+    unsigned long long *counts = calloc(count + 1, sizeof(unsigned long long));
+    unsigned long long *heat = calloc(count + 1, sizeof(unsigned long long));
+    int *blockers = calloc(count + 1, sizeof(int));
+    int *order = malloc(sizeof(int) * (count + 1));
+    heap = malloc(sizeof(int) * (count + 1));
+    heap_heat = heat;
+    heap_size = 0;
+
+    if (!counts || !heat || !blockers || !order || !heap) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto fail;
+    }
+    if (read_rule_counters(counts, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot read rule counters\n");
+        goto fail;
+    }
+
+    unsigned long long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += counts[i];
+    }
+
+    // Only rules with a real share of the traffic are worth moving
+    unsigned long long hot_floor = total * REORDER_HOT_PERCENT / 100;
+    if (hot_floor == 0) {
+        hot_floor = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        heat[i] = counts[i] >= hot_floor ? counts[i] : 0;
+    }
+
+    // An earlier rule that overlaps a later one must stay ahead of it
+    for (int j = 0; j < count; j++) {
+        for (int i = 0; i < j; i++) {
+            if (rules_overlap(rules[i], rules[j])) {
+                blockers[j]++;
+            }
+        }
+        if (blockers[j] == 0) {
+            heap_push(j);
+        }
+    }
+
+    // Place the hottest rule whose blockers are all placed; cold rules
+    // come out in their original order
+    for (int n = 0; n < count; n++) {
+        int next = heap_pop();
+        order[n] = next;
+        for (int j = next + 1; j < count; j++) {
+            if (rules_overlap(rules[next], rules[j]) && --blockers[j] == 0) {
+                heap_push(j);
+            }
+        }
+    }
+
+    printf("\nReordering %d rules (%llu packets matched)...\n", count, total);
+
+    int moved = 0;
+    for (int n = 0; n < count; n++) {
+        if (order[n] < n) {
+            continue;
+        }
+        if (order[n] != n) {
+            printf("  Rule %d (%llu packets) moved from position %d to %d\n",
+                   rules[order[n]]->id, counts[order[n]], order[n] + 1, n + 1);
+            moved++;
+        }
+    }
+    if (moved == 0) {
+        printf("  Rule order already matches the traffic\n");
+    }
+
+    if (!dry_run && moved > 0) {
+        FirewallRule *sorted = malloc(sizeof(FirewallRule) * (count + 1));
+        if (!sorted) {
+            fprintf(stderr, "Error: Out of memory\n");
+            moved = -1;
+        } else {
+            // Rules keep their IDs; only the order changes
+            for (int n = 0; n < count; n++) {
+                sorted[n] = *rules[order[n]];
+            }
+            if (rule_store_replace(sorted, count) != 0) {
+                moved = -1;
+            }
+            free(sorted);
+        }
+    }
+
+    free(counts);
+    free(heat);
+    free(blockers);
+    free(order);
+    free(heap);
+    heap = NULL;
+    return moved;
+
+fail:
+    free(counts);
+    free(heat);
+    free(blockers);
+    free(order);
+    free(heap);
+    heap = NULL;
+    return -1;
+}
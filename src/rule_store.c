@@ -0,0 +1,403 @@
+#include "firewall.h"
+
+/*
+ * Rule store.
+ *
+ * Rules live in a slab of fixed-size chunks, so a rule never moves once
+ * stored and the store grows without a fixed cap. A rule ID names its
+ * slot plus the slot's generation, which changes when the slot is freed:
+ * IDs stay stable while other rules come and go, and a stale ID (for
+ * example a Rule-ID-N comment left in the kernel) never resolves to a
+ * newer rule. Free slots form a doubly linked free list and used slots
+ * a doubly linked evaluation-order list, both threaded through the
+ * slots, so lookup, append and removal are O(1). Code that walks the
+ * rules by position uses ordered_rules(), rebuilt on demand after a
+ * change.
+ */
+
+#define RULE_CHUNK_BITS 12
+#define RULE_CHUNK_SIZE (1 << RULE_CHUNK_BITS)
+#define RULE_SLOT_MASK ((1 << RULE_SLOT_BITS) - 1)
+#define RULE_MAX_SLOTS RULE_SLOT_MASK
+
+typedef struct {
+    FirewallRule rule;      // First member: a rule pointer is a slot pointer
+    int slot;
+    int generation;
+    int in_use;
+    int seen;               // Scratch flag of rule_store_replace()
+    int position;           // Index in the ordered view
+    int prev;               // Neighbours in the order list or the free list
+    int next;
+} RuleSlot;
+
+int rule_count = 0;
+
+static RuleSlot **chunks;
+static int chunk_count;
+static int slot_capacity;
+
+static int order_head = -1;
+static int order_tail = -1;
+static int free_head = -1;
+static int free_count;
+
+// Rules in evaluation order, rebuilt when view_stale is set
+static FirewallRule **order_view;
+static int view_capacity;
+static int view_stale = 1;
+
+// Bumped by every change, so cached renderings can tell they are stale
+static unsigned long store_version;
+
+/**
+ * Slot by index
+ */
+static RuleSlot *slot_at(int slot) {
+    return &chunks[slot >> RULE_CHUNK_BITS][slot & (RULE_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Push a slot onto the free list
+ */
+static void push_free(int slot) {
+    RuleSlot *s = slot_at(slot);
+    s->in_use = 0;
+    s->prev = -1;
+    s->next = free_head;
+    if (free_head >= 0) {
+        slot_at(free_head)->prev = slot;
+    }
+    free_head = slot;
+    free_count++;
+}
+
+/**
+ * Take a slot off the free list
+ */
+static void unlink_free(int slot) {
+    RuleSlot *s = slot_at(slot);
+    if (s->prev >= 0) {
+        slot_at(s->prev)->next = s->next;
+    } else {
+        free_head = s->next;
+    }
+    if (s->next >= 0) {
+        slot_at(s->next)->prev = s->prev;
+    }
+    free_count--;
+}
+
+/**
+ * Add one chunk of free slots
+ */
+static int grow_store(void) {
+    if (slot_capacity + RULE_CHUNK_SIZE > RULE_MAX_SLOTS) {
+        fprintf(stderr, "Error: Maximum rule limit reached\n");
+        return -1;
+    }
+
+    RuleSlot **grown = realloc(chunks, sizeof(RuleSlot *) * (chunk_count + 1));
+    if (!grown) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    chunks = grown;
+
+    RuleSlot *chunk = calloc(RULE_CHUNK_SIZE, sizeof(RuleSlot));
+    if (!chunk) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    chunks[chunk_count++] = chunk;
+
+    // Pushed in reverse so the lowest slot is handed out first
+    int first = slot_capacity;
+    slot_capacity += RULE_CHUNK_SIZE;
+    for (int slot = slot_capacity - 1; slot >= first; slot--) {
+        slot_at(slot)->slot = slot;
+        push_free(slot);
+    }
+    return 0;
+}
+
+/**
+ * Make room for at least the given number of rules in the ordered view
+ */
+static int grow_view(int needed) {
+    int capacity = view_capacity ? view_capacity : RULE_CHUNK_SIZE;
+    while (capacity < needed + 1) {
+        capacity *= 2;
+    }
+    FirewallRule **grown = realloc(order_view, sizeof(FirewallRule *) * capacity);
+    if (!grown) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    order_view = grown;
+    view_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Used slot an ID refers to, or NULL for an unknown or stale ID
+ */
+static RuleSlot *find_slot(int rule_id) {
+    int slot = (rule_id & RULE_SLOT_MASK) - 1;
+    if (rule_id <= 0 || slot < 0 || slot >= slot_capacity) {
+        return NULL;
+    }
+    RuleSlot *s = slot_at(slot);
+    if (!s->in_use || s->rule.id != rule_id) {
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Append a rule at the end of the evaluation order
+ * A free ID is reused when requested (0 picks the next free slot)
+ * Returns the rule's ID, or -1 on error
+ */
+int rule_store_add(const FirewallRule *rule, int rule_id) {
+    int slot = (rule_id & RULE_SLOT_MASK) - 1;
+    int generation = rule_id >> RULE_SLOT_BITS;
+
+    while (rule_id > 0 && slot >= slot_capacity) {
+        if (grow_store() != 0) {
+            return -1;
+        }
+    }
+    if (rule_count + 1 > view_capacity && grow_view(rule_count + 1) != 0) {
+        return -1;
+    }
+
+    // Room for a deadline in whatever slot the rule gets
+    if (rule->expires && expiry_reserve(slot_capacity + RULE_CHUNK_SIZE) != 0) {
+        return -1;
+    }
+
+    RuleSlot *s;
+    if (rule_id > 0 && !slot_at(slot)->in_use) {
+        s = slot_at(slot);
+        unlink_free(slot);
+        s->generation = generation;
+    } else {
+        if (free_head < 0 && grow_store() != 0) {
+            return -1;
+        }
+        s = slot_at(free_head);
+        unlink_free(free_head);
+    }
+
+    s->rule = *rule;
+    s->rule.id = RULE_ID(s->slot, s->generation);
+    s->in_use = 1;
+    s->prev = order_tail;
+    s->next = -1;
+    if (order_tail >= 0) {
+        slot_at(order_tail)->next = s->slot;
+    } else {
+        order_head = s->slot;
+    }
+    order_tail = s->slot;
+    if (s->rule.expires) {
+        expiry_schedule(s->slot, s->rule.id, s->rule.expires);
+    }
+
+    rule_count++;
+    view_stale = 1;
+    store_version++;
+    return s->rule.id;
+}
+
+/**
+ * Remove a rule by ID
+ * Returns 0 on success, -1 if there is no such rule
+ */
+int rule_store_remove(int rule_id) {
+    RuleSlot *s = find_slot(rule_id);
+    if (!s) {
+        return -1;
+    }
+
+    if (s->prev >= 0) {
+        slot_at(s->prev)->next = s->next;
+    } else {
+        order_head = s->next;
+    }
+    if (s->next >= 0) {
+        slot_at(s->next)->prev = s->prev;
+    } else {
+        order_tail = s->prev;
+    }
+
+    expiry_cancel(s->slot);
+
+    // A new generation keeps the old ID from naming the next occupant
+    s->generation = (s->generation + 1) & RULE_GENERATION_MASK;
+    push_free(s->slot);
+
+    rule_count--;
+    view_stale = 1;
+    store_version++;
+    return 0;
+}
+
+/**
+ * Remove every rule
+ */
+void rule_store_clear(void) {
+    while (order_head >= 0) {
+        rule_store_remove(slot_at(order_head)->rule.id);
+    }
+}
+
+/**
+ * Make the store hold exactly the given rules, in the given order
+ * Rules whose ID is stored keep it and take the new contents; the rest
+ * are added, and stored rules missing from the list are removed
+ * Returns 0 on success, -1 on error (the store is left unchanged)
+ */
+int rule_store_replace(const FirewallRule *list, int count) {
+    int *order = malloc(sizeof(int) * (count + 1));
+    if (!order) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    for (int slot = order_head; slot >= 0; slot = slot_at(slot)->next) {
+        slot_at(slot)->seen = 0;
+    }
+
+    // Match list entries to stored rules first, so every slot needed
+    // can be reserved before anything changes
+    int missing = 0, expiring = 0;
+    for (int i = 0; i < count; i++) {
+        expiring |= list[i].expires != 0;
+        RuleSlot *s = find_slot(list[i].id);
+        if (s && !s->seen) {
+            s->seen = 1;
+            order[i] = s->slot;
+        } else {
+            order[i] = -1;
+            missing++;
+        }
+    }
+    while (free_count < missing) {
+        if (grow_store() != 0) {
+            free(order);
+            return -1;
+        }
+    }
+    if ((rule_count + missing > view_capacity && grow_view(rule_count + missing) != 0) ||
+        (expiring && expiry_reserve(slot_capacity + RULE_CHUNK_SIZE) != 0)) {
+        free(order);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (order[i] >= 0) {
+            RuleSlot *s = slot_at(order[i]);
+            if (list[i].expires != s->rule.expires) {
+                expiry_cancel(s->slot);
+                if (list[i].expires) {
+                    expiry_schedule(s->slot, s->rule.id, list[i].expires);
+                }
+            }
+            s->rule = list[i];
+        } else {
+            // Everything it needs was reserved above, so this cannot fail
+            int id = rule_store_add(&list[i], 0);
+            if (id < 0) {
+                free(order);
+                return -1;
+            }
+            RuleSlot *s = find_slot(id);
+            s->seen = 1;
+            order[i] = s->slot;
+        }
+    }
+
+    int slot = order_head;
+    while (slot >= 0) {
+        RuleSlot *s = slot_at(slot);
+        slot = s->next;
+        if (!s->seen) {
+            rule_store_remove(s->rule.id);
+        }
+    }
+
+    // Relink the order list to follow the given order
+    order_head = count > 0 ? order[0] : -1;
+    order_tail = count > 0 ? order[count - 1] : -1;
+    for (int i = 0; i < count; i++) {
+        RuleSlot *s = slot_at(order[i]);
+        s->prev = i > 0 ? order[i - 1] : -1;
+        s->next = i + 1 < count ? order[i + 1] : -1;
+    }
+
+    free(order);
+    view_stale = 1;
+    store_version++;
+    return 0;
+}
+
+/**
+ * Rules in evaluation order (rule_count entries)
+ * The array is NULL-terminated and valid until the store next changes
+ */
+FirewallRule **ordered_rules(void) {
+    if (!view_stale) {
+        return order_view;
+    }
+    // A store that never held a rule has no view yet
+    if (!order_view && grow_view(0) != 0) {
+        static FirewallRule *empty_view[1];
+        return empty_view;
+    }
+
+    int position = 0;
+    for (int slot = order_head; slot >= 0; slot = slot_at(slot)->next) {
+        RuleSlot *s = slot_at(slot);
+        s->position = position;
+        order_view[position++] = &s->rule;
+    }
+    order_view[position] = NULL;
+    view_stale = 0;
+    return order_view;
+}
+
+/**
+ * Position of a rule in evaluation order, or -1 if there is no such rule
+ */
+int rule_position(int rule_id) {
+    RuleSlot *s = find_slot(rule_id);
+    if (!s) {
+        return -1;
+    }
+    ordered_rules();
+    return s->position;
+}
+
+/**
+ * Counter that changes whenever the stored rules do
+ */
+unsigned long rule_store_version(void) {
+    return store_version;
+}
+
+/**
+ * Get the number of rules
+ */
+int get_rule_count(void) {
+    return rule_count;
+}
+
+/**
+ * Get rule by ID
+ */
+FirewallRule* get_rule_by_id(int rule_id) {
+    RuleSlot *s = find_slot(rule_id);
+    return s ? &s->rule : NULL;
+}
@@ -0,0 +1,400 @@
+#include "firewall.h"
+
+/*
+ * Kernel-vs-config reconciliation.
+ *
+ * Reads the live INPUT chain, reduces every entry and every compiled
+ * entry to a canonical key (field order, /32 suffixes, protocol case,
+ * implicit -m tcp and state order do not matter), keeps the longest run
+ * of live entries that already appear in the right order, and deletes
+ * and inserts only the rest, all in one transaction.
+ */
+
+#define SYNC_KEY_LENGTH (MAX_RULE_LENGTH * 2)
+
+typedef struct {
+    char src[MAX_IP_LENGTH];
+    char dst[MAX_IP_LENGTH];
+    char iface[64];
+    char proto[MAX_PROTOCOL_LENGTH];
+    char ports[MULTIPORT_LENGTH];
+    char set[IPSET_NAME_LENGTH + 8];
+    char ctstate[CTSTATE_LENGTH];
+    char comment[MAX_COMMENT_LENGTH];
+    char target[PARTITION_CHAIN_LENGTH + 4];
+    char extra[MAX_RULE_LENGTH];
+} SyncFields;
+
+/**
+ * Split the next shell-style word off a spec, dropping quotes
+ * Returns a pointer past the word, or NULL at the end
+ */
+static const char *next_word(const char *pos, char *word, size_t size) {
+    size_t len = 0;
+
+    while (*pos == ' ' || *pos == '\t') {
+        pos++;
+    }
+    if (!*pos) {
+        return NULL;
+    }
+
+    int quoted = 0;
+    for (; *pos && (quoted || (*pos != ' ' && *pos != '\t')); pos++) {
+        if (*pos == '"') {
+            quoted = !quoted;
+        } else if (*pos == '\\' && pos[1]) {
+            pos++;
+            if (len < size - 1) {
+                word[len++] = *pos;
+            }
+        } else if (len < size - 1) {
+            word[len++] = *pos;
+        }
+    }
+    word[len] = '\0';
+    return pos;
+}
+
+/**
+ * Copy an address as its network prefix, without a redundant /32
+ */
+static void copy_address(char *out, size_t size, const char *address) {
+    uint32_t addr;
+    int len;
+
+    if (parse_ipv4_prefix(address, &addr, &len) != 0) {
+        snprintf(out, size, "%s", address);
+        return;
+    }
+
+    struct in_addr in;
+    char ip[INET_ADDRSTRLEN];
+    in.s_addr = htonl(addr);
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    if (len == 32) {
+        snprintf(out, size, "%s", ip);
+    } else {
+        snprintf(out, size, "%s/%d", ip, len);
+    }
+}
+
+static int compare_words(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Sort a comma-separated state list so that "RELATED,ESTABLISHED" and
+ * "ESTABLISHED,RELATED" compare equal
+ */
+static void copy_states(char *out, size_t size, const char *states) {
+    char copy[CTSTATE_LENGTH * 2];
+    char *parts[8];
+    char *saveptr;
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", states);
+    for (char *part = strtok_r(copy, ",", &saveptr); part && count < 8; part = strtok_r(NULL, ",", &saveptr)) {
+        parts[count++] = part;
+    }
+    qsort(parts, count, sizeof(char *), compare_words);
+
+    out[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        size_t used = strlen(out);
+        snprintf(out + used, size - used, "%s%s", i ? "," : "", parts[i]);
+    }
+}
+
+/**
+ * Reduce a rule specification ("-A INPUT ..." or a build_entry_spec()
+ * string) to its canonical key
+ */
+static void canonical_key(const char *spec, char *key, size_t size) {
+    SyncFields f;
+    char word[MAX_COMMENT_LENGTH], arg[MAX_COMMENT_LENGTH];
+    const char *pos = spec;
+
+    memset(&f, 0, sizeof(f));
+
+    while ((pos = next_word(pos, word, sizeof(word)))) {
+        // Options without an argument are kept verbatim
+        if (strcmp(word, "!") == 0) {
+            strncat(f.extra, " !", sizeof(f.extra) - strlen(f.extra) - 1);
+            continue;
+        }
+
+        const char *after = next_word(pos, arg, sizeof(arg));
+        if (!after) {
+            arg[0] = '\0';
+        } else {
+            pos = after;
+        }
+
+        if (strcmp(word, "-A") == 0) {
+            continue;
+        } else if (strcmp(word, "-s") == 0) {
+            copy_address(f.src, sizeof(f.src), arg);
+        } else if (strcmp(word, "-d") == 0) {
+            copy_address(f.dst, sizeof(f.dst), arg);
+        } else if (strcmp(word, "-i") == 0) {
+            snprintf(f.iface, sizeof(f.iface), "%s", arg);
+        } else if (strcmp(word, "-p") == 0) {
+            snprintf(f.proto, sizeof(f.proto), "%s", arg);
+            for (char *c = f.proto; *c; c++) {
+                *c = tolower((unsigned char)*c);
+            }
+            // iptables does not print "-p all"
+            if (strcmp(f.proto, "all") == 0) {
+                f.proto[0] = '\0';
+            }
+        } else if (strcmp(word, "-m") == 0) {
+            // Modules are implied by their options
+            continue;
+        } else if (strcmp(word, "--dport") == 0 || strcmp(word, "--dports") == 0) {
+            snprintf(f.ports, sizeof(f.ports), "%s", arg);
+        } else if (strcmp(word, "--match-set") == 0) {
+            char dir[16] = "";
+            const char *dir_end = next_word(pos, dir, sizeof(dir));
+            if (dir_end) {
+                pos = dir_end;
+            }
+            snprintf(f.set, sizeof(f.set), "%.*s %s", IPSET_NAME_LENGTH - 1, arg, dir);
+        } else if (strcmp(word, "--ctstate") == 0 || strcmp(word, "--state") == 0) {
+            copy_states(f.ctstate, sizeof(f.ctstate), arg);
+        } else if (strcmp(word, "--comment") == 0) {
+            snprintf(f.comment, sizeof(f.comment), "%s", arg);
+        } else if (strcmp(word, "--reject-with") == 0 && strcmp(arg, "icmp-port-unreachable") == 0) {
+            // The default REJECT type, printed by iptables but never generated
+            continue;
+        } else if (strcmp(word, "-j") == 0 || strcmp(word, "-g") == 0) {
+            snprintf(f.target, sizeof(f.target), "-%c %.*s", word[1], PARTITION_CHAIN_LENGTH - 1, arg);
+        } else {
+            // Anything this tool never generates keeps the entry unique
+            size_t used = strlen(f.extra);
+            snprintf(f.extra + used, sizeof(f.extra) - used, " %s %s", word, arg);
+        }
+    }
+
+    snprintf(key, size, "%s|%s|%s|%s|%s|%s|%s|%s|%s|%s", f.src, f.dst, f.iface, f.proto,
+             f.ports, f.set, f.ctstate, f.comment, f.target, f.extra);
+}
+
+typedef struct {
+    char *key;
+    int index;
+} SyncKey;
+
+static int compare_sync_keys(const void *a, const void *b) {
+    const SyncKey *ka = a, *kb = b;
+    int cmp = strcmp(ka->key, kb->key);
+    return cmp ? cmp : ka->index - kb->index;
+}
+
+/**
+ * First position in a sorted key array whose key is not below key
+ */
+static int lower_bound(const SyncKey *keys, int count, const char *key) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(keys[mid].key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Mark the longest increasing subsequence of seq[0..count) in keep[]
+ * (entries of -1 never take part)
+ */
+static int mark_longest_run(const int *seq, int count, char *keep) {
+    int *tails = malloc(sizeof(int) * (count + 1));
+    int *prev = malloc(sizeof(int) * (count + 1));
+    int length = 0;
+
+    if (!tails || !prev) {
+        free(tails);
+        free(prev);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (seq[i] < 0) {
+            continue;
+        }
+        int lo = 0, hi = length;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (seq[tails[mid]] < seq[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        prev[i] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = i;
+        if (lo == length) {
+            length++;
+        }
+    }
+
+    for (int i = length ? tails[length - 1] : -1; i >= 0; i = prev[i]) {
+        keep[i] = 1;
+    }
+
+    free(tails);
+    free(prev);
+    return length;
+}
+
+/**
+ * Bring the live INPUT chain in line with the configured rules
+ * With dry_run set only the planned operations are printed
+ * Returns the number of chain operations, or -1 on error
+ */
+int sync_ruleset(int dry_run) {
+    if (firewall_config.backend == BACKEND_NFTABLES || firewall_config.partition_threshold > 0) {
+        // Both rebuild their whole ruleset in one transaction anyway
+        printf("Ruleset is replaced atomically in this mode, applying it\n");
+        return dry_run ? 0 : apply_all_rules();
+    }
+
+    CompiledRuleset rs;
+    char (*live)[MAX_RULE_LENGTH] = NULL;
+    int live_count = read_input_specs(&live);
+
+    if (live_count < 0) {
+        fprintf(stderr, "Error: Cannot read the INPUT chain\n");
+        return -1;
+    }
+    if (compile_ruleset(&rs) != 0) {
+        free(live);
+        return -1;
+    }
+
+    int want_count = rs.entry_count;
+    SyncKey *live_keys = malloc(sizeof(SyncKey) * (live_count + 1));
+    char (*want_keys)[SYNC_KEY_LENGTH] = malloc(sizeof(*want_keys) * (want_count + 1));
+    char (*live_text)[SYNC_KEY_LENGTH] = malloc(sizeof(*live_text) * (live_count + 1));
+    int *match = malloc(sizeof(int) * (want_count + 1));
+    int *next_use = calloc(live_count + 1, sizeof(int));
+    char *keep = calloc(want_count + 1, 1);
+    char *live_kept = calloc(live_count + 1, 1);
+    int ret = -1;
+
+    if (!live_keys || !want_keys || !live_text || !match || !next_use || !keep || !live_kept) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto out;
+    }
+
+    for (int i = 0; i < live_count; i++) {
+        canonical_key(live[i], live_text[i], SYNC_KEY_LENGTH);
+        live_keys[i].key = live_text[i];
+        live_keys[i].index = i;
+    }
+    qsort(live_keys, live_count, sizeof(SyncKey), compare_sync_keys);
+
+    // Pair each wanted entry with the next unused live entry of its key
+    for (int i = 0; i < want_count; i++) {
+        char spec[MAX_RULE_LENGTH];
+        build_entry_spec(&rs.entries[i], spec, sizeof(spec));
+        canonical_key(spec, want_keys[i], SYNC_KEY_LENGTH);
+
+        int first = lower_bound(live_keys, live_count, want_keys[i]);
+        int slot = first + next_use[first];
+        match[i] = -1;
+        if (slot < live_count && strcmp(live_keys[slot].key, want_keys[i]) == 0) {
+            match[i] = live_keys[slot].index;
+            next_use[first]++;
+        }
+    }
+
+    // Entries already in the right relative order stay untouched
+    if (mark_longest_run(match, want_count, keep) < 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto out;
+    }
+    for (int i = 0; i < want_count; i++) {
+        if (keep[i]) {
+            live_kept[match[i]] = 1;
+        }
+    }
+
+    int deletes = 0, inserts = 0;
+    for (int i = 0; i < live_count; i++) {
+        deletes += !live_kept[i];
+    }
+    for (int i = 0; i < want_count; i++) {
+        inserts += !keep[i];
+    }
+
+    printf("\nSync: %d live entries, %d configured, %d kept, %d to delete, %d to insert\n",
+           live_count, want_count, want_count - inserts, deletes, inserts);
+
+    if (dry_run) {
+        for (int i = live_count - 1; i >= 0; i--) {
+            if (!live_kept[i]) {
+                printf("  -D INPUT %d  (%s)\n", i + 1, live[i]);
+            }
+        }
+        for (int i = 0; i < want_count; i++) {
+            if (!keep[i]) {
+                char spec[MAX_RULE_LENGTH];
+                build_entry_spec(&rs.entries[i], spec, sizeof(spec));
+                printf("  -I INPUT %d%s\n", i + 1, spec);
+            }
+        }
+        ret = deletes + inserts;
+        goto out;
+    }
+
+    if (deletes + inserts == 0) {
+        printf("Kernel already matches the configuration\n");
+        ret = 0;
+        goto out;
+    }
+
+    // Sets first, so inserted entries can reference them
+    if (refresh_ipsets(&rs) != 0 || begin_iptables_batch(0) != 0) {
+        goto out;
+    }
+
+    // Delete from the bottom so earlier positions stay valid; what is
+    // left is the kept entries in wanted order, filled in from the top
+    for (int i = live_count - 1; i >= 0; i--) {
+        if (!live_kept[i]) {
+            delete_entry_at(i + 1);
+        }
+    }
+    for (int i = 0; i < want_count; i++) {
+        if (!keep[i]) {
+            insert_entry_to_iptables(&rs.entries[i], i + 1);
+        }
+    }
+
+    ret = commit_iptables_batch();
+    if (ret == 0) {
+        purge_stale_sets(&rs);
+        printf("Sync complete: %d operations\n", deletes + inserts);
+        ret = deletes + inserts;
+    } else {
+        fprintf(stderr, "Error: Sync failed, %s\n",
+                rs.member_count ? "chains unchanged but ipsets already rebuilt" : "kernel ruleset unchanged");
+    }
+
+out:
+    free(live);
+    free(live_keys);
+    free(want_keys);
+    free(live_text);
+    free(match);
+    free(next_use);
+    free(keep);
+    free(live_kept);
+    free_compiled_ruleset(&rs);
+    return ret;
+}
@@ -0,0 +1,291 @@
+#include "firewall.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * Binary ruleset snapshot.
+ *
+ * Saving RULES_FILE also writes RULES_SNAPSHOT: the packed rules, the
+ * string pool their handles point into, and the backend payload that
+ * `export` prints for them. At startup the snapshot is mapped and copied
+ * into the rule store as is when it is at least as new as RULES_FILE and
+ * its checksum matches, so no rule text is parsed. Until the rules or
+ * the settings change, apply and export send the stored payload instead
+ * of compiling the ruleset again. RULES_FILE stays the source of truth:
+ * any doubt about the snapshot falls back to parsing it.
+ *
+ * Layout: SnapshotHeader, then rule_count FirewallRules, pool_size bytes
+ * of string pool and payload_size bytes of payload.
+ */
+
+#define SNAPSHOT_MAGIC "PFWSNAP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rule_size;         // sizeof(FirewallRule) when written
+    uint64_t rule_count;
+    uint64_t pool_size;
+    uint64_t payload_size;
+    uint64_t config_hash;       // Settings the payload was rendered with
+    uint64_t checksum;          // Of everything after the header
+} SnapshotHeader;
+
+// Mapping that holds the payload of the loaded snapshot
+static char *snapshot_map;
+static size_t snapshot_size;
+static const char *payload;
+static size_t payload_size;
+static uint64_t payload_config;
+static unsigned long payload_version;
+
+/**
+ * Checksum of a buffer, eight bytes per step
+ */
+static uint64_t snapshot_checksum(const char *data, size_t size) {
+    uint64_t hash = 1469598103934665603ull;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Hash of the settings that shape the backend payload
+ */
+static uint64_t config_hash(void) {
+    char text[256];
+    int len = snprintf(text, sizeof(text), "%s|%s|%d|%d|%d|%d", firewall_config.chain,
+                       firewall_config.policy, firewall_config.backend, firewall_config.ipset_threshold,
+                       firewall_config.partition_threshold, firewall_config.fast_path);
+    return snapshot_checksum(text, (size_t)len);
+}
+
+/**
+ * Drop the loaded snapshot, if any
+ */
+static void release_snapshot(void) {
+    if (snapshot_map) {
+        munmap(snapshot_map, snapshot_size);
+    }
+    snapshot_map = NULL;
+    snapshot_size = 0;
+    payload = NULL;
+    payload_size = 0;
+}
+
+/**
+ * Write a buffer in full
+ */
+static int write_all_fp(FILE *fp, const void *data, size_t size) {
+    return size == 0 || fwrite(data, 1, size, fp) == size ? 0 : -1;
+}
+
+/**
+ * Write RULES_SNAPSHOT for the current rules
+ * Returns 0 on success, -1 on error (no snapshot is left behind)
+ */
+int save_snapshot(void) {
+    char *rendered = NULL;
+    size_t rendered_size = 0;
+    FILE *mem = open_memstream(&rendered, &rendered_size);
+    if (!mem) {
+        fprintf(stderr, "Error: Out of memory\n");
+        unlink(RULES_SNAPSHOT);
+        return -1;
+    }
+    int ret = firewall_config.backend == BACKEND_NFTABLES ? render_nft_ruleset(mem)
+                                                          : render_iptables_payload(mem);
+    if (fclose(mem) != 0 || ret != 0) {
+        free(rendered);
+        unlink(RULES_SNAPSHOT);
+        return -1;
+    }
+
+    // Rules in evaluation order, packed back to back
+    FirewallRule **rules = ordered_rules();
+    FirewallRule *packed = malloc(sizeof(FirewallRule) * (rule_count + 1));
+    if (!packed) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(rendered);
+        unlink(RULES_SNAPSHOT);
+        return -1;
+    }
+    for (int i = 0; i < rule_count; i++) {
+        packed[i] = *rules[i];
+    }
+
+    size_t pool_size;
+    const char *pool = pool_data(&pool_size);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.rule_size = sizeof(FirewallRule);
+    header.rule_count = (uint64_t)rule_count;
+    header.pool_size = pool_size;
+    header.payload_size = rendered_size;
+    header.config_hash = config_hash();
+
+    // The checksum runs over the three parts as laid out in the file
+    size_t rules_size = sizeof(FirewallRule) * (size_t)rule_count;
+    size_t body_size = rules_size + pool_size + rendered_size;
+    char *body = malloc(body_size + 1);
+    if (!body) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(packed);
+        free(rendered);
+        unlink(RULES_SNAPSHOT);
+        return -1;
+    }
+    memcpy(body, packed, rules_size);
+    if (pool_size) {
+        memcpy(body + rules_size, pool, pool_size);
+    }
+    memcpy(body + rules_size + pool_size, rendered, rendered_size);
+    header.checksum = snapshot_checksum(body, body_size);
+    free(packed);
+    free(rendered);
+
+    // Written aside and renamed, so a reader never sees half a snapshot
+    char temp[sizeof(RULES_SNAPSHOT) + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", RULES_SNAPSHOT);
+    FILE *fp = fopen(temp, "wb");
+    ret = fp ? 0 : -1;
+    if (fp) {
+        ret = write_all_fp(fp, &header, sizeof(header)) | write_all_fp(fp, body, body_size);
+        if (fclose(fp) != 0) {
+            ret = -1;
+        }
+    }
+    free(body);
+
+    if (ret != 0 || rename(temp, RULES_SNAPSHOT) != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", RULES_SNAPSHOT);
+        unlink(temp);
+        unlink(RULES_SNAPSHOT);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Load the rules from RULES_SNAPSHOT when it is usable
+ * Returns the number of rules loaded, or -1 to fall back to RULES_FILE
+ */
+int load_snapshot(void) {
+    struct stat text_st, snap_st;
+
+    release_snapshot();
+    if (stat(RULES_FILE, &text_st) != 0) {
+        return -1;
+    }
+    int fd = open(RULES_SNAPSHOT, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // A rules file edited after the snapshot was written wins
+    if (fstat(fd, &snap_st) != 0 || (size_t)snap_st.st_size < sizeof(SnapshotHeader) ||
+        snap_st.st_mtim.tv_sec < text_st.st_mtim.tv_sec ||
+        (snap_st.st_mtim.tv_sec == text_st.st_mtim.tv_sec &&
+         snap_st.st_mtim.tv_nsec < text_st.st_mtim.tv_nsec)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)snap_st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, map, sizeof(header));
+    uint64_t body_size = size - sizeof(header);
+    uint64_t rules_size = header.rule_count * sizeof(FirewallRule);
+    const char *body = map + sizeof(header);
+
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.rule_size != sizeof(FirewallRule) ||
+        header.rule_count > (uint64_t)INT32_MAX || header.pool_size > body_size ||
+        header.payload_size > body_size ||
+        rules_size + header.pool_size + header.payload_size != body_size ||
+        snapshot_checksum(body, body_size) != header.checksum) {
+        fprintf(stderr, "Warning: Ignoring damaged or outdated %s\n", RULES_SNAPSHOT);
+        munmap(map, size);
+        return -1;
+    }
+
+    rule_store_clear();
+    if (pool_restore(body + rules_size, header.pool_size) != 0) {
+        munmap(map, size);
+        return -1;
+    }
+
+    // The header is 8-byte aligned and rules are 4-byte aligned, so the
+    // mapped rules can be read in place
+    const FirewallRule *rules = (const FirewallRule *)body;
+    for (uint64_t i = 0; i < header.rule_count; i++) {
+        if (rule_store_add(&rules[i], rules[i].id) < 0) {
+            rule_store_clear();
+            munmap(map, size);
+            return -1;
+        }
+    }
+
+    snapshot_map = map;
+    snapshot_size = size;
+    payload = body + rules_size + header.pool_size;
+    payload_size = header.payload_size;
+    payload_config = header.config_hash;
+    payload_version = rule_store_version();
+    return rule_count;
+}
+
+/**
+ * Stored payload of the loaded snapshot, or NULL when the rules or the
+ * settings changed since it was rendered
+ */
+const char *snapshot_payload(size_t *size) {
+    if (!payload || payload_version != rule_store_version() || payload_config != config_hash()) {
+        return NULL;
+    }
+    *size = payload_size;
+    return payload;
+}
+
+/**
+ * Payload of the loaded snapshot even when the rules or the settings
+ * changed since: what the last save rendered, which is what the kernel
+ * was last given. NULL when no snapshot was loaded
+ */
+const char *snapshot_saved_payload(size_t *size) {
+    *size = payload_size;
+    return payload;
+}
+
+/**
+ * Write the stored payload (same output as render_iptables_payload() or
+ * render_nft_ruleset() for the current rules)
+ * Returns 0 on success, -1 when there is no usable payload
+ */
+int write_snapshot_payload(FILE *out) {
+    size_t size;
+    const char *data = snapshot_payload(&size);
+    if (!data) {
+        return -1;
+    }
+    return write_all_fp(out, data, size);
+}
@@ -0,0 +1,200 @@
+#include "firewall.h"
+#include <pthread.h>
+
+/*
+ * String pool.
+ *
+ * Interface names and comments are stored once in a shared buffer and
+ * rules keep a 32-bit handle, the string's offset. Equal strings get the
+ * same handle, so rules compare them as integers. Offset 0 holds the
+ * empty string. Pointers from pool_string() stay valid until the next
+ * string is interned. Interning is locked, since import workers intern
+ * while they parse.
+ */
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *pool;
+static size_t pool_used;
+static size_t pool_size;
+
+// Open-addressed table of handles, 0 marks a free slot
+static uint32_t *table;
+static size_t table_size;
+static size_t table_count;
+
+/**
+ * FNV-1a hash of len bytes
+ */
+static uint32_t pool_hash(const char *text, size_t len) {
+    uint32_t hash = 2166136261u;
+    while (len-- > 0) {
+        hash ^= (unsigned char)*text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Double the handle table and rehash every string
+ */
+static int grow_table(void) {
+    size_t size = table_size ? table_size * 2 : 1024;
+    uint32_t *grown = calloc(size, sizeof(uint32_t));
+    if (!grown) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < table_size; i++) {
+        if (table[i]) {
+            const char *text = pool + table[i];
+            size_t slot = pool_hash(text, strlen(text)) & (size - 1);
+            while (grown[slot]) {
+                slot = (slot + 1) & (size - 1);
+            }
+            grown[slot] = table[i];
+        }
+    }
+
+    free(table);
+    table = grown;
+    table_size = size;
+    return 0;
+}
+
+/**
+ * Find or add a string; the caller holds pool_lock
+ */
+static uint32_t intern_locked(const char *text, size_t len) {
+    if ((table_count + 1) * 2 > table_size && grow_table() != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 0;
+    }
+
+    size_t slot = pool_hash(text, len) & (table_size - 1);
+    while (table[slot]) {
+        const char *stored = pool + table[slot];
+        if (strncmp(stored, text, len) == 0 && stored[len] == '\0') {
+            return table[slot];
+        }
+        slot = (slot + 1) & (table_size - 1);
+    }
+
+    if (!pool || pool_used + len + 1 > pool_size) {
+        size_t size = pool_size ? pool_size : 4096;
+        while (size < pool_used + len + 2) {
+            size *= 2;
+        }
+        if (size > UINT32_MAX) {
+            fprintf(stderr, "Error: String pool is full\n");
+            return 0;
+        }
+        char *grown = realloc(pool, size);
+        if (!grown) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return 0;
+        }
+        if (!pool) {
+            grown[0] = '\0';
+            pool_used = 1;
+        }
+        pool = grown;
+        pool_size = size;
+    }
+
+    uint32_t handle = (uint32_t)pool_used;
+    memcpy(pool + pool_used, text, len);
+    pool[pool_used + len] = '\0';
+    pool_used += len + 1;
+    table[slot] = handle;
+    table_count++;
+    return handle;
+}
+
+/**
+ * Intern the first len bytes of text (which holds no NUL among them),
+ * returning the handle (0 for "" or when out of memory)
+ */
+uint32_t intern_span(const char *text, size_t len) {
+    if (!text || len == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    uint32_t handle = intern_locked(text, len);
+    pthread_mutex_unlock(&pool_lock);
+    return handle;
+}
+
+/**
+ * Intern a string, returning its handle (0 for "" or when out of memory)
+ */
+uint32_t intern_string(const char *text) {
+    return text ? intern_span(text, strlen(text)) : 0;
+}
+
+/**
+ * The pool's buffer, for writing it out as is (handles stay valid
+ * when it is read back with pool_restore())
+ */
+const char *pool_data(size_t *size) {
+    *size = pool ? pool_used : 0;
+    return pool;
+}
+
+/**
+ * Replace the pool with a buffer written by pool_data()
+ * Returns 0 on success, -1 if the buffer is malformed or out of memory
+ */
+int pool_restore(const char *data, size_t size) {
+    if (size > UINT32_MAX || (size > 0 && (data[0] != '\0' || data[size - 1] != '\0'))) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    free(pool);
+    free(table);
+    pool = NULL;
+    table = NULL;
+    pool_used = pool_size = 0;
+    table_size = table_count = 0;
+
+    int ret = 0;
+    if (size > 0) {
+        pool = malloc(size);
+        if (!pool) {
+            ret = -1;
+        } else {
+            memcpy(pool, data, size);
+            pool_used = pool_size = size;
+        }
+    }
+
+    // Rebuild the handle table from the strings
+    for (size_t offset = 1; ret == 0 && offset < pool_used; offset += strlen(pool + offset) + 1) {
+        if ((table_count + 1) * 2 > table_size && grow_table() != 0) {
+            ret = -1;
+            break;
+        }
+        const char *text = pool + offset;
+        size_t slot = pool_hash(text, strlen(text)) & (table_size - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        table[slot] = (uint32_t)offset;
+        table_count++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (ret != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    return ret;
+}
+
+/**
+ * String for a handle
+ */
+const char *pool_string(uint32_t handle) {
+    return pool && handle < pool_used ? pool + handle : "";
+}
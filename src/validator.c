@@ -1,170 +1,139 @@
 #include "firewall.h"
 
 /**
- * Validate IP address
+ * Parse an IP address or CIDR into a host-order address and prefix length
+ * The address is masked to its network part
  */
-int validate_ip(const char *ip) {
-    if (!ip || strlen(ip) == 0) {
-        return 0;
-    }
-
-    struct sockaddr_in sa;
-    int result = inet_pton(AF_INET, ip, &(sa.sin_addr));
-    return result == 1;
-}
+int parse_ipv4_prefix(const char *text, uint32_t *addr, int *prefix_len) {
+    char ip[MAX_IP_LENGTH];
+    struct in_addr in;
+    int len = 32;
 
-/**
- * Validate CIDR notation
- */
-int validate_cidr(const char *cidr) {
-    if (!cidr) {
-        return 0;
+    if (!text || !text[0]) {
+        return -1;
     }
 
-    char *slash = strchr(cidr, '/');
-    if (!slash) {
-        return 0;
+    strncpy(ip, text, sizeof(ip) - 1);
+    ip[sizeof(ip) - 1] = '\0';
+
+    char *slash = strchr(ip, '/');
+    if (slash) {
+        *slash = '\0';
+        len = atoi(slash + 1);
     }
 
-    // Validate IP part
-    char ip[46];
-    strncpy(ip, cidr, slash - cidr);
-    ip[slash - cidr] = '\0';
-    
-    if (!validate_ip(ip)) {
-        return 0;
+    if (inet_pton(AF_INET, ip, &in) != 1 || len < 0 || len > 32) {
+        return -1;
     }
 
-    // Validate subnet mask
-    int mask = atoi(slash + 1);
-    return (mask >= 0 && mask <= 32);
+    *addr = ntohl(in.s_addr) & (len ? 0xFFFFFFFFu << (32 - len) : 0);
+    *prefix_len = len;
+    return 0;
 }
 
 /**
- * Validate port number or range
+ * Parse a port or "first:last" range
  */
-int validate_port(const char *port) {
-    if (!port || strlen(port) == 0) {
-        return 0;
+int parse_port_range(const char *port, int *first, int *last) {
+    if (!port || !port[0]) {
+        return -1;
     }
 
-    // Check for port range (e.g., 8000:8999)
     char *colon = strchr(port, ':');
-    if (colon) {
-        char range[256];
-        strncpy(range, port, sizeof(range) - 1);
-        range[sizeof(range) - 1] = '\0';
-
-        *colon = '\0';
-        colon++;
-        
-        int start = atoi(range);
-        int end = atoi(colon);
-        
-        return (start > 0 && start <= 65535 && end > 0 && end <= 65535 && start <= end);
-    }
-
-    // Single port
-    int port_num = atoi(port);
-    return (port_num > 0 && port_num <= 65535);
+    *first = atoi(port);
+    *last = colon ? atoi(colon + 1) : *first;
+    return 0;
 }
 
 /**
- * Validate action
+ * Write an address as "a.b.c.d" or "a.b.c.d/len" ("" when no address)
  */
-int validate_action(const char *action) {
-    if (!action) {
-        return 0;
-    }
+void format_address(uint32_t addr, int prefix_len, char *out, size_t size) {
+    struct in_addr in;
+    char ip[INET_ADDRSTRLEN];
 
-    return (strcmp(action, "ACCEPT") == 0 ||
-            strcmp(action, "DROP") == 0 ||
-            strcmp(action, "REJECT") == 0);
+    if (prefix_len < 0) {
+        snprintf(out, size, "%s", "");
+        return;
+    }
+    in.s_addr = htonl(addr);
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    if (prefix_len == 32) {
+        snprintf(out, size, "%s", ip);
+    } else {
+        snprintf(out, size, "%s/%d", ip, prefix_len);
+    }
 }
 
 /**
- * Validate protocol
+ * Write a port as "port" or "first:last" ("" when no port)
  */
-int validate_protocol(const char *protocol) {
-    if (!protocol) {
-        return 0;
+void format_port_range(int first, int last, char *out, size_t size) {
+    if (first == 0) {
+        snprintf(out, size, "%s", "");
+    } else if (first == last) {
+        snprintf(out, size, "%d", first);
+    } else {
+        snprintf(out, size, "%d:%d", first, last);
     }
-
-    return (strcmp(protocol, "TCP") == 0 ||
-            strcmp(protocol, "UDP") == 0 ||
-            strcmp(protocol, "ICMP") == 0 ||
-            strcmp(protocol, "ALL") == 0);
 }
 
 /**
- * Validate entire rule string
+ * Action code for an action name, ACTION_NONE if invalid
  */
-int validate_rule_string(const char *rule_string) {
-    if (!rule_string) {
-        return 0;
-    }
-
-    // Basic checks
-    if (strlen(rule_string) == 0) {
-        return 0;
+int parse_action(const char *text) {
+    if (strcmp(text, "ACCEPT") == 0) {
+        return ACTION_ACCEPT;
     }
-
-    // Must contain action
-    if (strstr(rule_string, "action=") == NULL) {
-        return 0;
+    if (strcmp(text, "DROP") == 0) {
+        return ACTION_DROP;
     }
-
-    // Parse and validate components
-    FirewallRule rule;
-    if (parse_rule_string(rule_string, &rule) != 0) {
-        return 0;
+    if (strcmp(text, "REJECT") == 0) {
+        return ACTION_REJECT;
     }
+    return ACTION_NONE;
+}
 
-    // Validate each component
-    if (!validate_action(rule.action)) {
-        return 0;
-    }
+/**
+ * Name of an action code ("" for ACTION_NONE)
+ */
+const char *action_name(int action) {
+    static const char *names[] = { "", "ACCEPT", "DROP", "REJECT" };
+    return action >= 0 && action <= ACTION_REJECT ? names[action] : "";
+}
 
-    if (rule.source[0] && !validate_ip(rule.source) && !validate_cidr(rule.source)) {
-        return 0;
+/**
+ * Protocol code for a protocol name, PROTO_NONE if invalid
+ */
+int parse_protocol(const char *text) {
+    if (strcmp(text, "TCP") == 0) {
+        return PROTO_TCP;
     }
-
-    if (rule.dest[0] && !validate_ip(rule.dest) && !validate_cidr(rule.dest)) {
-        return 0;
+    if (strcmp(text, "UDP") == 0) {
+        return PROTO_UDP;
     }
-
-    if (rule.port[0] && !validate_port(rule.port)) {
-        return 0;
+    if (strcmp(text, "ICMP") == 0) {
+        return PROTO_ICMP;
     }
-
-    if (rule.protocol[0] && !validate_protocol(rule.protocol)) {
-        return 0;
+    if (strcmp(text, "ALL") == 0) {
+        return PROTO_ALL;
     }
-
-    return 1;
+    return PROTO_NONE;
 }
 
 /**
- * Check if running with root privileges
+ * Name of a protocol code ("" for PROTO_NONE)
  */
-int check_root_privileges(void) {
-    return (geteuid() == 0);
+const char *protocol_name(int protocol) {
+    static const char *names[] = { "", "TCP", "UDP", "ICMP", "ALL" };
+    return protocol >= 0 && protocol <= PROTO_ALL ? names[protocol] : "";
 }
 
 /**
- * Log a message
+ * Check if running with root privileges
  */
-void log_message(const char *message) {
-    FILE *fp = fopen("/var/log/personal-firewall.log", "a");
-    if (fp) {
-        time_t now;
-        time(&now);
-        char *time_str = ctime(&now);
-        time_str[strlen(time_str) - 1] = '\0'; // Remove newline
-        
-        fprintf(fp, "[%s] %s\n", time_str, message);
-        fclose(fp);
-    }
+int check_root_privileges(void) {
+    return (geteuid() == 0);
 }
 
 /**
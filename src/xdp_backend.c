@@ -0,0 +1,1296 @@
+#define _DEFAULT_SOURCE     // syscall()
+#include "firewall.h"
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/*
+ * XDP early drop (`xdp=generic` or `xdp=native` in CONFIG_FILE).
+ *
+ * DROP rules that no earlier rule with another action can match are also
+ * installed in an XDP program, which drops their packets in the driver
+ * (or, in generic mode, as the packet enters the stack) before an skb
+ * is built or INPUT is walked. The rules stay in netfilter as well, so
+ * turning XDP off changes no verdict.
+ *
+ * XDP runs before conntrack and routing, so nothing is offloaded while
+ * the conntrack fast path accepts ESTABLISHED and RELATED packets ahead
+ * of the rules, and a rule is only offloaded on an interface that does
+ * not forward: every IPv4 packet it receives is then for this host and
+ * walks INPUT. A rule is offloaded when, in addition, it names one
+ * interface (no '+'), matches a source or a destination prefix but not
+ * both, and its port range spans at most XDP_MAX_PORT_RANGE ports. The
+ * program keeps its state in maps:
+ *
+ *   sources, dests  LPM tries keyed by (interface, prefix), giving the
+ *                   group of the longest matching prefix. A rule without
+ *                   addresses uses the /0 source prefix.
+ *   ports           (group, IP protocol, port) entries the group drops;
+ *                   0 stands for any protocol or any port. A group holds
+ *                   the entries of the prefixes that contain it too, so
+ *                   the longest match alone decides.
+ *   interfaces      Interfaces the program is attached to.
+ *   drops           Per-CPU count of dropped packets.
+ *
+ * The program is written directly in BPF instructions and loaded with
+ * the bpf() system call, so neither libbpf nor clang is needed. It and
+ * its maps are pinned under XDP_PIN_DIR. Every rule change brings the
+ * maps in line with the rules entry by entry, and the program is never
+ * reloaded: packets in flight see either the old rules or the new ones.
+ * The daemon keeps a copy of the map contents; the CLI reads them back.
+ */
+
+#define XDP_PIN_DIR "/sys/fs/bpf/personal-firewall"
+#define BPF_FS_DIR "/sys/fs/bpf"
+#define BPF_FS_MAGIC_NUMBER 0xCAFE4A11
+#define XDP_MAX_PREFIXES (1 << 20)
+#define XDP_MAX_PORT_KEYS (1 << 21)
+#define XDP_MAX_INTERFACES 256
+// Widest port range a rule may span and still be offloaded
+#define XDP_MAX_PORT_RANGE 64
+#define XDP_PROG_MAX 128
+#define XDP_LABELS 8
+
+#define XDP_TRIE_SOURCE 0
+#define XDP_TRIE_DEST   1
+
+// LPM trie key; the prefix length counts the 32 interface bits
+typedef struct {
+    uint32_t prefixlen;
+    uint32_t ifindex;
+    uint32_t addr;              // Network order
+} XdpPrefixKey;
+
+// Ports map key
+typedef struct {
+    uint32_t group;
+    uint8_t protocol;           // IP protocol number, 0 for any
+    uint8_t pad;
+    uint16_t port;              // Network order, 0 for any
+} XdpPortKey;
+
+typedef struct {
+    int trie;
+    XdpPrefixKey key;
+    uint32_t group;
+} XdpPrefix;
+
+// One (prefix, protocol, port) an offloaded rule drops
+typedef struct {
+    int trie;
+    XdpPrefixKey key;
+    uint8_t protocol;
+    uint16_t port;
+} XdpMatch;
+
+// A protocol/port a prefix drops
+typedef struct {
+    uint8_t protocol;
+    uint16_t port;
+} XdpCondition;
+
+// Interface the program is attached to, with its attach flags
+typedef struct {
+    uint32_t ifindex;
+    uint32_t flags;
+} XdpInterface;
+
+// Map contents
+typedef struct {
+    XdpPrefix *prefixes;
+    int prefix_count;
+    XdpPortKey *ports;
+    int port_count;
+    XdpInterface interfaces[XDP_MAX_INTERFACES];
+    int interface_count;
+    int rules;                  // Rules offloaded
+} XdpState;
+
+typedef struct {
+    int prog;
+    int sources;
+    int dests;
+    int ports;
+    int interfaces;
+    int drops;
+} XdpObjects;
+
+static XdpObjects objects = { -1, -1, -1, -1, -1, -1 };
+// What the maps hold, once read or written by this process
+static XdpState current;
+static int current_valid;
+
+static const char *pin_names[] = { "prog", "sources", "dests", "ports", "interfaces", "drops" };
+
+/**
+ * Issue a bpf() system call
+ */
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries,
+                      uint32_t flags, const char *name) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    attr.map_flags = flags;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_update(int fd, const void *key, const void *value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    attr.value = (uint64_t)(unsigned long)value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_lookup(int fd, const void *key, void *value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    attr.value = (uint64_t)(unsigned long)value;
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static int map_delete(int fd, const void *key) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * Key after key in a map (key NULL: the first key)
+ * Returns 0, or -1 once there are no more keys
+ */
+static int map_next_key(int fd, const void *key, void *next) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    attr.next_key = (uint64_t)(unsigned long)next;
+    return sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+static void pin_path(const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/%s", XDP_PIN_DIR, name);
+}
+
+static int obj_pin(int fd, const char *name) {
+    char path[128];
+    union bpf_attr attr;
+    pin_path(name, path, sizeof(path));
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uint64_t)(unsigned long)path;
+    attr.bpf_fd = (uint32_t)fd;
+    return sys_bpf(BPF_OBJ_PIN, &attr);
+}
+
+static int obj_get(const char *name) {
+    char path[128];
+    union bpf_attr attr;
+    pin_path(name, path, sizeof(path));
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uint64_t)(unsigned long)path;
+    return sys_bpf(BPF_OBJ_GET, &attr);
+}
+
+/*
+ * Program builder. Jumps name a label; offsets are filled in once the
+ * whole program is emitted.
+ */
+typedef struct {
+    struct bpf_insn insn[XDP_PROG_MAX];
+    int jump_label[XDP_PROG_MAX];       // Label a jump goes to, -1 if none
+    int label_at[XDP_LABELS];
+    int count;
+} ProgramBuilder;
+
+// Labels
+#define L_LOOKUP 0
+#define L_L4     1
+#define L_DEST   2
+#define L_PASS   3
+#define L_DROP   4
+#define L_DONE   5
+
+static void emit(ProgramBuilder *b, uint8_t code, int dst, int src, int off, int32_t imm) {
+    struct bpf_insn *insn = &b->insn[b->count];
+    memset(insn, 0, sizeof(*insn));
+    insn->code = code;
+    insn->dst_reg = (uint8_t)dst;
+    insn->src_reg = (uint8_t)src;
+    insn->off = (int16_t)off;
+    insn->imm = imm;
+    b->jump_label[b->count++] = -1;
+}
+
+static void emit_jump(ProgramBuilder *b, uint8_t code, int dst, int src, int32_t imm, int label) {
+    emit(b, code, dst, src, 0, imm);
+    b->jump_label[b->count - 1] = label;
+}
+
+static void place(ProgramBuilder *b, int label) {
+    b->label_at[label] = b->count;
+}
+
+// r1 = map (two instructions)
+static void emit_map(ProgramBuilder *b, int fd) {
+    emit(b, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, fd);
+    emit(b, 0, 0, 0, 0, 0);
+}
+
+// r0 = bpf_map_lookup_elem(map, fp + key_offset)
+static void emit_lookup(ProgramBuilder *b, int fd, int key_offset) {
+    emit_map(b, fd);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, key_offset);
+    emit(b, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+}
+
+/**
+ * Look the key at fp-16 up in a trie, then the group's any, protocol
+ * and protocol/port entries; drop on a hit, else go on to label next
+ */
+static void emit_trie_check(ProgramBuilder *b, int trie_fd, int next) {
+    emit_lookup(b, trie_fd, -16);
+    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, next);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_0, 0, 0);
+    emit(b, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, -24, 0);
+    emit(b, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, -20, 0);
+    emit_lookup(b, objects.ports, -24);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, L_DROP);
+    emit(b, BPF_STX | BPF_B | BPF_MEM, BPF_REG_10, BPF_REG_7, -20, 0);
+    emit_lookup(b, objects.ports, -24);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, L_DROP);
+    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_8, 0, 0, next);
+    emit(b, BPF_STX | BPF_H | BPF_MEM, BPF_REG_10, BPF_REG_8, -18, 0);
+    emit_lookup(b, objects.ports, -24);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, L_DROP);
+}
+
+/**
+ * Emit the XDP program
+ *
+ * Registers: r6 context, r7 IP protocol, r8 destination port (network
+ * order, 0 when there is none), r9 input interface. Stack: fp-16 trie
+ * key, fp-4 destination address, fp-24 ports key, fp-28 drops key.
+ */
+static void build_program(ProgramBuilder *b) {
+    b->count = 0;
+
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, 0, 0);     // data
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_6, 4, 0);     // data_end
+    // Ethernet and the fixed IPv4 header must be there
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 34);
+    emit_jump(b, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, L_PASS);
+    emit(b, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 12, 0);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, htons(0x0800), L_PASS);
+
+    emit(b, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_7, BPF_REG_2, 23, 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_8, 0, 0, 0);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 30, 0);
+    emit(b, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, -4, 0);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_9, BPF_REG_6, 12, 0);    // ingress_ifindex
+    emit(b, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, -16, 64);
+    emit(b, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_9, -12, 0);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_2, 26, 0);
+    emit(b, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, -8, 0);
+
+    // Destination port of TCP and UDP, in the first fragment only
+    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_7, 0, 6, L_L4);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 17, L_LOOKUP);
+    place(b, L_L4);
+    emit(b, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_4, BPF_REG_2, 20, 0);
+    emit(b, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, htons(0x1FFF));
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0, L_LOOKUP);
+    emit(b, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_4, BPF_REG_2, 14, 0);
+    emit(b, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_4, 0, 0, 0x0F);
+    emit(b, BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_4, 0, 0, 2);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_5, BPF_REG_2, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 18);
+    emit_jump(b, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, L_LOOKUP);
+    emit(b, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_8, BPF_REG_5, 16, 0);
+
+    place(b, L_LOOKUP);
+    emit_trie_check(b, objects.sources, L_DEST);
+    place(b, L_DEST);
+    emit(b, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_4, BPF_REG_10, -4, 0);
+    emit(b, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_4, -8, 0);
+    emit_trie_check(b, objects.dests, L_PASS);
+
+    place(b, L_PASS);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    emit(b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    place(b, L_DROP);
+    emit(b, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, -28, 0);
+    emit_lookup(b, objects.drops, -28);
+    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, L_DONE);
+    emit(b, BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_1, BPF_REG_0, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+    emit(b, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_0, BPF_REG_1, 0, 0);
+    place(b, L_DONE);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP);
+    emit(b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    for (int i = 0; i < b->count; i++) {
+        if (b->jump_label[i] >= 0) {
+            b->insn[i].off = (int16_t)(b->label_at[b->jump_label[i]] - i - 1);
+        }
+    }
+}
+
+/**
+ * Load the program against the open maps
+ * Returns the program fd, or -1 (with the verifier log printed)
+ */
+static int load_program(void) {
+    static char log[65536];
+    ProgramBuilder b;
+    union bpf_attr attr;
+
+    build_program(&b);
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(unsigned long)b.insn;
+    attr.insn_cnt = (uint32_t)b.count;
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    strncpy(attr.prog_name, "pfw_early_drop", sizeof(attr.prog_name) - 1);
+
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        int saved = errno;
+        attr.log_buf = (uint64_t)(unsigned long)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        log[0] = '\0';
+        if (sys_bpf(BPF_PROG_LOAD, &attr) < 0 && log[0]) {
+            fprintf(stderr, "%s", log);
+        }
+        fprintf(stderr, "Error: Cannot load the XDP program: %s\n", strerror(saved));
+    }
+    return fd;
+}
+
+static void close_objects(void) {
+    int *fds = &objects.prog;
+    for (int i = 0; i < 6; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * Mount the BPF filesystem if it is not
+ */
+static int ensure_bpf_fs(void) {
+    struct statfs st;
+    if (statfs(BPF_FS_DIR, &st) == 0 && (unsigned long)st.f_type == BPF_FS_MAGIC_NUMBER) {
+        return 0;
+    }
+    mkdir(BPF_FS_DIR, 0700);
+    if (mount("bpf", BPF_FS_DIR, "bpf", 0, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot mount the BPF filesystem on %s: %s\n", BPF_FS_DIR, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open the pinned program and maps, creating them if create is set
+ * Returns 1 when they are open, 0 when none are pinned (and create is
+ * not set), -1 on error
+ */
+static int open_objects(int create) {
+    if (objects.prog >= 0) {
+        return 1;
+    }
+    if (access(XDP_PIN_DIR, F_OK) != 0 && !create) {
+        return 0;
+    }
+    if (ensure_bpf_fs() != 0) {
+        return -1;
+    }
+
+    int *fds = &objects.prog;
+    int found = 0;
+    for (int i = 0; i < 6; i++) {
+        fds[i] = obj_get(pin_names[i]);
+        found += fds[i] >= 0;
+    }
+    if (found == 6) {
+        return 1;
+    }
+    close_objects();
+    if (!create) {
+        return 0;
+    }
+
+    // Start over from whatever a failed setup left
+    char path[128];
+    for (int i = 0; i < 6; i++) {
+        pin_path(pin_names[i], path, sizeof(path));
+        unlink(path);
+    }
+    mkdir(XDP_PIN_DIR, 0700);
+    current_valid = 0;
+
+    objects.sources = map_create(BPF_MAP_TYPE_LPM_TRIE, sizeof(XdpPrefixKey), sizeof(uint32_t),
+                                 XDP_MAX_PREFIXES, BPF_F_NO_PREALLOC, "pfw_sources");
+    objects.dests = map_create(BPF_MAP_TYPE_LPM_TRIE, sizeof(XdpPrefixKey), sizeof(uint32_t),
+                               XDP_MAX_PREFIXES, BPF_F_NO_PREALLOC, "pfw_dests");
+    objects.ports = map_create(BPF_MAP_TYPE_HASH, sizeof(XdpPortKey), sizeof(uint32_t),
+                               XDP_MAX_PORT_KEYS, BPF_F_NO_PREALLOC, "pfw_ports");
+    objects.interfaces = map_create(BPF_MAP_TYPE_HASH, sizeof(uint32_t), sizeof(uint32_t),
+                                    XDP_MAX_INTERFACES, 0, "pfw_interfaces");
+    objects.drops = map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1, 0, "pfw_drops");
+    if (objects.sources < 0 || objects.dests < 0 || objects.ports < 0 ||
+        objects.interfaces < 0 || objects.drops < 0) {
+        fprintf(stderr, "Error: Cannot create the XDP maps: %s\n", strerror(errno));
+        close_objects();
+        return -1;
+    }
+    objects.prog = load_program();
+    if (objects.prog < 0) {
+        close_objects();
+        return -1;
+    }
+
+    // The program last: its pin marks a complete setup
+    for (int i = 5; i >= 0; i--) {
+        if (obj_pin(fds[i], pin_names[i]) != 0) {
+            fprintf(stderr, "Error: Cannot pin %s under %s: %s\n", pin_names[i], XDP_PIN_DIR, strerror(errno));
+            close_objects();
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Attach the program to an interface (prog_fd -1: detach)
+ * Returns 0 on success, -1 with errno set
+ */
+static int set_link_xdp(uint32_t ifindex, int prog_fd, uint32_t flags) {
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        char attrs[64];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_seq = 1;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = (int)ifindex;
+
+    // IFLA_XDP { IFLA_XDP_FD, IFLA_XDP_FLAGS }
+    struct rtattr *nest = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    nest->rta_type = IFLA_XDP | NLA_F_NESTED;
+    struct rtattr *attr = (struct rtattr *)RTA_DATA(nest);
+    attr->rta_type = IFLA_XDP_FD;
+    attr->rta_len = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(attr), &prog_fd, sizeof(int));
+    attr = (struct rtattr *)((char *)attr + RTA_ALIGN(attr->rta_len));
+    attr->rta_type = IFLA_XDP_FLAGS;
+    attr->rta_len = RTA_LENGTH(sizeof(uint32_t));
+    memcpy(RTA_DATA(attr), &flags, sizeof(uint32_t));
+    nest->rta_len = (unsigned short)((char *)attr + RTA_ALIGN(attr->rta_len) - (char *)nest);
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(nest->rta_len);
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    char reply[4096];
+    ssize_t n = -1;
+    if (sendto(fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) >= 0) {
+        n = recv(fd, reply, sizeof(reply), 0);
+    }
+    close(fd);
+
+    struct nlmsghdr *nh = (struct nlmsghdr *)reply;
+    if (n < (ssize_t)NLMSG_LENGTH(sizeof(struct nlmsgerr)) || nh->nlmsg_type != NLMSG_ERROR) {
+        errno = EPROTO;
+        return -1;
+    }
+    const struct nlmsgerr *err = (const struct nlmsgerr *)NLMSG_DATA(nh);
+    if (err->error) {
+        errno = -err->error;
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t mode_flags(void) {
+    return firewall_config.xdp == XDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+}
+
+static uint32_t prefix_host_addr(const XdpPrefixKey *key) {
+    return ntohl(key->addr);
+}
+
+static int compare_prefix_keys(int trie_a, const XdpPrefixKey *a, int trie_b, const XdpPrefixKey *b) {
+    if (trie_a != trie_b) {
+        return trie_a < trie_b ? -1 : 1;
+    }
+    if (a->ifindex != b->ifindex) {
+        return a->ifindex < b->ifindex ? -1 : 1;
+    }
+    uint32_t x = prefix_host_addr(a), y = prefix_host_addr(b);
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    return a->prefixlen < b->prefixlen ? -1 : a->prefixlen > b->prefixlen;
+}
+
+static int compare_matches(const void *a, const void *b) {
+    const XdpMatch *x = a, *y = b;
+    int c = compare_prefix_keys(x->trie, &x->key, y->trie, &y->key);
+    if (c) {
+        return c;
+    }
+    if (x->protocol != y->protocol) {
+        return x->protocol < y->protocol ? -1 : 1;
+    }
+    return x->port < y->port ? -1 : x->port > y->port;
+}
+
+static int compare_prefixes(const void *a, const void *b) {
+    const XdpPrefix *x = a, *y = b;
+    return compare_prefix_keys(x->trie, &x->key, y->trie, &y->key);
+}
+
+static int compare_conditions(const void *a, const void *b) {
+    const XdpCondition *x = a, *y = b;
+    if (x->protocol != y->protocol) {
+        return x->protocol < y->protocol ? -1 : 1;
+    }
+    return x->port < y->port ? -1 : x->port > y->port;
+}
+
+static int compare_port_keys(const void *a, const void *b) {
+    const XdpPortKey *x = a, *y = b;
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    if (x->protocol != y->protocol) {
+        return x->protocol < y->protocol ? -1 : 1;
+    }
+    return x->port < y->port ? -1 : x->port > y->port;
+}
+
+/**
+ * Whether IPv4 packets arriving on an interface may be routed on rather
+ * than delivered here (also when that cannot be read)
+ */
+static int interface_forwards(const char *name) {
+    char path[64 + IF_NAMESIZE];
+    int forwarding = 1;
+
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv4/conf/%s/forwarding", name);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%d", &forwarding) != 1) {
+            forwarding = 1;
+        }
+        fclose(fp);
+    }
+    return forwarding != 0;
+}
+
+/**
+ * Why a DROP rule cannot go to XDP, or NULL when it can
+ * blockers are the earlier active rules with another action
+ */
+static const char *offload_blocker(const FirewallRule *rule, FirewallRule **blockers, int blocker_count,
+                                   uint32_t *ifindex) {
+    const char *name = pool_string(rule->interface);
+    size_t len = strlen(name);
+
+    // XDP sees established packets before conntrack can accept them
+    if (firewall_config.fast_path) {
+        return "the fast path accepts established traffic first";
+    }
+    if (len == 0) {
+        return "no interface";
+    }
+    if (name[len - 1] == '+') {
+        return "interface wildcard";
+    }
+    *ifindex = if_nametoindex(name);
+    if (*ifindex == 0) {
+        return "no such interface";
+    }
+    // Forwarded packets never walk INPUT
+    if (interface_forwards(name)) {
+        return "interface forwards traffic";
+    }
+    if (rule->source_len >= 0 && rule->dest_len >= 0) {
+        return "both source and destination";
+    }
+    if (rule->port_first && (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP) &&
+        rule->port_last - rule->port_first >= XDP_MAX_PORT_RANGE) {
+        return "port range too wide";
+    }
+
+    for (int i = 0; i < blocker_count; i++) {
+        if (rules_overlap(blockers[i], rule)) {
+            return "an earlier rule with another action overlaps it";
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Append the (prefix, protocol, port) matches of an offloaded rule
+ */
+static int add_rule_matches(const FirewallRule *rule, uint32_t ifindex, XdpMatch **matches,
+                            int *count, int *capacity) {
+    XdpMatch m;
+    memset(&m, 0, sizeof(m));
+    m.key.ifindex = ifindex;
+    if (rule->dest_len >= 0) {
+        m.trie = XDP_TRIE_DEST;
+        m.key.prefixlen = 32 + (uint32_t)rule->dest_len;
+        m.key.addr = htonl(rule->dest);
+    } else {
+        m.trie = XDP_TRIE_SOURCE;
+        m.key.prefixlen = 32 + (uint32_t)(rule->source_len > 0 ? rule->source_len : 0);
+        m.key.addr = rule->source_len > 0 ? htonl(rule->source) : 0;
+    }
+
+    int first = 0, last = 0;
+    if (rule->protocol == PROTO_TCP || rule->protocol == PROTO_UDP) {
+        m.protocol = rule->protocol == PROTO_TCP ? 6 : 17;
+        first = rule->port_first;
+        last = rule->port_first ? rule->port_last : 0;
+    } else if (rule->protocol == PROTO_ICMP) {
+        m.protocol = 1;
+    }
+
+    for (int port = first; port <= last; port++) {
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 256;
+            XdpMatch *grown = realloc(*matches, sizeof(XdpMatch) * *capacity);
+            if (!grown) {
+                return -1;
+            }
+            *matches = grown;
+        }
+        m.port = htons((uint16_t)port);
+        (*matches)[(*count)++] = m;
+    }
+    return 0;
+}
+
+static void free_state(XdpState *state) {
+    free(state->prefixes);
+    free(state->ports);
+    memset(state, 0, sizeof(*state));
+}
+
+/**
+ * Sort and deduplicate conditions, dropping those another one covers:
+ * any protocol covers everything, any port covers its protocol's ports
+ * Returns the number kept
+ */
+static int prune_conditions(XdpCondition *c, int count) {
+    qsort(c, count, sizeof(XdpCondition), compare_conditions);
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (kept > 0) {
+            // (0, 0) sorts first
+            if (c[0].protocol == 0) {
+                break;
+            }
+            const XdpCondition *last = &c[kept - 1];
+            if (last->protocol == c[i].protocol && (last->port == 0 || last->port == c[i].port)) {
+                continue;
+            }
+        }
+        c[kept++] = c[i];
+    }
+    return kept;
+}
+
+static int reserve_conditions(XdpCondition **array, int *capacity, int needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    int wanted = *capacity ? *capacity : 256;
+    while (wanted < needed) {
+        wanted *= 2;
+    }
+    XdpCondition *grown = realloc(*array, sizeof(XdpCondition) * wanted);
+    if (!grown) {
+        return -1;
+    }
+    *array = grown;
+    *capacity = wanted;
+    return 0;
+}
+
+/**
+ * Whether prefix a contains prefix b
+ */
+static int prefix_contains(const XdpPrefix *a, const XdpPrefix *b) {
+    if (a->trie != b->trie || a->key.ifindex != b->key.ifindex || a->key.prefixlen > b->key.prefixlen) {
+        return 0;
+    }
+    int len = (int)a->key.prefixlen - 32;
+    uint32_t mask = len > 0 ? 0xFFFFFFFFu << (32 - len) : 0;
+    return (prefix_host_addr(&b->key) & mask) == prefix_host_addr(&a->key);
+}
+
+/**
+ * Group of a prefix in the maps, 0 if it is not there
+ */
+static uint32_t current_group(const XdpPrefix *prefix) {
+    XdpPrefix *found = bsearch(prefix, current.prefixes, current.prefix_count, sizeof(XdpPrefix),
+                               compare_prefixes);
+    return found ? found->group : 0;
+}
+
+/**
+ * Collect the matches of the rules that can be offloaded
+ * With report set, print why each other DROP rule stays in netfilter
+ * Returns the number of matches (*matches to be freed), or -1
+ */
+static int collect_matches(XdpState *state, XdpMatch **matches, int report) {
+    FirewallRule **rules = ordered_rules();
+    FirewallRule **blockers = malloc(sizeof(FirewallRule *) * (rule_count + 1));
+    int count = 0, capacity = 0, blocker_count = 0;
+
+    *matches = NULL;
+    if (!blockers) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    for (int i = 0; i < rule_count; i++) {
+        const FirewallRule *rule = rules[i];
+        if (!rule->active) {
+            continue;
+        }
+        if (rule->action != ACTION_DROP) {
+            blockers[blocker_count++] = rules[i];
+            continue;
+        }
+
+        uint32_t ifindex = 0;
+        const char *reason = offload_blocker(rule, blockers, blocker_count, &ifindex);
+        if (reason) {
+            if (report) {
+                printf("  Rule %d stays in netfilter: %s\n", rule->id, reason);
+            }
+            continue;
+        }
+        if (add_rule_matches(rule, ifindex, matches, &count, &capacity) != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            free(blockers);
+            free(*matches);
+            *matches = NULL;
+            return -1;
+        }
+        state->rules++;
+
+        int known = 0;
+        for (int k = 0; k < state->interface_count; k++) {
+            known |= state->interfaces[k].ifindex == ifindex;
+        }
+        if (!known && state->interface_count < XDP_MAX_INTERFACES) {
+            state->interfaces[state->interface_count].ifindex = ifindex;
+            state->interfaces[state->interface_count++].flags = mode_flags();
+        }
+    }
+
+    free(blockers);
+    return count;
+}
+
+/**
+ * Work out the map contents for the rules; prefixes already in the maps
+ * keep their group
+ * Returns 0 on success, -1 on error
+ */
+static int build_state(XdpState *state, int report) {
+    XdpMatch *matches;
+
+    memset(state, 0, sizeof(*state));
+    int match_count = collect_matches(state, &matches, report);
+    if (match_count < 0) {
+        return -1;
+    }
+    qsort(matches, match_count, sizeof(XdpMatch), compare_matches);
+
+    // At most one prefix per match
+    state->prefixes = malloc(sizeof(XdpPrefix) * (match_count + 1));
+    int *first = malloc(sizeof(int) * (match_count + 1));
+    int *count = malloc(sizeof(int) * (match_count + 1));
+    XdpCondition *conditions = NULL, *scratch = NULL;
+    int total = 0, capacity = 0, scratch_capacity = 0;
+    int ret = state->prefixes && first && count ? 0 : -1;
+
+    uint32_t next_group = 0;
+    for (int i = 0; i < current.prefix_count; i++) {
+        if (current.prefixes[i].group > next_group) {
+            next_group = current.prefixes[i].group;
+        }
+    }
+
+    // In sorted order a prefix comes after all prefixes that contain it,
+    // so a stack holds the chain of prefixes containing the current one
+    int stack[34], depth = 0;
+    for (int m = 0; m < match_count && ret == 0; ) {
+        int end = m;
+        while (end < match_count && compare_prefix_keys(matches[end].trie, &matches[end].key,
+                                                        matches[m].trie, &matches[m].key) == 0) {
+            end++;
+        }
+
+        XdpPrefix *prefix = &state->prefixes[state->prefix_count];
+        prefix->trie = matches[m].trie;
+        prefix->key = matches[m].key;
+        prefix->group = current_group(prefix);
+        if (!prefix->group) {
+            prefix->group = ++next_group;
+        }
+
+        while (depth > 0 && !prefix_contains(&state->prefixes[stack[depth - 1]], prefix)) {
+            depth--;
+        }
+        int parent = depth > 0 ? stack[depth - 1] : -1;
+        int index = state->prefix_count++;
+        stack[depth++] = index;
+
+        // Its own conditions plus everything the containing prefix drops
+        int inherited = parent >= 0 ? count[parent] : 0;
+        int n = 0;
+        if (reserve_conditions(&scratch, &scratch_capacity, end - m + inherited) != 0) {
+            ret = -1;
+            break;
+        }
+        for (int k = m; k < end; k++) {
+            scratch[n].protocol = matches[k].protocol;
+            scratch[n++].port = matches[k].port;
+        }
+        if (inherited) {
+            memcpy(scratch + n, conditions + first[parent], sizeof(XdpCondition) * inherited);
+            n += inherited;
+        }
+        n = prune_conditions(scratch, n);
+
+        if (reserve_conditions(&conditions, &capacity, total + n) != 0) {
+            ret = -1;
+            break;
+        }
+        memcpy(conditions + total, scratch, sizeof(XdpCondition) * n);
+        first[index] = total;
+        count[index] = n;
+        total += n;
+        m = end;
+    }
+
+    if (ret == 0 && (total > XDP_MAX_PORT_KEYS || state->prefix_count > XDP_MAX_PREFIXES)) {
+        fprintf(stderr, "Error: Too many XDP entries (%d prefixes, %d port entries)\n",
+                state->prefix_count, total);
+        ret = -2;
+    }
+    if (ret == 0) {
+        state->ports = malloc(sizeof(XdpPortKey) * (total + 1));
+        ret = state->ports ? 0 : -1;
+    }
+    for (int i = 0; i < state->prefix_count && ret == 0; i++) {
+        for (int k = 0; k < count[i]; k++) {
+            XdpPortKey *key = &state->ports[state->port_count++];
+            key->group = state->prefixes[i].group;
+            key->protocol = conditions[first[i] + k].protocol;
+            key->pad = 0;
+            key->port = conditions[first[i] + k].port;
+        }
+    }
+    if (ret == 0) {
+        qsort(state->ports, state->port_count, sizeof(XdpPortKey), compare_port_keys);
+    }
+
+    if (ret == -1) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+    if (ret != 0) {
+        free_state(state);
+    }
+    free(first);
+    free(count);
+    free(conditions);
+    free(scratch);
+    free(matches);
+    return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Read a trie's prefixes and groups
+ */
+static int read_trie(int fd, int trie, XdpState *state, int *capacity) {
+    XdpPrefixKey key, next;
+    const void *previous = NULL;
+
+    while (map_next_key(fd, previous, &next) == 0) {
+        uint32_t group;
+        if (map_lookup(fd, &next, &group) == 0) {
+            if (state->prefix_count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 256;
+                XdpPrefix *grown = realloc(state->prefixes, sizeof(XdpPrefix) * *capacity);
+                if (!grown) {
+                    return -1;
+                }
+                state->prefixes = grown;
+            }
+            XdpPrefix *prefix = &state->prefixes[state->prefix_count++];
+            prefix->trie = trie;
+            prefix->key = next;
+            prefix->group = group;
+        }
+        key = next;
+        previous = &key;
+    }
+    return 0;
+}
+
+/**
+ * Read the map contents into current
+ */
+static int read_current_state(void) {
+    int prefix_capacity = 0, port_capacity = 0;
+    XdpPortKey port, next_port;
+    uint32_t ifindex, next_ifindex;
+    const void *previous;
+
+    free_state(&current);
+    if (read_trie(objects.sources, XDP_TRIE_SOURCE, &current, &prefix_capacity) != 0 ||
+        read_trie(objects.dests, XDP_TRIE_DEST, &current, &prefix_capacity) != 0) {
+        goto out_of_memory;
+    }
+
+    previous = NULL;
+    while (map_next_key(objects.ports, previous, &next_port) == 0) {
+        if (current.port_count == port_capacity) {
+            port_capacity = port_capacity ? port_capacity * 2 : 256;
+            XdpPortKey *grown = realloc(current.ports, sizeof(XdpPortKey) * port_capacity);
+            if (!grown) {
+                goto out_of_memory;
+            }
+            current.ports = grown;
+        }
+        current.ports[current.port_count++] = next_port;
+        port = next_port;
+        previous = &port;
+    }
+
+    previous = NULL;
+    while (map_next_key(objects.interfaces, previous, &next_ifindex) == 0 &&
+           current.interface_count < XDP_MAX_INTERFACES) {
+        uint32_t flags;
+        if (map_lookup(objects.interfaces, &next_ifindex, &flags) == 0) {
+            current.interfaces[current.interface_count].ifindex = next_ifindex;
+            current.interfaces[current.interface_count++].flags = flags;
+        }
+        ifindex = next_ifindex;
+        previous = &ifindex;
+    }
+
+    qsort(current.prefixes, current.prefix_count, sizeof(XdpPrefix), compare_prefixes);
+    qsort(current.ports, current.port_count, sizeof(XdpPortKey), compare_port_keys);
+    current_valid = 1;
+    return 0;
+
+out_of_memory:
+    fprintf(stderr, "Error: Out of memory\n");
+    free_state(&current);
+    return -1;
+}
+
+static const XdpInterface *find_interface(const XdpState *state, uint32_t ifindex) {
+    for (int i = 0; i < state->interface_count; i++) {
+        if (state->interfaces[i].ifindex == ifindex) {
+            return &state->interfaces[i];
+        }
+    }
+    return NULL;
+}
+
+static void interface_name(uint32_t ifindex, char *name) {
+    if (!if_indextoname(ifindex, name)) {
+        snprintf(name, IF_NAMESIZE, "#%u", ifindex);
+    }
+}
+
+/**
+ * Change the maps and attachments from current to desired
+ * Entries a prefix leads to go in before the prefix, and a prefix goes
+ * out before its entries, so a packet never sees a group half made
+ * Returns 0 on success, -1 on error (current is then read again next time)
+ */
+static int apply_state(XdpState *desired) {
+    uint32_t one = 1;
+    int failed = 0;
+
+    for (int i = 0; i < desired->port_count && !failed; i++) {
+        if (!bsearch(&desired->ports[i], current.ports, current.port_count, sizeof(XdpPortKey),
+                     compare_port_keys)) {
+            failed = map_update(objects.ports, &desired->ports[i], &one) != 0;
+        }
+    }
+    for (int i = 0; i < desired->prefix_count && !failed; i++) {
+        const XdpPrefix *prefix = &desired->prefixes[i];
+        if (current_group(prefix) != prefix->group) {
+            int fd = prefix->trie == XDP_TRIE_SOURCE ? objects.sources : objects.dests;
+            failed = map_update(fd, &prefix->key, &prefix->group) != 0;
+        }
+    }
+    for (int i = 0; i < current.prefix_count && !failed; i++) {
+        const XdpPrefix *prefix = &current.prefixes[i];
+        if (!bsearch(prefix, desired->prefixes, desired->prefix_count, sizeof(XdpPrefix), compare_prefixes)) {
+            int fd = prefix->trie == XDP_TRIE_SOURCE ? objects.sources : objects.dests;
+            failed = map_delete(fd, &prefix->key) != 0;
+        }
+    }
+    for (int i = 0; i < current.port_count && !failed; i++) {
+        if (!bsearch(&current.ports[i], desired->ports, desired->port_count, sizeof(XdpPortKey),
+                     compare_port_keys)) {
+            failed = map_delete(objects.ports, &current.ports[i]) != 0;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Error: Cannot update the XDP maps: %s\n", strerror(errno));
+        current_valid = 0;
+        return -1;
+    }
+
+    // Attachments: detach where no rule needs the program any more
+    char name[IF_NAMESIZE];
+    for (int i = 0; i < current.interface_count; i++) {
+        const XdpInterface *now = &current.interfaces[i];
+        const XdpInterface *wanted = find_interface(desired, now->ifindex);
+        if (wanted && wanted->flags == now->flags) {
+            continue;
+        }
+        if (set_link_xdp(now->ifindex, -1, now->flags) != 0 && errno != ENODEV) {
+            interface_name(now->ifindex, name);
+            fprintf(stderr, "Warning: Cannot detach XDP from %s: %s\n", name, strerror(errno));
+        }
+        map_delete(objects.interfaces, &now->ifindex);
+    }
+    for (int i = 0; i < desired->interface_count; i++) {
+        XdpInterface *wanted = &desired->interfaces[i];
+        const XdpInterface *now = find_interface(&current, wanted->ifindex);
+        if (now && now->flags == wanted->flags) {
+            continue;
+        }
+        if (set_link_xdp(wanted->ifindex, objects.prog, wanted->flags | XDP_FLAGS_UPDATE_IF_NOEXIST) != 0) {
+            interface_name(wanted->ifindex, name);
+            fprintf(stderr, "Error: Cannot attach XDP to %s: %s\n", name,
+                    errno == EBUSY || errno == EEXIST ? "another XDP program is attached" : strerror(errno));
+            // Not recorded, so the next change tries again
+            *wanted = desired->interfaces[--desired->interface_count];
+            i--;
+            continue;
+        }
+        map_update(objects.interfaces, &wanted->ifindex, &wanted->flags);
+    }
+
+    free_state(&current);
+    current = *desired;
+    current_valid = 1;
+    return 0;
+}
+
+/**
+ * Detach the program everywhere and unpin it and its maps
+ * Returns 1 when something was removed, 0 when nothing was there, -1
+ */
+static int xdp_teardown(void) {
+    int opened = open_objects(0);
+    if (opened <= 0) {
+        return opened;
+    }
+    if (!current_valid && read_current_state() != 0) {
+        return -1;
+    }
+
+    char name[IF_NAMESIZE];
+    for (int i = 0; i < current.interface_count; i++) {
+        if (set_link_xdp(current.interfaces[i].ifindex, -1, current.interfaces[i].flags) != 0 && errno != ENODEV) {
+            interface_name(current.interfaces[i].ifindex, name);
+            fprintf(stderr, "Warning: Cannot detach XDP from %s: %s\n", name, strerror(errno));
+        }
+    }
+
+    close_objects();
+    char path[128];
+    for (int i = 0; i < 6; i++) {
+        pin_path(pin_names[i], path, sizeof(path));
+        unlink(path);
+    }
+    rmdir(XDP_PIN_DIR);
+    free_state(&current);
+    current_valid = 0;
+    printf("XDP early drop removed\n");
+    return 1;
+}
+
+/**
+ * Attach, update or remove the program to match the rules
+ */
+static int sync_program(void) {
+    if (firewall_config.xdp == XDP_MODE_OFF) {
+        return xdp_teardown() < 0 ? -1 : 0;
+    }
+    if (open_objects(1) < 0) {
+        return -1;
+    }
+    if (!current_valid && read_current_state() != 0) {
+        return -1;
+    }
+
+    XdpState desired;
+    if (build_state(&desired, 0) != 0) {
+        return -1;
+    }
+    if (apply_state(&desired) != 0) {
+        free_state(&desired);
+        return -1;
+    }
+    printf("XDP early drop: %d rules on %d interfaces (%d prefixes, %d port entries)\n",
+           current.rules, current.interface_count, current.prefix_count, current.port_count);
+    return 0;
+}
+
+/**
+ * Bring the XDP program in line with the rules: attach it where
+ * offloaded rules need it and update its maps in place
+ * With XDP off, remove a program left from when it was on
+ * Returns 0 on success, -1 on error
+ */
+int xdp_sync(void) {
+    uint64_t started = PROFILE_BEGIN();
+    int ret = sync_program();
+    PROFILE_END(PROFILE_XDP, started);
+    return ret;
+}
+
+/**
+ * Number of possible CPUs (the size of a per-CPU map value)
+ */
+static int possible_cpus(void) {
+    char text[256];
+    int cpus = 0;
+    FILE *fp = fopen("/sys/devices/system/cpu/possible", "r");
+
+    if (fp && fgets(text, sizeof(text), fp)) {
+        // "0-3", "0" or "0-3,8-11": one past the highest listed CPU
+        for (char *p = text; *p; ) {
+            if (isdigit((unsigned char)*p)) {
+                long cpu = strtol(p, &p, 10);
+                if (cpu + 1 > cpus) {
+                    cpus = (int)cpu + 1;
+                }
+            } else {
+                p++;
+            }
+        }
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    return cpus > 0 ? cpus : (int)sysconf(_SC_NPROCESSORS_CONF);
+}
+
+/**
+ * Show the XDP program's state: interfaces, entries and drops, and why
+ * each DROP rule left in netfilter is not offloaded
+ */
+int xdp_print_status(void) {
+    static const char *modes[] = { "OFF", "GENERIC", "NATIVE" };
+    char line[64], name[IF_NAMESIZE];
+    unsigned long long dropped = 0;
+
+    int opened = open_objects(0);
+    if (opened < 0 || (opened > 0 && !current_valid && read_current_state() != 0)) {
+        return -1;
+    }
+    if (opened > 0) {
+        int cpus = possible_cpus();
+        uint64_t *values = calloc(cpus, sizeof(uint64_t));
+        uint32_t zero = 0;
+        if (values && map_lookup(objects.drops, &zero, values) == 0) {
+            for (int i = 0; i < cpus; i++) {
+                dropped += values[i];
+            }
+        }
+        free(values);
+    }
+
+    printf("\n╔══════════════════════════════════════════════════════════════════╗\n");
+    printf("║                    XDP EARLY DROP                                ║\n");
+    printf("╠══════════════════════════════════════════════════════════════════╣\n");
+    printf("║  Mode:       %-52s║\n", modes[firewall_config.xdp]);
+    if (opened == 0) {
+        printf("║  Program:    %-52s║\n", "NOT LOADED");
+        printf("╚══════════════════════════════════════════════════════════════════╝\n");
+        return 0;
+    }
+
+    line[0] = '\0';
+    for (int i = 0; i < current.interface_count; i++) {
+        interface_name(current.interfaces[i].ifindex, name);
+        size_t used = strlen(line);
+        snprintf(line + used, sizeof(line) - used, "%s%s", used ? " " : "", name);
+    }
+    printf("║  Interfaces: %-52s║\n", current.interface_count ? line : "none");
+    snprintf(line, sizeof(line), "%d prefixes, %d port entries", current.prefix_count, current.port_count);
+    printf("║  Entries:    %-52s║\n", line);
+    snprintf(line, sizeof(line), "%llu packets", dropped);
+    printf("║  Dropped:    %-52s║\n", line);
+    printf("╚══════════════════════════════════════════════════════════════════╝\n");
+
+    if (firewall_config.xdp != XDP_MODE_OFF) {
+        XdpState desired;
+        if (build_state(&desired, 1) != 0) {
+            return -1;
+        }
+        printf("%d rules offloaded\n", desired.rules);
+        free_state(&desired);
+    }
+    return 0;
+}